@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+# Generates lib/libriscv/threaded_fuse.inc, the superinstructions used by
+# the threaded dispatch, from profiles of executed instruction pairs:
+#
+#   PAIRS=program.pairs ./rvlinux program
+#   ./fuse_table.py program.pairs [more.pairs ...]
+#
+# A superinstruction is used when its pair is on average at least
+# --min-share percent of the executed pairs of a profile.
+import argparse
+import os
+import re
+import sys
+
+LIBRISCV = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "lib", "libriscv")
+
+def read_superinstructions(path):
+	# (first, second, fused, condition) in the order they are listed
+	result = []
+	condition = None
+	for line in open(path):
+		line = line.strip()
+		if line.startswith("#ifdef"):
+			condition = line.split()[1]
+		elif line.startswith("#endif"):
+			condition = None
+		m = re.match(r"SUPERINSTRUCTION\((\w+),\s*(\w+),\s*(\w+)\)", line)
+		if m:
+			result.append((m.group(1), m.group(2), m.group(3), condition))
+	return result
+
+def read_shares(path):
+	# The share of each pair of the executed pairs, in percent
+	pairs = {}
+	for line in open(path):
+		if line.startswith("#") or not line.strip():
+			continue
+		count, first, second = line.split()
+		pairs[(first, second)] = pairs.get((first, second), 0) + int(count)
+	total = sum(pairs.values())
+	if total == 0:
+		sys.exit("%s has no executed pairs" % path)
+	return {pair: 100.0 * count / total for pair, count in pairs.items()}
+
+def main():
+	parser = argparse.ArgumentParser()
+	parser.add_argument("profiles", nargs="+", help="files written by PAIRS=file ./rvlinux")
+	parser.add_argument("--min-share", type=float, default=0.1,
+		help="smallest share of the executed pairs, in percent (default: 0.1)")
+	parser.add_argument("--output", default=os.path.join(LIBRISCV, "threaded_fuse.inc"))
+	args = parser.parse_args()
+
+	candidates = read_superinstructions(os.path.join(LIBRISCV, "threaded_superinstructions.inc"))
+	# Each program counts the same, however long it runs
+	profiles = [read_shares(path) for path in args.profiles]
+
+	chosen = []
+	for first, second, fused, condition in candidates:
+		share = sum(p.get((first, second), 0.0) for p in profiles) / len(profiles)
+		if share >= args.min_share:
+			chosen.append((share, first, second, fused, condition))
+	chosen.sort(key=lambda c: -c[0])
+
+	with open(args.output, "w") as out:
+		out.write("// Generated by emulator/fuse_table.py from profiles of executed pairs:\n")
+		for path in args.profiles:
+			out.write("//   %s\n" % os.path.basename(path))
+		out.write("// Superinstructions whose pair is at least %g%% of the executed pairs,\n" % args.min_share)
+		out.write("// by their average share. Candidates are in threaded_superinstructions.inc.\n")
+		for condition in [None] + sorted({c[4] for c in chosen if c[4] is not None}):
+			lines = ["FUSE(%s, %s, %s) // %.2f%%\n" % (c[1], c[2], c[3], c[0])
+				for c in chosen if c[4] == condition]
+			if condition is not None and lines:
+				lines = ["#ifdef %s\n" % condition] + lines + ["#endif\n"]
+			out.writelines(lines)
+
+if __name__ == "__main__":
+	main()
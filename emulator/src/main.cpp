@@ -16,6 +16,7 @@ static void run_program(
 	const std::vector<std::string>& args)
 {
 	const bool debugging_enabled = getenv("DEBUG") != nullptr;
+	const char* pairs_file = getenv("PAIRS");
 
 	riscv::Machine<W> machine { binary, {
 		.memory_max = MAX_MEMORY,
@@ -137,6 +138,11 @@ static void run_program(
 		} else if (debugging_enabled) {
 			// CLI debug simulation
 			debug.simulate();
+		} else if (pairs_file != nullptr) {
+			// Slow simulation that counts the executed instruction
+			// pairs, for emulator/fuse_table.py
+			debug.count_pairs = true;
+			debug.simulate();
 		} else {
 			// Normal RISC-V simulation
 			machine.simulate();
@@ -173,6 +179,16 @@ static void run_program(
 	auto t1 = std::chrono::high_resolution_clock::now();
 	std::chrono::duration<double> runtime = t1 - t0;
 
+	if (pairs_file != nullptr) {
+		FILE* f = fopen(pairs_file, "w");
+		if (f == nullptr) {
+			fprintf(stderr, "Could not open %s\n", pairs_file);
+			exit(1);
+		}
+		debug.print_pairs(f);
+		fclose(f);
+	}
+
 	const auto retval = machine.return_value();
 	// You can silence this output by setting SILENT=1, like so:
 	// SILENT=1 ./rvlinux myprogram
@@ -1,3 +1,34 @@
+#ifndef BYTECODE_BODIES
+#define BYTECODE_BODIES
+// Instruction bodies shared by the single-instruction handlers and
+// the superinstructions, so that a fused pair always does exactly
+// what the two instructions would have done one after the other.
+#define LUI_BODY()                                   \
+	{ VIEW_INSTR();                                  \
+	  REG(instr.Utype.rd) = instr.Utype.upper_imm(); }
+#define ADDI_BODY()                                  \
+	{ VIEW_INSTR_AS(fi, FasterItype);                \
+	  REG(fi.get_rs1()) =                            \
+		REG(fi.get_rs2()) + fi.signed_imm(); }
+#define LI_BODY()                                    \
+	{ VIEW_INSTR_AS(fi, FasterImmediate);            \
+	  REG(fi.get_rd()) = fi.signed_imm(); }
+#define BRANCH_BODY(op)                              \
+	{ VIEW_INSTR_AS(fi, FasterItype);                \
+	  if (REG(fi.get_rs1()) op REG(fi.get_rs2())) {  \
+		PERFORM_BRANCH();                            \
+	  } }
+#define LDD_BODY()                                   \
+	{ VIEW_INSTR_AS(fi, FasterItype);                \
+	  const auto addr = REG(fi.get_rs2()) + fi.signed_imm(); \
+	  REG(fi.get_rs1()) =                            \
+		(int64_t)MACHINE().memory.template read<uint64_t>(addr); }
+#define STD_BODY()                                   \
+	{ VIEW_INSTR_AS(fi, FasterItype);                \
+	  const auto addr = REG(fi.get_rs1()) + fi.signed_imm(); \
+	  MACHINE().memory.template write<uint64_t>(addr, REG(fi.get_rs2())); }
+#endif // BYTECODE_BODIES
+
 
 #ifdef BYTECODES_OP_IMM
 
@@ -14,14 +45,11 @@ INSTRUCTION(RV32C_BC_MV, rv32c_mv) {
 }
 #endif
 INSTRUCTION(RV32I_BC_ADDI, rv32i_addi) {
-	VIEW_INSTR_AS(fi, FasterItype);
-	REG(fi.get_rs1()) =
-		REG(fi.get_rs2()) + fi.signed_imm();
+	ADDI_BODY();
 	NEXT_INSTR();
 }
 INSTRUCTION(RV32I_BC_LI, rv32i_li) {
-	VIEW_INSTR_AS(fi, FasterImmediate);
-	REG(fi.get_rd()) = fi.signed_imm();
+	LI_BODY();
 	NEXT_INSTR();
 }
 INSTRUCTION(RV32I_BC_MV, rv32i_mv) {
@@ -107,17 +135,11 @@ INSTRUCTION(RV32C_BC_BNEZ, rv32c_bnez) {
 #endif // RISCV_EXT_COMPRESSED
 
 INSTRUCTION(RV32I_BC_BEQ, rv32i_beq) {
-	VIEW_INSTR_AS(fi, FasterItype);
-	if (REG(fi.get_rs1()) == REG(fi.get_rs2())) {
-		PERFORM_BRANCH();
-	}
+	BRANCH_BODY(==);
 	NEXT_BLOCK(4);
 }
 INSTRUCTION(RV32I_BC_BNE, rv32i_bne) {
-	VIEW_INSTR_AS(fi, FasterItype);
-	if (REG(fi.get_rs1()) != REG(fi.get_rs2())) {
-		PERFORM_BRANCH();
-	}
+	BRANCH_BODY(!=);
 	NEXT_BLOCK(4);
 }
 INSTRUCTION(RV32I_BC_BEQ_FW, rv32i_beq_fw) {
@@ -194,10 +216,7 @@ INSTRUCTION(RV32I_BC_LDWU, rv32i_ldwu) {
 }
 INSTRUCTION(RV32I_BC_LDD, rv32i_ldd) {
 	if constexpr (W >= 8) {
-		VIEW_INSTR_AS(fi, FasterItype);
-		const auto addr = REG(fi.get_rs2()) + fi.signed_imm();
-		REG(fi.get_rs1()) =
-			(int64_t)MACHINE().memory.template read<uint64_t>(addr);
+		LDD_BODY();
 		NEXT_INSTR();
 	}
 #ifdef DISPATCH_MODE_TAILCALL
@@ -206,9 +225,7 @@ INSTRUCTION(RV32I_BC_LDD, rv32i_ldd) {
 }
 INSTRUCTION(RV32I_BC_STD, rv32i_std) {
 	if constexpr (W >= 8) {
-		VIEW_INSTR_AS(fi, FasterItype);
-		const auto addr  = REG(fi.get_rs1()) + fi.signed_imm();
-		MACHINE().memory.template write<uint64_t>(addr, REG(fi.get_rs2()));
+		STD_BODY();
 		NEXT_INSTR();
 	}
 #ifdef DISPATCH_MODE_TAILCALL
@@ -275,10 +292,7 @@ INSTRUCTION(RV32F_BC_FLD, rv32i_fld) {
 
 INSTRUCTION(RV32C_BC_LDD, rv32c_ldd) {
 	if constexpr (W >= 8) {
-		VIEW_INSTR_AS(fi, FasterItype);
-		const auto addr = REG(fi.get_rs2()) + fi.signed_imm();
-		REG(fi.get_rs1()) =
-			(int64_t)MACHINE().memory.template read<uint64_t>(addr);
+		LDD_BODY();
 		NEXT_C_INSTR();
 	}
 #ifdef DISPATCH_MODE_TAILCALL
@@ -287,9 +301,7 @@ INSTRUCTION(RV32C_BC_LDD, rv32c_ldd) {
 }
 INSTRUCTION(RV32C_BC_STD, rv32c_std) {
 	if constexpr (W >= 8) {
-		VIEW_INSTR_AS(fi, FasterItype);
-		const auto addr = REG(fi.get_rs1()) + fi.signed_imm();
-		MACHINE().memory.template write<uint64_t>(addr, REG(fi.get_rs2()));
+		STD_BODY();
 		NEXT_C_INSTR();
 	}
 #ifdef DISPATCH_MODE_TAILCALL
@@ -315,8 +327,7 @@ INSTRUCTION(RV32I_BC_AUIPC, rv32i_auipc)
 }
 INSTRUCTION(RV32I_BC_LUI, rv32i_lui)
 {
-	VIEW_INSTR();
-	REG(instr.Utype.rd) = instr.Utype.upper_imm();
+	LUI_BODY();
 	NEXT_INSTR();
 }
 
@@ -600,3 +611,79 @@ INSTRUCTION(RV32V_BC_VFADD_VV, rv32v_vfadd_vv) {
 #endif // RISCV_EXT_VECTOR
 
 #endif // FLP
+
+#ifdef BYTECODES_FUSED
+
+// Superinstructions execute an instruction and the one after it
+// in the same block, with only one dispatch. The second instruction
+// keeps its own (rewritten) entry, which is also where jumps to it land.
+
+INSTRUCTION(RV32I_BC_LUI_ADDI, rv32i_lui_addi) {
+	LUI_BODY();
+	SKIP_INSTR();
+	ADDI_BODY();
+	NEXT_INSTR();
+}
+INSTRUCTION(RV32I_BC_LI_BEQ, rv32i_li_beq) {
+	LI_BODY();
+	SKIP_INSTR();
+	BRANCH_BODY(==);
+	NEXT_BLOCK(4);
+}
+INSTRUCTION(RV32I_BC_LI_BNE, rv32i_li_bne) {
+	LI_BODY();
+	SKIP_INSTR();
+	BRANCH_BODY(!=);
+	NEXT_BLOCK(4);
+}
+INSTRUCTION(RV32I_BC_LDD_LDD, rv32i_ldd_ldd) {
+	if constexpr (W >= 8) {
+		LDD_BODY();
+		SKIP_INSTR();
+		LDD_BODY();
+		NEXT_INSTR();
+	}
+#ifdef DISPATCH_MODE_TAILCALL
+	else UNUSED_FUNCTION();
+#endif
+}
+INSTRUCTION(RV32I_BC_STD_STD, rv32i_std_std) {
+	if constexpr (W >= 8) {
+		STD_BODY();
+		SKIP_INSTR();
+		STD_BODY();
+		NEXT_INSTR();
+	}
+#ifdef DISPATCH_MODE_TAILCALL
+	else UNUSED_FUNCTION();
+#endif
+}
+
+#ifdef RISCV_EXT_COMPRESSED
+
+INSTRUCTION(RV32C_BC_LDD_LDD, rv32c_ldd_ldd) {
+	if constexpr (W >= 8) {
+		LDD_BODY();
+		SKIP_C_INSTR();
+		LDD_BODY();
+		NEXT_C_INSTR();
+	}
+#ifdef DISPATCH_MODE_TAILCALL
+	else UNUSED_FUNCTION();
+#endif
+}
+INSTRUCTION(RV32C_BC_STD_STD, rv32c_std_std) {
+	if constexpr (W >= 8) {
+		STD_BODY();
+		SKIP_C_INSTR();
+		STD_BODY();
+		NEXT_C_INSTR();
+	}
+#ifdef DISPATCH_MODE_TAILCALL
+	else UNUSED_FUNCTION();
+#endif
+}
+
+#endif // RISCV_EXT_COMPRESSED
+
+#endif // FUSED
@@ -17,12 +17,20 @@
 #define RISCV_PAGE_SIZE  4096UL
 #endif
 
+#ifndef RISCV_PAGE_CACHE_ENTRIES
+#define RISCV_PAGE_CACHE_ENTRIES  8
+#endif
+
 namespace riscv
 {
 	static constexpr int SYSCALL_EBREAK = RISCV_SYSCALL_EBREAK_NR;
 
 	static constexpr size_t PageSize = RISCV_PAGE_SIZE;
 	static constexpr size_t PageMask = RISCV_PAGE_SIZE-1;
+	// Number of entries in each of the read and write page caches
+	static constexpr unsigned PageCacheEntries = RISCV_PAGE_CACHE_ENTRIES;
+	static_assert((PageCacheEntries & (PageCacheEntries-1)) == 0 && PageCacheEntries > 0,
+		"Page cache entries must be a power of two");
 
 #ifdef RISCV_MEMORY_TRAPS
 	static constexpr bool memory_traps_enabled = true;
@@ -30,6 +38,25 @@ namespace riscv
 	static constexpr bool memory_traps_enabled = false;
 #endif
 
+#ifdef RISCV_PAGE_CACHE_STATS
+	static constexpr bool page_cache_stats_enabled = true;
+#else
+	static constexpr bool page_cache_stats_enabled = false;
+#endif
+
+#ifdef RISCV_FLAT_MEMORY
+	static constexpr bool flat_memory_enabled = true;
+#else
+	static constexpr bool flat_memory_enabled = false;
+#endif
+
+#if defined(RISCV_GUARDED_ARENA) && defined(RISCV_FLAT_MEMORY) && defined(__linux__)
+	// 32-bit guests get their whole address space in a guarded arena
+	static constexpr bool guarded_arena_enabled = true;
+#else
+	static constexpr bool guarded_arena_enabled = false;
+#endif
+
 #ifdef RISCV_FORCE_ALIGN_MEMORY
 	static constexpr bool force_align_memory = true;
 #else
@@ -92,10 +119,43 @@ namespace riscv
 		bool dynamic_linking = false;
 		// Minimal fork does not loan any pages from the source Machine
 		bool minimal_fork = false;
+		// Forks hold a reference to the page data they were forked from,
+		// instead of borrowing it. The source Machine then copies pages
+		// on its next write to them, and may free pages while forks run.
+		// Incompatible with the RISCV_FLAT_MEMORY arena.
+		bool shared_fork = false;
 		// Allow the use of a linear arena to increase memory locality somewhat
+		// With RISCV_FLAT_MEMORY, loads and stores inside the arena go directly
+		// to host memory, ignoring page attributes, traps and shared pages.
+		// With RISCV_GUARDED_ARENA, 32-bit guests get a guarded arena for
+		// their whole address space instead, which keeps page attributes.
 		bool use_memory_arena = memory_arena_is_default;
+		// Index pages below this address in a two-level page table, which
+		// avoids hashing on page lookups. 0 disables the flat page table.
+		// 32-bit guests can pass (1ull << 32) to cover all their memory.
+		uint64_t flat_page_table_bound = 0;
+		// Decode the main execute segment block by block as it is being
+		// executed, instead of all at once. Speeds up loading programs
+		// with large amounts of code. Ignored with binary translation.
+		bool lazy_decoding = false;
+		// Share decoded execute segments with other Machines in the same
+		// process that also enable this, and load identical instructions
+		// at the same address with the same decoding options. Shared
+		// segments are never modified. Ignored with binary translation
+		// and lazy decoding.
+		bool share_execute_segments = false;
+		// Store decoder caches in this directory, and load them from
+		// there on later runs of the same program. The directory must
+		// only be writable by trusted users. Ignored with binary
+		// translation and lazy decoding. Empty disables.
+		std::string_view decoder_cache_directory {};
+		// Evict the least recently used execute segments when creating
+		// more than this many, eg. for guests that generate code. The
+		// main execute segment is always kept, so the limit must be at
+		// least 2. 0 means no limit.
+		unsigned max_execute_segments = 0;
 		// Override exit function with a program-provided function
-		std::string_view default_exit_function;
+		std::string_view default_exit_function {};
 
 		riscv::Function<struct Page&(Memory<W>&, address_type<W>, bool)> page_fault_handler = nullptr;
 
@@ -103,12 +163,21 @@ namespace riscv
 		unsigned block_size_treshold = 6;
 		unsigned translate_blocks_max = 5000;
 		unsigned translate_instr_max = 150'000;
+		// Compile the translation on a background thread, and keep
+		// interpreting until it is ready. It is activated the next
+		// time the CPU starts simulating or changes execute segment.
+		bool translate_background = false;
+		// A profile stored with CPU::store_translation_profile(). When
+		// set, the most executed blocks are translated, instead of the
+		// first blocks that are long enough.
+		std::string_view translate_profile {};
 #endif
 	};
 
 	template <int W> struct MultiThreading;
 	template <int W> struct Multiprocessing;
 	template <int W> struct SerializedMachine;
+	struct FrozenPage;
 	struct Arena;
 
 	template <typename T>
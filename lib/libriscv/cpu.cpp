@@ -16,10 +16,17 @@ namespace riscv
 	};
 
 	template <int W>
-	CPU<W>::CPU(Machine<W>& machine, unsigned cpu_id, const Machine<W>& other)
-		: m_machine { machine }, m_cpuid { cpu_id }
+	CPU<W>::CPU(Machine<W>& machine, const Machine<W>& other, const MachineOptions<W>& options)
+		: m_machine { machine }, m_cpuid { options.cpu_id }
 	{
+		// Shared forks are loaded from the published state instead,
+		// as the source may be running
+		if (options.shared_fork)
+			return;
 		this->m_exec = other.cpu.m_exec;
+		// Forks may execute the segment concurrently with the source
+		if (this->m_exec != nullptr)
+			this->m_exec->decode_all();
 		// Copy all registers except vectors
 		// Users can still copy vector registers by assigning to registers().rvv().
 		this->registers().copy_from(Registers<W>::Options::NoVectors, other.cpu.registers());
@@ -65,6 +72,10 @@ namespace riscv
 	{
 		static const int MAX_RESTARTS = 4;
 		int restarts = 0;
+#ifdef RISCV_BINARY_TRANSLATION
+		if (UNLIKELY(machine().memory.has_background_translation()))
+			machine().memory.activate_background_translation();
+#endif
 restart_next_execute_segment:
 
 		// Immediately look at the page in order to
@@ -141,7 +152,7 @@ restart_next_execute_segment:
 			// access to read fault handler.
 			auto& page = machine().memory.get_pageno(p);
 			const size_t offset = (p - base_pageno) * Page::size();
-			std::memcpy(area.get() + offset, page.data(), Page::size());
+			machine().memory.memcpy_page(area.get() + offset, p, page, 0, Page::size());
 		}
 
 		// Decode and store it for later
@@ -169,19 +180,20 @@ restart_next_execute_segment:
 		format_t instruction;
 
 		if (LIKELY(offset <= Page::size()-4)) {
-			instruction.whole = uint32_t(*(UnderAlign32 *)(page.data() + offset));
+			machine().memory.memcpy_page(&instruction.whole, pageno, page, offset, 4);
 			return instruction;
 		}
 		// It's not possible to jump to a misaligned address,
 		// so there is necessarily 16-bit left of the page now.
-		instruction.whole = *(uint16_t*) (page.data() + offset);
+		instruction.whole = 0;
+		machine().memory.memcpy_page(&instruction.half[0], pageno, page, offset, 2);
 
 		// If it's a 32-bit instruction at a page border, we need
 		// to get the next page, and then read the upper half
 		if (UNLIKELY(instruction.is_long()))
 		{
 			const auto& page = machine().memory.get_exec_pageno(pageno+1);
-			instruction.half[1] = *(uint16_t*) page.data();
+			machine().memory.memcpy_page(&instruction.half[1], pageno+1, page, 0, 2);
 		}
 
 		return instruction;
@@ -207,6 +219,8 @@ restart_next_execute_segment:
 	template<int W> RISCV_HOT_PATH()
 	void CPU<W>::simulate_precise(uint64_t max)
 	{
+		// Segments evicted during simulation stay alive until it returns
+		[[maybe_unused]] const typename Memory<W>::ExecuteSegmentsInUse exec_in_use {machine().memory};
 		// Decoded segments are always faster
 		// So, always have at least the current segment
 		if (!is_executable(this->pc())) {
@@ -6,6 +6,7 @@
 #ifdef RISCV_EXT_ATOMICS
 #include "rva.hpp"
 #endif
+#include <unordered_map>
 #include <vector>
 
 namespace riscv
@@ -103,11 +104,21 @@ namespace riscv
 		void deserialize_from(const std::vector<uint8_t>&, const SerializedMachine<W>&);
 
 		// Binary translation functions
-		int  load_translation(const MachineOptions<W>&, std::string* filename) const;
-		void try_translate(const MachineOptions<W>&, const std::string&, address_t pc, std::vector<TransInstr<W>>) const;
+		// Returns 1 when the segment must be translated, with the filename
+		// and profile entries that are then passed on to try_translate
+		int  load_translation(const MachineOptions<W>&, std::string* filename, std::vector<ProfileEntry>* profile, const DecodedExecuteSegment<W>&) const;
+		void try_translate(const MachineOptions<W>&, const std::string&, const std::vector<ProfileEntry>&, const DecodedExecuteSegment<W>&, address_t pc, std::vector<TransInstr<W>>) const;
+		// Maps the translated functions of a compiled translation into
+		// the decoder cache of the segment. Returns false on failure.
+		bool activate_dylib(const DecodedExecuteSegment<W>&, void*) const RISCV_INTERNAL;
+		// Executes one instruction at a time, while counting how many
+		// times each instruction is executed. The profile can be stored
+		// and passed to the translator, see MachineOptions::translate_profile.
+		void simulate_profiling(uint64_t);
+		void store_translation_profile(const std::string& filename) const;
 
 		CPU(Machine<W>&, unsigned cpu_id);
-		CPU(Machine<W>&, unsigned cpu_id, const Machine<W>& other); // Fork
+		CPU(Machine<W>&, const Machine<W>& other, const MachineOptions<W>&); // Fork
 		void init_execute_area(const void* data, address_t begin, address_t length);
 		void set_execute_segment(DecodedExecuteSegment<W>* seg) { m_exec = seg; }
 		auto* current_execute_segment() const noexcept { return m_exec; }
@@ -121,6 +132,31 @@ namespace riscv
 		// Override how to produce the next active execute segment
 		void set_override_new_execute_segment(override_execute_segment_t func) { m_override_exec = func; }
 
+		// Callbacks from inside a load or store (page handlers and memory
+		// traps) see, and may change, the registers. With a register cache
+		// the dispatch loop has them in a copy, which is written back while
+		// the callback runs (see register_cache.hpp).
+		struct CallbackRegisters {
+#ifdef RISCV_REGISTER_CACHE
+			CallbackRegisters(CPU& c) : cpu(c), cached(c.m_cached_regs) {
+				if (UNLIKELY(cached != nullptr)) {
+					cpu.registers().get() = *cached;
+					cpu.m_cached_regs = nullptr;
+				}
+			}
+			~CallbackRegisters() {
+				if (UNLIKELY(cached != nullptr)) {
+					*cached = cpu.registers().get();
+					cpu.m_cached_regs = cached;
+				}
+			}
+			CPU& cpu;
+			std::array<register_type<W>, 32>* const cached;
+#else
+			CallbackRegisters(CPU&) {}
+#endif
+		};
+
 		// Override how to handle unknown instructions, so that you may implement your own
 		static inline std::function<const instruction_t& (format_t)> on_unimplemented_instruction;
 		// Retrieve default handler for unimplemented instructions (can be returned in on_unimplemented_instruction)
@@ -130,6 +166,13 @@ namespace riscv
 		Registers<W> m_regs;
 		Machine<W>&  m_machine;
 
+#ifdef RISCV_REGISTER_CACHE
+		// The copy of the integer registers that the dispatch loop works
+		// on, while it is newer than m_regs
+		std::array<register_type<W>, 32>* m_cached_regs = nullptr;
+		template <int> friend struct RegisterCache;
+#endif
+
 #ifdef RISCV_SUPERVISOR_MODE
 		mutable std::unique_ptr<Supervisor<W>> m_super = nullptr;
 #endif
@@ -157,7 +200,10 @@ namespace riscv
 #ifdef RISCV_EXT_ATOMICS
 		AtomicMemory<W> m_atomics;
 #endif
-		void activate_dylib(void*) const RISCV_INTERNAL;
+#ifdef RISCV_BINARY_TRANSLATION
+		// Execution counts by instruction address
+		std::unordered_map<address_t, uint64_t> m_profile;
+#endif
 		static_assert((W == 4 || W == 8 || W == 16), "Must be either 32-bit, 64-bit or 128-bit ISA");
 	};
 
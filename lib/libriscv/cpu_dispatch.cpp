@@ -1,6 +1,9 @@
 #include "machine.hpp"
 #include "decoder_cache.hpp"
 #include "instruction_counter.hpp"
+#ifdef RISCV_REGISTER_CACHE
+#include "register_cache.hpp"
+#endif
 #include "threaded_bytecodes.hpp"
 #include "rv32i_instr.hpp"
 #include "rvfd.hpp"
@@ -27,6 +30,13 @@ namespace riscv
 #define NEXT_C_INSTR() \
 	decoder += 1;      \
 	EXECUTE_INSTR();
+#define SKIP_INSTR()                  \
+	if constexpr (compressed_enabled) \
+		decoder += 2;                 \
+	else                              \
+		decoder += 1;
+#define SKIP_C_INSTR() \
+	decoder += 1;
 
 #define NEXT_BLOCK(len)               \
 	pc += len;                        \
@@ -55,6 +65,23 @@ namespace riscv
 	} \
 	goto check_jump;
 
+// Indirect jumps that stay in the current execute segment skip the
+// segment lookup, with a single bounds check. Threaded dispatch shares
+// one indirect branch for the next block, as per-handler branches made
+// JALR slower there. The switch shares one anyway.
+#ifdef DISPATCH_MODE_SWITCH_BASED
+#define INDIRECT_JUMP_DISPATCH() NEXT_SEGMENT();
+#else
+#define INDIRECT_JUMP_DISPATCH() goto continue_segment;
+#endif
+#define PERFORM_INDIRECT_JUMP()                                   \
+	if (LIKELY(addr_t(pc - current_begin) < addr_t(current_end - current_begin) \
+		&& (pc & (compressed_enabled ? 0x1 : 0x3)) == 0          \
+		&& !counter.overflowed())) {                              \
+		INDIRECT_JUMP_DISPATCH();                                 \
+	}                                                             \
+	goto check_unaligned_jump;
+
 #define PERFORM_FORWARD_BRANCH()        \
 	if constexpr (VERBOSE_JUMPS) printf("Fw.Branch 0x%lX >= 0x%lX\n", pc, pc + fi.signed_imm()); \
 	pc += fi.signed_imm();              \
@@ -136,6 +163,12 @@ void CPU<W>::DISPATCH_FUNC(uint64_t imax)
 
 		[RV64I_BC_ADDIW] = &&rv64i_addiw,
 
+		[RV32I_BC_LUI_ADDI] = &&rv32i_lui_addi,
+		[RV32I_BC_LI_BEQ]  = &&rv32i_li_beq,
+		[RV32I_BC_LI_BNE]  = &&rv32i_li_bne,
+		[RV32I_BC_LDD_LDD] = &&rv32i_ldd_ldd,
+		[RV32I_BC_STD_STD] = &&rv32i_std_std,
+
 #ifdef RISCV_EXT_COMPRESSED
 		[RV32C_BC_ADDI]     = &&rv32c_addi,
 		[RV32C_BC_LI]       = &&rv32c_addi,
@@ -143,6 +176,10 @@ void CPU<W>::DISPATCH_FUNC(uint64_t imax)
 		[RV32C_BC_BNEZ]     = &&rv32c_bnez,
 		[RV32C_BC_LDD]      = &&rv32c_ldd,
 		[RV32C_BC_STD]      = &&rv32c_std,
+		[RV32C_BC_LDD_LDD]  = &&rv32c_ldd_ldd,
+		[RV32C_BC_STD_STD]  = &&rv32c_std_std,
+		[RV32C_BC_JR]       = &&rv32c_jr,
+		[RV32C_BC_JALR]     = &&rv32c_jalr,
 		[RV32C_BC_FUNCTION] = &&rv32c_func,
 		[RV32C_BC_JUMPFUNC] = &&rv32c_jfunc,
 #endif
@@ -166,12 +203,21 @@ void CPU<W>::DISPATCH_FUNC(uint64_t imax)
 		[RV32V_BC_VFADD_VV] = &&rv32v_vfadd_vv,
 #endif
 		[RV32I_BC_FUNCTION] = &&execute_decoded_function,
+		[RV32I_BC_DECODE]  = &&execute_decode,
 #ifdef RISCV_BINARY_TRANSLATION
 		[RV32I_BC_TRANSLATOR] = &&translated_function,
 #endif
 		[RV32I_BC_SYSTEM]  = &&rv32i_system,
 	};
 #endif
+	// Segments evicted during simulation stay alive until it returns
+	[[maybe_unused]] const typename Memory<W>::ExecuteSegmentsInUse exec_in_use {machine().memory};
+
+#ifdef RISCV_BINARY_TRANSLATION
+	// Translations compiled in the background are activated here
+	if (UNLIKELY(machine().memory.has_background_translation()))
+		machine().memory.activate_background_translation();
+#endif
 
 	// We need an execute segment matching current PC
 	if (UNLIKELY(!is_executable(this->pc())))
@@ -186,6 +232,9 @@ void CPU<W>::DISPATCH_FUNC(uint64_t imax)
 		machine().set_max_instructions(UINT64_MAX);
 
 	InstrCounter counter{machine()};
+#ifdef RISCV_REGISTER_CACHE
+	RegisterCache<W> regcache{*this};
+#endif
 
 	DecodedExecuteSegment<W>* exec = this->m_exec;
 	DecoderData<W>* exec_decoder = exec->decoder_cache();
@@ -212,7 +261,15 @@ while (true) {
 #endif
 
 #define CPU()       (*this)
+#ifdef RISCV_REGISTER_CACHE
+#define REG(x)      regcache.get()[x]
+#define SPILL_REGISTERS()  regcache.spill()
+#define RELOAD_REGISTERS() regcache.reload()
+#else
 #define REG(x)      registers().get()[x]
+#define SPILL_REGISTERS()  /* */
+#define RELOAD_REGISTERS() /* */
+#endif
 #define REGISTERS() registers()
 #define MACHINE()   machine()
 
@@ -230,6 +287,10 @@ while (true) {
 #  include "bytecode_impl.cpp"
 #undef BYTECODES_BRANCH
 
+#define BYTECODES_FUSED
+#  include "bytecode_impl.cpp"
+#undef BYTECODES_FUSED
+
 INSTRUCTION(RV32I_BC_FAST_JAL, rv32i_fast_jal) {
 	VIEW_INSTR();
 	pc = instr.whole;
@@ -242,7 +303,7 @@ INSTRUCTION(RV32I_BC_FAST_JAL, rv32i_fast_jal) {
 }
 INSTRUCTION(RV32I_BC_FAST_CALL, rv32i_fast_call) {
 	VIEW_INSTR();
-	reg(REG_RA) = pc + 4;
+	REG(REG_RA) = pc + 4;
 	pc = instr.whole;
 	if constexpr (VERBOSE_JUMPS) {
 		printf("FAST_CALL PC 0x%lX => 0x%lX\n", pc, pc + instr.whole);
@@ -255,30 +316,52 @@ INSTRUCTION(RV32I_BC_JALR, rv32i_jalr) {
 	VIEW_INSTR();
 	// jump to register + immediate
 	// NOTE: if rs1 == rd, avoid clobber by storing address first
-	const auto address = reg(instr.Itype.rs1) + instr.Itype.signed_imm();
+	const auto address = REG(instr.Itype.rs1) + instr.Itype.signed_imm();
 	// Link *next* instruction (rd = PC + 4)
 	if (instr.Itype.rd != 0) {
-		reg(instr.Itype.rd) = pc + 4;
+		REG(instr.Itype.rd) = pc + 4;
 	}
 	if constexpr (VERBOSE_JUMPS) {
 		printf("JALR PC 0x%lX => 0x%lX\n", pc, address);
 	}
 	pc = address;
-	goto check_unaligned_jump;
+	PERFORM_INDIRECT_JUMP();
 }
 
 #ifdef RISCV_EXT_COMPRESSED
+INSTRUCTION(RV32C_BC_JR, rv32c_jr) {
+	VIEW_INSTR_AS(fi, FasterMove);
+	if constexpr (VERBOSE_JUMPS) {
+		printf("C.JR PC 0x%lX => 0x%lX\n", pc, (long)REG(fi.get_rs1()));
+	}
+	pc = REG(fi.get_rs1());
+	PERFORM_INDIRECT_JUMP();
+}
+INSTRUCTION(RV32C_BC_JALR, rv32c_jalr) {
+	VIEW_INSTR_AS(fi, FasterMove);
+	const auto address = REG(fi.get_rs1());
+	REG(REG_RA) = pc + 2;
+	if constexpr (VERBOSE_JUMPS) {
+		printf("C.JALR PC 0x%lX => 0x%lX\n", pc, (long)address);
+	}
+	pc = address;
+	PERFORM_INDIRECT_JUMP();
+}
 INSTRUCTION(RV32C_BC_FUNCTION, rv32c_func) {
 	VIEW_INSTR();
 	auto handler = decoder->get_handler();
+	SPILL_REGISTERS();
 	handler(*this, instr);
+	RELOAD_REGISTERS();
 	NEXT_C_INSTR();
 }
 INSTRUCTION(RV32C_BC_JUMPFUNC, rv32c_jfunc) {
 	VIEW_INSTR();
 	registers().pc = pc;
 	auto handler = decoder->get_handler();
+	SPILL_REGISTERS();
 	handler(*this, instr);
+	RELOAD_REGISTERS();
 	if constexpr (VERBOSE_JUMPS) {
 		printf("Compressed jump from 0x%lX to 0x%lX\n",
 			pc, registers().pc + 2);
@@ -297,8 +380,11 @@ INSTRUCTION(RV32I_BC_SYSCALL, rv32i_syscall) {
 	this->registers().pc = pc;
 	// Make the instruction counter(s) visible
 	counter.apply_counter();
+	// Make the registers visible
+	SPILL_REGISTERS();
 	// Invoke system call
 	machine().system_call(this->reg(REG_ECALL));
+	RELOAD_REGISTERS();
 	// Restore max counter
 	counter.retrieve_max_counter();
 	if (UNLIKELY(counter.overflowed() || pc != this->registers().pc))
@@ -320,9 +406,20 @@ INSTRUCTION(RV32I_BC_SYSCALL, rv32i_syscall) {
 INSTRUCTION(RV32I_BC_FUNCTION, execute_decoded_function) {
 	VIEW_INSTR();
 	auto handler = decoder->get_handler();
+	SPILL_REGISTERS();
 	handler(*this, instr);
+	RELOAD_REGISTERS();
 	NEXT_INSTR();
 }
+INSTRUCTION(RV32I_BC_DECODE, execute_decode) {
+	// Undecoded entries are only reached at the start of a block.
+	// Decode the block, and then redo the start of the block.
+	const auto undecoded_count = decoder->instruction_count();
+	exec->decode_lazily(pc);
+	counter.increment_counter(decoder->instruction_count() - undecoded_count);
+	pc += decoder->block_bytes();
+	EXECUTE_INSTR();
+}
 INSTRUCTION(RV32I_BC_STOP, rv32i_stop) {
 	REGISTERS().pc = pc + 4;
 	counter.stop();
@@ -332,7 +429,7 @@ INSTRUCTION(RV32I_BC_STOP, rv32i_stop) {
 INSTRUCTION(RV32I_BC_JAL, rv32i_jal) {
 	VIEW_INSTR_AS(fi, FasterJtype);
 	if (fi.rd != 0)
-		reg(fi.rd) = pc + 4;
+		REG(fi.rd) = pc + 4;
 	if constexpr (VERBOSE_JUMPS) {
 		printf("JAL PC 0x%lX => 0x%lX\n", pc, pc+fi.offset);
 	}
@@ -350,12 +447,14 @@ INSTRUCTION(RV32I_BC_TRANSLATOR, translated_function) {
 	this->registers().pc = pc;
 	// Make the instruction counter visible
 	counter.apply_counter();
+	SPILL_REGISTERS();
 	// Invoke translated code
 	auto handler = decoder->get_handler();
 	handler(*this, instr);
+	RELOAD_REGISTERS();
 	// Restore counter
 	counter.retrieve();
-	// Translations are always full-length instructions (?)
+	// Translations leave PC 4 bytes before the next instruction
 	pc = registers().pc + 4;
 	goto check_jump;
 }
@@ -367,8 +466,10 @@ INSTRUCTION(RV32I_BC_SYSTEM, rv32i_system) {
 	this->registers().pc = pc;
 	// Make the instruction counter visible
 	counter.apply_counter();
+	SPILL_REGISTERS();
 	// Invoke SYSTEM
 	machine().system(instr);
+	RELOAD_REGISTERS();
 	// Restore PC in case it changed (supervisor)
 	pc = registers().pc + 4;
 	goto check_jump;
@@ -408,8 +509,10 @@ check_jump: {
 		// custom callbacks when changing segments that can
 		// jump around.
 		registers().pc = pc;
+		SPILL_REGISTERS();
 		// Change to a new execute segment
 		exec = this->next_execute_segment();
+		RELOAD_REGISTERS();
 		exec_decoder = exec->decoder_cache();
 		current_begin = exec->exec_begin();
 		current_end = exec->exec_end();
@@ -2,6 +2,9 @@
 
 #include "decoder_cache.hpp"
 #include "rv32i_instr.hpp"
+#include "threaded_bytecodes.hpp"
+#include <algorithm>
+#include <cinttypes>
 #include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
@@ -367,6 +370,8 @@ template<int W>
 void DebugMachine<W>::simulate(uint64_t max)
 {
 	auto& cpu = machine.cpu;
+	// Segments evicted during simulation stay alive until it returns
+	[[maybe_unused]] const typename Memory<W>::ExecuteSegmentsInUse exec_in_use {machine.memory};
 	auto* exec = cpu.current_execute_segment();
 	if (UNLIKELY(exec == nullptr))
 		exec = cpu.next_execute_segment();
@@ -399,6 +404,8 @@ void DebugMachine<W>::simulate(uint64_t max)
 		const rv32i_instruction instruction =
 			rv32i_instruction { *(UnderAlign32*) &exec_seg_data[pc] };
 		INSTRUCTION_LOGGING();
+		if (UNLIKELY(this->count_pairs))
+			this->count_pair(*exec, pc, compressed_enabled ? instruction.length() : 4);
 
 		// We can't use decoder cache when translator is enabled
 		constexpr bool enable_cache = !binary_translation_enabled;
@@ -428,6 +435,50 @@ void DebugMachine<W>::simulate(uint64_t max)
 } // DebugMachine::simulate
 
 
+template<int W>
+void DebugMachine<W>::count_pair(const DecodedExecuteSegment<W>& exec, address_t pc, unsigned length)
+{
+	// Pairs are fused before the first instruction of a block is
+	// executed, so the bytecodes of fused entries are unfused here
+	const auto* decoder = exec.decoder_cache();
+	const auto& entry = decoder[pc / DecoderCache<W>::DIVISOR];
+	if (entry.idxend == 0 || !exec.is_within(pc + length))
+		return;
+	const auto& next = decoder[(pc + length) / DecoderCache<W>::DIVISOR];
+	this->m_pairs[{
+		DecodedExecuteSegment<W>::threaded_unfuse(entry.get_bytecode()),
+		DecodedExecuteSegment<W>::threaded_unfuse(next.get_bytecode())
+	}] ++;
+}
+
+template<int W>
+void DebugMachine<W>::print_pairs(FILE* out) const
+{
+	// Bytecodes are printed by name when they are part of a superinstruction
+	static const std::unordered_map<size_t, const char*> names {
+#define SUPERINSTRUCTION(first, second, fused) { first, #first }, { second, #second },
+#include "threaded_superinstructions.inc"
+#undef SUPERINSTRUCTION
+	};
+	std::vector<std::pair<uint64_t, std::pair<size_t, size_t>>> pairs;
+	for (const auto& it : this->m_pairs)
+		pairs.push_back({it.second, it.first});
+	std::sort(pairs.begin(), pairs.end(), std::greater<>());
+
+	fprintf(out, "# Executed pairs of bytecodes in a block: count first second\n");
+	for (const auto& [count, pair] : pairs) {
+		fprintf(out, "%" PRIu64, count);
+		for (const size_t bytecode : { pair.first, pair.second }) {
+			auto it = names.find(bytecode);
+			if (it != names.end())
+				fprintf(out, " %s", it->second);
+			else
+				fprintf(out, " %zu", bytecode);
+		}
+		fprintf(out, "\n");
+	}
+}
+
 	template struct DebugMachine<4>;
 	template struct DebugMachine<8>;
 	INSTANTIATE_128_IF_ENABLED(DebugMachine);
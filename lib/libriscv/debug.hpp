@@ -1,5 +1,7 @@
 #include "machine.hpp"
+#include <cstdio>
 #include <functional>
+#include <map>
 #include <unordered_map>
 
 namespace riscv
@@ -19,6 +21,11 @@ namespace riscv
         bool verbose_registers = false;
         bool verbose_fp_registers = false;
 
+        // Count the executed pairs of adjacent instructions in a block,
+        // by bytecode, for choosing superinstructions (see threaded_fuse.inc)
+        bool count_pairs = false;
+        void print_pairs(FILE*) const;
+
         void breakpoint(address_t address, breakpoint_t = default_pausepoint);
         void erase_breakpoint(address_t address) { breakpoint(address, nullptr); }
         auto& breakpoints() { return this->m_breakpoints; }
@@ -33,6 +40,8 @@ namespace riscv
         mutable int32_t m_break_steps = 0;
         mutable int32_t m_break_steps_cnt = 0;
         std::unordered_map<address_t, breakpoint_t> m_breakpoints;
+        std::map<std::pair<size_t, size_t>, uint64_t> m_pairs;
+        void count_pair(const DecodedExecuteSegment<W>&, address_t pc, unsigned length);
         bool break_time() const;
         void register_debug_logging() const;
     };
@@ -118,7 +118,8 @@ size_t CPU<W>::computed_index_for(rv32i_instruction instr)
 				}
 				else if (ci.CI2.funct3 == 0x3) {
 					if constexpr (sizeof(address_t) == 8) {
-						return RV32C_BC_LDD; // C.LDSP
+						if (ci.CI2.rd != 0)
+							return RV32C_BC_LDD; // C.LDSP
 					} else {
 						return RV32C_BC_FUNCTION; // C.FLWSP
 					}
@@ -132,11 +133,11 @@ size_t CPU<W>::computed_index_for(rv32i_instruction instr)
 				const bool topbit = ci.whole & (1 << 12);
 				if (!topbit && ci.CR.rd != 0 && ci.CR.rs2 == 0)
 				{
-					return RV32C_BC_JUMPFUNC; // C.JR rd
+					return RV32C_BC_JR; // C.JR rd
 				}
 				else if (topbit && ci.CR.rd != 0 && ci.CR.rs2 == 0)
 				{
-					return RV32C_BC_JUMPFUNC; // C.JALR ra, rd+0
+					return RV32C_BC_JALR; // C.JALR ra, rd+0
 				}
 				else if (!topbit && ci.CR.rd != 0 && ci.CR.rs2 != 0)
 				{	// MV rd, rs2
@@ -1,5 +1,8 @@
 #pragma once
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <string_view>
 #include "types.hpp"
 
 namespace riscv
@@ -42,12 +45,31 @@ namespace riscv
 
 		DecodedExecuteSegment(address_t pbase, size_t len, address_t vaddr, size_t exlen);
 
+		// Lazily decoded segments decode blocks the first time they are
+		// executed. Forks and multiprocessing decode everything up front,
+		// as they may execute the segment concurrently.
+		bool is_lazy() const noexcept { return m_lazy; }
+		void set_lazy(bool lazy) noexcept { m_lazy = lazy; }
+		void decode_lazily(address_t pc);
+		void decode_all();
+
+		// Decoder caches can be stored in a directory, named after the
+		// checksum of the instructions, and loaded by later processes
+		bool load_decoder_cache(std::string_view directory);
+		void store_decoder_cache(std::string_view directory) const;
+
 		size_t threaded_rewrite(size_t bytecode, address_t pc, rv32i_instruction& instr);
+		static size_t threaded_fuse(size_t bytecode, size_t next_bytecode);
+		// The bytecode of the first instruction of a superinstruction
+		static size_t threaded_unfuse(size_t bytecode);
 
 	private:
 		address_t m_vaddr_begin;
 		address_t m_vaddr_end;
 		DecoderData<W>* m_exec_decoder = nullptr;
+		std::atomic<bool> m_lazy = false;
+		// Forks of the same machine may decode everything concurrently
+		std::mutex m_decode_all_mtx;
 
 		// The flat execute segment is used to execute
 		// the CPU::simulate_precise function in order to
@@ -4,6 +4,23 @@
 #include "rv32i_instr.hpp"
 #include "rvc.hpp"
 #include "threaded_rewriter.cpp"
+#include "util/crc32.hpp"
+#ifdef RISCV_BINARY_TRANSLATION
+#include "tr_types.hpp"
+#endif
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
 
 namespace riscv
 {
@@ -63,6 +80,18 @@ namespace riscv
 		return false;
 	}
 
+	// All instructions that can modify PC or stop the machine
+	template <int W>
+	static bool is_block_ending(rv32i_instruction instr)
+	{
+		if (compressed_enabled && instr.length() == 2)
+			return !is_regular_compressed<W>(instr.half[0]);
+		const auto opcode = instr.opcode();
+		return opcode == RV32I_BRANCH || is_stopping_system(instr)
+			|| opcode == RV32I_JAL || opcode == RV32I_JALR
+			|| opcode == RV32I_AUIPC;
+	}
+
 	template <int W>
 	static void realize_fastsim(
 		address_type<W> base_pc, address_type<W> last_pc,
@@ -70,11 +99,6 @@ namespace riscv
 	{
 		if constexpr (compressed_enabled)
 		{
-			if (UNLIKELY(base_pc >= last_pc))
-				throw MachineException(INVALID_PROGRAM, "The execute segment has an overflow");
-			if (UNLIKELY(base_pc & 0x3))
-				throw MachineException(INVALID_PROGRAM, "The execute segment is misaligned");
-
 			// Go through entire executable segment and measure lengths
 			// Record entries while looking for jumping instruction, then
 			// fill out data and opcode lengths previous instructions.
@@ -91,7 +115,6 @@ namespace riscv
 
 					const auto instruction = read_instruction(
 						exec_segment, pc, last_pc);
-					const auto opcode = instruction.opcode();
 					const auto length = instruction.length();
 					// Make sure PC does not overflow
 					if (pc + length < pc)
@@ -105,16 +128,8 @@ namespace riscv
 					last_length = length;
 
 					// All opcodes that can modify PC
-					if (length == 2)
-					{
-						if (!is_regular_compressed<W>(instruction.half[0]))
-							break;
-					} else {
-						if (opcode == RV32I_BRANCH || is_stopping_system(instruction)
-							|| opcode == RV32I_JAL || opcode == RV32I_JALR
-							|| opcode == RV32I_AUIPC || entry.instr == FASTSIM_BLOCK_END)
-							break;
-					}
+					if (is_block_ending<W>(instruction) || entry.instr == FASTSIM_BLOCK_END)
+						break;
 					// If we reached the end, and the opcode is not "stopping",
 					// then it's an illegal block.
 					if (UNLIKELY(pc >= last_pc)) {
@@ -166,12 +181,9 @@ namespace riscv
 				const auto instruction = read_instruction(
 					exec_segment, pc, last_pc);
 				auto& entry = exec_decoder[pc / DecoderCache<W>::DIVISOR];
-				const auto opcode = instruction.opcode();
 
 				// All opcodes that can modify PC and stop the machine
-				if (opcode == RV32I_BRANCH || is_stopping_system(instruction)
-					|| opcode == RV32I_JAL || opcode == RV32I_JALR
-					|| opcode == RV32I_AUIPC || entry.instr == FASTSIM_BLOCK_END)
+				if (is_block_ending<W>(instruction) || entry.instr == FASTSIM_BLOCK_END)
 					idxend = 0;
 				// Ends at *one instruction before* the block ends
 				entry.idxend = idxend;
@@ -183,6 +195,338 @@ namespace riscv
 		}
 	}
 
+	// Superinstructions replace the bytecode of the first instruction of
+	// a pair, and must not cross the end of a block, where instruction
+	// counting happens. The second instruction is left as-is.
+	template <int W>
+	static void fuse_instructions(
+		address_type<W> base_pc, address_type<W> last_pc,
+		const uint8_t* exec_segment, DecoderData<W>* exec_decoder)
+	{
+		address_type<W> pc = base_pc;
+		while (pc < last_pc)
+		{
+			const unsigned length = compressed_enabled ?
+				read_instruction(exec_segment, pc, last_pc).length() : 4;
+			auto& entry = exec_decoder[pc / DecoderCache<W>::DIVISOR];
+			if (entry.idxend != 0 && pc + length < last_pc)
+			{
+				auto& next = exec_decoder[(pc + length) / DecoderCache<W>::DIVISOR];
+				entry.set_bytecode(DecodedExecuteSegment<W>::threaded_fuse(
+					entry.get_bytecode(), next.get_bytecode()));
+			}
+			pc += length;
+		}
+	}
+
+	// Decode the instructions in [addr, end_addr) into the decoder
+	// cache, then measure blocks and fuse instructions in the range.
+	// The range must end at the end of a block, or the execute segment.
+	template <int W>
+	static void decode_range(DecodedExecuteSegment<W>& exec,
+		const address_type<W> addr, const address_type<W> end_addr,
+		[[maybe_unused]] bool translated)
+	{
+		using address_t = address_type<W>;
+		auto* exec_decoder = exec.decoder_cache();
+		// PC-relative pointer to instruction bits
+		auto* exec_segment = exec.exec_data();
+
+		// When compressed instructions are enabled, many decoder
+		// entries are illegal because they between instructions.
+		bool was_full_instruction = true;
+
+		/* Generate all instruction pointers for executable code.
+		   Cannot step outside of this area when pregen is enabled,
+		   so it's fine to leave the boundries alone. */
+		address_t dst = addr;
+		for (; dst < end_addr;)
+		{
+			auto& entry = exec_decoder[dst / DecoderCache<W>::DIVISOR];
+			entry.instr = 0x0;
+			entry.idxend = 0;
+
+			// Load unaligned instruction from execute segment
+			const auto instruction = read_instruction(
+				exec_segment, dst, end_addr);
+			rv32i_instruction rewritten = instruction;
+
+#ifdef RISCV_BINARY_TRANSLATION
+			if (translated) {
+				if (entry.isset()) {
+					// With fastsim we pretend the original opcode is JAL,
+					// which breaks the fastsim loop. In all cases, continue.
+					entry.instr = FASTSIM_BLOCK_END;
+					entry.set_bytecode(CPU<W>::computed_index_for(entry.instr));
+					if constexpr (compressed_enabled) {
+						// Translations begin at a full instruction
+						dst += 2;
+						was_full_instruction = (instruction.length() == 2);
+					} else
+						dst += 4;
+					continue;
+				}
+			}
+#endif // RISCV_BINARY_TRANSLATION
+
+			// Insert decoded instruction into decoder cache
+			Instruction<W> decoded = CPU<W>::decode(instruction);
+			entry.set_handler(decoded);
+
+			// Cache the (modified) instruction bits
+			auto bytecode = CPU<W>::computed_index_for(instruction);
+			// Threaded rewrites are **always** enabled
+			bytecode = exec.threaded_rewrite(bytecode, dst, rewritten);
+			entry.set_bytecode(bytecode);
+			entry.instr = rewritten.whole;
+
+			// Increment PC after everything
+			if constexpr (compressed_enabled) {
+				// With compressed we always step forward 2 bytes at a time
+				dst += 2;
+				if (was_full_instruction) {
+					// For it to be a full instruction again,
+					// the length needs to match.
+					was_full_instruction = (instruction.length() == 2);
+				} else {
+					// If it wasn't a full instruction last time, it
+					// will for sure be one now.
+					was_full_instruction = true;
+				}
+			} else
+				dst += 4;
+		}
+
+		realize_fastsim<W>(addr, dst, exec_segment, exec_decoder);
+		fuse_instructions<W>(addr, dst, exec_segment, exec_decoder);
+	}
+
+	// Decode from an undecoded entry at the start of a block, until the
+	// first block that ends at or after the end of its page. Blocks are
+	// never partially decoded, so execution can only reach undecoded
+	// entries at the start of a block, where they count as nothing.
+	template <int W>
+	void DecodedExecuteSegment<W>::decode_lazily(address_t pc)
+	{
+		const address_t end_addr = this->exec_end();
+		const address_t page_end = (pc & ~address_t(Page::size()-1)) + Page::size();
+		auto* exec_segment = this->exec_data();
+
+		address_t last = pc;
+		while (last < end_addr)
+		{
+			const auto instruction = read_instruction(
+				exec_segment, last, end_addr);
+			last += (compressed_enabled) ? instruction.length() : 4;
+			if (last >= page_end && is_block_ending<W>(instruction))
+				break;
+		}
+		decode_range<W>(*this, pc, std::min(last, end_addr), false);
+	}
+
+	template <int W>
+	void DecodedExecuteSegment<W>::decode_all()
+	{
+		if (!m_lazy.load(std::memory_order_acquire))
+			return;
+		std::lock_guard<std::mutex> lock(m_decode_all_mtx);
+		if (m_lazy.load(std::memory_order_relaxed)) {
+			decode_range<W>(*this, exec_begin(), exec_end(), false);
+			m_lazy.store(false, std::memory_order_release);
+		}
+	}
+
+	// Undecoded entries fall back to full decoding of the
+	// instruction when they are used outside of dispatch,
+	// eg. by precise simulation and the debugger.
+	template <int W>
+	static void execute_undecoded(CPU<W>& cpu, rv32i_instruction instr)
+	{
+		cpu.execute(instr);
+	}
+
+	// Decoder cache files begin with a header that must match the
+	// running emulator, followed by the handler table and the decoder
+	// cache pages. Handler indices are only valid in the process that
+	// created them, so the handler table stores an instruction for each
+	// index. Loading the file decodes those to rebuild the indices.
+	// Bytecodes are stored as-is, so the header also carries a hash of
+	// the sources that number them and rewrite their instruction bits
+	// (see lib/CMakeLists.txt). Builds without it use zero. The checksum
+	// covers the header, the handler table and the decoder cache pages.
+#ifndef RISCV_BYTECODE_HASH
+#define RISCV_BYTECODE_HASH 0
+#endif
+	struct DecoderCacheFileHeader
+	{
+		static constexpr uint32_t MAGIC = 0x43445652; // RVDC
+		static constexpr uint32_t VERSION = 3;
+
+		uint32_t magic = MAGIC;
+		uint32_t version = VERSION;
+		uint32_t xlen;
+		uint32_t entry_size;
+		uint32_t bytecodes = BYTECODES_MAX;
+		uint32_t extensions = compressed_enabled | (atomics_enabled << 1) | (vector_extension << 2);
+		uint64_t vaddr;
+		uint64_t exlen;
+		uint32_t exec_checksum;
+		uint32_t handlers = 0;
+		uint64_t cache_size;
+		uint32_t checksum = 0;
+		uint32_t bytecode_hash = RISCV_BYTECODE_HASH;
+
+		bool matches(const DecoderCacheFileHeader& other) const noexcept {
+			return magic == other.magic && version == other.version
+				&& xlen == other.xlen && entry_size == other.entry_size
+				&& bytecodes == other.bytecodes && bytecode_hash == other.bytecode_hash
+				&& extensions == other.extensions
+				&& vaddr == other.vaddr && exlen == other.exlen
+				&& exec_checksum == other.exec_checksum
+				&& cache_size == other.cache_size;
+		}
+	};
+	static_assert(sizeof(DecoderCacheFileHeader) == 64, "The header must not have padding");
+
+	static uint32_t decoder_cache_checksum(DecoderCacheFileHeader hdr,
+		const std::vector<uint32_t>& handlers, const void* cache, size_t cache_size)
+	{
+		hdr.checksum = 0;
+		uint32_t crc = crc32c(0xFFFFFFFF, &hdr, sizeof(hdr));
+		crc = crc32c(crc, handlers.data(), handlers.size() * sizeof(uint32_t));
+		return ~crc32c(crc, cache, cache_size);
+	}
+
+	template <int W>
+	static DecoderCacheFileHeader decoder_cache_header(
+		const DecodedExecuteSegment<W>& exec, size_t cache_size)
+	{
+		const size_t exlen = exec.exec_end() - exec.exec_begin();
+		DecoderCacheFileHeader hdr;
+		hdr.xlen = W * 8;
+		hdr.entry_size = sizeof(DecoderData<W>);
+		hdr.vaddr = exec.exec_begin();
+		hdr.exlen = exlen;
+		hdr.exec_checksum = crc32c(exec.exec_data(exec.exec_begin()), exlen);
+		hdr.cache_size = cache_size;
+		return hdr;
+	}
+
+	template <int W>
+	static std::string decoder_cache_filename(
+		std::string_view directory, const DecoderCacheFileHeader& hdr)
+	{
+		char buffer[64];
+		const int len = snprintf(buffer, sizeof(buffer), "/rvdecoder%u-%08X-%llX",
+			hdr.xlen, hdr.exec_checksum, (unsigned long long)hdr.vaddr);
+		return std::string(directory) + std::string(buffer, len);
+	}
+
+	// Blocks from a decoder cache file must count at least one
+	// instruction, and end with an instruction inside the segment
+	template <int W>
+	static bool valid_block(const DecoderData<W>& entry,
+		address_type<W> pc, address_type<W> end)
+	{
+#ifdef RISCV_EXT_COMPRESSED
+		if (entry.icount > entry.idxend)
+			return false;
+#endif
+		return entry.idxend == 0
+			|| (pc < end && address_type<W>(entry.block_bytes()) < end - pc);
+	}
+
+	template <int W>
+	bool DecodedExecuteSegment<W>::load_decoder_cache(std::string_view directory)
+	{
+		using handler_t = decltype(DecoderData<W>::m_handler);
+		auto* cache = reinterpret_cast<uint8_t*>(m_decoder_cache.get());
+		const auto expected = decoder_cache_header<W>(*this, m_decoder_cache_size);
+		const auto filename = decoder_cache_filename<W>(directory, expected);
+
+		FILE* f = fopen(filename.c_str(), "rb");
+		if (f == nullptr)
+			return false;
+		DecoderCacheFileHeader hdr;
+		std::vector<uint32_t> handlers;
+		bool success = fread(&hdr, sizeof(hdr), 1, f) == 1
+			&& hdr.matches(expected)
+			&& hdr.handlers > 0 && hdr.handlers <= (1u << 8 * sizeof(handler_t));
+		if (success) {
+			handlers.resize(hdr.handlers);
+			success = fread(handlers.data(), sizeof(uint32_t), handlers.size(), f) == handlers.size()
+				&& fread(cache, 1, m_decoder_cache_size, f) == m_decoder_cache_size
+				&& decoder_cache_checksum(hdr, handlers, cache, m_decoder_cache_size) == hdr.checksum;
+		}
+		fclose(f);
+
+		if (success) {
+			// Translate the stored handler indices into our own
+			std::vector<handler_t> remap(handlers.size());
+			for (size_t i = 0; i < handlers.size(); i++) {
+				DecoderData<W> entry;
+				entry.set_handler(CPU<W>::decode(rv32i_instruction{handlers[i]}));
+				remap[i] = entry.m_handler;
+			}
+			const size_t entries = m_decoder_cache_size / sizeof(DecoderData<W>);
+			auto* decoder = m_decoder_cache[0].get_base();
+			for (size_t i = 0; i < entries && success; i++) {
+				// Dispatch indexes its tables with the bytecode, and
+				// runs every instruction of a block without checking
+				// the segment bounds, so the file must not be trusted
+				const address_t pc = pagedata_base() + i * DecoderCache<W>::DIVISOR;
+				success = decoder[i].m_handler < remap.size()
+					&& decoder[i].m_bytecode < BYTECODES_MAX
+					&& valid_block(decoder[i], pc, exec_end());
+				if (success)
+					decoder[i].m_handler = remap[decoder[i].m_handler];
+			}
+		}
+		if (!success) {
+			// Leave an empty decoder cache behind
+			std::memset(cache, 0, m_decoder_cache_size);
+		}
+		return success;
+	}
+
+	template <int W>
+	void DecodedExecuteSegment<W>::store_decoder_cache(std::string_view directory) const
+	{
+		const auto* cache = reinterpret_cast<const uint8_t*>(m_decoder_cache.get());
+		auto hdr = decoder_cache_header<W>(*this, m_decoder_cache_size);
+
+		// Remember an instruction that decodes to each handler index
+		std::vector<uint32_t> handlers;
+		auto* exec_segment = this->exec_data();
+		for (address_t pc = exec_begin(); pc < exec_end(); pc += DecoderCache<W>::DIVISOR)
+		{
+			const auto& entry = m_exec_decoder[pc / DecoderCache<W>::DIVISOR];
+			if (entry.m_handler >= handlers.size())
+				handlers.resize(entry.m_handler + 1, 0);
+			if (entry.m_handler != 0)
+				handlers[entry.m_handler] = read_instruction(exec_segment, pc, exec_end()).whole;
+		}
+		hdr.handlers = handlers.size();
+		hdr.checksum = decoder_cache_checksum(hdr, handlers, cache, m_decoder_cache_size);
+
+		// Write to a temporary file first, so that other
+		// processes never see a partially written file.
+		// The name is unique to this process and store.
+		static std::atomic<unsigned> store_counter = 0;
+		const auto filename = decoder_cache_filename<W>(directory, hdr);
+		const auto tmpname = filename + "." + std::to_string(getpid())
+			+ "." + std::to_string(store_counter++);
+		FILE* f = fopen(tmpname.c_str(), "wbx");
+		if (f == nullptr)
+			return;
+		const bool success = fwrite(&hdr, sizeof(hdr), 1, f) == 1
+			&& fwrite(handlers.data(), sizeof(uint32_t), handlers.size(), f) == handlers.size()
+			&& fwrite(cache, 1, m_decoder_cache_size, f) == m_decoder_cache_size;
+		if (fclose(f) == 0 && success && std::rename(tmpname.c_str(), filename.c_str()) == 0)
+			return;
+		std::remove(tmpname.c_str());
+	}
+
 	// The decoder cache is a sequential array of DecoderData<W> entries
 	// each of which (currently) serves a dual purpose of enabling
 	// threaded dispatch (m_bytecode) and fallback to callback function
@@ -230,99 +574,82 @@ namespace riscv
 				"The invalid instruction did not have the index zero", invalid_op.m_handler);
 		}
 
-		// PC-relative pointer to instruction bits
-		auto* exec_segment = exec.exec_data();
+		if constexpr (compressed_enabled)
+		{
+			if (UNLIKELY(addr >= addr + len))
+				throw MachineException(INVALID_PROGRAM, "The execute segment has an overflow");
+			if (UNLIKELY(addr & 0x3))
+				throw MachineException(INVALID_PROGRAM, "The execute segment is misaligned");
+		}
 
 #ifdef RISCV_BINARY_TRANSLATION
 		// We do not support binary translation for RV128I
 		// Also, don't run the translator again (for now)
-		if (W != 16 && !is_binary_translated()) {
+		if (W != 16 && !is_binary_translated() && !has_background_translation()) {
 			// Attempt to load binary translation
-			// Also, fill out the binary translation SO filename for later
+			// Also, fill out the binary translation SO filename
+			// and the translation profile for later
 			std::string bintr_filename;
-			machine().cpu.load_translation(options, &bintr_filename);
+			std::vector<ProfileEntry> profile;
+			const int result =
+				machine().cpu.load_translation(options, &bintr_filename, &profile, exec);
 
-			if (!machine().is_binary_translated())
+			// Translate unless disabled or loaded from an earlier run
+			if (result > 0)
 			{
 				// This can be improved somewhat, by fetching them on demand
 				// instead of building a vector of the whole execute segment.
 				std::vector<TransInstr<W>> ipairs;
 				ipairs.reserve(len / 4);
+				auto* exec_segment = exec.exec_data();
 
-				for (address_t dst = addr; dst < addr + len; dst += 4)
+				for (address_t dst = addr; dst < addr + len;)
 				{
 					// Load unaligned instruction from execute segment
 					const rv32i_instruction instruction { *(UnalignedLoad32*) &exec_segment[dst] };
-					ipairs.push_back({instruction.whole});
+					const unsigned length = compressed_enabled ? instruction.length() : 4;
+					ipairs.push_back({instruction.whole, length});
+					dst += length;
 				}
 				machine().cpu.try_translate(
-					options, bintr_filename, addr, std::move(ipairs));
+					options, bintr_filename, profile, exec, addr, std::move(ipairs));
 			}
 		} // W != 16
 	#endif
 
-		// When compressed instructions are enabled, many decoder
-		// entries are illegal because they between instructions.
-		bool was_full_instruction = true;
-
-		/* Generate all instruction pointers for executable code.
-		   Cannot step outside of this area when pregen is enabled,
-		   so it's fine to leave the boundries alone. */
-		address_t dst = addr;
-		const address_t end_addr = addr + len;
-		for (; dst < addr + len;)
-		{
-			auto& entry = exec_decoder[dst / DecoderCache<W>::DIVISOR];
-			entry.instr = 0x0;
-			entry.idxend = 0;
-
-			// Load unaligned instruction from execute segment
-			const auto instruction = read_instruction(
-				exec_segment, dst, end_addr);
-			rv32i_instruction rewritten = instruction;
-
 #ifdef RISCV_BINARY_TRANSLATION
-			if (machine().is_binary_translated()) {
-				if (entry.isset()) {
-					// With fastsim we pretend the original opcode is JAL,
-					// which breaks the fastsim loop. In all cases, continue.
-					entry.instr = FASTSIM_BLOCK_END;
-					entry.set_bytecode(CPU<W>::computed_index_for(entry.instr));
-					dst += 4;
-					continue;
-				}
-			}
-#endif // RISCV_BINARY_TRANSLATION
-
-			// Insert decoded instruction into decoder cache
-			Instruction<W> decoded = CPU<W>::decode(instruction);
-			entry.set_handler(decoded);
-
-			// Cache the (modified) instruction bits
-			auto bytecode = CPU<W>::computed_index_for(instruction);
-			// Threaded rewrites are **always** enabled
-			bytecode = exec.threaded_rewrite(bytecode, dst, rewritten);
-			entry.set_bytecode(bytecode);
-			entry.instr = rewritten.whole;
+		const bool lazy = false;
+#else
+		const bool lazy = options.lazy_decoding;
+#endif
+		if (lazy)
+		{
+			// Every entry starts out undecoded, and is decoded
+			// the first time it is executed (see decode_lazily)
+			DecoderData<W> undecoded;
+			undecoded.set_bytecode(RV32I_BC_DECODE);
+			undecoded.set_insn_handler(execute_undecoded<W>);
+#ifdef RISCV_EXT_COMPRESSED
+			undecoded.icount = 1; // Counts as zero instructions
+#endif
+			for (address_t dst = addr; dst < addr + len; dst += DecoderCache<W>::DIVISOR)
+				exec_decoder[dst / DecoderCache<W>::DIVISOR] = undecoded;
+			exec.set_lazy(true);
+			return;
+		}
 
-			// Increment PC after everything
-			if constexpr (compressed_enabled) {
-				// With compressed we always step forward 2 bytes at a time
-				dst += 2;
-				if (was_full_instruction) {
-					// For it to be a full instruction again,
-					// the length needs to match.
-					was_full_instruction = (instruction.length() == 2);
-				} else {
-					// If it wasn't a full instruction last time, it
-					// will for sure be one now.
-					was_full_instruction = true;
-				}
-			} else
-				dst += 4;
+#ifndef RISCV_BINARY_TRANSLATION
+		if (!options.decoder_cache_directory.empty())
+		{
+			if (exec.load_decoder_cache(options.decoder_cache_directory))
+				return;
+			decode_range<W>(exec, addr, addr + len, false);
+			exec.store_decoder_cache(options.decoder_cache_directory);
+			return;
 		}
+#endif
 
-		realize_fastsim<W>(addr, dst, exec_segment, exec_decoder);
+		decode_range<W>(exec, addr, addr + len, is_binary_translated());
 	}
 
 	template <int W> RISCV_INTERNAL
@@ -338,6 +665,76 @@ namespace riscv
 		return idx;
 	}
 
+	// Decoded execute segments shared between all machines in the process,
+	// keyed by address, length, the checksum of the instruction bits and
+	// the fingerprint of the options they were decoded with. Only weak
+	// references are kept, so that a segment is freed together with the
+	// last machine using it.
+	template <int W>
+	struct SharedExecuteSegments
+	{
+		using address_t = address_type<W>;
+		using key_t = std::tuple<address_t, size_t, uint32_t, uint32_t>;
+
+		// The options that reach generate_decoder_cache(), and may
+		// change what a segment is decoded into
+		static uint32_t options_fingerprint(const MachineOptions<W>& options)
+		{
+			uint32_t fingerprint = crc32c(&options.lazy_decoding, sizeof(options.lazy_decoding));
+			fingerprint = crc32c(fingerprint,
+				options.decoder_cache_directory.data(), options.decoder_cache_directory.size());
+#ifdef RISCV_BINARY_TRANSLATION
+			const unsigned translation[] = {
+				options.block_size_treshold, options.translate_blocks_max,
+				options.translate_instr_max, options.translate_background };
+			fingerprint = crc32c(fingerprint, translation, sizeof(translation));
+			fingerprint = crc32c(fingerprint,
+				options.translate_profile.data(), options.translate_profile.size());
+#endif
+			return fingerprint;
+		}
+
+		std::shared_ptr<DecodedExecuteSegment<W>> find(const key_t& key, const void* vdata)
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			auto it = m_segments.find(key);
+			if (it == m_segments.end())
+				return nullptr;
+			auto segment = it->second.lock();
+			if (segment == nullptr) {
+				m_segments.erase(it);
+				return nullptr;
+			}
+			// The checksum is only 32 bits, so verify the instructions
+			const auto vaddr = std::get<0>(key);
+			const auto exlen = std::get<1>(key);
+			if (std::memcmp(segment->exec_data(vaddr), vdata, exlen) != 0)
+				return nullptr;
+			return segment;
+		}
+		void insert(const key_t& key, std::shared_ptr<DecodedExecuteSegment<W>> segment)
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			// Forget segments that are no longer in use
+			for (auto it = m_segments.begin(); it != m_segments.end();) {
+				if (it->second.expired())
+					it = m_segments.erase(it);
+				else
+					++it;
+			}
+			m_segments.insert_or_assign(key, std::move(segment));
+		}
+
+		static SharedExecuteSegments& get() {
+			static SharedExecuteSegments shared;
+			return shared;
+		}
+
+	private:
+		std::mutex m_mtx;
+		std::map<key_t, std::weak_ptr<DecodedExecuteSegment<W>>> m_segments;
+	};
+
 	// An execute segment contains a sequential array of raw instruction bits
 	// belonging to a set of sequential pages with +exec permission.
 	// It also contains a decoder cache that is produced from this instruction data.
@@ -374,33 +771,155 @@ namespace riscv
 			throw MachineException(INVALID_PROGRAM, "Segment virtual base was bogus");
 		}
 
+		// Make room for the new segment
+		if (m_max_exec_segments != 0 && m_exec.size() >= m_max_exec_segments)
+			this->evict_execute_segments(m_max_exec_segments - 1);
+
+		// Lazily decoded segments are modified as they execute, and
+		// binary translation happens per machine, so those are never shared
+		const bool shared = options.share_execute_segments
+			&& !options.lazy_decoding && !binary_translation_enabled;
+		typename SharedExecuteSegments<W>::key_t key;
+		if (shared) {
+			key = { vaddr, exlen, crc32c(vdata, exlen),
+				SharedExecuteSegments<W>::options_fingerprint(options) };
+			auto segment = SharedExecuteSegments<W>::get().find(key, vdata);
+			if (segment != nullptr) {
+				m_exec.push_back(std::move(segment));
+				this->index_execute_segment();
+				return *m_exec.back();
+			}
+		}
+
 		// Create the whole executable memory range
-		m_exec.emplace_back(pbase, plen, vaddr, exlen);
-		auto& current_exec = m_exec.back();
+		m_exec.push_back(std::make_shared<DecodedExecuteSegment<W>>(pbase, plen, vaddr, exlen));
+		auto& current_exec = *m_exec.back();
 
 		auto* exec_data = current_exec.exec_data(pbase);
 		std::memset(&exec_data[0],      0,     prelen);
 		std::memcpy(&exec_data[prelen], vdata, exlen);
 		std::memset(&exec_data[prelen + exlen], 0,   postlen);
 
-		this->generate_decoder_cache(options, current_exec);
+		try {
+			this->generate_decoder_cache(options, current_exec);
+		} catch (...) {
+			// Segments that failed to decode are never looked up
+			m_exec.pop_back();
+			throw;
+		}
+
+		if (shared)
+			SharedExecuteSegments<W>::get().insert(key, m_exec.back());
 
+		this->index_execute_segment();
 		return current_exec;
 	}
 
+	// Index the last segment in m_exec
 	template <int W>
-	DecodedExecuteSegment<W>* Memory<W>::exec_segment_for(address_t vaddr)
+	void Memory<W>::index_execute_segment()
 	{
-		for (auto& segment : m_exec) {
-			if (segment.is_within(vaddr)) return &segment;
+		const auto& segment = *m_exec.back();
+		m_exec_last_used.push_back(++m_exec_lookups);
+		const ExecuteSegmentEntry entry {
+			segment.exec_begin(), segment.exec_end(), m_exec.size() - 1 };
+		auto it = std::upper_bound(m_exec_index.begin(), m_exec_index.end(), entry.begin,
+			[] (address_t addr, const ExecuteSegmentEntry& e) { return addr < e.begin; });
+		m_exec_index.insert(it, entry);
+	}
+
+#ifdef RISCV_BINARY_TRANSLATION
+	// Dispatch loops hold on to the execute segment and decoder cache
+	// they are running, so instead of patching the decoder cache of
+	// a running segment, a new segment is decoded with the compiled
+	// translation and then takes the place of the old one. This is
+	// done on the simulation thread only, at points where the CPU
+	// looks up its execute segment.
+	template <int W>
+	void Memory<W>::activate_background_translation()
+	{
+		if (!m_bintr_background->done.load(std::memory_order_acquire))
+			return;
+		const auto bt = std::move(m_bintr_background);
+		if (bt->dylib == nullptr)
+			return;
+
+		auto it = std::find_if(m_exec.begin(), m_exec.end(),
+			[&] (const auto& segment) { return segment->exec_begin() == bt->exec_begin; });
+		if (it == m_exec.end())
+			return;
+		auto old_segment = *it;
+
+		const auto pbase = old_segment->pagedata_base();
+		const auto vaddr = old_segment->exec_begin();
+		const size_t exlen = old_segment->exec_end() - vaddr;
+		constexpr address_t PMASK = Page::size()-1;
+		const size_t plen = (exlen + (vaddr - pbase) + PMASK) & ~PMASK;
+
+		auto segment = std::make_shared<DecodedExecuteSegment<W>>(pbase, plen, vaddr, exlen);
+		std::memcpy(segment->exec_data(pbase), old_segment->exec_data(pbase), plen);
+		const size_t n_pages = plen / Page::size();
+		auto* decoder_cache = segment->create_decoder_cache(
+			new DecoderCache<W> [n_pages],
+			n_pages * sizeof(DecoderCache<W>));
+		segment->set_decoder(decoder_cache[0].get_base() - pbase / DecoderCache<W>::DIVISOR);
+		// The translation was compiled from the options of the segment,
+		// so it is activated as is, like a translation from an earlier run
+		void* dylib = std::exchange(bt->dylib, nullptr);
+		if (!machine().cpu.activate_dylib(*segment, dylib))
+			return;
+		this->set_binary_translated(dylib);
+		decode_range<W>(*segment, vaddr, vaddr + exlen, true);
+	#ifdef RISCV_TRANSLATION_CACHE
+		bt->filename.clear();
+	#endif
+
+		if (machine().cpu.current_execute_segment() == old_segment.get())
+			machine().cpu.set_execute_segment(segment.get());
+		*it = std::move(segment);
+		// Simulations that are running may still use the old segment
+		if (m_exec_users != 0)
+			m_exec_retired.push_back(std::move(old_segment));
+	}
+#endif
+
+	// The position in m_exec of the segment that vaddr is in, or
+	// the size of m_exec when there is none
+	template <int W>
+	size_t Memory<W>::exec_segment_index(address_t vaddr) const
+	{
+		// A few segments are faster to scan in the order they were
+		// created in, as the host predicts the jumps between them
+		// well. Overlapping segments are only found by scanning.
+		if (m_exec.size() > EXECUTE_SEGMENT_SCAN_MAX) {
+			// The last segment that begins at or below vaddr
+			auto it = std::upper_bound(m_exec_index.begin(), m_exec_index.end(), vaddr,
+				[] (address_t addr, const ExecuteSegmentEntry& e) { return addr < e.begin; });
+			if (it != m_exec_index.begin() && vaddr < std::prev(it)->end)
+				return std::prev(it)->exec;
 		}
-		return nullptr;
+		size_t i = 0;
+		for (; i < m_exec.size(); i++) {
+			if (m_exec[i]->is_within(vaddr)) break;
+		}
+		return i;
+	}
+
+	template <int W>
+	DecodedExecuteSegment<W>* Memory<W>::exec_segment_for(address_t vaddr)
+	{
+		const size_t i = this->exec_segment_index(vaddr);
+		if (i == m_exec.size())
+			return nullptr;
+		m_exec_last_used[i] = ++m_exec_lookups;
+		return m_exec[i].get();
 	}
 
 	template <int W>
 	const DecodedExecuteSegment<W>* Memory<W>::exec_segment_for(address_t vaddr) const
 	{
-		return const_cast<Memory<W>*>(this)->exec_segment_for(vaddr);
+		const size_t i = this->exec_segment_index(vaddr);
+		return (i != m_exec.size()) ? m_exec[i].get() : nullptr;
 	}
 
 	template <int W>
@@ -409,11 +928,41 @@ namespace riscv
 		if (m_exec.size() <= remaining_size)
 			return;
 
-		// pop_back() might throw, so let's invalidate early
-		machine().cpu.set_execute_segment(nullptr);
+		auto* current = machine().cpu.current_execute_segment();
+		while (m_exec.size() > remaining_size)
+		{
+			// Find the least recently used segment, preferring any
+			// other than the main and the current execute segment
+			auto* main = m_exec.front().get();
+			size_t victim = 0;
+			int victim_rank = 0;
+			for (size_t i = 0; i < m_exec.size(); i++) {
+				auto* segment = m_exec[i].get();
+				const int rank = (segment == main) ? 1 : (segment == current) ? 2 : 3;
+				if (rank > victim_rank ||
+					(rank == victim_rank && m_exec_last_used[i] < m_exec_last_used[victim])) {
+					victim = i;
+					victim_rank = rank;
+				}
+			}
 
-		while (m_exec.size() > remaining_size) {
-			m_exec.pop_back();
+			if (m_exec[victim].get() == current) {
+				machine().cpu.set_execute_segment(nullptr);
+				current = nullptr;
+			}
+			// Remove the segment from the index, and renumber the
+			// positions of the segments after it
+			m_exec_index.erase(std::find_if(m_exec_index.begin(), m_exec_index.end(),
+				[victim] (const ExecuteSegmentEntry& e) { return e.exec == victim; }));
+			for (auto& entry : m_exec_index) {
+				if (entry.exec > victim)
+					entry.exec--;
+			}
+			// Simulations that are running may still use the segment
+			if (m_exec_users != 0)
+				m_exec_retired.push_back(std::move(m_exec[victim]));
+			m_exec.erase(m_exec.begin() + victim);
+			m_exec_last_used.erase(m_exec_last_used.begin() + victim);
 		}
 	}
 
@@ -421,6 +970,9 @@ namespace riscv
 	template struct Memory<8>;
 	template struct DecoderData<4>;
 	template struct DecoderData<8>;
+	template struct DecodedExecuteSegment<4>;
+	template struct DecodedExecuteSegment<8>;
 	INSTANTIATE_128_IF_ENABLED(DecoderData);
+	INSTANTIATE_128_IF_ENABLED(DecodedExecuteSegment);
 	INSTANTIATE_128_IF_ENABLED(Memory);
 } // riscv
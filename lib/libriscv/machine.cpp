@@ -45,10 +45,14 @@ namespace riscv
 	}
 	template <int W>
 	inline Machine<W>::Machine(const Machine& other, const MachineOptions<W>& options)
-		: cpu(*this, options.cpu_id, other),
+		: cpu(*this, other, options),
 		  memory(*this, other, options),
 		  m_arena(nullptr)
 	{
+		if (options.shared_fork) {
+			this->load_shared_state(*memory.shared_fork_source());
+			return;
+		}
 		this->m_counter = other.m_counter;
 		this->m_max_counter = other.m_max_counter;
 		if (other.m_mt) {
@@ -57,6 +61,85 @@ namespace riscv
 		// TODO: transfer arena?
 	}
 
+	template <int W>
+	void Machine<W>::reset_to(const Machine& other, const MachineOptions<W>& options)
+	{
+		memory.reset_to(other, options);
+		if (options.shared_fork) {
+			this->load_shared_state(*memory.shared_fork_source());
+			return;
+		}
+
+		cpu.registers().copy_from(Registers<W>::Options::NoVectors, other.cpu.registers());
+		cpu.set_execute_segment(other.cpu.current_execute_segment());
+		// Forks may execute the segment concurrently with the master
+		if (auto* exec = cpu.current_execute_segment(); exec != nullptr)
+			exec->decode_all();
+#ifdef RISCV_EXT_ATOMICS
+		cpu.atomics() = other.cpu.atomics();
+#endif
+		this->m_counter = other.m_counter;
+		this->m_max_counter = other.m_max_counter;
+		if (other.m_mt) {
+			m_mt.reset(new MultiThreading {*this, *other.m_mt});
+		} else {
+			m_mt = nullptr;
+		}
+		// A native heap is kept, but returned to the state of the master
+		if (m_arena && other.m_arena) {
+			other.m_arena->transfer(*m_arena);
+		} else if (!other.m_arena) {
+			m_arena = nullptr;
+		}
+	}
+
+	template <int W>
+	void Machine<W>::publish_for_forks()
+	{
+		if (memory.is_forked())
+			throw MachineException(ILLEGAL_OPERATION,
+				"Only the original machine can publish its state");
+		auto state = std::make_shared<SharedForkState<W>>();
+		memory.publish_pages(*state);
+
+		state->registers.copy_from(Registers<W>::Options::NoVectors, cpu.registers());
+#ifdef RISCV_EXT_ATOMICS
+		state->atomics = cpu.atomics();
+#endif
+		state->counter = this->m_counter;
+		state->max_counter = this->m_max_counter;
+		// Forks make their own copies of the threads and the native heap
+		if (m_mt)
+			state->threads = std::make_shared<const MultiThreading<W>>(*this, *m_mt);
+		if (m_arena)
+			state->arena = std::make_shared<const Arena>(*m_arena);
+
+		memory.set_published_state(std::move(state));
+	}
+
+	template <int W>
+	void Machine<W>::load_shared_state(const SharedForkState<W>& state)
+	{
+		cpu.registers().copy_from(Registers<W>::Options::NoVectors, state.registers);
+		cpu.set_execute_segment(state.exec.get());
+#ifdef RISCV_EXT_ATOMICS
+		cpu.atomics() = state.atomics;
+#endif
+		this->m_counter = state.counter;
+		this->m_max_counter = state.max_counter;
+		if (state.threads) {
+			m_mt.reset(new MultiThreading {*this, *state.threads});
+		} else {
+			m_mt = nullptr;
+		}
+		// A native heap is kept, but returned to the published state
+		if (m_arena && state.arena) {
+			state.arena->transfer(*m_arena);
+		} else if (!state.arena) {
+			m_arena = nullptr;
+		}
+	}
+
 	template <int W>
 	inline Machine<W>::Machine(const std::vector<uint8_t>& bin, const MachineOptions<W>& opts)
 		: Machine(std::string_view{(char*) bin.data(), bin.size()}, opts) {}
@@ -2,9 +2,13 @@
 #include "cpu.hpp"
 #include "memory.hpp"
 #include "riscvbase.hpp"
+#include "shared_fork.hpp"
 #include "posix/filedesc.hpp"
 #include "posix/signals.hpp"
 #include <array>
+#ifdef RISCV_ASYNC_SNAPSHOTS
+#include <future>
+#endif
 #include <string_view>
 
 namespace riscv
@@ -45,7 +49,25 @@ namespace riscv
 		// all cached structures like execute segment, rodata and the
 		// instruction cache is also loaned. The main machine must not be
 		// destroyed or (in most cases) modified while the fork is running.
+		// With the shared_fork option, forks are instead created from the
+		// state @main has last published with publish_for_forks(), and
+		// hold a reference to its page data. Creating them only reads the
+		// published state, so the main machine may keep running and
+		// modifying its memory on another thread, but it must still
+		// outlive the fork.
 		Machine(const Machine& main, const MachineOptions<W>& = {});
+		// Returns a fork to the state of a new fork of @main, without
+		// recreating it. Only the pages the fork has changed are restored,
+		// and with shared_fork, also the pages that differ in the state
+		// @main has published since. The options should be the ones the
+		// fork was created with. Registers, counters and threads are
+		// copied from @main, or from its published state.
+		void reset_to(const Machine& main, const MachineOptions<W>& = {});
+		// Publishes the current state of the machine for new and reset
+		// shared forks. Pages are made copy-on-write, and only the pages
+		// changed since the last time are published again. Must be called
+		// on the thread running the machine, while it is not simulating.
+		void publish_for_forks();
 		~Machine();
 
 		// Simulate a RISC-V machine until @max_instructions have been
@@ -247,17 +269,54 @@ namespace riscv
 
 		// Serializes all the machine state + a tiny header to @vec
 		void serialize_to(std::vector<uint8_t>& vec) const;
+		// Serializes the machine state, but only with the pages that were
+		// changed or freed after the snapshot with the given id was made.
+		// Throws if the snapshot id is unknown.
+		void serialize_delta_since(uint32_t snapshot_id, std::vector<uint8_t>& vec) const;
+		// The id of the latest snapshot made with serialize_to() or
+		// serialize_delta_since(), or zero if there are none.
+		uint32_t snapshot_id() const noexcept { return memory.snapshot_id(); }
 		// Returns the machine to a previously stored state
 		// NOTE: All previous memory traps are lost, syscall handlers,
 		// destructor callbacks are kept. Page fault handler and
 		// symbol lookup cache is also kept. Returns 0 on success.
+		// Delta snapshots are applied on top of the current state, which
+		// must be the state of the snapshot the delta was made against.
+		// Returns -8 if the machine was last serialized to or restored
+		// from another snapshot than that one.
 		int deserialize_from(const std::vector<uint8_t>&);
+		// Serializes like serialize_to(), but with all the page data at the
+		// end, aligned to page boundaries relative to the start of the
+		// snapshot. Written to a file it can be restored with deserialize_mapped().
+		void serialize_aligned_to(std::vector<uint8_t>& vec) const;
+		// Restores a snapshot file made with serialize_aligned_to() by mapping
+		// it privately and using the page data in place, so that pages are
+		// only read from the file when first accessed. Writes never reach
+		// the file. Pages inside a flat memory arena are still copied.
+		// Returns 0 on success, -6 if the file could not be mapped, -7
+		// if the snapshot is not page aligned, or is compressed, and -8
+		// for a delta snapshot made against another snapshot.
+		int deserialize_mapped(const std::string& filename);
+#ifdef RISCV_ASYNC_SNAPSHOTS
+		// Makes a snapshot without waiting for the pages to be serialized.
+		// The pages are made copy-on-write, and a background thread writes
+		// them compressed, while the machine can keep running. Each page
+		// that is written to before then is copied once, and pages are
+		// written in place again after that. Only pages in the page table
+		// are deferred: flat arena pages are written without going through
+		// a page, and are copied right away, like other pages that can't
+		// be shared.
+		// The snapshot is restored with deserialize_from().
+		std::future<std::vector<uint8_t>> serialize_async();
+#endif
 
 	private:
 		template<typename... Args, std::size_t... indices>
 		auto resolve_args(std::index_sequence<indices...>) const;
 		static void setup_native_heap_internal(const size_t);
+		void serialize_snapshot(std::vector<uint8_t>& vec, uint32_t base_id, uint16_t flags) const;
 		void timeout_exception(uint64_t);
+		void load_shared_state(const SharedForkState<W>&);
 
 		uint64_t     m_counter = 0;
 		uint64_t     m_max_counter = 0;
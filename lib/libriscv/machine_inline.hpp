@@ -25,7 +25,10 @@ template <int W>
 template <bool Throw>
 inline void Machine<W>::simulate(uint64_t max_instr)
 {
-	cpu.simulate(max_instr);
+	if (guarded_arena_enabled && memory.is_guarded_arena())
+		memory.guarded_simulate(max_instr);
+	else
+		cpu.simulate(max_instr);
 	if constexpr (Throw) {
 		// It is a timeout exception if the max counter is non-zero and
 		// the simulation ended. Otherwise, the machine stopped normally.
@@ -72,6 +75,7 @@ void Machine<W>::install_syscall_handlers(std::initializer_list<std::pair<size_t
 template <int W>
 inline void Machine<W>::system_call(size_t sysnum)
 {
+	[[maybe_unused]] const typename Memory<W>::HostAccess host_access {memory};
 	if (LIKELY(sysnum < syscall_handlers.size())) {
 		const auto& handler = Machine::syscall_handlers[sysnum];
 		handler(*this);
@@ -8,12 +8,328 @@
 #ifdef __linux__
 #define DEMANGLE_ENABLED
 #include <sys/mman.h>
+#include <unistd.h>
 extern "C" char *
 __cxa_demangle(const char *name, char *buf, size_t *n, int *status);
 #endif
+#if defined(__linux__) && defined(RISCV_FLAT_MEMORY)
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <sched.h>
+#include <signal.h>
+#include <vector>
+#endif
 
 namespace riscv
 {
+#if defined(__linux__) && defined(RISCV_FLAT_MEMORY)
+	static constexpr size_t ARENAS_MAX = 4096;
+
+	// Flat accesses bypass pages, so once snapshots are being made the
+	// flat arena is write-protected, and the first write to a page marks
+	// it as written and makes it writable again. Guarded arenas track
+	// writes in their page states instead.
+	struct ArenaWrites {
+		uintptr_t base;
+		size_t    pages;
+		std::unique_ptr<uint8_t[]> clean; // One per page, set while write-protected
+
+		void written(size_t pageno) {
+			clean[pageno] = 0;
+			if (mprotect((char *)base + pageno * PageSize, PageSize, PROT_READ | PROT_WRITE) != 0) {
+				// The mapping could not be split any further, and
+				// every page counts as written until the next snapshot
+				mprotect((void *)base, pages * PageSize, PROT_READ | PROT_WRITE);
+				std::fill(&clean[0], &clean[pages], 0);
+			}
+		}
+	};
+#endif
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+	// Guarded arenas reserve the 32-bit address space and one guard page,
+	// followed by the pages that faulting pages are moved aside to
+	static constexpr size_t GUARDED_ARENA_SIZE = (1ull << 32) + PageSize;
+	static constexpr size_t GUARDED_ARENA_PAGES = (1ull << 32) / PageSize;
+	static constexpr size_t GUARDED_ARENA_ASIDE = 2;
+	static constexpr size_t GUARDED_ARENA_MAPPING = GUARDED_ARENA_SIZE + GUARDED_ARENA_ASIDE * PageSize;
+#ifndef MREMAP_DONTUNMAP
+#define MREMAP_DONTUNMAP 4
+#endif
+
+	// Host memory is committed on the first access to a page, up to
+	// memory_max. Pages with other attributes are never committed on
+	// access, and faults on them are guest protection faults.
+	// Untouched pages are committed in chunks, so that the host mapping
+	// is not split page by page (see vm.max_map_count). The whole chunk
+	// counts against memory_max. Committed pages are write-protected
+	// while they are unchanged since the last snapshot.
+	struct GuardedArena {
+		enum : uint8_t {
+			COMMITTED  = 1,
+			PROTECTED  = 2,
+			UNREADABLE = 4,
+			WRITE_TRACKED = 8,
+		};
+		uintptr_t base;
+		size_t    pages_max;
+		size_t    pages_committed = 0;
+		uint8_t*  state; // One per page
+		std::atomic<bool>* fault_pending;
+		static constexpr size_t COMMIT_CHUNK = 16;
+		// Pages whose host protections could not be restored. They
+		// are protected again before the guest runs.
+		std::vector<size_t> stale {};
+
+		// A guest fault moves the faulting page aside, and the access
+		// completes on an empty stand-in page in its place, which never
+		// reaches the guest. The page is moved back before the fault is
+		// raised. An access spans at most two pages.
+		std::array<size_t, GUARDED_ARENA_ASIDE> moved {};
+		size_t   moved_count = 0;
+		int      fault = 0;
+		uint64_t fault_addr = 0;
+
+		char* page_at(size_t pageno) const noexcept {
+			return (char *)base + pageno * PageSize;
+		}
+		char* aside_at(size_t idx) const noexcept {
+			return (char *)base + GUARDED_ARENA_SIZE + idx * PageSize;
+		}
+
+		// Returns false, with nothing changed, when the host
+		// protections could not be changed
+		bool commit(size_t pageno) {
+			const size_t first = pageno & ~(COMMIT_CHUNK - 1);
+			if (pages_committed + COMMIT_CHUNK <= pages_max
+				&& std::all_of(&state[first], &state[first + COMMIT_CHUNK],
+					[] (uint8_t s) { return s == 0; })
+				&& commit_range(first, COMMIT_CHUNK))
+				return true;
+			return commit_range(pageno, 1);
+		}
+		bool commit_range(size_t pageno, size_t count) {
+			if (mprotect((char *)base + pageno * PageSize, count * PageSize, PROT_READ | PROT_WRITE) != 0)
+				return false;
+			std::fill(&state[pageno], &state[pageno + count], COMMITTED);
+			pages_committed += count;
+			return true;
+		}
+		// The first write to a page since the last snapshot
+		bool written(size_t pageno) {
+			if (mprotect(page_at(pageno), PageSize, PROT_READ | PROT_WRITE) != 0)
+				return false;
+			state[pageno] &= ~WRITE_TRACKED;
+			return true;
+		}
+		// Moves a page, with its contents and protections, aside. An empty
+		// page stays mapped in its place, so there is never a hole there.
+		static bool move_aside(char* page, char* aside) {
+			if (mremap(page, PageSize, PageSize,
+					MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, aside) == MAP_FAILED)
+				return false;
+			if (mprotect(page, PageSize, PROT_READ | PROT_WRITE) == 0)
+				return true;
+			mremap(aside, PageSize, PageSize,
+				MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, page);
+			return false;
+		}
+		bool divert(size_t pageno, int type, uint64_t addr) {
+			if (moved_count == moved.size())
+				return false;
+			for (size_t i = 0; i < moved_count; i++)
+				if (moved[i] == pageno) return false;
+			if (!move_aside(page_at(pageno), aside_at(moved_count)))
+				return false;
+			moved[moved_count++] = pageno;
+			if (fault == 0) {
+				fault = type;
+				fault_addr = addr;
+			}
+			fault_pending->store(true, std::memory_order_relaxed);
+			return true;
+		}
+		// Moves the page back in place of the stand-in page, and leaves
+		// the aside page mapped and empty
+		bool move_back(size_t idx) {
+			return mremap(aside_at(idx), PageSize, PageSize,
+				MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, page_at(moved[idx])) != MAP_FAILED
+				&& mprotect(aside_at(idx), PageSize, PROT_NONE) == 0;
+		}
+	};
+	// The guarded arena of the guest running on this thread
+	static thread_local const GuardedArena* guarded_running = nullptr;
+
+	static int arena_protections(const PageAttributes& attr)
+	{
+		return (attr.read ? PROT_READ : 0) | (attr.write ? PROT_READ | PROT_WRITE : 0);
+	}
+
+	// Sets the state and host protections of a page following its
+	// attributes. Returns false, with nothing changed, on failure.
+	static bool guarded_protect(GuardedArena* arena, size_t pageno, const PageAttributes& attr)
+	{
+		char* page = (char *)arena->base + pageno * PageSize;
+		if (pageno >= GUARDED_ARENA_PAGES) // The guard page
+			return mprotect(page, PageSize, PROT_NONE) == 0;
+		const bool is_default = attr.read && attr.write;
+		const uint8_t flags = (is_default ? 0 : GuardedArena::PROTECTED)
+			| (attr.read ? 0 : GuardedArena::UNREADABLE);
+		uint8_t state = flags;
+		int prot = arena_protections(attr);
+		if (arena->state[pageno] & GuardedArena::COMMITTED) {
+			state |= GuardedArena::COMMITTED;
+		} else if (is_default) {
+			// Committed on the first access, as usual
+			prot = PROT_NONE;
+		}
+		if (mprotect(page, PageSize, prot) != 0)
+			return false;
+		arena->state[pageno] = state;
+		return true;
+	}
+#endif
+#if defined(__linux__) && defined(RISCV_FLAT_MEMORY)
+	// Arenas by address range, looked up by the fault handler. The index
+	// is replaced as a whole, and the replaced index, along with any arena
+	// removed from it, is only released once no fault handler can be
+	// using it anymore.
+	struct ArenaRange {
+		uintptr_t begin;
+		uintptr_t end;
+		ArenaWrites*  writes;
+		GuardedArena* guarded;
+	};
+	struct ArenaIndex {
+		std::vector<ArenaRange> ranges; // Sorted by address
+	};
+	static std::atomic<const ArenaIndex*> arena_index {nullptr};
+	static std::atomic<unsigned> arena_index_readers {0};
+	static std::mutex arena_index_mtx;
+	static struct sigaction arena_old_action;
+
+	static const ArenaRange* arena_lookup(const ArenaIndex* index, uintptr_t addr)
+	{
+		if (index == nullptr)
+			return nullptr;
+		auto it = std::upper_bound(index->ranges.begin(), index->ranges.end(), addr,
+			[] (uintptr_t a, const ArenaRange& range) { return a < range.begin; });
+		if (it == index->ranges.begin() || addr >= (it - 1)->end)
+			return nullptr;
+		return &*(it - 1);
+	}
+
+	// Returns true when the fault was a write to a tracked page, or
+	// when the access may be retried in a guarded arena
+	static bool arena_fault_handled(const ArenaRange& range, uintptr_t addr)
+	{
+		if (ArenaWrites* arena = range.writes; arena != nullptr) {
+			const size_t pageno = (addr - arena->base) / PageSize;
+			if (arena->clean[pageno]) {
+				arena->written(pageno);
+				return true;
+			}
+			return false;
+		}
+#ifdef RISCV_GUARDED_ARENA
+		if (GuardedArena* arena = range.guarded; arena != nullptr) {
+			const uint64_t offset = addr - arena->base;
+			const size_t pageno = offset / PageSize;
+			int fault = PROTECTION_FAULT;
+			if (pageno < GUARDED_ARENA_PAGES && (arena->state[pageno] & GuardedArena::WRITE_TRACKED)) {
+				if (arena->written(pageno))
+					return true;
+				fault = OUT_OF_MEMORY;
+			} else if (pageno < GUARDED_ARENA_PAGES && arena->state[pageno] == 0) {
+				// First access: Commit the page and retry
+				if (arena->pages_committed < arena->pages_max && arena->commit(pageno))
+					return true;
+				fault = OUT_OF_MEMORY;
+			}
+			// A guest fault: Retry on a stand-in page, and let the
+			// access raise the fault. Unwinding from here would skip
+			// the C++ frames of the dispatch loop.
+			return guarded_running == arena && arena->divert(pageno, fault, offset);
+		}
+#endif
+		return false;
+	}
+
+	static void arena_fault(int sig, siginfo_t* info, void* context)
+	{
+		const auto addr = (uintptr_t) info->si_addr;
+		arena_index_readers.fetch_add(1);
+		const ArenaRange* range = arena_lookup(arena_index.load(), addr);
+		const bool handled = range != nullptr && arena_fault_handled(*range, addr);
+		arena_index_readers.fetch_sub(1);
+		if (handled)
+			return;
+
+		// Not a guest fault: Forward to the previous handler
+		const auto& old = arena_old_action;
+		if (old.sa_flags & SA_SIGINFO) {
+			old.sa_sigaction(sig, info, context);
+		} else if (old.sa_handler == SIG_DFL || old.sa_handler == SIG_IGN) {
+			// Return and fault again with the default action
+			signal(sig, SIG_DFL);
+		} else {
+			old.sa_handler(sig);
+		}
+	}
+
+	// Publishes a new index with @add inserted and the arena at @remove
+	// taken out, then waits out fault handlers using the old index
+	static bool replace_arena_index(const ArenaRange* add, uintptr_t remove)
+	{
+		const ArenaIndex* old = arena_index.load();
+		auto* index = new ArenaIndex {};
+		if (old != nullptr) {
+			for (const auto& range : old->ranges)
+				if (range.begin != remove)
+					index->ranges.push_back(range);
+		}
+		if (add != nullptr) {
+			if (index->ranges.size() >= ARENAS_MAX) {
+				delete index;
+				return false;
+			}
+			auto it = std::lower_bound(index->ranges.begin(), index->ranges.end(), add->begin,
+				[] (const ArenaRange& range, uintptr_t a) { return range.begin < a; });
+			index->ranges.insert(it, *add);
+		}
+		arena_index.store(index);
+		while (arena_index_readers.load() != 0)
+			sched_yield();
+		delete old;
+		return true;
+	}
+
+	static bool register_arena(const ArenaRange& range)
+	{
+		std::lock_guard<std::mutex> lock(arena_index_mtx);
+		// (Re-)install the handler, in case someone replaced it. Anything
+		// that is not a guest fault is forwarded to the replaced handler.
+		struct sigaction current {};
+		sigaction(SIGSEGV, nullptr, &current);
+		if (!(current.sa_flags & SA_SIGINFO) || current.sa_sigaction != arena_fault)
+		{
+			struct sigaction sa {};
+			sa.sa_sigaction = arena_fault;
+			sa.sa_flags = SA_SIGINFO;
+			sigemptyset(&sa.sa_mask);
+			sigaction(SIGSEGV, &sa, &arena_old_action);
+		}
+		return replace_arena_index(&range, 0);
+	}
+	// Once this returns, no fault handler uses the arena anymore
+	static void unregister_arena(uintptr_t base)
+	{
+		std::lock_guard<std::mutex> lock(arena_index_mtx);
+		replace_arena_index(nullptr, base);
+	}
+#endif
+
 	template <int W>
 	Memory<W>::Memory(Machine<W>& mach, std::string_view bin,
 					MachineOptions<W> options)
@@ -21,6 +337,12 @@ namespace riscv
 		  m_original_machine {true},
 		  m_binary {bin}
 	{
+		this->m_page_table.init(options.flat_page_table_bound);
+		this->m_max_exec_segments = options.max_execute_segments;
+		if (UNLIKELY(m_max_exec_segments == 1))
+			throw MachineException(ILLEGAL_OPERATION,
+				"Max execute segments must be 0 or at least 2", m_max_exec_segments);
+
 		if (options.page_fault_handler != nullptr)
 		{
 			this->m_page_fault_handler = std::move(options.page_fault_handler);
@@ -30,10 +352,15 @@ namespace riscv
 			const address_t pages_max = options.memory_max / Page::size();
 			assert(pages_max >= 1);
 
-			if (options.use_memory_arena)
+			if (options.use_memory_arena && W == 4 && guarded_arena_enabled)
+			{
+				this->create_guarded_arena(pages_max);
+			}
+			else if (options.use_memory_arena)
 			{
 #ifdef __linux__
-				const size_t len = pages_max * Page::size();
+				// An extra page allows flat accesses to straddle the end
+				const size_t len = (pages_max + 1) * Page::size();
 				this->m_arena = (PageData *)mmap(NULL, len, PROT_READ | PROT_WRITE,
 					MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
 				this->m_arena_pages = pages_max;
@@ -44,9 +371,12 @@ namespace riscv
 				}
 #else
 				// TODO: XXX: Investigate if this is a time sink
-				this->m_arena = new PageData[pages_max];
+				this->m_arena = new PageData[pages_max + 1];
 				this->m_arena_pages = pages_max;
 #endif
+				if constexpr (flat_memory_enabled) {
+					this->m_flat_boundary = m_arena_pages * Page::size();
+				}
 			}
 
 			this->m_page_fault_handler =
@@ -57,12 +387,7 @@ namespace riscv
 					// Within linear arena at the start
 					if (page < mem.m_arena_pages)
 					{
-						const PageAttributes attr {
-							.read  = true,
-							.write = true,
-							.non_owning = true
-						};
-						return mem.allocate_page(page, attr, &mem.m_arena[page]);
+						return mem.allocate_arena_page(page);
 					}
 					// Create page on-demand
 					return mem.allocate_page(page,
@@ -86,6 +411,10 @@ namespace riscv
 		m_original_machine {false},
 		m_binary{other.memory.binary()}
 	{
+		this->m_max_exec_segments = options.max_execute_segments;
+		if (UNLIKELY(m_max_exec_segments == 1))
+			throw MachineException(ILLEGAL_OPERATION,
+				"Max execute segments must be 0 or at least 2", m_max_exec_segments);
 		this->machine_loader(other, options);
 	}
 
@@ -93,23 +422,440 @@ namespace riscv
 	Memory<W>::~Memory()
 	{
 		this->clear_all_pages();
-		// only the original machine owns rodata range
-		if (!this->m_original_machine) {
-			m_ropages.pages.release();
-		}
+		this->release_snapshot_mappings();
 #ifdef RISCV_BINARY_TRANSLATION
 		if (m_bintr_dl)
 			dlclose(m_bintr_dl);
 #endif
 		if (this->m_arena != nullptr) {
 #ifdef __linux__
-			munmap(this->m_arena, this->m_arena_pages * Page::size());
+#ifdef RISCV_FLAT_MEMORY
+			if (this->m_arena_writes != nullptr) {
+				unregister_arena(m_arena_writes->base);
+				delete m_arena_writes;
+			}
+#endif
+#ifdef RISCV_GUARDED_ARENA
+			if (this->m_guarded_arena != nullptr) {
+				unregister_arena(m_guarded_arena->base);
+				munmap(m_guarded_arena->aside_at(0), GUARDED_ARENA_ASIDE * Page::size());
+				munmap(m_guarded_arena->state, GUARDED_ARENA_PAGES);
+				delete m_guarded_arena;
+			}
+#endif
+			munmap(this->m_arena, (this->m_arena_pages + 1) * Page::size());
 #else
 			delete[] this->m_arena;
 #endif
 		}
 	}
 
+	template <int W> RISCV_INTERNAL
+	void Memory<W>::create_guarded_arena(size_t pages_max)
+	{
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+		// Every 32-bit address (plus access size) is inside the reservation,
+		// so loads and stores need no bounds checks. Host page protections
+		// mirror page attributes, and faults become guest protection faults.
+		void* arena = mmap(NULL, GUARDED_ARENA_MAPPING, PROT_NONE,
+			MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		if (UNLIKELY(arena == MAP_FAILED))
+			throw MachineException(OUT_OF_MEMORY, "Could not reserve a guarded arena", GUARDED_ARENA_MAPPING);
+		void* state = mmap(NULL, GUARDED_ARENA_PAGES, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		if (UNLIKELY(state == MAP_FAILED)) {
+			munmap(arena, GUARDED_ARENA_MAPPING);
+			throw MachineException(OUT_OF_MEMORY, "Could not reserve a guarded arena", GUARDED_ARENA_PAGES);
+		}
+		auto* guarded = new GuardedArena {
+			.base = (uintptr_t)arena,
+			.pages_max = pages_max,
+			.state = (uint8_t *)state,
+			.fault_pending = &m_guarded_fault,
+		};
+		// Faulting pages are moved aside, which needs Linux 5.7
+		const bool can_move = GuardedArena::move_aside(guarded->aside_at(0), guarded->aside_at(1))
+			&& mprotect(guarded->aside_at(0), Page::size(), PROT_NONE) == 0;
+		if (UNLIKELY(!can_move || !register_arena({guarded->base, guarded->base + GUARDED_ARENA_SIZE, nullptr, guarded}))) {
+			munmap(state, GUARDED_ARENA_PAGES);
+			munmap(arena, GUARDED_ARENA_MAPPING);
+			delete guarded;
+			if (!can_move)
+				throw MachineException(FEATURE_DISABLED,
+					"Guarded arenas need the host to support MREMAP_DONTUNMAP");
+			throw MachineException(OUT_OF_MEMORY, "Too many guarded arenas", ARENAS_MAX);
+		}
+		this->m_arena = (PageData *)arena;
+		this->m_arena_pages = GUARDED_ARENA_PAGES;
+		this->m_flat_boundary = 1ull << 32;
+		this->m_guarded_arena = guarded;
+#else
+		(void)pages_max;
+#endif
+	}
+
+	template <int W>
+	void Memory<W>::commit_arena_page(address_t pageno)
+	{
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+		auto* arena = this->m_guarded_arena;
+		if (arena != nullptr && pageno < m_arena_pages
+			&& !(arena->state[pageno] & GuardedArena::COMMITTED))
+		{
+			if (UNLIKELY(arena->pages_committed >= arena->pages_max || !arena->commit(pageno)))
+				throw MachineException(OUT_OF_MEMORY, "Out of memory", arena->pages_max);
+		}
+#else
+		(void)pageno;
+#endif
+	}
+
+	template <int W>
+	PageData* Memory<W>::copy_to_arena_page(address_t pageno, const PageData& data)
+	{
+		// Writable while copying, see protect_arena_page()
+		this->commit_arena_page(pageno);
+		this->protect_arena_page(pageno, PageAttributes{});
+		this->arena_page_written(pageno);
+		std::memcpy(m_arena[pageno].buffer8.data(), data.buffer8.data(), Page::size());
+		return &m_arena[pageno];
+	}
+
+	template <int W>
+	void Memory<W>::protect_arena_page(address_t pageno, const PageAttributes& attr)
+	{
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+		auto* arena = this->m_guarded_arena;
+		if (arena != nullptr && pageno < m_arena_pages
+			&& UNLIKELY(!guarded_protect(arena, pageno, attr)))
+		{
+			// The attributes have already changed, and the guest must
+			// not run with host protections that do not match them
+			arena->stale.push_back(pageno);
+			throw MachineException(OUT_OF_MEMORY, "Out of memory", arena->pages_max);
+		}
+#else
+		(void)pageno; (void)attr;
+#endif
+	}
+
+	template <int W>
+	void Memory<W>::reprotect_arena_page(address_t pageno) const
+	{
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+		const Page* page = this->find_page(pageno);
+		if (!guarded_protect(m_guarded_arena, pageno, page ? page->attr : PageAttributes{}))
+			m_guarded_arena->stale.push_back(pageno);
+#else
+		(void)pageno;
+#endif
+	}
+
+	template <int W>
+	void Memory<W>::reprotect_stale_arena_pages() const
+	{
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+		auto* arena = this->m_guarded_arena;
+		const auto stale = std::move(arena->stale);
+		arena->stale.clear();
+		for (const size_t pageno : stale)
+			this->reprotect_arena_page(pageno);
+		if (UNLIKELY(!arena->stale.empty()))
+			throw MachineException(OUT_OF_MEMORY, "Out of memory", arena->pages_max);
+#endif
+	}
+
+	template <int W>
+	void Memory<W>::release_arena_pages(address_t pageno, size_t count)
+	{
+		// Arena pages are not cleared when they are created again,
+		// and flat accesses would otherwise still see the old contents
+		if (this->m_arena != nullptr && pageno < m_arena_pages) {
+			count = std::min(count, size_t(m_arena_pages - pageno));
+			const size_t len = count * Page::size();
+#ifdef __linux__
+#ifdef RISCV_GUARDED_ARENA
+			if (auto* arena = this->m_guarded_arena; arena != nullptr) {
+				if (UNLIKELY(mprotect(&m_arena[pageno], len, PROT_NONE) != 0))
+					throw MachineException(OUT_OF_MEMORY, "Out of memory", arena->pages_max);
+				for (size_t p = pageno; p < pageno + count; p++) {
+					if (arena->state[p] & GuardedArena::COMMITTED)
+						arena->pages_committed--;
+					arena->state[p] = 0;
+				}
+			}
+#endif
+			madvise(&m_arena[pageno], len, MADV_DONTNEED);
+#else
+			std::memset(&m_arena[pageno], 0, len);
+#endif
+		}
+	}
+
+	template <int W>
+	void Memory<W>::memcpy_page(void* dst, address_t pageno, const Page& page, size_t offset, size_t len) const
+	{
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+		auto* arena = this->m_guarded_arena;
+		if (arena != nullptr && is_arena_page(pageno, page)
+			&& (arena->state[pageno] & GuardedArena::UNREADABLE))
+		{
+			// Readable only while copying
+			if (UNLIKELY(mprotect(&m_arena[pageno], Page::size(),
+					arena_protections(page.attr) | PROT_READ) != 0))
+				throw MachineException(OUT_OF_MEMORY, "Out of memory", arena->pages_max);
+			std::memcpy(dst, page.data() + offset, len);
+			this->reprotect_arena_page(pageno);
+			return;
+		}
+#else
+		(void)pageno;
+#endif
+		std::memcpy(dst, page.data() + offset, len);
+	}
+
+	template <int W>
+	void Memory<W>::arena_touched_pages(std::vector<uint8_t>& touched) const
+	{
+		const size_t arena_pages = this->m_flat_boundary / Page::size();
+		touched.assign(arena_pages, 0);
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+		if (auto* arena = this->m_guarded_arena; arena != nullptr) {
+			for (size_t p = 0; p < arena_pages; p++)
+				touched[p] = arena->state[p] & GuardedArena::COMMITTED;
+			return;
+		}
+#endif
+#ifdef __linux__
+		// Pages that were never accessed are not resident
+		if (sysconf(_SC_PAGESIZE) == Page::size()
+			&& mincore(m_arena, arena_pages * Page::size(), touched.data()) == 0)
+		{
+			for (auto& t : touched)
+				t &= 1;
+			return;
+		}
+#endif
+		std::fill(touched.begin(), touched.end(), 1);
+	}
+
+	template <int W>
+	bool Memory<W>::arena_page_touched(address_t pageno) const
+	{
+		if (pageno >= this->m_flat_boundary / Page::size())
+			return false;
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+		if (auto* arena = this->m_guarded_arena; arena != nullptr)
+			return arena->state[pageno] & GuardedArena::COMMITTED;
+#endif
+#ifdef __linux__
+		uint8_t resident = 0;
+		if (sysconf(_SC_PAGESIZE) == Page::size()
+			&& mincore(&m_arena[pageno], Page::size(), &resident) == 0)
+			return resident & 1;
+#endif
+		return true;
+	}
+
+	template <int W>
+	void Memory<W>::sync_arena_generations() const
+	{
+		const size_t arena_pages = this->m_flat_boundary / Page::size();
+		if (arena_pages == 0)
+			return;
+		if (m_arena_generations == nullptr)
+			m_arena_generations.reset(new uint32_t[arena_pages] {});
+		// Pages written since the last snapshot get the generation of this
+		// one, and are write-protected again so that the next write is seen
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+		if (auto* arena = this->m_guarded_arena; arena != nullptr) {
+			for (size_t p = 0; p < arena_pages; ) {
+				const uint8_t state = arena->state[p];
+				if (!(state & GuardedArena::COMMITTED) || (state & GuardedArena::WRITE_TRACKED)) {
+					p++;
+					continue;
+				}
+				if (state != GuardedArena::COMMITTED) {
+					// Pages with other attributes are not write-protected,
+					// and count as written when they are writable
+					const Page* page = this->find_page(p);
+					if (page == nullptr || page->attr.write)
+						m_arena_generations[p] = m_generation;
+					p++;
+					continue;
+				}
+				size_t end = p;
+				while (end < arena_pages && arena->state[end] == GuardedArena::COMMITTED)
+					m_arena_generations[end++] = m_generation;
+				if (mprotect(arena->page_at(p), (end - p) * Page::size(), PROT_READ) == 0) {
+					for (size_t q = p; q < end; q++)
+						arena->state[q] |= GuardedArena::WRITE_TRACKED;
+				}
+				p = end;
+			}
+			return;
+		}
+#endif
+#if defined(__linux__) && defined(RISCV_FLAT_MEMORY)
+		if (this->m_arena_writes == nullptr) {
+			auto* writes = new ArenaWrites {
+				.base = (uintptr_t)m_arena,
+				.pages = arena_pages,
+				.clean = std::unique_ptr<uint8_t[]> (new uint8_t[arena_pages] {}),
+			};
+			if (register_arena({writes->base, writes->base + arena_pages * Page::size(), writes, nullptr}))
+				this->m_arena_writes = writes;
+			else
+				delete writes;
+		}
+		if (auto* writes = this->m_arena_writes; writes != nullptr) {
+			uint8_t* clean = writes->clean.get();
+			for (size_t p = 0; p < arena_pages; ) {
+				if (clean[p]) {
+					p++;
+					continue;
+				}
+				size_t end = p;
+				while (end < arena_pages && !clean[end])
+					m_arena_generations[end++] = m_generation;
+				// Marked before the pages can fault
+				std::fill(&clean[p], &clean[end], 1);
+				if (mprotect(&m_arena[p], (end - p) * Page::size(), PROT_READ) != 0)
+					std::fill(&clean[p], &clean[end], 0);
+				p = end;
+			}
+			return;
+		}
+#endif
+		// Without write tracking, every page that may hold data was written
+		std::vector<uint8_t> touched;
+		this->arena_touched_pages(touched);
+		for (size_t p = 0; p < arena_pages; p++)
+			if (touched[p])
+				m_arena_generations[p] = m_generation;
+	}
+
+	template <int W>
+	void Memory<W>::arena_page_written(address_t pageno)
+	{
+		// The kernel does not fault on write-protected pages, so they
+		// are made writable before the host hands them out for writing
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+		if (auto* arena = this->m_guarded_arena; arena != nullptr) {
+			if ((arena->state[pageno] & GuardedArena::WRITE_TRACKED) && UNLIKELY(!arena->written(pageno)))
+				throw MachineException(OUT_OF_MEMORY, "Out of memory", arena->pages_max);
+			return;
+		}
+#endif
+#if defined(__linux__) && defined(RISCV_FLAT_MEMORY)
+		if (auto* writes = this->m_arena_writes; writes != nullptr
+			&& pageno < writes->pages && writes->clean[pageno])
+			writes->written(pageno);
+#else
+		(void)pageno;
+#endif
+	}
+
+	template <int W>
+	void Memory<W>::arena_host_reads(bool enable) const
+	{
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+		auto* arena = this->m_guarded_arena;
+		if (arena == nullptr)
+			return;
+		for (size_t p = 0; p < m_arena_pages; p++) {
+			if (!(arena->state[p] & GuardedArena::UNREADABLE))
+				continue;
+			// The host protections follow the attributes of the page
+			const Page* page = this->find_page(p);
+			if (page == nullptr)
+				continue;
+			if (!enable) {
+				this->reprotect_arena_page(p);
+			} else if (UNLIKELY(mprotect(&m_arena[p], Page::size(),
+					arena_protections(page->attr) | PROT_READ) != 0)) {
+				this->arena_host_reads(false);
+				throw MachineException(OUT_OF_MEMORY, "Out of memory", arena->pages_max);
+			}
+		}
+#else
+		(void)enable;
+#endif
+	}
+
+	template <int W>
+	void Memory<W>::guarded_simulate(uint64_t max_instructions)
+	{
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+		if (UNLIKELY(!m_guarded_arena->stale.empty()))
+			this->reprotect_stale_arena_pages();
+		// Pages that could not be moved back after a fault
+		if (UNLIKELY(m_guarded_fault.load(std::memory_order_relaxed)))
+			this->restore_guarded_pages();
+		const GuardedArena* const outer = guarded_running;
+		const bool outer_flat = this->m_guarded_flat;
+		guarded_running = this->m_guarded_arena;
+		this->m_guarded_flat = true;
+		try {
+			machine().cpu.simulate(max_instructions);
+		} catch (...) {
+			guarded_running = outer;
+			this->m_guarded_flat = outer_flat;
+			this->restore_guarded_pages();
+			throw;
+		}
+		guarded_running = outer;
+		this->m_guarded_flat = outer_flat;
+		// A fault in host code that accessed the arena directly
+		if (UNLIKELY(m_guarded_fault.load(std::memory_order_relaxed)))
+			raise_guarded_fault();
+#else
+		machine().cpu.simulate(max_instructions);
+#endif
+	}
+
+	template <int W>
+	void Memory<W>::raise_guarded_fault() const
+	{
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+		const int fault = m_guarded_arena->fault;
+		const uint64_t fault_addr = m_guarded_arena->fault_addr;
+		this->restore_guarded_pages();
+		if (fault == OUT_OF_MEMORY)
+			throw MachineException(OUT_OF_MEMORY, "Out of memory", m_guarded_arena->pages_max);
+		throw MachineException(PROTECTION_FAULT, "Protection fault", fault_addr);
+#else
+		throw MachineException(PROTECTION_FAULT, "Protection fault", 0);
+#endif
+	}
+
+	template <int W>
+	void Memory<W>::restore_guarded_pages() const
+	{
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+		auto* arena = this->m_guarded_arena;
+		if (arena == nullptr || !m_guarded_fault.load(std::memory_order_relaxed))
+			return;
+		// Pages are moved back in the order they were moved aside
+		size_t restored = 0;
+		while (restored < arena->moved_count && arena->move_back(restored)) {
+			if (arena->moved[restored] < GUARDED_ARENA_PAGES)
+				this->reprotect_arena_page(arena->moved[restored]);
+			restored++;
+		}
+		if (UNLIKELY(restored < arena->moved_count)) {
+			// The stand-in pages stay accessible until this succeeds,
+			// so the guest can not run before then
+			std::copy(&arena->moved[restored], &arena->moved[arena->moved_count], &arena->moved[0]);
+			arena->moved_count -= restored;
+			throw MachineException(OUT_OF_MEMORY, "Out of memory", arena->pages_max);
+		}
+		arena->moved_count = 0;
+		arena->fault = 0;
+		m_guarded_fault.store(false, std::memory_order_relaxed);
+#endif
+	}
+
 	template <int W> RISCV_INTERNAL
 	void Memory<W>::reset()
 	{
@@ -121,13 +867,15 @@ namespace riscv
 	void Memory<W>::clear_all_pages()
 	{
 		this->m_pages.clear();
+		this->m_page_table.clear();
+		this->m_all_pages_dirty = true;
 		this->invalidate_reset_cache();
 	}
 
 	template <int W> RISCV_INTERNAL
 	void Memory<W>::initial_paging()
 	{
-		if (m_pages.find(0) == m_pages.end()) {
+		if (find_page(0) == nullptr) {
 			// add a guard page to catch zero-page accesses
 			install_shared_page(0, Page::guard_page());
 		}
@@ -191,7 +939,9 @@ namespace riscv
 			}
 		}
 
-		if (attr.read && !attr.write && m_ropages.end == 0) {
+		// Read-only pages in the flat arena must live in the arena
+		const bool in_flat_arena = hdr->p_vaddr < m_flat_boundary;
+		if (attr.read && !attr.write && m_ropages.end == 0 && !in_flat_arena) {
 			// If the serialization fails, we will fallback to memcpy
 			// with set_page_attr, like normal.
 			if (serialize_pages(m_ropages, hdr->p_vaddr, src, len, attr))
@@ -418,46 +1168,343 @@ namespace riscv
 	{
 		// Some machines don't need custom PF handlers
 		this->m_page_fault_handler = master.memory.m_page_fault_handler;
+		this->m_page_table.init(options.flat_page_table_bound);
 
-		if (options.minimal_fork == false)
+		if (options.shared_fork)
 		{
-			// Hardly any pages are dont_fork, so we estimate that
-			// all master pages will be loaned.
-			m_pages.reserve(master.memory.pages().size());
-			for (const auto& it : master.memory.pages())
+			if (master.memory.m_flat_boundary != 0)
+				throw MachineException(ILLEGAL_OPERATION,
+					"Shared forks are incompatible with the flat memory arena");
+			// The master may be running, so only its published state is read
+			this->m_fork_source = master.memory.published_state();
+			if (m_fork_source == nullptr)
+				throw MachineException(ILLEGAL_OPERATION,
+					"Shared forks need a master that has published its state");
+			const auto& state = *m_fork_source;
+			if (options.minimal_fork == false)
 			{
-				const auto& page = it.second;
-				// Skip pages marked as dont_fork
-				if (page.attr.dont_fork) continue;
-				// Make every page non-owning
-				auto attr = page.attr;
-				if (attr.write) {
-					attr.write = false;
-					attr.is_cow = true;
+				m_pages.reserve(state.page_count);
+				state.foreach_page([this] (address_t pageno, const SharedForkPage& page) {
+					this->loan_page(pageno, page.attr, page.data, page.shared);
+				});
+			}
+			this->m_start_address = state.start_address;
+			this->m_stack_address = state.stack_address;
+			this->m_exit_address = state.exit_address;
+			this->m_heap_address = state.heap_address;
+			this->m_mmap_address = state.mmap_address;
+			this->m_ropages.begin = state.ropages_begin;
+			this->m_ropages.end   = state.ropages_end;
+			this->m_ropages.pages = state.ropages;
+			this->m_ropages.data  = state.ropages_data;
+		}
+		else
+		{
+			if (options.minimal_fork == false)
+			{
+				// Hardly any pages are dont_fork, so we estimate that
+				// all master pages will be loaned.
+				m_pages.reserve(master.memory.m_pages.size());
+				for (const auto& it : master.memory.m_pages)
+				{
+					const auto& page = it.second;
+					// Skip pages marked as dont_fork
+					if (page.attr.dont_fork) continue;
+					this->loan_page(it.first, page.attr, page.m_page.get(), page.m_shared);
+				}
+				// Flat accesses write to the arena without creating pages
+				std::vector<uint8_t> touched;
+				master.memory.arena_touched_pages(touched);
+				for (size_t pageno = 0; pageno < touched.size(); pageno++) {
+					if (touched[pageno] && this->find_page(pageno) == nullptr)
+						this->loan_arena_page(master.memory, pageno);
 				}
-				attr.non_owning = true;
-				m_pages.emplace(std::piecewise_construct,
-					std::forward_as_tuple(it.first),
-					std::forward_as_tuple(attr, page.m_page.get())
-				);
 			}
+			this->m_start_address = master.memory.m_start_address;
+			this->m_stack_address = master.memory.m_stack_address;
+			this->m_exit_address = master.memory.m_exit_address;
+			this->m_heap_address = master.memory.m_heap_address;
+			this->m_mmap_address = master.memory.m_mmap_address;
+			this->m_ropages = master.memory.m_ropages;
 		}
-		this->m_start_address = master.memory.m_start_address;
-		this->m_stack_address = master.memory.m_stack_address;
-		this->m_exit_address = master.memory.m_exit_address;
-		this->m_heap_address = master.memory.m_heap_address;
-		this->m_mmap_address = master.memory.m_mmap_address;
 
 		// TODO: Set callback that can loan execute segments from master
 
-		this->m_ropages.begin = master.memory.m_ropages.begin;
-		this->m_ropages.end   = master.memory.m_ropages.end;
-		this->m_ropages.pages.reset(master.memory.m_ropages.pages.get());
-
 		// invalidate all cached pages, because references are invalidated
 		this->invalidate_reset_cache();
 	}
 
+	// Generations of published shared fork states, across all machines
+	static std::atomic<uint64_t> shared_fork_generation {0};
+
+	// Loaned pages are non-owning, and copied on write
+	static PageAttributes loaned_attributes(PageAttributes attr)
+	{
+		if (attr.write) {
+			attr.write = false;
+			attr.is_cow = true;
+		}
+		attr.non_owning = true;
+		return attr;
+	}
+
+	template <int W> RISCV_INTERNAL
+	void Memory<W>::loan_page(address_t pageno, PageAttributes attr,
+		PageData* data, const std::shared_ptr<PageData>& shared)
+	{
+		attr = loaned_attributes(attr);
+		auto res = m_pages.try_emplace(pageno, attr, data);
+		Page& page = res.first->second;
+		if (res.second) {
+			this->index_page(pageno, &page);
+		} else {
+			page.new_data(data, false);
+			page.attr = attr;
+			page.m_trap = nullptr;
+		}
+		page.m_shared = shared;
+	}
+
+	template <int W> RISCV_INTERNAL
+	void Memory<W>::loan_arena_page(const Memory<W>& master, address_t pageno)
+	{
+		// Arena pages without a page have default attributes
+		this->loan_page(pageno, PageAttributes{}, &master.m_arena[pageno], nullptr);
+	}
+
+	template <int W> RISCV_INTERNAL
+	void Memory<W>::share_page(address_t pageno, Page& page)
+	{
+		// Arena pages are moved out of the arena on first share
+		if (this->is_arena_page(pageno, page))
+			page.new_data(new PageData{page.page()}, true);
+		// Borrowed pages can only be loaned out
+		page.share();
+	}
+
+	template <int W> RISCV_INTERNAL
+	void Memory<W>::load_shared_page(const SharedForkState<W>& state, address_t pageno)
+	{
+		if (const auto* page = state.find(pageno); page != nullptr)
+			this->loan_page(pageno, page->attr, page->data, page->shared);
+		else
+			this->free_pageno(pageno);
+	}
+
+	template <int W>
+	void Memory<W>::publish_pages(SharedForkState<W>& state)
+	{
+		if (m_flat_boundary != 0)
+			throw MachineException(ILLEGAL_OPERATION,
+				"Shared forks are incompatible with the flat memory arena");
+		using Chunk = typename SharedForkState<W>::Chunk;
+		static constexpr unsigned CHUNK_PAGES = SharedForkState<W>::CHUNK_PAGES;
+
+		auto publish = [&] (address_t pageno, Page* page) {
+			const address_t chunkno = pageno / CHUNK_PAGES;
+			const uint64_t bit = uint64_t(1) << (pageno % CHUNK_PAGES);
+			auto it = state.chunks.find(chunkno);
+			if (page == nullptr || page->attr.dont_fork) {
+				if (it == state.chunks.end() || (it->second->present & bit) == 0)
+					return;
+			} else if (it == state.chunks.end()) {
+				it = state.chunks.emplace(chunkno, std::make_shared<Chunk>()).first;
+			}
+			// Chunks of the previously published state are never written to
+			auto& chunk = it->second;
+			if (chunk.use_count() > 1)
+				chunk = std::make_shared<Chunk>(*chunk);
+			auto& entry = chunk->pages[pageno % CHUNK_PAGES];
+			if (chunk->present & bit) {
+				chunk->present &= ~bit;
+				state.page_count--;
+			}
+			entry = {};
+			if (page != nullptr && !page->attr.dont_fork) {
+				this->share_page(pageno, *page);
+				entry = { page->attr, page->m_page.get(), page->m_shared };
+				chunk->present |= bit;
+				state.page_count++;
+			} else if (chunk->present == 0) {
+				state.chunks.erase(it);
+			}
+		};
+
+		const auto* previous = m_published.get();
+		state.generation = ++shared_fork_generation;
+		if (previous == nullptr || m_all_pages_dirty)
+		{
+			for (auto& it : m_pages)
+				publish(it.first, &it.second);
+		}
+		else
+		{
+			state.chunks = previous->chunks;
+			state.page_count = previous->page_count;
+			std::sort(m_dirty_pages.begin(), m_dirty_pages.end());
+			m_dirty_pages.erase(std::unique(m_dirty_pages.begin(), m_dirty_pages.end()), m_dirty_pages.end());
+			for (const address_t pageno : m_dirty_pages)
+				publish(pageno, this->find_page(pageno));
+
+			auto changes = std::make_shared<typename SharedForkState<W>::Changes>();
+			changes->since = previous->generation;
+			changes->pages = m_dirty_pages;
+			changes->total = changes->pages.size();
+			// The log is cut once it holds more pages than there are,
+			// and forks from before then compare all pages instead
+			const auto& before = previous->changes;
+			if (before != nullptr && before->total + changes->total <= state.page_count) {
+				changes->previous = before;
+				changes->total += before->total;
+			}
+			state.changes = std::move(changes);
+		}
+		m_dirty_pages.clear();
+		m_all_pages_dirty = false;
+		// Cached pages may have become copy-on-write
+		this->invalidate_reset_cache();
+
+		if (auto* exec = machine().cpu.current_execute_segment(); exec != nullptr) {
+			// Forks decode the segment concurrently otherwise
+			exec->decode_all();
+			auto it = std::find_if(m_exec.begin(), m_exec.end(),
+				[exec] (const auto& segment) { return segment.get() == exec; });
+			// Segments not owned here must outlive the forks
+			if (it != m_exec.end())
+				state.exec = *it;
+			else
+				state.exec = std::shared_ptr<DecodedExecuteSegment<W>>(std::shared_ptr<void>(), exec);
+		}
+		state.start_address = m_start_address;
+		state.stack_address = m_stack_address;
+		state.exit_address = m_exit_address;
+		state.heap_address = m_heap_address;
+		state.mmap_address = m_mmap_address;
+		state.ropages_begin = m_ropages.begin;
+		state.ropages_end   = m_ropages.end;
+		state.ropages       = m_ropages.pages;
+		state.ropages_data  = m_ropages.data;
+	}
+
+	template <int W>
+	void Memory<W>::set_published_state(std::shared_ptr<const SharedForkState<W>> state)
+	{
+		std::lock_guard<std::mutex> lock(m_published_mtx);
+		this->m_published = std::move(state);
+	}
+
+	template <int W>
+	std::shared_ptr<const SharedForkState<W>> Memory<W>::published_state() const
+	{
+		std::lock_guard<std::mutex> lock(m_published_mtx);
+		return this->m_published;
+	}
+
+	template <int W>
+	void Memory<W>::reset_to(const Machine<W>& master, const MachineOptions<W>& options)
+	{
+		if (m_original_machine)
+			throw MachineException(ILLEGAL_OPERATION,
+				"Only forks can be reset to a master machine");
+		std::shared_ptr<const SharedForkState<W>> state = nullptr;
+		if (options.shared_fork) {
+			if (master.memory.m_flat_boundary != 0)
+				throw MachineException(ILLEGAL_OPERATION,
+					"Shared forks are incompatible with the flat memory arena");
+			// The master may be running, so only its published state is read
+			state = master.memory.published_state();
+			if (state == nullptr)
+				throw MachineException(ILLEGAL_OPERATION,
+					"Shared forks need a master that has published its state");
+		}
+		const auto& main = master.memory;
+
+		// Restoring pages marks them dirty again, so take the list first
+		auto dirty = std::move(this->m_dirty_pages);
+		std::sort(dirty.begin(), dirty.end());
+		dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+
+		for (const address_t pageno : dirty)
+		{
+			if (options.minimal_fork) {
+				this->free_pageno(pageno);
+			} else if (state != nullptr) {
+				this->load_shared_page(*state, pageno);
+			} else if (const Page* page = main.find_page(pageno); page != nullptr && !page->attr.dont_fork) {
+				this->loan_page(pageno, page->attr, page->m_page.get(), page->m_shared);
+			} else if (page == nullptr && main.arena_page_touched(pageno)) {
+				this->loan_arena_page(main, pageno);
+			} else {
+				this->free_pageno(pageno);
+			}
+		}
+		// The master of a shared fork may have published new pages since.
+		// Only those are restored, when the log of changes reaches back to
+		// the state the fork came from, and otherwise all pages are compared.
+		if (state != nullptr && !options.minimal_fork
+			&& (state != m_fork_source || m_all_pages_dirty))
+		{
+			const uint64_t source = (m_fork_source != nullptr) ? m_fork_source->generation : 0;
+			const auto* changes = m_all_pages_dirty ? nullptr : state->changes.get();
+			dirty.clear();
+			for (; changes != nullptr; changes = changes->previous.get()) {
+				dirty.insert(dirty.end(), changes->pages.begin(), changes->pages.end());
+				if (changes->since == source)
+					break;
+			}
+			if (changes != nullptr)
+			{
+				std::sort(dirty.begin(), dirty.end());
+				dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+				for (const address_t pageno : dirty)
+					this->load_shared_page(*state, pageno);
+			}
+			else
+			{
+				state->foreach_page([this] (address_t pageno, const SharedForkPage& page) {
+					const Page* mine = this->find_page(pageno);
+					const auto attr = loaned_attributes(page.attr);
+					if (mine == nullptr || mine->m_page.get() != page.data
+						|| mine->attr.read != attr.read || mine->attr.exec != attr.exec
+						|| mine->attr.is_cow != attr.is_cow)
+						this->loan_page(pageno, page.attr, page.data, page.shared);
+				});
+				// Pages the master has since freed
+				dirty.clear();
+				for (const auto& it : m_pages) {
+					if (state->find(it.first) == nullptr)
+						dirty.push_back(it.first);
+				}
+				for (const address_t pageno : dirty)
+					this->free_pageno(pageno);
+			}
+		}
+		this->m_all_pages_dirty = false;
+		// Keep the allocation for the next round
+		dirty.clear();
+		this->m_dirty_pages = std::move(dirty);
+
+		// Execute segments created by the fork may hold its own changes
+		this->evict_execute_segments(0);
+
+		if (state != nullptr) {
+			this->m_start_address = state->start_address;
+			this->m_stack_address = state->stack_address;
+			this->m_exit_address = state->exit_address;
+			this->m_heap_address = state->heap_address;
+			this->m_mmap_address = state->mmap_address;
+			this->m_fork_source = std::move(state);
+		} else {
+			this->m_start_address = main.m_start_address;
+			this->m_stack_address = main.m_stack_address;
+			this->m_exit_address = main.m_exit_address;
+			this->m_heap_address = main.m_heap_address;
+			this->m_mmap_address = main.m_mmap_address;
+		}
+
+		this->invalidate_reset_cache();
+	}
+
 	template <int W>
 	std::string Memory<W>::get_page_info(address_t addr) const
 	{
@@ -1,8 +1,11 @@
 #pragma once
 #include "elf.hpp"
 #include "page.hpp"
+#include "page_table.hpp"
+#include <atomic>
 #include <cassert>
 #include <cstring>
+#include <mutex>
 #include <string_view>
 #include <unordered_map>
 #include "decoded_exec_segment.hpp"
@@ -12,6 +15,8 @@
 namespace riscv
 {
 	template<int W> struct Machine;
+	template<int W> struct SharedForkState;
+	struct BackgroundTranslation;
 	struct vBuffer { char* ptr; size_t len; };
 
 	template<int W>
@@ -104,8 +109,10 @@ namespace riscv
 		size_t pages_active() const noexcept { return m_pages.size(); }
 		size_t owned_pages_active() const noexcept;
 		// Page handling
+		// Pages are only inserted and erased through Memory, which keeps
+		// the flat page table (flat_page_table_bound) in sync with them.
 		const auto& pages() const noexcept { return m_pages; }
-		auto& pages() noexcept { return m_pages; }
+		const auto& flat_page_table() const noexcept { return m_page_table; }
 		const Page& get_page(address_t) const;
 		const Page& get_exec_pageno(address_t npage) const; // throws
 		const Page& get_pageno(address_t npage) const;
@@ -121,6 +128,10 @@ namespace riscv
 		Page& allocate_page(address_t page, Args&& ...);
 		void  invalidate_cache(address_t pageno, Page*) const;
 		void  invalidate_reset_cache() const;
+		// Hit and miss counters for the read and write page caches.
+		// Only counted when RISCV_PAGE_CACHE_STATS is defined.
+		const PageCacheStats& page_cache_stats() const noexcept { return m_cache_stats; }
+		void reset_page_cache_stats() noexcept { m_cache_stats = {}; }
 		void  free_pages(address_t, size_t len);
 		bool  free_pageno(address_t pageno);
 		// Page fault when writing to unused memory
@@ -148,35 +159,119 @@ namespace riscv
 		// NOTE: use print_and_pause() to immediately break!
 		void trap(address_t page_addr, mmio_cb_t callback);
 		// shared pages (regular pages will have priority!)
+		// Inside the flat arena the contents are copied into the arena.
 		Page&  install_shared_page(address_t pageno, const Page&);
 		// create pages for non-owned (shared) memory with given attributes
+		// Not possible inside the flat arena, which flat accesses read directly.
 		void insert_non_owned_memory(
 			address_t dst, void* src, size_t size, PageAttributes = {});
 
 		// Custom execute segment, returns page base, final size and execute segment pointer
 		DecodedExecuteSegment<W>* exec_segment_for(address_t vaddr);
+		// The same lookup, which does not count as a use for eviction
 		const DecodedExecuteSegment<W>* exec_segment_for(address_t vaddr) const;
-		const DecodedExecuteSegment<W>& main_execute_segment() const { return m_exec.at(0); }
+		const DecodedExecuteSegment<W>& main_execute_segment() const { return *m_exec.at(0); }
 		DecodedExecuteSegment<W>& create_execute_segment(const MachineOptions<W>&, const void* data, address_t addr, size_t len);
 		size_t cached_execute_segments() const noexcept { return m_exec.size(); }
-		// Evict newest execute segments until only remaining left
+		// Evict least recently used execute segments until only remaining left.
+		// The main execute segment is evicted last, and the current one
+		// is kept when possible.
 		// Default: Leave only the main execute segment left.
 		void evict_execute_segments(size_t remaining_size = 1);
+		// Held by each simulation while it runs. Segments evicted during
+		// a simulation may still be in use by it, or by an outer one that
+		// is paused in a system call, eg. during a nested vmcall. They are
+		// freed when the outermost simulation returns.
+		struct ExecuteSegmentsInUse {
+			ExecuteSegmentsInUse(Memory& m) : mem(m) { m.m_exec_users++; }
+			~ExecuteSegmentsInUse() {
+				if (--mem.m_exec_users == 0)
+					mem.m_exec_retired.clear();
+			}
+			Memory& mem;
+		};
+
+		// Linear arena at the start of memory (when enabled)
+		void* memory_arena_ptr() const noexcept { return (void*) m_arena; }
+		size_t memory_arena_size() const noexcept { return m_arena_pages * Page::size(); }
+		// Loads and stores below this address use the flat arena directly
+		uint64_t flat_memory_boundary() const noexcept { return m_flat_boundary; }
+		// Host page protections mirror the page attributes in a guarded arena
+		bool is_guarded_arena() const noexcept { return m_guarded_arena != nullptr; }
+		// Simulates with host faults in the guarded arena turned into
+		// guest exceptions. Guest loads and stores only go directly to
+		// a guarded arena while it is active.
+		void guarded_simulate(uint64_t max_instructions);
+		// Host code, like system call handlers, accesses a guarded arena
+		// through the pages instead, as it does not check for faults
+		struct HostAccess {
+#if defined(__linux__) && defined(RISCV_GUARDED_ARENA)
+			HostAccess(Memory& m) : mem(m), flat(m.m_guarded_flat) { m.m_guarded_flat = false; }
+			~HostAccess() { mem.m_guarded_flat = flat; }
+			Memory& mem;
+			const bool flat;
+#else
+			HostAccess(Memory&) {}
+#endif
+		};
+		// Copies from a page, which in a guarded arena may be protected
+		// from the host, eg. an execute-only page
+		void memcpy_page(void* dst, address_t pageno, const Page&, size_t offset, size_t len) const;
 
 		const auto& binary() const noexcept { return m_binary; }
 		void reset();
+		// Returns the memory of a fork to the state of @master, by
+		// restoring only the pages the fork has changed. Shared forks are
+		// reset to what @master has last published, and also restore
+		// the pages it has published again since they were reset.
+		// Execute segments created by the fork are dropped.
+		// See Machine::reset_to().
+		void reset_to(const Machine<W>& master, const MachineOptions<W>& = {});
+		// The state last published for shared forks, which may be read
+		// from any thread. See Machine::publish_for_forks().
+		std::shared_ptr<const SharedForkState<W>> published_state() const;
+		// The published state a shared fork was created from, or was
+		// last reset to.
+		const auto& shared_fork_source() const noexcept { return m_fork_source; }
+		// shares the pages changed since the state was last published
+		// and gathers them in @state. See Machine::publish_for_forks().
+		void publish_pages(SharedForkState<W>& state);
+		void set_published_state(std::shared_ptr<const SharedForkState<W>>);
 
 #ifdef RISCV_BINARY_TRANSLATION
 		bool is_binary_translated() const noexcept { return m_bintr_dl != nullptr; }
 		void set_binary_translated(void* dl) const { m_bintr_dl = dl; }
+		// A translation being compiled on a background thread replaces
+		// its execute segment once it is ready. The old segment is kept
+		// alive, as it may still be in use further up the call stack.
+		bool has_background_translation() const noexcept { return m_bintr_background != nullptr; }
+		void set_background_translation(std::shared_ptr<BackgroundTranslation> bt) const { m_bintr_background = std::move(bt); }
+		void activate_background_translation();
+		// Translated code looks up pages in the page caches directly
+		const void* read_page_cache() const noexcept { return m_rd_cache.entries; }
+		const void* write_page_cache() const noexcept { return m_wr_cache.entries; }
 #else
 		bool is_binary_translated() const noexcept { return false; }
 #endif
 
-		// serializes all the machine state + a tiny header to @vec
-		void serialize_to(std::vector<uint8_t>& vec) const;
+		// serializes pages changed since header.base_id (or all pages
+		// when it is zero) to @vec, and starts a new snapshot generation
+		void serialize_to(std::vector<uint8_t>& vec, SerializedMachine<W>& header) const;
+#ifdef RISCV_ASYNC_SNAPSHOTS
+		// makes the pages of a snapshot copy-on-write and gathers them
+		// in @pages, and starts a new snapshot generation. See Machine::serialize_async().
+		void freeze_pages(std::vector<FrozenPage>& pages, SerializedMachine<W>& header);
+#endif
+		// the id of the latest snapshot of this memory, or zero
+		uint32_t snapshot_id() const noexcept { return m_generation - 1; }
+		// the id of the snapshot this memory was last serialized
+		// to or restored from, which delta snapshots must be made against
+		uint32_t snapshot_state() const noexcept { return m_snapshot_state; }
 		// returns the machine to a previously stored state
 		void deserialize_from(const std::vector<uint8_t>&, const SerializedMachine<W>&);
+		// restores a page aligned snapshot from a private file mapping,
+		// which is then owned by this memory. See Machine::deserialize_mapped().
+		void deserialize_mapped(void* map, size_t size, const SerializedMachine<W>&);
 
 		Memory(Machine<W>&, std::string_view, MachineOptions<W>);
 		Memory(Machine<W>&, const Machine<W>&, MachineOptions<W>);
@@ -185,8 +280,9 @@ namespace riscv
 		struct MemoryArea {
 			address_t begin = 0;
 			address_t end = 0;
-			std::unique_ptr<Page[]> pages = nullptr;
-			std::unique_ptr<uint8_t[]> data = nullptr;
+			// Shared with forks, which may outlive this machine
+			std::shared_ptr<Page[]> pages = nullptr;
+			std::shared_ptr<uint8_t[]> data = nullptr;
 			bool contains(address_t pg) const noexcept { return pg >= begin && pg < end; }
 			bool contains(address_t x1, address_t x2) const noexcept {
 				return x1 < end && x2 >= begin;
@@ -194,7 +290,69 @@ namespace riscv
 		};
 		void clear_all_pages();
 		void initial_paging();
+		Page& allocate_arena_page(address_t pageno);
+		bool is_flat_address(address_t addr) const noexcept {
+			// Guarded arenas contain the whole 32-bit address space
+			if constexpr (W == 4 && guarded_arena_enabled)
+				return m_guarded_flat;
+			return addr < m_flat_boundary;
+		}
+		void create_guarded_arena(size_t pages_max);
+		void commit_arena_page(address_t pageno);
+		PageData* copy_to_arena_page(address_t pageno, const PageData&);
+		void protect_arena_page(address_t pageno, const PageAttributes&);
+		void release_arena_pages(address_t pageno, size_t count);
+		// Host protections that could not be restored are retried
+		// before the guest runs again
+		void reprotect_arena_page(address_t pageno) const;
+		void reprotect_stale_arena_pages() const;
+		bool is_arena_page(address_t pageno, const Page& page) const noexcept {
+			return pageno < m_arena_pages && page.has_data() && &page.page() == &m_arena[pageno];
+		}
+		// Pages whose data is serialized: owned, shared, arena or mapped snapshot pages
+		bool is_serializable(address_t pageno, const Page& page) const noexcept {
+			return !page.attr.non_owning || page.is_shared() || is_arena_page(pageno, page)
+				|| is_mapped_page(page);
+		}
+		bool is_mapped_page(const Page& page) const noexcept;
+		// Flat arena pages that may hold data, one entry per page. Pages
+		// that were never committed (or resident) read as zeroes.
+		void arena_touched_pages(std::vector<uint8_t>&) const;
+		bool arena_page_touched(address_t pageno) const;
+		// Serializing reads guarded arena pages that the guest can not read
+		void arena_host_reads(bool enable) const;
+		struct ArenaHostReads {
+			ArenaHostReads(const Memory& m) : mem(m) { mem.arena_host_reads(true); }
+			~ArenaHostReads() { mem.arena_host_reads(false); }
+			const Memory& mem;
+		};
+		// Flat arena pages are write-protected between snapshots, and
+		// those written since the last one get its generation
+		void sync_arena_generations() const;
+		void arena_page_written(address_t pageno);
+		template <typename Func>
+		void foreach_snapshot_page(uint32_t since, Func&&) const;
+		void deserialize_pages(const uint8_t* data, const SerializedMachine<W>&, bool mapped);
+		void restore_page(address_t pageno, PageAttributes, const PageData&, uint32_t generation);
+		void install_mapped_page(address_t pageno, PageAttributes, PageData*, uint32_t generation);
+		// unmaps the snapshot files no page refers to anymore
+		void release_snapshot_mappings();
+		Page* find_page(address_t pageno) noexcept;
+		const Page* find_page(address_t pageno) const noexcept;
+		void index_page(address_t pageno, Page* page) noexcept {
+			if (m_page_table.covers(pageno)) m_page_table.set(pageno, page);
+		}
 		[[noreturn]] static void protection_fault(address_t);
+		// A host fault in the guarded arena is recorded by the signal
+		// handler, which lets the access complete on a stand-in page.
+		// The access then raises it as a guest exception.
+		void check_guarded_fault() const {
+			std::atomic_signal_fence(std::memory_order_seq_cst);
+			if (UNLIKELY(m_guarded_fault.load(std::memory_order_relaxed)))
+				raise_guarded_fault();
+		}
+		[[noreturn]] void raise_guarded_fault() const;
+		void restore_guarded_pages() const;
 		const PageData& cached_readable_page(address_t, size_t) const;
 		PageData& cached_writable_page(address_t);
 		// Helpers
@@ -231,15 +389,29 @@ namespace riscv
 		void serialize_execute_segment(const MachineOptions<W>&, const Phdr*);
 		bool serialize_pages(MemoryArea&, address_t, const char*, size_t, PageAttributes);
 		void generate_decoder_cache(const MachineOptions<W>&, DecodedExecuteSegment<W>&);
+		void index_execute_segment();
+		size_t exec_segment_index(address_t vaddr) const;
 		// Machine copy-on-write fork
 		void machine_loader(const Machine<W>&, const MachineOptions<W>&);
+		void loan_page(address_t pageno, PageAttributes, PageData*, const std::shared_ptr<PageData>&);
+		void loan_arena_page(const Memory<W>& master, address_t pageno);
+		void share_page(address_t pageno, Page& page);
+		void load_shared_page(const SharedForkState<W>&, address_t pageno);
+		// Forks remember the pages they have changed, for reset_to(),
+		// and published masters the pages changed since publishing.
+		void mark_dirty(address_t pageno) {
+			if (!m_original_machine || m_published != nullptr)
+				m_dirty_pages.push_back(pageno);
+		}
 
 		Machine<W>& m_machine;
 
-		mutable CachedPage<W, const PageData> m_rd_cache;
-		mutable CachedPage<W, PageData> m_wr_cache;
+		mutable PageCache<W, const PageData> m_rd_cache;
+		mutable PageCache<W, PageData> m_wr_cache;
+		mutable PageCacheStats m_cache_stats;
 
 		std::unordered_map<address_t, Page> m_pages;
+		FlatPageTable<W> m_page_table;
 
 		page_fault_cb_t m_page_fault_handler = nullptr;
 		page_write_cb_t m_page_write_handler = default_page_write;
@@ -256,15 +428,61 @@ namespace riscv
 
 		const std::string_view m_binary;
 
-		// Execute segments
-		std::vector<DecodedExecuteSegment<W>> m_exec;
+		// Pages changed (or created) by a fork since it was created,
+		// or by a master since it last published its state
+		std::vector<address_t> m_dirty_pages;
+		// Pages were removed without being marked dirty
+		bool m_all_pages_dirty = false;
+		// State published for shared forks, replaced under the mutex
+		// by the master only, and read by forks under the mutex
+		std::shared_ptr<const SharedForkState<W>> m_published = nullptr;
+		mutable std::mutex m_published_mtx;
+		// Shared forks keep what they were created from alive
+		std::shared_ptr<const SharedForkState<W>> m_fork_source = nullptr;
+		// Snapshot generation given to changed pages. Serializing
+		// starts a new generation.
+		mutable uint32_t m_generation = 1;
+		// See snapshot_state()
+		mutable uint32_t m_snapshot_state = 0;
+		// Generation where each page was freed, for delta snapshots
+		std::unordered_map<address_t, uint32_t> m_freed_pages;
+		// Flat arena accesses bypass pages, so the generation of each
+		// arena page is kept here, see sync_arena_generations().
+		mutable std::unique_ptr<uint32_t[]> m_arena_generations = nullptr;
+		// Snapshot files mapped by deserialize_mapped(), with their sizes
+		std::vector<std::pair<void*, size_t>> m_snapshot_mappings;
+
+		// Execute segments, possibly shared with other machines, and
+		// the lookup each of them was last found by, for eviction
+		std::vector<std::shared_ptr<DecodedExecuteSegment<W>>> m_exec;
+		std::vector<uint64_t> m_exec_last_used;
+		// Positions in m_exec, sorted by the begin address of their
+		// segment. Only searched with more than EXECUTE_SEGMENT_SCAN_MAX.
+		struct ExecuteSegmentEntry {
+			address_t begin;
+			address_t end;
+			size_t exec;
+		};
+		std::vector<ExecuteSegmentEntry> m_exec_index;
+		static constexpr size_t EXECUTE_SEGMENT_SCAN_MAX = 16;
+		uint64_t m_exec_lookups = 0;
+		size_t m_max_exec_segments = 0;
+		// Evicted execute segments, see ExecuteSegmentsInUse
+		std::vector<std::shared_ptr<DecodedExecuteSegment<W>>> m_exec_retired;
+		unsigned m_exec_users = 0;
 
 		// Linear arena at start of memory (mmap-backed)
 		PageData* m_arena = nullptr;
 		size_t m_arena_pages = 0;
+		uint64_t m_flat_boundary = 0;
+		mutable struct ArenaWrites* m_arena_writes = nullptr;
+		struct GuardedArena* m_guarded_arena = nullptr;
+		bool m_guarded_flat = false;
+		mutable std::atomic<bool> m_guarded_fault {false};
 
 #ifdef RISCV_BINARY_TRANSLATION
 		mutable void* m_bintr_dl = nullptr;
+		mutable std::shared_ptr<BackgroundTranslation> m_bintr_background = nullptr;
 #endif
 	};
 #include "memory_inline.hpp"
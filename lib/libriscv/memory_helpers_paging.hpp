@@ -17,20 +17,25 @@ void Memory<W>::memzero(address_t dst, size_t len)
 		const address_t pageno = page_number(dst);
 		// We only use the page table now because we have previously
 		// checked special regions.
-		auto it = m_pages.find(pageno);
+		Page* found = find_page(pageno);
 		// If we don't find a page, we can treat it as a CoW zero page
-		if (it != m_pages.end()) {
-			Page& page = it->second;
+		if (found != nullptr) {
+			Page& page = *found;
 			if (page.attr.is_cow) {
+				[[maybe_unused]] const typename CPU<W>::CallbackRegisters regs {m_machine.cpu};
 				m_page_write_handler(*this, pageno, page);
+				this->mark_dirty(pageno);
+				this->invalidate_cache(pageno, &page);
 			}
 			if (page.attr.write) {
+				page.m_generation = m_generation;
 				// Zero the existing writable page
 				std::memset(page.data() + offset, 0, size);
 			} else {
 				this->protection_fault(dst);
 			}
 		} else {
+			[[maybe_unused]] const typename CPU<W>::CallbackRegisters regs {m_machine.cpu};
 			// Check if the page being read is known to be all zeroes
 			const Page& page = m_page_readf_handler(*this, pageno);
 			// If not, the page fault gives us a new blank page.
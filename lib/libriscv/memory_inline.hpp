@@ -11,6 +11,14 @@ template <int W>
 template <typename T> inline
 T Memory<W>::read(address_t address)
 {
+	if constexpr (flat_memory_enabled) {
+		if (LIKELY(is_flat_address(address))) {
+			const T value = *(T*) &((uint8_t*)m_arena)[address];
+			if constexpr (W == 4 && guarded_arena_enabled)
+				check_guarded_fault();
+			return value;
+		}
+	}
 	const auto offset = address & memory_align_mask<T>();
 	if constexpr (unaligned_memory_slowpaths) {
 		if (UNLIKELY(offset+sizeof(T) > Page::size())) {
@@ -27,6 +35,12 @@ template <int W>
 template <typename T> inline
 T& Memory<W>::writable_read(address_t address)
 {
+	// The reference escapes the fault check of a guarded arena,
+	// so the pages are used instead
+	if constexpr (flat_memory_enabled && !(W == 4 && guarded_arena_enabled)) {
+		if (LIKELY(is_flat_address(address)))
+			return *(T*) &((uint8_t*)m_arena)[address];
+	}
 	auto& pagedata = cached_writable_page(address);
 	return pagedata.template aligned_read<T>(address & memory_align_mask<T>());
 }
@@ -35,6 +49,14 @@ template <int W>
 template <typename T> inline
 void Memory<W>::write(address_t address, T value)
 {
+	if constexpr (flat_memory_enabled) {
+		if (LIKELY(is_flat_address(address))) {
+			*(T*) &((uint8_t*)m_arena)[address] = value;
+			if constexpr (W == 4 && guarded_arena_enabled)
+				check_guarded_fault();
+			return;
+		}
+	}
 	const auto offset = address & memory_align_mask<T>();
 	if constexpr (unaligned_memory_slowpaths) {
 		if (UNLIKELY(offset+sizeof(T) > Page::size())) {
@@ -43,17 +65,20 @@ void Memory<W>::write(address_t address, T value)
 		}
 	}
 	const auto pageno = page_number(address);
-	auto& entry = m_wr_cache;
+	auto& entry = m_wr_cache.entry(pageno);
 	if (entry.pageno == pageno) {
+		if constexpr (page_cache_stats_enabled) m_cache_stats.write_hits++;
 		entry.page->template aligned_write<T>(offset, value);
 		return;
 	}
+	if constexpr (page_cache_stats_enabled) m_cache_stats.write_misses++;
 
 	auto& page = create_writable_pageno(pageno);
 	if (LIKELY(page.attr.is_cacheable())) {
 		entry = {pageno, &page.page()};
 	} else if constexpr (memory_traps_enabled && sizeof(T) <= 16) {
 		if (UNLIKELY(page.has_trap())) {
+			[[maybe_unused]] const typename CPU<W>::CallbackRegisters regs {m_machine.cpu};
 			page.trap(offset, sizeof(T) | TRAP_WRITE, value);
 			return;
 		}
@@ -3,15 +3,19 @@ template <int W> inline
 const PageData& Memory<W>::cached_readable_page(address_t address, size_t len) const
 {
 	const auto pageno = page_number(address);
-	auto& entry = m_rd_cache;
-	if (entry.pageno == pageno)
+	auto& entry = m_rd_cache.entry(pageno);
+	if (entry.pageno == pageno) {
+		if constexpr (page_cache_stats_enabled) m_cache_stats.read_hits++;
 		return *entry.page;
+	}
+	if constexpr (page_cache_stats_enabled) m_cache_stats.read_misses++;
 
 	auto& page = get_readable_pageno(pageno);
 	if (LIKELY(page.attr.is_cacheable())) {
 		entry = {pageno, &page.page()};
 	} else if constexpr (memory_traps_enabled) {
 		if (UNLIKELY(page.has_trap())) {
+			[[maybe_unused]] const typename CPU<W>::CallbackRegisters regs {m_machine.cpu};
 			page.trap(address & (Page::size()-1), len | TRAP_READ, 0);
 		}
 	}
@@ -22,9 +26,13 @@ template <int W> inline
 PageData& Memory<W>::cached_writable_page(address_t address)
 {
 	const auto pageno = page_number(address);
-	auto& entry = m_wr_cache;
-	if (entry.pageno == pageno)
+	auto& entry = m_wr_cache.entry(pageno);
+	if (entry.pageno == pageno) {
+		if constexpr (page_cache_stats_enabled) m_cache_stats.write_hits++;
 		return *entry.page;
+	}
+	if constexpr (page_cache_stats_enabled) m_cache_stats.write_misses++;
+
 	auto& page = create_writable_pageno(pageno);
 	if (LIKELY(page.attr.is_cacheable()))
 		entry = {pageno, &page.page()};
@@ -45,9 +53,8 @@ inline const Page& Memory<W>::get_exec_pageno(const address_t pageno) const
 		return m_ropages.pages[pageno - m_ropages.begin];
 	}
 
-	auto it = m_pages.find(pageno);
-	if (LIKELY(it != m_pages.end())) {
-		return it->second;
+	if (const auto* page = find_page(pageno); LIKELY(page != nullptr)) {
+		return *page;
 	}
 	CPU<W>::trigger_exception(EXECUTION_SPACE_PROTECTION_FAULT, pageno * Page::size());
 }
@@ -55,34 +62,53 @@ inline const Page& Memory<W>::get_exec_pageno(const address_t pageno) const
 template <int W>
 inline const Page& Memory<W>::get_pageno(const address_t pageno) const
 {
-	auto it = m_pages.find(pageno);
-	if (LIKELY(it != m_pages.end())) {
-		return it->second;
+	if (const auto* page = find_page(pageno); LIKELY(page != nullptr)) {
+		return *page;
 	}
 
 	if (m_ropages.contains(pageno)) {
 		return m_ropages.pages[pageno - m_ropages.begin];
 	}
 
+	if constexpr (flat_memory_enabled) {
+		// Flat stores don't create pages, so page-based readers
+		// must see the arena page that may have been written to.
+		if (pageno < m_arena_pages)
+			return const_cast<Memory<W>*> (this)->allocate_arena_page(pageno);
+	}
+
+	[[maybe_unused]] const typename CPU<W>::CallbackRegisters regs {m_machine.cpu};
 	return m_page_readf_handler(*this, pageno);
 }
 
+template <int W>
+inline Page* Memory<W>::find_page(const address_t pageno) noexcept
+{
+	if (m_page_table.covers(pageno))
+		return m_page_table.get(pageno);
+	auto it = m_pages.find(pageno);
+	return (it != m_pages.end()) ? &it->second : nullptr;
+}
+template <int W>
+inline const Page* Memory<W>::find_page(const address_t pageno) const noexcept
+{
+	return const_cast<Memory<W>*> (this)->find_page(pageno);
+}
+
 template <int W> inline void
 Memory<W>::invalidate_cache(address_t pageno, Page* page) const
 {
-	// NOTE: It is only possible to keep the write page as long as
-	// the page tables are node-based. In that case, we only have
-	// to invalidate the read page when it matches.
-	if (m_rd_cache.pageno == pageno) {
-		m_rd_cache.pageno = (address_t)-1;
-	}
+	// Both entries must go, as the page may have changed data
+	// or lost its permissions (eg. set_page_attr).
+	m_rd_cache.invalidate(pageno);
+	m_wr_cache.invalidate(pageno);
 	(void)page;
 }
 template <int W> inline void
 Memory<W>::invalidate_reset_cache() const
 {
-	m_rd_cache.pageno = (address_t)-1;
-	m_wr_cache.pageno = (address_t)-1;
+	m_rd_cache.reset();
+	m_wr_cache.reset();
 }
 
 template <int W>
@@ -93,18 +119,33 @@ Page& Memory<W>::allocate_page(const address_t page, Args&&... args)
 		std::forward_as_tuple(page),
 		std::forward_as_tuple(std::forward<Args> (args)...)
 	);
+	this->index_page(page, &it.first->second);
+	this->mark_dirty(page);
+	it.first->second.m_generation = m_generation;
 	// Invalidate only this page
 	this->invalidate_cache(page, &it.first->second);
 	// Return new default-writable page
 	return it.first->second;
 }
 
+template <int W>
+inline Page& Memory<W>::allocate_arena_page(const address_t pageno)
+{
+	const PageAttributes attr {
+		.read  = true,
+		.write = true,
+		.non_owning = true
+	};
+	this->commit_arena_page(pageno);
+	return this->allocate_page(pageno, attr, &m_arena[pageno]);
+}
+
 template <int W>
 inline size_t Memory<W>::owned_pages_active() const noexcept
 {
 	size_t count = 0;
 	for (const auto& it : m_pages) {
-		if (!it.second.attr.non_owning) count++;
+		if (!it.second.attr.non_owning || it.second.is_shared()) count++;
 	}
 	return count;
 }
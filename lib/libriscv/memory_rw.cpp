@@ -14,13 +14,22 @@ namespace riscv
 	template <int W>
 	Page& Memory<W>::create_writable_pageno(const address_t pageno, bool init)
 	{
-		auto it = m_pages.find(pageno);
-		if (LIKELY(it != m_pages.end())) {
-			Page& page = it->second;
+		if (m_flat_boundary != 0 && pageno < m_arena_pages)
+			this->arena_page_written(pageno);
+		if (Page* found = find_page(pageno); LIKELY(found != nullptr)) {
+			Page& page = *found;
+			// Writable page caches are reset on each snapshot,
+			// so that page writes come through here again.
+			page.m_generation = m_generation;
 			if (LIKELY(page.attr.write)) {
 				return page;
 			} else if (page.attr.is_cow) {
+				[[maybe_unused]] const typename CPU<W>::CallbackRegisters regs {m_machine.cpu};
 				m_page_write_handler(*this, pageno, page);
+				page.m_generation = m_generation;
+				this->mark_dirty(pageno);
+				// The read cache may still point to the old page data
+				this->invalidate_cache(pageno, &page);
 				return page;
 			}
 		} else {
@@ -30,7 +39,9 @@ namespace riscv
 			}
 
 			// Handler must produce a new page, or throw
+			[[maybe_unused]] const typename CPU<W>::CallbackRegisters regs {m_machine.cpu};
 			Page& page = m_page_fault_handler(*this, pageno, init);
+			page.m_generation = m_generation;
 			if (LIKELY(page.attr.write)) {
 				this->invalidate_cache(pageno, &page);
 				return page;
@@ -42,6 +53,12 @@ namespace riscv
 	template <int W>
 	bool Memory<W>::free_pageno(address_t pageno)
 	{
+		this->index_page(pageno, nullptr);
+		this->invalidate_cache(pageno, nullptr);
+		this->mark_dirty(pageno);
+		// Remember freed pages once snapshots are being made
+		if (m_generation > 1)
+			m_freed_pages[pageno] = m_generation;
 		return m_pages.erase(pageno) != 0;
 	}
 
@@ -50,13 +67,12 @@ namespace riscv
 	{
 		address_t pageno = page_number(dst);
 		address_t end = pageno + (len /= Page::size());
+		this->release_arena_pages(pageno, len);
 		while (pageno < end)
 		{
 			this->free_pageno(pageno);
 			pageno ++;
 		}
-		// TODO: This can be improved by invalidating matches only
-		this->invalidate_reset_cache();
 	}
 
 	template <int W>
@@ -129,16 +145,22 @@ namespace riscv
 		attr.non_owning = true;
 		// NOTE: If you insert a const Page, DON'T modify it! The machine
 		// won't, unless system-calls do or manual intervention happens!
+		auto* data = const_cast<PageData*> (shared_page.m_page.get());
+		// Flat accesses read the arena, not the page
+		if (data != nullptr && pageno < m_flat_boundary / Page::size())
+			data = this->copy_to_arena_page(pageno, *data);
 		auto res = m_pages.emplace(std::piecewise_construct,
 			std::forward_as_tuple(pageno),
-			std::forward_as_tuple(attr, const_cast<PageData*> (shared_page.m_page.get()))
+			std::forward_as_tuple(attr, data)
 		);
-		// TODO: Can be improved by invalidating more intelligently
-		this->invalidate_reset_cache();
+		this->index_page(pageno, &res.first->second);
+		this->invalidate_cache(pageno, &res.first->second);
+		this->mark_dirty(pageno);
+		this->protect_arena_page(pageno, attr);
 		// try overwriting instead, if emplace failed
 		if (res.second == false) {
 			Page& page = res.first->second;
-			new (&page) Page{attr, const_cast<PageData*> (shared_page.m_page.get())};
+			new (&page) Page{attr, data};
 			return page;
 		}
 		return res.first->second;
@@ -151,18 +173,23 @@ namespace riscv
 		assert(dst % Page::size() == 0);
 		assert((dst + size) % Page::size() == 0);
 		attr.non_owning = true;
+		if (UNLIKELY(size > 0 && dst < m_flat_boundary))
+			throw MachineException(ILLEGAL_OPERATION,
+				"Non-owned memory can not be inserted into the flat arena", dst);
 
 		for (size_t i = 0; i < size; i += Page::size())
 		{
 			const auto pageno = (dst + i) / Page::size();
 			PageData* pdata = reinterpret_cast<PageData*> ((char*) src + i);
-			m_pages.emplace(std::piecewise_construct,
+			auto res = m_pages.emplace(std::piecewise_construct,
 				std::forward_as_tuple(pageno),
 				std::forward_as_tuple(attr, pdata)
 			);
+			this->index_page(pageno, &res.first->second);
+			this->invalidate_cache(pageno, &res.first->second);
+			this->mark_dirty(pageno);
+			this->protect_arena_page(pageno, attr);
 		}
-		// TODO: Can be improved by invalidating more intelligently
-		this->invalidate_reset_cache();
 	}
 
 	template <int W> void
@@ -173,9 +200,8 @@ namespace riscv
 		{
 			const size_t size = std::min(Page::size(), len);
 			const address_t pageno = page_number(dst);
-			auto it = pages().find(pageno);
-			if (it != pages().end()) {
-				auto& page = it->second;
+			if (Page* found = find_page(pageno); found != nullptr) {
+				auto& page = *found;
 				if (page.is_cow_page()) {
 					// The special zero-CoW page is an internal optimization
 					// We can ignore the page if the default attrs apply.
@@ -188,6 +214,9 @@ namespace riscv
 					// There is a page there, however, we must
 					// keep non_owning as-is.
 					page.attr.apply_regular_attributes(options);
+					page.m_generation = m_generation;
+					// Shared page data must never be written to
+					if (page.is_shared()) page.share();
 				}
 			} else {
 				// If the page was not found, it was likely (also) the
@@ -196,6 +225,10 @@ namespace riscv
 					this->create_writable_pageno(pageno).
 						attr.apply_regular_attributes(options);
 			}
+			// Cached entries may have the old permissions
+			this->invalidate_cache(pageno, nullptr);
+			this->mark_dirty(pageno);
+			this->protect_arena_page(pageno, options);
 
 			dst += size;
 			len -= size;
@@ -218,13 +251,21 @@ namespace riscv
 			total += sizeof(page);
 				// Regular owned page
 			if ((!page.attr.non_owning && page.has_data()) ||
+				// Shared page
+				page.is_shared() ||
 				// Arena page
-				(page.attr.non_owning && page_number < m_arena_pages))
+				this->is_arena_page(page_number, page))
 					total += Page::size();
 		}
 
+		total += m_page_table.size_bytes();
+
 		for (const auto& exec : m_exec) {
-			total += exec.size_bytes();
+			total += exec->size_bytes();
+		}
+		// Evicted segments that running simulations still hold
+		for (const auto& exec : m_exec_retired) {
+			total += exec->size_bytes();
 		}
 
 		return total;
@@ -52,6 +52,9 @@ bool Machine<W>::multiprocess(unsigned num_cpus, uint64_t maxi,
 	const uint64_t stackpage = Memory<W>::page_number(stack);
 	const uint64_t stackendpage = Memory<W>::page_number(stack + stksize);
 	smp().failures = 0x0;
+	// Workers fork from this machine concurrently
+	if (auto* exec = cpu.current_execute_segment(); exec != nullptr)
+		exec->decode_all();
 
 	// Create worker 1...N
 	std::vector<std::function<void()>> tasks;
@@ -4,9 +4,12 @@
 //
 #pragma once
 #include "common.hpp"
+#include <array>
 #include <cstddef>
 #include <cassert>
 #include <deque>
+#include <set>
+#include <unordered_map>
 #include "util/function.hpp"
 
 namespace riscv
@@ -26,9 +29,10 @@ struct ArenaChunk
 	size_t size = 0;
 	bool   free = false;
 	PointerType data = 0;
+	// Free chunks in a small size-class bin are linked together
+	ArenaChunk* bin_next = nullptr;
+	ArenaChunk* bin_prev = nullptr;
 
-	ArenaChunk* find(PointerType ptr);
-	ArenaChunk* find_free(size_t size);
 	void merge_next(Arena&);
 	void split_next(Arena&, size_t size);
 	void subsume_next(Arena&, size_t extra);
@@ -37,6 +41,10 @@ struct ArenaChunk
 struct Arena
 {
 	static constexpr size_t ALIGNMENT = 8u;
+	// Free chunks up to this size are kept in exact size-class bins,
+	// while larger free chunks are kept in a best-fit tree.
+	static constexpr size_t SMALL_BINS = 64u;
+	static constexpr size_t SMALL_MAX  = SMALL_BINS * ALIGNMENT;
 	using PointerType = ArenaChunk::PointerType;
 	using ReallocResult = std::tuple<PointerType, size_t>;
 	using unknown_realloc_func_t = Function<ReallocResult(PointerType, size_t)>;
@@ -73,6 +81,7 @@ struct Arena
 	ArenaChunk* new_chunk(Args&&... args);
 	void   free_chunk(ArenaChunk*);
 	ArenaChunk* find_chunk(PointerType ptr);
+	ArenaChunk* find_any_chunk(PointerType ptr);
 
 	static size_t word_align(size_t size) {
 		return (size + (ALIGNMENT-1)) & ~(ALIGNMENT-1);
@@ -82,6 +91,26 @@ struct Arena
 		return std::max(ALIGNMENT, word_align(size));
 	}
 private:
+	struct LargeChunkOrder {
+		using is_transparent = void;
+		bool operator() (const ArenaChunk* a, const ArenaChunk* b) const noexcept {
+			return a->size < b->size || (a->size == b->size && a->data < b->data);
+		}
+		bool operator() (const ArenaChunk* a, size_t size) const noexcept {
+			return a->size < size;
+		}
+		bool operator() (size_t size, const ArenaChunk* b) const noexcept {
+			return size < b->size;
+		}
+	};
+	static size_t bin_index(size_t size) noexcept {
+		return size / ALIGNMENT - 1;
+	}
+	ArenaChunk* find_free(size_t size);
+	void insert_free(ArenaChunk*);
+	void remove_free(ArenaChunk*);
+	PointerType allocate(ArenaChunk*, size_t size);
+	void rebuild_index();
 	void internal_free(ArenaChunk* ch);
 	void foreach(Function<void(const ArenaChunk&)>) const;
 
@@ -89,34 +118,18 @@ private:
 	std::vector<ArenaChunk*> m_free_chunks;
 	ArenaChunk  m_base_chunk;
 
+	// Allocated chunks by their data pointer
+	std::unordered_map<PointerType, ArenaChunk*> m_used;
+	std::array<ArenaChunk*, SMALL_BINS> m_bins {};
+	uint64_t m_bin_bitmap = 0;
+	std::set<ArenaChunk*, LargeChunkOrder> m_large;
+
 	unknown_free_func_t m_free_unknown_chunk
 		= [] (auto, auto*) { return -1; };
 	unknown_realloc_func_t m_realloc_unknown_chunk
 		= [] (auto, auto) { return ReallocResult{0, 0}; };
 };
 
-// find exact free chunk that matches ptr
-inline ArenaChunk* ArenaChunk::find(PointerType ptr)
-{
-	ArenaChunk* ch = this;
-	while (ch != nullptr) {
-		if (!ch->free && ch->data == ptr)
-			return ch;
-		ch = ch->next;
-	}
-	return nullptr;
-}
-// find free chunk that has at least given size
-inline ArenaChunk* ArenaChunk::find_free(size_t size)
-{
-    ArenaChunk* ch = this;
-	while (ch != nullptr) {
-		if (ch->free && ch->size >= size)
-			return ch;
-		ch = ch->next;
-	}
-	return nullptr;
-}
 // merge this and next into this chunk
 inline void ArenaChunk::merge_next(Arena& arena)
 {
@@ -186,35 +199,101 @@ inline void Arena::free_chunk(ArenaChunk* chunk)
 }
 inline ArenaChunk* Arena::find_chunk(PointerType ptr)
 {
-	for (auto& chunk : m_chunks) {
-		if (!chunk.free && chunk.data == ptr)
-			return &chunk;
+	auto it = m_used.find(ptr);
+	return (it != m_used.end()) ? it->second : nullptr;
+}
+// slow-path lookup that also finds free chunks, which are not indexed by pointer
+inline ArenaChunk* Arena::find_any_chunk(PointerType ptr)
+{
+	for (ArenaChunk* ch = &m_base_chunk; ch != nullptr && ch->data <= ptr; ch = ch->next) {
+		if (ch->data == ptr)
+			return ch;
 	}
 	return nullptr;
 }
 
+inline void Arena::insert_free(ArenaChunk* ch)
+{
+	if (UNLIKELY(ch->size == 0))
+		return;
+	if (ch->size <= SMALL_MAX) {
+		const size_t idx = bin_index(ch->size);
+		ch->bin_prev = nullptr;
+		ch->bin_next = m_bins[idx];
+		if (ch->bin_next)
+			ch->bin_next->bin_prev = ch;
+		m_bins[idx] = ch;
+		m_bin_bitmap |= uint64_t(1) << idx;
+	} else {
+		m_large.insert(ch);
+	}
+}
+inline void Arena::remove_free(ArenaChunk* ch)
+{
+	if (UNLIKELY(ch->size == 0))
+		return;
+	if (ch->size <= SMALL_MAX) {
+		const size_t idx = bin_index(ch->size);
+		if (ch->bin_prev)
+			ch->bin_prev->bin_next = ch->bin_next;
+		else
+			m_bins[idx] = ch->bin_next;
+		if (ch->bin_next)
+			ch->bin_next->bin_prev = ch->bin_prev;
+		if (m_bins[idx] == nullptr)
+			m_bin_bitmap &= ~(uint64_t(1) << idx);
+	} else {
+		m_large.erase(ch);
+	}
+}
+// find the smallest free chunk that has at least given size
+inline ArenaChunk* Arena::find_free(size_t size)
+{
+	if (size <= SMALL_MAX) {
+		const uint64_t candidates = m_bin_bitmap & (~uint64_t(0) << bin_index(size));
+		if (candidates != 0)
+			return m_bins[__builtin_ctzll(candidates)];
+	}
+	auto it = m_large.lower_bound(size);
+	return (it != m_large.end()) ? *it : nullptr;
+}
+// carve an allocation of given size from the start of a free chunk
+inline Arena::PointerType Arena::allocate(ArenaChunk* ch, size_t size)
+{
+	remove_free(ch);
+	if (ch->size > size) {
+		ch->split_next(*this, size);
+		insert_free(ch->next);
+	}
+	ch->free = false;
+	m_used.emplace(ch->data, ch);
+	return ch->data;
+}
+
 inline void Arena::internal_free(ArenaChunk* ch)
 {
+	m_used.erase(ch->data);
 	ch->free = true;
 	// merge chunks ahead and behind us
 	if (ch->next && ch->next->free) {
+		remove_free(ch->next);
 		ch->merge_next(*this);
 	}
 	if (ch->prev && ch->prev->free) {
 		ch = ch->prev;
+		remove_free(ch);
 		ch->merge_next(*this);
 	}
+	insert_free(ch);
 }
 
 inline Arena::PointerType Arena::malloc(size_t size)
 {
 	const size_t length = fixup_size(size);
-	ArenaChunk* ch = base_chunk().find_free(length);
+	ArenaChunk* ch = find_free(length);
 
 	if (ch != nullptr) {
-		ch->split_next(*this, length);
-		ch->free = false;
-		return ch->data;
+		return allocate(ch, length);
 	}
 	return 0;
 }
@@ -234,7 +313,7 @@ inline Arena::PointerType Arena::seq_alloc_aligned(size_t size, size_t alignment
 	const size_t oversized = fixup_size(size * 2);
 
 	// Find memory that can always cover the object sequentially
-	ArenaChunk* ch = base_chunk().find_free(oversized);
+	ArenaChunk* ch = find_free(oversized);
 
 	if (ch != nullptr) {
 		// XXX: Assume that alignment of data is OK
@@ -244,26 +323,20 @@ inline Arena::PointerType Arena::seq_alloc_aligned(size_t size, size_t alignment
 		{
 			// The second page boundary
 			PointerType boundary = (ch->data + size) & ~(RISCV_PAGE_SIZE-1);
-			// Split at the page boundary
+			// Split at the page boundary, leaving the
+			// data before the boundary free
+			remove_free(ch);
 			ch->split_next(*this, boundary - ch->data);
+			insert_free(ch);
+			insert_free(ch->next);
 
 			// The data after the page boundary is usable,
 			// but it must be split to the object size
-			auto* final_ch = ch->next;
-			final_ch->free = false;
-
-			// Free the data before the boundary
-			this->internal_free(ch);
-
-			// XXX: Always split?
-			final_ch->split_next(*this, objectsize);
-			return final_ch->data;
+			return allocate(ch->next, objectsize);
 		}
 		else
 		{
-			ch->split_next(*this, objectsize);
-			ch->free = false;
-			return ch->data;
+			return allocate(ch, objectsize);
 		}
 	}
 	return 0;
@@ -275,8 +348,8 @@ inline Arena::ReallocResult
 	if (ptr == 0x0) // Regular malloc
 		return {malloc(newsize), 0};
 
-	ArenaChunk* ch = base_chunk().find(ptr);
-	if (UNLIKELY(ch == nullptr || ch->free)) {
+	ArenaChunk* ch = find_chunk(ptr);
+	if (UNLIKELY(ch == nullptr)) {
 		// Realloc failure handler
 		return m_realloc_unknown_chunk(ptr, newsize);
 	}
@@ -288,10 +361,13 @@ inline Arena::ReallocResult
 	// We return the old length to aid memcpy
 	const size_t old_len = ch->size;
 	// Try to eat from the next chunk
-	if (ch->next && ch->next->free) {
+	ArenaChunk* next = ch->next;
+	if (next && next->free && ch->size + next->size >= newsize) {
+		remove_free(next);
 		ch->subsume_next(*this, newsize);
-		if (ch->size >= newsize)
-			return {ch->data, 0};
+		if (ch->next == next)
+			insert_free(next);
+		return {ch->data, 0};
 	}
 
 	// Fallback to malloc, then free the old chunk
@@ -306,17 +382,21 @@ inline Arena::ReallocResult
 
 inline size_t Arena::size(PointerType ptr, bool allow_free)
 {
-	ArenaChunk* ch = base_chunk().find(ptr);
-	if (UNLIKELY(ch == nullptr || (ch->free && !allow_free)))
-		return 0;
+	ArenaChunk* ch = find_chunk(ptr);
+	if (UNLIKELY(ch == nullptr)) {
+		if (allow_free)
+			ch = find_any_chunk(ptr);
+		if (ch == nullptr)
+			return 0;
+	}
 	return ch->size;
 }
 
 inline int Arena::free(PointerType ptr)
 {
-	ArenaChunk* ch = base_chunk().find(ptr);
-	if (UNLIKELY(ch == nullptr || ch->free))
-		return m_free_unknown_chunk(ptr, ch);
+	ArenaChunk* ch = find_chunk(ptr);
+	if (UNLIKELY(ch == nullptr))
+		return m_free_unknown_chunk(ptr, find_any_chunk(ptr));
 
 	this->internal_free(ch);
 	return 0;
@@ -327,6 +407,7 @@ inline Arena::Arena(PointerType arena_base, PointerType arena_end)
 	m_base_chunk.size = arena_end - arena_base;
 	m_base_chunk.data = arena_base;
 	m_base_chunk.free = true;
+	insert_free(&m_base_chunk);
 }
 
 inline void Arena::foreach(Function<void(const ArenaChunk&)> callback) const
@@ -381,6 +462,22 @@ inline void Arena::transfer(Arena& dest) const
 
 		chunk = chunk->next;
 	}
+	dest.rebuild_index();
+}
+
+inline void Arena::rebuild_index()
+{
+	m_used.clear();
+	m_bins.fill(nullptr);
+	m_bin_bitmap = 0;
+	m_large.clear();
+
+	for (ArenaChunk* ch = &m_base_chunk; ch != nullptr; ch = ch->next) {
+		if (!ch->free)
+			m_used.emplace(ch->data, ch);
+		else
+			insert_free(ch);
+	}
 }
 
 } // namespace riscv
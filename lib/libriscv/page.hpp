@@ -1,6 +1,7 @@
 #pragma once
 #include "common.hpp"
 #include "types.hpp"
+#include <atomic>
 #include <cassert>
 #include <memory>
 #include <array>
@@ -80,10 +81,13 @@ struct Page
 	Page(const PageAttributes& a, const PageData& d = {})
 		: attr(a), m_page(new PageData{d}) { attr.non_owning = false; }
 	Page(Page&& other) noexcept
-		: attr(other.attr), m_page(std::move(other.m_page)) {}
+		: attr(other.attr), m_generation(other.m_generation),
+		  m_page(std::move(other.m_page)), m_shared(std::move(other.m_shared)) {}
 	Page& operator= (Page&& other) noexcept {
 		attr = other.attr;
+		m_generation = other.m_generation;
 		m_page = std::move(other.m_page);
+		m_shared = std::move(other.m_shared);
 		return *this;
 	}
 	// create a page that doesn't own this memory
@@ -120,6 +124,15 @@ struct Page
 	/* Transform a CoW-page to an owned writable page */
 	void make_writable()
 	{
+		if (m_shared != nullptr && m_shared.use_count() == 1)
+		{
+			// Nobody else holds on to the shared data any longer (like
+			// a finished snapshot writer), so it is written in place
+			std::atomic_thread_fence(std::memory_order_acquire);
+			attr.write = true;
+			attr.is_cow = false;
+			return;
+		}
 		if (m_page != nullptr)
 		{
 			auto* new_data = new PageData {*m_page};
@@ -128,24 +141,38 @@ struct Page
 		} else {
 			m_page.reset(new PageData {});
 		}
+		m_shared = nullptr;
 		attr.write = true;
 		attr.is_cow = false;
 		attr.non_owning = false;
 	}
 
 	// Loan a page from somewhere else, that will not be
-	// deleted here. There is no ref-counting mechanism, and
-	// the memory is ultimately owned by the master page.
+	// deleted here. Unless the master page is shared, there
+	// is no ref-counting mechanism, and the memory is
+	// ultimately owned by the master page.
 	void loan(const Page& master_page) {
 		this->attr = master_page.attr;
 		this->attr.non_owning = true;
 		this->m_page.reset(master_page.m_page.get());
+		this->m_shared = master_page.m_shared;
 	}
 
+	// Move owned page data into shared (reference-counted)
+	// ownership, and make the page copy-on-write. Pages that
+	// don't own their data can not be shared.
+	bool share();
+	bool is_shared() const noexcept { return m_shared != nullptr; }
+
 	// this combination has been benchmarked to be faster than
 	// page-aligning the PageData struct and putting it first
 	PageAttributes attr;
+	// Snapshot generation of the latest change to the page
+	// (see Machine::serialize_delta_since)
+	uint32_t m_generation = 0;
 	std::unique_ptr<PageData> m_page;
+	// Keeps shared page data alive, while m_page is non-owning
+	std::shared_ptr<PageData> m_shared;
 
 	bool has_trap() const noexcept { return m_trap != nullptr; }
 	// NOTE: Setting a trap makes the page uncacheable
@@ -169,9 +196,26 @@ inline void Page::new_data(PageData* data, bool data_owned)
 	if (this->attr.non_owning)
 		this->m_page.release();
 	this->m_page.reset(data);
+	this->m_shared = nullptr;
 	this->attr.non_owning = !data_owned;
 }
 
+inline bool Page::share()
+{
+	if (m_shared == nullptr) {
+		if (attr.non_owning || m_page == nullptr)
+			return false;
+		this->m_shared.reset(m_page.get());
+		this->attr.non_owning = true;
+	}
+	// Writes must now go through copy-on-write
+	if (attr.write) {
+		attr.write = false;
+		attr.is_cow = true;
+	}
+	return true;
+}
+
 inline void Page::trap(uint32_t offset, int mode, int64_t value) const
 {
 	this->m_trap((Page&) *this, offset, mode, value);
@@ -204,4 +248,28 @@ template <int W, typename T> struct CachedPage {
 	void reset() { pageno = (address_type<W>)-1; page = nullptr; }
 };
 
+// Direct-mapped cache of pages, indexed by the low page number bits
+template <int W, typename T, unsigned N = PageCacheEntries> struct PageCache {
+	using address_t = address_type<W>;
+	CachedPage<W, T> entries[N];
+
+	auto& entry(address_t pageno) noexcept {
+		return entries[size_t(pageno) & (N-1)];
+	}
+	void invalidate(address_t pageno) noexcept {
+		auto& e = entry(pageno);
+		if (e.pageno == pageno) e.reset();
+	}
+	void reset() noexcept {
+		for (auto& e : entries) e.reset();
+	}
+};
+
+struct PageCacheStats {
+	uint64_t read_hits = 0;
+	uint64_t read_misses = 0;
+	uint64_t write_hits = 0;
+	uint64_t write_misses = 0;
+};
+
 }
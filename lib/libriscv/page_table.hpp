@@ -0,0 +1,86 @@
+#pragma once
+#include "common.hpp"
+#include <memory>
+
+namespace riscv
+{
+	struct Page;
+
+	/* Two-level radix table from page number to Page, used to avoid
+	   hashing on page lookups. The pages themselves are owned by the
+	   node-based page map in Memory, and only page numbers below the
+	   bound given to init() are indexed. Leaves are created on demand. */
+	template <int W>
+	struct FlatPageTable
+	{
+		using address_t = address_type<W>;
+		static constexpr unsigned LEAF_BITS = 9;
+		static constexpr size_t   LEAF_SIZE = size_t(1) << LEAF_BITS;
+		static constexpr size_t   LEAF_MASK = LEAF_SIZE - 1;
+
+		void init(uint64_t address_bound);
+		bool enabled() const noexcept { return m_dir_size != 0; }
+
+		bool covers(address_t pageno) const noexcept {
+			return (pageno >> LEAF_BITS) < m_dir_size;
+		}
+		// Returns nullptr when the page is not present. Must be covered.
+		Page* get(address_t pageno) const noexcept {
+			const auto* leaf = m_dir[pageno >> LEAF_BITS].get();
+			return (leaf != nullptr) ? leaf[pageno & LEAF_MASK] : nullptr;
+		}
+		void set(address_t pageno, Page* page);
+		void clear() noexcept;
+
+		size_t leaves() const noexcept;
+		size_t size_bytes() const noexcept {
+			return m_dir_size * sizeof(m_dir[0]) + leaves() * LEAF_SIZE * sizeof(Page*);
+		}
+
+	private:
+		std::unique_ptr<std::unique_ptr<Page*[]>[]> m_dir = nullptr;
+		size_t m_dir_size = 0;
+	};
+
+	template <int W>
+	inline void FlatPageTable<W>::init(uint64_t address_bound)
+	{
+		// There is nothing to index above 4GB in a 32-bit address space
+		if (W == 4 && address_bound > (1ull << 32))
+			address_bound = 1ull << 32;
+		const uint64_t pages = (address_bound + PageSize - 1) / PageSize;
+		this->m_dir_size = (pages + LEAF_SIZE - 1) >> LEAF_BITS;
+		if (m_dir_size > 0)
+			this->m_dir.reset(new std::unique_ptr<Page*[]>[m_dir_size]);
+		else
+			this->m_dir = nullptr;
+	}
+
+	template <int W>
+	inline void FlatPageTable<W>::set(address_t pageno, Page* page)
+	{
+		auto& leaf = m_dir[pageno >> LEAF_BITS];
+		if (leaf == nullptr) {
+			if (page == nullptr)
+				return;
+			leaf.reset(new Page*[LEAF_SIZE] {});
+		}
+		leaf[pageno & LEAF_MASK] = page;
+	}
+
+	template <int W>
+	inline void FlatPageTable<W>::clear() noexcept
+	{
+		for (size_t i = 0; i < m_dir_size; i++)
+			m_dir[i] = nullptr;
+	}
+
+	template <int W>
+	inline size_t FlatPageTable<W>::leaves() const noexcept
+	{
+		size_t count = 0;
+		for (size_t i = 0; i < m_dir_size; i++)
+			count += (m_dir[i] != nullptr);
+		return count;
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include "cpu.hpp"
+
+namespace riscv
+{
+	// With RISCV_REGISTER_CACHE the dispatch loop works on a private
+	// copy of the integer registers. The address of the copy is only
+	// known to the dispatch function and the CPU, so stores to guest
+	// memory cannot alias it, and the compiler no longer has to reload
+	// register values after every store. The copy is written back before
+	// anything outside the dispatch loop can observe the registers
+	// (system calls, SYSTEM, function fallbacks, segment changes),
+	// and when leaving the loop, including by exception. Page handlers
+	// and memory traps run from inside a load or store, and the copy is
+	// written back around them by CPU::CallbackRegisters.
+	// Handlers index the registers with operands decoded at run-time,
+	// so the whole register file is kept, instead of a few named ones.
+	template <int W>
+	struct RegisterCache {
+		RegisterCache(CPU<W>& cpu)
+		  : m_cpu(cpu), m_outer(cpu.m_cached_regs)
+		{
+			reload();
+		}
+		~RegisterCache() {
+			if (m_cpu.m_cached_regs == &m_reg)
+				spill();
+			m_cpu.m_cached_regs = m_outer;
+		}
+
+		auto& get() noexcept {
+			return m_reg;
+		}
+		void spill() noexcept {
+			m_cpu.registers().get() = m_reg;
+			m_cpu.m_cached_regs = nullptr;
+		}
+		void reload() noexcept {
+			m_reg = m_cpu.registers().get();
+			m_cpu.m_cached_regs = &m_reg;
+		}
+	private:
+		std::array<register_type<W>, 32> m_reg;
+		CPU<W>& m_cpu;
+		// A dispatch loop that this one runs inside of
+		std::array<register_type<W>, 32>* const m_outer;
+	};
+} // riscv
@@ -488,8 +488,10 @@ namespace riscv
 	COMPRESSED_INSTR(C2_JALR,
 	[] (auto& cpu, rv32i_instruction instr) RVINSTR_ATTR {
 		const rv32c_instruction ci { instr };
+		// Read the target first, in case it is RA
+		const auto address = cpu.reg(ci.CR.rd);
 		cpu.reg(REG_RA) = cpu.pc() + 0x2;
-		cpu.jump(cpu.reg(ci.CR.rd) - 2);
+		cpu.jump(address - 2);
 		if constexpr (verbose_branches_enabled) {
 			printf(">>> C.JAL RA, 0x%lX <-- %s = 0x%lX\n",
 				(long) cpu.reg(REG_RA) - 2,
@@ -1,8 +1,18 @@
 #include <libriscv/machine.hpp>
+#include <algorithm>
+#include <cstring>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
 
 namespace riscv
 {
-	static const uint64_t MAGiC_V4LUE = 0x9c36ab9301aed873;
+	static const uint64_t MAGiC_V4LUE = 0x9c36ab9301aed874;
 	template <int W>
 	struct SerializedMachine
 	{
@@ -13,7 +23,7 @@ namespace riscv
 		uint16_t reg_size;
 		uint16_t page_size;
 		uint16_t attr_size;
-		uint16_t reserved;
+		uint16_t flags;
 		uint16_t cpu_offset;
 		uint16_t mem_offset;
 
@@ -25,82 +35,358 @@ namespace riscv
 		address_t mmap_address  = 0;
 		address_t heap_address  = 0;
 		address_t exit_address  = 0;
+
+		// Delta snapshots have a non-zero base id, and contain only
+		// pages changed since then, followed by the freed page numbers
+		uint32_t snapshot_id = 0;
+		uint32_t base_id = 0;
+		uint32_t n_freed = 0;
 	};
 	struct SerializedPage
 	{
 		uint64_t addr;
 		PageAttributes attr;
 	};
+	// The page data follows the page table and the freed pages, starting
+	// at the first page boundary after them. Used by deserialize_mapped().
+	static constexpr uint16_t SERIALIZED_PAGE_ALIGNED = 0x1;
+	// The page data follows the page table and the freed pages, with each
+	// page stored as its compressed length and data. Zero words are
+	// run-length encoded. Made by serialize_async().
+	static constexpr uint16_t SERIALIZED_COMPRESSED = 0x2;
+#ifdef RISCV_ASYNC_SNAPSHOTS
+	// Pages that are copy-on-write until their data has been serialized
+	struct FrozenPage
+	{
+		uint64_t addr;
+		PageAttributes attr;
+		std::shared_ptr<const PageData> data;
+	};
+#endif
 
 	template <int W>
-	void Machine<W>::serialize_to(std::vector<uint8_t>& vec) const
+	static bool is_page_aligned(const SerializedMachine<W>& state) noexcept {
+		return (state.flags & SERIALIZED_PAGE_ALIGNED) != 0;
+	}
+	template <int W>
+	static bool is_compressed(const SerializedMachine<W>& state) noexcept {
+		return (state.flags & SERIALIZED_COMPRESSED) != 0;
+	}
+	template <int W>
+	static bool has_page_table(const SerializedMachine<W>& state) noexcept {
+		return is_page_aligned(state) || is_compressed(state);
+	}
+	template <int W>
+	static size_t serialized_page_offset(const SerializedMachine<W>& state, size_t p) noexcept {
+		if (has_page_table(state))
+			return state.mem_offset + p * sizeof(SerializedPage);
+		return state.mem_offset + p * (sizeof(SerializedPage) + Page::size());
+	}
+	// Compressed page data has no fixed offsets, and must be walked
+	// from the offset of the first page
+	template <int W>
+	static size_t serialized_data_offset(const SerializedMachine<W>& state, size_t p) noexcept {
+		if (has_page_table(state)) {
+			const size_t end = serialized_page_offset(state, state.n_pages)
+				+ state.n_freed * sizeof(uint64_t);
+			if (is_compressed(state))
+				return end;
+			return ((end + Page::size() - 1) & ~(Page::size() - 1)) + p * Page::size();
+		}
+		return serialized_page_offset(state, p) + sizeof(SerializedPage);
+	}
+	template <int W>
+	static size_t serialized_freed_offset(const SerializedMachine<W>& state) noexcept {
+		return serialized_page_offset(state, state.n_pages);
+	}
+	template <int W>
+	static size_t serialized_size(const SerializedMachine<W>& state) noexcept {
+		if (has_page_table(state))
+			return serialized_data_offset(state, state.n_pages);
+		return serialized_freed_offset(state) + state.n_freed * sizeof(uint64_t);
+	}
+
+	template <int W>
+	static SerializedMachine<W> snapshot_header(const Machine<W>& machine,
+		uint32_t base_id, uint16_t flags)
 	{
-		const SerializedMachine<W> header {
+		const auto& memory = machine.memory;
+		return SerializedMachine<W> {
 			.magic    = MAGiC_V4LUE,
-			.n_pages  = (unsigned) memory.owned_pages_active(),
+			.n_pages  = 0,
 			.reg_size = sizeof(Registers<W>),
 			.page_size = Page::size(),
 			.attr_size = sizeof(PageAttributes),
-			.reserved = 0,
+			.flags = flags,
 			.cpu_offset = sizeof(SerializedMachine<W>),
 			.mem_offset = sizeof(SerializedMachine<W>),
 
-			.registers = cpu.registers(),
-			.counter   = this->instruction_counter(),
+			.registers = machine.cpu.registers(),
+			.counter   = machine.instruction_counter(),
 
 			.start_address = memory.start_address(),
 			.stack_address = memory.stack_initial(),
 			.mmap_address  = memory.mmap_address(),
 			.heap_address  = memory.heap_address(),
 			.exit_address  = memory.exit_address(),
+
+			.base_id = base_id,
 		};
-		const auto* hptr = (const uint8_t*) &header;
-		vec.insert(vec.end(), hptr, hptr + sizeof(header));
+	}
+
+#ifdef RISCV_ASYNC_SNAPSHOTS
+	// The compressed page is a sequence of zero word and literal word
+	// counts, each followed by the literal words. Zero pages are empty.
+	static void compress_page(std::vector<uint8_t>& vec, const PageData& page)
+	{
+		static constexpr size_t WORDS = PageSize / sizeof(uint64_t);
+		const auto* words = (const uint64_t*) page.buffer8.data();
+		const size_t len_offset = vec.size();
+		vec.resize(len_offset + sizeof(uint32_t));
+
+		size_t i = 0;
+		while (i < WORDS) {
+			const size_t zero_begin = i;
+			while (i < WORDS && words[i] == 0) i++;
+			if (i == WORDS && zero_begin == 0)
+				break; // Zero page
+			const size_t literal_begin = i;
+			while (i < WORDS && words[i] != 0) i++;
+			const uint16_t counts[2] = {
+				uint16_t(literal_begin - zero_begin), uint16_t(i - literal_begin)
+			};
+			auto* cptr = (const uint8_t*) counts;
+			vec.insert(vec.end(), cptr, cptr + sizeof(counts));
+			auto* lptr = (const uint8_t*) &words[literal_begin];
+			vec.insert(vec.end(), lptr, lptr + counts[1] * sizeof(uint64_t));
+		}
+		const uint32_t len = vec.size() - len_offset - sizeof(uint32_t);
+		std::memcpy(&vec[len_offset], &len, sizeof(len));
+	}
+#endif
+	static void decompress_page(PageData& page, const uint8_t* data, size_t len)
+	{
+		static constexpr size_t WORDS = PageSize / sizeof(uint64_t);
+		auto* words = (uint64_t*) page.buffer8.data();
+		size_t i = 0;
+		size_t off = 0;
+		while (off + 2 * sizeof(uint16_t) <= len) {
+			uint16_t counts[2];
+			std::memcpy(counts, &data[off], sizeof(counts));
+			off += sizeof(counts);
+			const size_t zeroes = std::min(size_t(counts[0]), WORDS - i);
+			std::fill(&words[i], &words[i + zeroes], 0);
+			i += zeroes;
+			const size_t literals = std::min({size_t(counts[1]), WORDS - i,
+				(len - off) / sizeof(uint64_t)});
+			std::memcpy(&words[i], &data[off], literals * sizeof(uint64_t));
+			i += literals;
+			off += literals * sizeof(uint64_t);
+		}
+		std::fill(&words[i], &words[WORDS], 0);
+	}
+
+	template <int W>
+	void Machine<W>::serialize_to(std::vector<uint8_t>& vec) const
+	{
+		this->serialize_snapshot(vec, 0, 0);
+	}
+	template <int W>
+	void Machine<W>::serialize_aligned_to(std::vector<uint8_t>& vec) const
+	{
+		this->serialize_snapshot(vec, 0, SERIALIZED_PAGE_ALIGNED);
+	}
+	template <int W>
+	void Machine<W>::serialize_delta_since(uint32_t snapshot_id, std::vector<uint8_t>& vec) const
+	{
+		if (snapshot_id == 0 || snapshot_id > this->snapshot_id())
+			throw MachineException(ILLEGAL_OPERATION, "Unknown snapshot id", snapshot_id);
+		this->serialize_snapshot(vec, snapshot_id, 0);
+	}
+	template <int W>
+	void Machine<W>::serialize_snapshot(std::vector<uint8_t>& vec, uint32_t base_id, uint16_t flags) const
+	{
+		auto header = snapshot_header(*this, base_id, flags);
+		// The header is written last, when the page counts are known
+		const size_t header_offset = vec.size();
+		vec.resize(header_offset + sizeof(header));
 		this->cpu.serialize_to(vec);
-		this->memory.serialize_to(vec);
+		this->memory.serialize_to(vec, header);
+		std::memcpy(&vec[header_offset], &header, sizeof(header));
 	}
+#ifdef RISCV_ASYNC_SNAPSHOTS
+	template <int W>
+	std::future<std::vector<uint8_t>> Machine<W>::serialize_async()
+	{
+		auto header = snapshot_header(*this, 0, SERIALIZED_COMPRESSED);
+		std::vector<FrozenPage> pages;
+		this->memory.freeze_pages(pages, header);
+
+		return std::async(std::launch::async,
+			[header, pages = std::move(pages)] () mutable
+		{
+			std::vector<uint8_t> vec(sizeof(header));
+			for (const auto& page : pages) {
+				const SerializedPage spage {
+					.addr = page.addr,
+					.attr = page.attr
+				};
+				auto* sptr = (const uint8_t*) &spage;
+				vec.insert(vec.end(), sptr, sptr + sizeof(SerializedPage));
+			}
+			for (const auto& page : pages)
+				compress_page(vec, *page.data);
+			header.n_pages = pages.size();
+			std::memcpy(&vec[0], &header, sizeof(header));
+			return vec;
+		});
+	}
+#endif
 	template <int W>
 	void CPU<W>::serialize_to(std::vector<uint8_t>& /* vec */) const
 	{
 	}
+
+	static bool page_is_zero(const PageData& page) noexcept
+	{
+		return std::memcmp(page.buffer8.data(), Page::cow_page().data(), PageSize) == 0;
+	}
+
 	template <int W>
-	void Memory<W>::serialize_to(std::vector<uint8_t>& vec) const
+	template <typename Func>
+	void Memory<W>::foreach_snapshot_page(uint32_t since, Func&& func) const
 	{
-		if (this->m_arena_pages > 0) {
-			throw MachineException(
-				FEATURE_DISABLED, "Serialize is incompatible with arena");
+		// Flat arena pages may have been written without a page
+		this->sync_arena_generations();
+		std::vector<uint8_t> touched;
+		this->arena_touched_pages(touched);
+		const size_t flat_pages = this->m_flat_boundary / Page::size();
+		for (size_t pageno = 0; pageno < flat_pages; pageno++)
+		{
+			const Page* page = this->find_page(pageno);
+			if (page == nullptr && !touched[pageno])
+				continue;
+			const PageData& data = touched[pageno] ? m_arena[pageno] : Page::cow_page().page();
+			const bool changed = (since == 0)
+				? (page != nullptr || !page_is_zero(data))
+				: (m_arena_generations[pageno] > since || (page && page->m_generation > since));
+			if (changed)
+				func(pageno, page ? page->attr : PageAttributes{}, data);
 		}
 
-		const size_t est_page_bytes =
-			this->m_pages.size() * (sizeof(SerializedPage) + Page::size());
-		vec.reserve(vec.size() + est_page_bytes);
-
 		for (const auto& it : this->m_pages)
 		{
 			const auto& page = it.second;
-			assert(!page.attr.is_cow && "Should never have CoW pages stored");
+			assert((!page.attr.is_cow || page.is_shared()) && "Should never have CoW pages stored");
+			if (it.first < flat_pages) continue;
 			// XXX: Ignore shared/non-owned pages?
-			if (page.attr.non_owning) continue;
+			if (!this->is_serializable(it.first, page)) continue;
+			if (since != 0 && page.m_generation <= since) continue;
+			func(it.first, page.attr, page.page());
+		}
+	}
+
+	template <int W>
+	void Memory<W>::serialize_to(std::vector<uint8_t>& vec, SerializedMachine<W>& header) const
+	{
+		const uint32_t since = header.base_id;
+		if (since == 0) {
+			const size_t est_page_bytes =
+				this->m_pages.size() * (sizeof(SerializedPage) + Page::size());
+			vec.reserve(vec.size() + est_page_bytes);
+		}
+
+		// The page table is written first, as page aligned snapshots
+		// keep all the page data at the end
+		std::vector<const PageData*> page_data;
+		[[maybe_unused]] const ArenaHostReads host_reads {*this};
+		this->foreach_snapshot_page(since,
+			[&] (address_t pageno, PageAttributes attr, const PageData& data) {
+			// Shared pages are only copy-on-write while shared
+			if (attr.is_cow) {
+				attr.write = true;
+				attr.is_cow = false;
+			}
 			// XXX: 128-bit addresses not taken into account
 			const SerializedPage spage {
-				.addr = static_cast<uint64_t>(it.first),
-				.attr = page.attr
+				.addr = static_cast<uint64_t>(pageno),
+				.attr = attr
 			};
 			auto* sptr = (const uint8_t*) &spage;
 			vec.insert(vec.end(), sptr, sptr + sizeof(SerializedPage));
-			// page data
-			auto* pptr = page.data();
-			vec.insert(vec.end(), pptr, pptr + Page::size());
+			if (is_page_aligned(header)) {
+				page_data.push_back(&data);
+			} else {
+				auto* pptr = data.buffer8.data();
+				vec.insert(vec.end(), pptr, pptr + Page::size());
+			}
+			header.n_pages++;
+		});
+
+		if (since != 0) {
+			for (const auto& it : this->m_freed_pages) {
+				if (it.second <= since) continue;
+				const uint64_t addr = it.first;
+				auto* aptr = (const uint8_t*) &addr;
+				vec.insert(vec.end(), aptr, aptr + sizeof(addr));
+				header.n_freed++;
+			}
 		}
+
+		if (is_page_aligned(header)) {
+			// Offsets are relative to the header (the CPU state is in it)
+			const size_t base = vec.size() - serialized_freed_offset(header)
+				- header.n_freed * sizeof(uint64_t);
+			vec.resize(base + serialized_data_offset(header, 0));
+			for (const auto* data : page_data) {
+				auto* pptr = data->buffer8.data();
+				vec.insert(vec.end(), pptr, pptr + Page::size());
+			}
+		}
+
+		// Writes after this must mark their pages again
+		header.snapshot_id = m_generation++;
+		m_snapshot_state = header.snapshot_id;
+		m_wr_cache.reset();
 	}
 
+#ifdef RISCV_ASYNC_SNAPSHOTS
 	template <int W>
-	int Machine<W>::deserialize_from(const std::vector<uint8_t>& vec)
+	void Memory<W>::freeze_pages(std::vector<FrozenPage>& pages, SerializedMachine<W>& header)
 	{
-		if (vec.size() < sizeof(SerializedMachine<W>)) {
+		const size_t flat_pages = this->m_flat_boundary / Page::size();
+		[[maybe_unused]] const ArenaHostReads host_reads {*this};
+		this->foreach_snapshot_page(header.base_id,
+			[&] (address_t pageno, PageAttributes attr, const PageData& data) {
+			if (attr.is_cow) {
+				attr.write = true;
+				attr.is_cow = false;
+			}
+			// Owned pages become shared copy-on-write, so that the
+			// next write to them makes a copy. Flat arena, arena and
+			// mapped pages are written to in place, and are copied now.
+			Page* page = (pageno >= flat_pages) ? this->find_page(pageno) : nullptr;
+			if (page != nullptr && page->share()) {
+				pages.push_back({pageno, attr, page->m_shared});
+			} else {
+				pages.push_back({pageno, attr, std::make_shared<PageData>(data)});
+			}
+		});
+
+		header.snapshot_id = m_generation++;
+		m_snapshot_state = header.snapshot_id;
+		// Cached writable pages are no longer writable
+		m_wr_cache.reset();
+	}
+#endif
+
+	template <int W>
+	static int validate_snapshot(const uint8_t* data, size_t size)
+	{
+		if (size < sizeof(SerializedMachine<W>)) {
 			return -1;
 		}
-		const auto& header = *(const SerializedMachine<W>*) vec.data();
+		const auto& header = *(const SerializedMachine<W>*) data;
 		if (header.magic != MAGiC_V4LUE)
 			return -1;
 		if (header.reg_size != sizeof(Registers<W>))
@@ -109,12 +395,79 @@ namespace riscv
 			return -3;
 		if (header.attr_size != sizeof(PageAttributes))
 			return -4;
+		if (size < serialized_size(header))
+			return -5;
+		if (is_compressed(header)) {
+			size_t off = serialized_data_offset(header, 0);
+			for (size_t p = 0; p < header.n_pages; p++) {
+				uint32_t len;
+				if (size - off < sizeof(len))
+					return -5;
+				std::memcpy(&len, &data[off], sizeof(len));
+				if (size - off - sizeof(len) < len)
+					return -5;
+				off += sizeof(len) + len;
+			}
+		}
+		return 0;
+	}
+
+	template <int W>
+	int Machine<W>::deserialize_from(const std::vector<uint8_t>& vec)
+	{
+		const int res = validate_snapshot<W>(vec.data(), vec.size());
+		if (res < 0)
+			return res;
+		const auto& header = *(const SerializedMachine<W>*) vec.data();
+		if (header.base_id != 0 && header.base_id != memory.snapshot_state())
+			return -8;
 		this->m_counter = header.counter;
 		cpu.deserialize_from(vec, header);
 		memory.deserialize_from(vec, header);
 		return 0;
 	}
 	template <int W>
+	int Machine<W>::deserialize_mapped(const std::string& filename)
+	{
+#ifdef __linux__
+		const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return -6;
+		struct stat st;
+		void* map = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && st.st_size > 0)
+			map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+			return -6;
+
+		const auto& header = *(const SerializedMachine<W>*) map;
+		int res = validate_snapshot<W>((const uint8_t*) map, st.st_size);
+		// Compressed pages would have to be decompressed into memory
+		// that the pages then point into, so they can not be mapped
+		if (res == 0 && (!is_page_aligned(header) || is_compressed(header)))
+			res = -7;
+		if (res == 0 && header.base_id != 0 && header.base_id != memory.snapshot_state())
+			res = -8;
+		if (res < 0) {
+			munmap(map, st.st_size);
+			return res;
+		}
+		this->m_counter = header.counter;
+		// All of the CPU state is in the header
+		cpu.deserialize_from({}, header);
+		memory.deserialize_mapped(map, st.st_size, header);
+		return 0;
+#else
+		std::ifstream file(filename, std::ios::binary);
+		if (!file)
+			return -6;
+		std::vector<uint8_t> vec((std::istreambuf_iterator<char>(file)),
+			std::istreambuf_iterator<char>());
+		return this->deserialize_from(vec);
+#endif
+	}
+	template <int W>
 	void CPU<W>::deserialize_from(const std::vector<uint8_t>& /* vec */,
 					const SerializedMachine<W>& state)
 	{
@@ -129,6 +482,63 @@ namespace riscv
 	template <int W>
 	void Memory<W>::deserialize_from(const std::vector<uint8_t>& vec,
 					const SerializedMachine<W>& state)
+	{
+		this->deserialize_pages(vec.data(), state, false);
+	}
+	template <int W>
+	void Memory<W>::deserialize_mapped(void* map, size_t size,
+					const SerializedMachine<W>& state)
+	{
+		this->m_snapshot_mappings.push_back({map, size});
+		this->deserialize_pages((const uint8_t*) map, state, true);
+	}
+	template <int W>
+	void Memory<W>::release_snapshot_mappings()
+	{
+		// Mappings are released once no page refers to them anymore
+		if (this->m_snapshot_mappings.empty())
+			return;
+		std::vector<bool> used(m_snapshot_mappings.size());
+		for (const auto& it : this->m_pages) {
+			const Page& page = it.second;
+			if (!page.attr.non_owning || !page.has_data())
+				continue;
+			const auto* data = (const uint8_t*) page.data();
+			for (size_t i = 0; i < m_snapshot_mappings.size(); i++) {
+				const auto* begin = (const uint8_t*) m_snapshot_mappings[i].first;
+				if (data >= begin && data < begin + m_snapshot_mappings[i].second)
+					used[i] = true;
+			}
+		}
+		size_t kept = 0;
+		for (size_t i = 0; i < m_snapshot_mappings.size(); i++) {
+			if (used[i]) {
+				m_snapshot_mappings[kept++] = m_snapshot_mappings[i];
+				continue;
+			}
+#ifdef __linux__
+			munmap(m_snapshot_mappings[i].first, m_snapshot_mappings[i].second);
+#endif
+		}
+		this->m_snapshot_mappings.resize(kept);
+	}
+	template <int W>
+	bool Memory<W>::is_mapped_page(const Page& page) const noexcept
+	{
+		if (!page.has_data())
+			return false;
+		const auto* data = (const uint8_t*) page.data();
+		for (const auto& mapping : this->m_snapshot_mappings) {
+			const auto* begin = (const uint8_t*) mapping.first;
+			if (data >= begin && data < begin + mapping.second)
+				return true;
+		}
+		return false;
+	}
+
+	template <int W>
+	void Memory<W>::deserialize_pages(const uint8_t* data,
+					const SerializedMachine<W>& state, bool mapped)
 	{
 		this->m_start_address = state.start_address;
 		this->m_stack_address = state.stack_address;
@@ -136,32 +546,105 @@ namespace riscv
 		this->m_heap_address  = state.heap_address;
 		this->m_exit_address  = state.exit_address;
 
-		[[maybe_unused]]
-		const size_t page_bytes =
-			state.n_pages * (sizeof(SerializedPage) + Page::size());
-		assert(vec.size() >= state.mem_offset + page_bytes);
-		// completely reset the paging system as
-		// all pages will be completely replaced
-		this->clear_all_pages();
+		if (state.base_id == 0) {
+			// completely reset the paging system as
+			// all pages will be completely replaced
+			this->clear_all_pages();
+			this->m_freed_pages.clear();
+			this->release_arena_pages(0, m_arena_pages);
+		} else {
+			// pages freed since the base snapshot
+			const auto* freed = (const uint64_t*) &data[serialized_freed_offset(state)];
+			for (size_t i = 0; i < state.n_freed; i++) {
+				this->free_pageno(freed[i]);
+				this->release_arena_pages(freed[i], 1);
+			}
+		}
 
-		size_t off = state.mem_offset;
+		const size_t flat_pages = this->m_flat_boundary / Page::size();
+		size_t compressed_off = serialized_data_offset(state, 0);
+		PageData decompressed { PageData::UNINITIALIZED };
 		for (size_t p = 0; p < state.n_pages; p++) {
-			const auto& page = *(SerializedPage*) &vec[off];
-			off += sizeof(SerializedPage);
-			const auto& data = *(PageData*) &vec[off];
-			// when we serialized non-owning pages, we lost the connection
-			// so now we own the page data
-			PageAttributes new_attr = page.attr;
-			new_attr.non_owning = false;
-			m_pages.emplace(std::piecewise_construct,
-				std::forward_as_tuple(page.addr),
-				std::forward_as_tuple(new_attr, data)
-			);
-
-			off += Page::size();
+			const auto& page = *(const SerializedPage*) &data[serialized_page_offset(state, p)];
+			auto* pdata = (PageData*) &data[serialized_data_offset(state, p)];
+			if (is_compressed(state)) {
+				uint32_t len;
+				std::memcpy(&len, &data[compressed_off], sizeof(len));
+				compressed_off += sizeof(len);
+				decompress_page(decompressed, &data[compressed_off], len);
+				compressed_off += len;
+				pdata = &decompressed;
+			}
+			// Flat accesses go directly to the arena, so those pages are copied
+			if (mapped && page.addr >= flat_pages)
+				this->install_mapped_page(page.addr, page.attr, pdata, state.snapshot_id);
+			else
+				this->restore_page(page.addr, page.attr, *pdata, state.snapshot_id);
 		}
+		// Later snapshots continue from the restored one
+		this->m_generation = std::max(m_generation, state.snapshot_id + 1);
+		this->m_snapshot_state = state.snapshot_id;
+		this->m_arena_generations = nullptr;
 		// page tables have been changed
 		this->invalidate_reset_cache();
+		// Replaced pages may have been the last ones in a mapping. The
+		// state may be in one, and is not used after this.
+		this->release_snapshot_mappings();
+	}
+
+	template <int W>
+	void Memory<W>::install_mapped_page(address_t pageno, PageAttributes attr,
+		PageData* data, uint32_t generation)
+	{
+		// The mapping is private, so the pages are written to directly
+		// and the kernel copies them on the first write
+		attr.non_owning = true;
+		Page* page = this->find_page(pageno);
+		if (page != nullptr) {
+			page->new_data(data, false);
+			page->attr = attr;
+			this->invalidate_cache(pageno, page);
+		} else {
+			page = &this->allocate_page(pageno, attr, data);
+		}
+		page->m_generation = generation;
+		this->mark_dirty(pageno);
+		this->protect_arena_page(pageno, attr);
+	}
+
+	template <int W>
+	void Memory<W>::restore_page(address_t pageno, PageAttributes attr,
+		const PageData& data, uint32_t generation)
+	{
+		Page* page = this->find_page(pageno);
+		if (pageno < m_arena_pages) {
+			// Arena pages are restored in-place, as flat accesses
+			// go directly to the arena
+			this->commit_arena_page(pageno);
+			this->protect_arena_page(pageno, PageAttributes{});
+			m_arena[pageno].buffer8 = data.buffer8;
+			if (page == nullptr || !this->is_arena_page(pageno, *page)) {
+				if (page != nullptr)
+					this->free_pageno(pageno);
+				page = &this->allocate_arena_page(pageno);
+			}
+			attr.non_owning = true;
+			this->protect_arena_page(pageno, attr);
+		} else if (page != nullptr && !page->attr.non_owning && page->has_data()) {
+			page->page().buffer8 = data.buffer8;
+			attr.non_owning = false;
+		} else if (page != nullptr) {
+			// when we serialized non-owning pages, we lost the connection
+			// so now we own the page data
+			page->new_data(new PageData{data}, true);
+			attr.non_owning = false;
+		} else {
+			attr.non_owning = false;
+			page = &this->allocate_page(pageno, attr, data);
+		}
+		page->attr = attr;
+		page->m_generation = generation;
+		this->mark_dirty(pageno);
 	}
 
 	template struct Machine<4>;
@@ -0,0 +1,103 @@
+#pragma once
+#include <array>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "page.hpp"
+#include "registers.hpp"
+#ifdef RISCV_EXT_ATOMICS
+#include "rva.hpp"
+#endif
+
+namespace riscv
+{
+	template<int W> struct DecodedExecuteSegment;
+	template<int W> struct MultiThreading;
+	struct Arena;
+
+	// A page as it was published for shared forks
+	struct SharedForkPage {
+		PageAttributes attr;
+		PageData* data = nullptr;
+		// Keeps the page data alive, unless the master borrows it
+		std::shared_ptr<PageData> shared;
+	};
+
+	// The state of a master machine, as published for shared forks by
+	// Machine::publish_for_forks(). It is immutable once published, and
+	// forks only ever read it, so they can be created and reset while
+	// the master keeps running and changing its memory.
+	template <int W>
+	struct SharedForkState
+	{
+		using address_t = address_type<W>;
+		// Pages are published in chunks, so that publishing again only
+		// copies the chunks with pages that changed.
+		static constexpr unsigned CHUNK_PAGES = 64;
+		struct Chunk {
+			std::array<SharedForkPage, CHUNK_PAGES> pages;
+			uint64_t present = 0;
+		};
+
+		const SharedForkPage* find(address_t pageno) const {
+			auto it = chunks.find(pageno / CHUNK_PAGES);
+			if (it == chunks.end()) return nullptr;
+			const unsigned idx = pageno % CHUNK_PAGES;
+			if ((it->second->present & (uint64_t(1) << idx)) == 0) return nullptr;
+			return &it->second->pages[idx];
+		}
+		template <typename Callback>
+		void foreach_page(Callback callback) const {
+			for (const auto& it : chunks) {
+				uint64_t present = it.second->present;
+				while (present != 0) {
+					const unsigned idx = __builtin_ctzll(present);
+					present &= present - 1;
+					callback(address_t(it.first * CHUNK_PAGES + idx), it.second->pages[idx]);
+				}
+			}
+		}
+
+		// The pages changed between two published states, linked to the
+		// changes before. Forks reset from an earlier state only visit
+		// these pages, as long as the log reaches back to their state.
+		struct Changes {
+			uint64_t since = 0;
+			std::vector<address_t> pages;
+			std::shared_ptr<const Changes> previous;
+			size_t total = 0;
+		};
+
+		// Generations are unique across all published states
+		uint64_t generation = 0;
+		// Chunks are shared with the state published before, and are
+		// only written to while publishing, when not shared yet.
+		std::unordered_map<address_t, std::shared_ptr<Chunk>> chunks;
+		size_t page_count = 0;
+		// Changes since the previously published state, or nullptr
+		// when all pages have been published again
+		std::shared_ptr<const Changes> changes;
+
+		address_t start_address = 0;
+		address_t stack_address = 0;
+		address_t exit_address  = 0;
+		address_t heap_address  = 0;
+		address_t mmap_address  = 0;
+		// The read-only pages of the master, kept alive for the forks
+		address_t ropages_begin = 0;
+		address_t ropages_end   = 0;
+		std::shared_ptr<Page[]> ropages;
+		std::shared_ptr<uint8_t[]> ropages_data;
+
+		Registers<W> registers;
+		// Keeps the execute segment alive for the forks running it
+		std::shared_ptr<DecodedExecuteSegment<W>> exec;
+#ifdef RISCV_EXT_ATOMICS
+		AtomicMemory<W> atomics;
+#endif
+		uint64_t counter = 0;
+		uint64_t max_counter = 0;
+		std::shared_ptr<const MultiThreading<W>> threads;
+		std::shared_ptr<const Arena> arena;
+	};
+}
@@ -15,7 +15,7 @@
 #define DISPATCH_MODE_TAILCALL
 #define INSTRUCTION(bytecode, name) \
 	template <int W>                \
-	static TcoRet<W> name(DecoderData<W>* d, MUNUSED DecodedExecuteSegment<W>* exec, MUNUSED CPU<W>& cpu, MUNUSED address_type<W> pc, MUNUSED uint64_t counter)
+	static TcoRet<W> name(DecoderData<W>* d, MUNUSED DecodedExecuteSegment<W>* exec, MUNUSED CPU<W>& cpu, MUNUSED address_type<W> pc, MUNUSED int64_t budget)
 #define addr_t  address_type<W>
 #define saddr_t signed_address_type<W>
 #define XLEN    (8 * W)
@@ -25,7 +25,7 @@
 #define VIEW_INSTR_AS(name, x) \
 	auto&& name = *(x *)&d->instr;
 #define EXECUTE_INSTR() \
-	computed_opcode<W>[d->get_bytecode()](d, exec, cpu, pc, counter)
+	computed_opcode<W>[d->get_bytecode()](d, exec, cpu, pc, budget)
 #define EXECUTE_CURRENT()              \
 	MUSTTAIL return EXECUTE_INSTR();
 #define NEXT_INSTR()                   \
@@ -34,21 +34,46 @@
 #define NEXT_C_INSTR() \
 	d += 1;            \
 	EXECUTE_CURRENT()
-
-#define COUNTER_OVERFLOWED(counter) \
-	(counter >= cpu.machine().max_instructions())
+#define SKIP_INSTR() \
+	d += (compressed_enabled ? 2 : 1);
+#define SKIP_C_INSTR() \
+	d += 1;
+
+// Instead of an instruction counter that is compared against the
+// max instructions in Machine, we count down a budget that is always
+// kept in a host register. The instruction counter can be recovered
+// from the budget at any time, as long as the limit is unchanged.
+#define BUDGET_LIMIT() \
+	budget_limit<W>(cpu.machine())
+#define INSTRUCTION_COUNTER() \
+	budget_counter<W>(cpu.machine(), budget)
+#define BUDGET_OVERFLOWED() \
+	(budget <= 0)
+// System calls and SYSTEM can see and change the instruction counter.
+// It is made visible before them, and the budget is recomputed after.
+#define PUBLISH_COUNTER() \
+	cpu.machine().set_instruction_counter(INSTRUCTION_COUNTER());
+#define RESTORE_BUDGET() \
+	budget = BUDGET_LIMIT() - cpu.machine().instruction_counter();
+// Any other call out of the dispatch can stop the machine, which lowers
+// the limit. The budget moves by as much as the limit did, so that the
+// counter is unchanged and the next checked jump sees the overflow.
+#define BEGIN_CALLOUT() \
+	const int64_t callout_limit = BUDGET_LIMIT();
+#define END_CALLOUT() \
+	budget += BUDGET_LIMIT() - callout_limit;
 #define RETURN_VALUES() \
-	{pc, counter}
+	{pc, INSTRUCTION_COUNTER()}
 #define UNUSED_FUNCTION() \
 	cpu.trigger_exception(ILLEGAL_OPCODE);
 
 #define BEGIN_BLOCK()                               \
 	pc += d->block_bytes(); \
-	counter += d->instruction_count();
-#define NEXT_BLOCK(len)                \
-	pc += len;                         \
-	d += (compressed_enabled ? 2 : 1); \
-	BEGIN_BLOCK();                     \
+	budget -= d->instruction_count();
+#define NEXT_BLOCK(len)                      \
+	pc += len;                               \
+	d += (compressed_enabled ? len / 2 : 1); \
+	BEGIN_BLOCK();                           \
 	EXECUTE_CURRENT()
 
 #define UNCHECKED_JUMP()                                       \
@@ -56,14 +81,17 @@
 	BEGIN_BLOCK();                                             \
 	EXECUTE_CURRENT();
 #define OVERFLOW_CHECKED_JUMP()                     \
-	if (UNLIKELY(COUNTER_OVERFLOWED(counter)))      \
+	if (UNLIKELY(BUDGET_OVERFLOWED()))              \
 		return RETURN_VALUES();                     \
 	UNCHECKED_JUMP()
 #define CHECKED_JUMP()                              \
-	if (UNLIKELY(COUNTER_OVERFLOWED(counter)))      \
+	if (UNLIKELY(BUDGET_OVERFLOWED()))              \
 		return RETURN_VALUES();                     \
-	else if (UNLIKELY(!exec->is_within(pc)))        \
+	else if (UNLIKELY(!exec->is_within(pc))) {      \
+		BEGIN_CALLOUT();                            \
 		exec = resolve_execute_segment<W>(cpu, pc); \
+		END_CALLOUT();                              \
+	}                                               \
 	UNCHECKED_JUMP()
 
 #define PERFORM_BRANCH()   \
@@ -78,6 +106,27 @@ namespace riscv
 {
 	static constexpr bool VERBOSE_JUMPS = false;
 
+	// The limit that the budget counts down towards. Limits above
+	// INT64_MAX are unreachable and are treated as INT64_MAX, which
+	// lets the budget be a signed integer.
+	template <int W>
+	static inline int64_t budget_limit(const Machine<W>& machine)
+	{
+		return (int64_t)std::min(machine.max_instructions(), uint64_t(INT64_MAX));
+	}
+
+	// The instruction counter is never below the one last made visible
+	// in Machine. The budget only goes below that when the limit was
+	// lowered behind our back, e.g. by machine.stop() in a memory trap,
+	// and the last visible counter is then the best we have.
+	template <int W>
+	static inline uint64_t budget_counter(const Machine<W>& machine, int64_t budget)
+	{
+		const int64_t counter = budget_limit<W>(machine) - budget;
+		const uint64_t visible = machine.instruction_counter();
+		return (counter >= 0 && uint64_t(counter) >= visible) ? counter : visible;
+	}
+
 	template <int W>
 	DecodedExecuteSegment<W>* resolve_execute_segment(CPU<W>& cpu, address_type<W>& pc)
 	{
@@ -96,7 +145,7 @@ namespace riscv
 	using TcoRet = std::tuple<address_type<W>, uint64_t>;
 
 	template <int W>
-	using DecoderFunc = TcoRet<W>(*)(DecoderData<W>*, DecodedExecuteSegment<W>*, CPU<W> &, address_type<W> pc, uint64_t counter);
+	using DecoderFunc = TcoRet<W>(*)(DecoderData<W>*, DecodedExecuteSegment<W>*, CPU<W> &, address_type<W> pc, int64_t budget);
 	namespace {
 		template <int W>
 		extern const DecoderFunc<W> computed_opcode[BYTECODES_MAX];
@@ -119,11 +168,28 @@ namespace riscv
 #  include "bytecode_impl.cpp"
 #undef BYTECODES_BRANCH
 
+#define BYTECODES_FUSED
+#  include "bytecode_impl.cpp"
+#undef BYTECODES_FUSED
+
 	INSTRUCTION(RV32I_BC_FUNCTION, execute_decoded_function)
 	{
 		auto handler = d->get_handler();
+		BEGIN_CALLOUT();
 		handler(cpu, {d->instr});
-		NEXT_INSTR();  
+		END_CALLOUT();
+		NEXT_INSTR();
+	}
+
+	INSTRUCTION(RV32I_BC_DECODE, execute_decode)
+	{
+		// Undecoded entries are only reached at the start of a block.
+		// Decode the block, and then redo the start of the block.
+		const int64_t undecoded_count = d->instruction_count();
+		exec->decode_lazily(pc);
+		budget -= d->instruction_count() - undecoded_count;
+		pc += d->block_bytes();
+		EXECUTE_CURRENT();
 	}
 
 	INSTRUCTION(RV32I_BC_SYSCALL, rv32i_syscall)
@@ -131,12 +197,12 @@ namespace riscv
 		// Make the current PC visible
 		cpu.registers().pc = pc;
 		// Make the instruction counter(s) visible
-		cpu.machine().set_instruction_counter(counter);
+		PUBLISH_COUNTER();
 		// Invoke system call
 		cpu.machine().system_call(cpu.reg(REG_ECALL));
-		// Restore max counter and check overflow
-		counter = cpu.machine().instruction_counter();
-		if (UNLIKELY(COUNTER_OVERFLOWED(counter)))
+		// Restore budget and check overflow
+		RESTORE_BUDGET();
+		if (UNLIKELY(BUDGET_OVERFLOWED()))
 		{
 			return RETURN_VALUES();
 		}
@@ -145,7 +211,9 @@ namespace riscv
 		{
 			pc = cpu.registers().pc;
 			if (UNLIKELY(!exec->is_within(pc))) {
+				BEGIN_CALLOUT();
 				exec = resolve_execute_segment<W>(cpu, pc);
+				END_CALLOUT();
 			}
 			d = &exec->decoder_cache()[pc / DecoderCache<W>::DIVISOR];
 		}
@@ -209,8 +277,10 @@ namespace riscv
 	{
 		(void) d;
 		pc += 4; // Complete STOP instruction
+		// Stopping changes the limit
+		const uint64_t counter = INSTRUCTION_COUNTER();
 		cpu.machine().stop();
-		return RETURN_VALUES();
+		return {pc, counter};
 	}
 
 #define BYTECODES_FLP
@@ -218,11 +288,33 @@ namespace riscv
 #undef BYTECODES_FLP
 
 #ifdef RISCV_EXT_COMPRESSED
+	INSTRUCTION(RV32C_BC_JR, rv32c_jr)
+	{
+		VIEW_INSTR_AS(fi, FasterMove);
+		pc = cpu.reg(fi.get_rs1());
+		// Alignment checks
+		cpu.jump(pc);
+		CHECKED_JUMP();
+	}
+
+	INSTRUCTION(RV32C_BC_JALR, rv32c_jalr)
+	{
+		VIEW_INSTR_AS(fi, FasterMove);
+		const auto address = cpu.reg(fi.get_rs1());
+		cpu.reg(REG_RA) = pc + 2;
+		// Alignment checks
+		cpu.jump(address);
+		pc = address;
+		CHECKED_JUMP();
+	}
+
 	INSTRUCTION(RV32C_BC_FUNCTION, rv32c_func)
 	{
 		VIEW_INSTR();
 		auto handler = d->get_handler();
+		BEGIN_CALLOUT();
 		handler(cpu, instr);
+		END_CALLOUT();
 		NEXT_C_INSTR();
 	}
 	INSTRUCTION(RV32C_BC_JUMPFUNC, rv32c_jfunc)
@@ -230,7 +322,9 @@ namespace riscv
 		VIEW_INSTR();
 		cpu.registers().pc = pc;
 		auto handler = d->get_handler();
+		BEGIN_CALLOUT();
 		handler(cpu, instr);
+		END_CALLOUT();
 		if constexpr (VERBOSE_JUMPS)
 		{
 			printf("Compressed jump from 0x%lX to 0x%lX\n",
@@ -246,9 +340,11 @@ namespace riscv
 		// Make the current PC visible
 		cpu.registers().pc = pc;
 		// Make the instruction counter visible
-		cpu.machine().set_instruction_counter(counter);
+		PUBLISH_COUNTER();
 		// Invoke SYSTEM
 		cpu.machine().system(instr);
+		// Restore budget, as SYSTEM can stop the machine
+		RESTORE_BUDGET();
 		// Restore PC in case it changed (supervisor)
 		pc = cpu.registers().pc + 4;
 		CHECKED_JUMP();
@@ -330,12 +426,23 @@ namespace riscv
 
 		[RV64I_BC_ADDIW] = rv64i_addiw,
 
+		[RV32I_BC_LUI_ADDI] = rv32i_lui_addi,
+		[RV32I_BC_LI_BEQ]  = rv32i_li_beq,
+		[RV32I_BC_LI_BNE]  = rv32i_li_bne,
+		[RV32I_BC_LDD_LDD] = rv32i_ldd_ldd,
+		[RV32I_BC_STD_STD] = rv32i_std_std,
+
 #ifdef RISCV_EXT_COMPRESSED
 		[RV32C_BC_ADDI]     = rv32c_addi,
 		[RV32C_BC_LI]       = rv32c_addi,
-		[RV32C_BC_MV]       = rv32c_addi,
+		[RV32C_BC_MV]       = rv32c_mv,
+		[RV32C_BC_BNEZ]     = rv32c_bnez,
 		[RV32C_BC_LDD]      = rv32c_ldd,
 		[RV32C_BC_STD]      = rv32c_std,
+		[RV32C_BC_LDD_LDD]  = rv32c_ldd_ldd,
+		[RV32C_BC_STD_STD]  = rv32c_std_std,
+		[RV32C_BC_JR]       = rv32c_jr,
+		[RV32C_BC_JALR]     = rv32c_jalr,
 		[RV32C_BC_FUNCTION] = rv32c_func,
 		[RV32C_BC_JUMPFUNC] = rv32c_jfunc,
 #endif
@@ -359,6 +466,7 @@ namespace riscv
 		[RV32V_BC_VFADD_VV] = rv32v_vfadd_vv,
 #endif
 		[RV32I_BC_FUNCTION] = execute_decoded_function,
+		[RV32I_BC_DECODE]  = execute_decode,
 #ifdef RISCV_BINARY_TRANSLATION
 		[RV32I_BC_TRANSLATOR] = translated_function,
 #endif
@@ -369,6 +477,13 @@ namespace riscv
 	template <int W> inline RISCV_HOT_PATH()
 	void CPU<W>::simulate_tco(uint64_t imax)
 	{
+		// Segments evicted during simulation stay alive until it returns
+		[[maybe_unused]] const typename Memory<W>::ExecuteSegmentsInUse exec_in_use {machine().memory};
+#ifdef RISCV_BINARY_TRANSLATION
+		// Translations compiled in the background are activated here
+		if (UNLIKELY(machine().memory.has_background_translation()))
+			machine().memory.activate_background_translation();
+#endif
 		// We need an execute segment matching current PC
 		if (UNLIKELY(!is_executable(this->pc())))
 		{
@@ -382,7 +497,7 @@ namespace riscv
 			machine().set_max_instructions(UINT64_MAX);
 
 		uint64_t pc = this->pc();
-		uint64_t counter = machine().instruction_counter();
+		int64_t budget = budget_limit<W>(machine()) - machine().instruction_counter();
 
 		DecodedExecuteSegment<W>* exec = this->m_exec;
 		DecoderData<W>* exec_decoder = exec->decoder_cache();
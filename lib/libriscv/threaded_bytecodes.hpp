@@ -73,6 +73,13 @@ namespace riscv
 
 		RV64I_BC_ADDIW,
 
+		// Superinstructions: Two instructions in one dispatch
+		RV32I_BC_LUI_ADDI,
+		RV32I_BC_LI_BEQ,
+		RV32I_BC_LI_BNE,
+		RV32I_BC_LDD_LDD,
+		RV32I_BC_STD_STD,
+
 #ifdef RISCV_EXT_COMPRESSED
 		RV32C_BC_ADDI,
 		RV32C_BC_LI,
@@ -80,6 +87,10 @@ namespace riscv
 		RV32C_BC_BNEZ,
 		RV32C_BC_LDD,
 		RV32C_BC_STD,
+		RV32C_BC_LDD_LDD,
+		RV32C_BC_STD_STD,
+		RV32C_BC_JR,
+		RV32C_BC_JALR,
 		RV32C_BC_FUNCTION,
 		RV32C_BC_JUMPFUNC,
 #endif
@@ -103,6 +114,7 @@ namespace riscv
 		RV32V_BC_VFADD_VV,
 #endif
 		RV32I_BC_FUNCTION,
+		RV32I_BC_DECODE,
 #ifdef RISCV_BINARY_TRANSLATION
 		RV32I_BC_TRANSLATOR,
 #endif
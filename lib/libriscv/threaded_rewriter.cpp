@@ -223,6 +223,17 @@ namespace riscv
 				instr.whole = rewritten.whole;
 				return RV32C_BC_MV;
 			}
+			case RV32C_BC_JR:
+			case RV32C_BC_JALR: {
+				const rv32c_instruction ci{original};
+
+				FasterMove rewritten;
+				rewritten.rd  = 0;
+				rewritten.rs1 = ci.CR.rd;
+
+				instr.whole = rewritten.whole;
+				return bytecode;
+			}
 			case RV32C_BC_BNEZ: {
 				const rv32c_instruction ci { original };
 
@@ -288,4 +299,27 @@ namespace riscv
 		return bytecode;
 	}
 
+	// Pairs of (rewritten) bytecodes in the same block that are fused
+	// into a superinstruction. The table is generated from profiles of
+	// executed pairs, see PAIRS in emulator/README.md.
+	template <int W> RISCV_INTERNAL
+	size_t DecodedExecuteSegment<W>::threaded_fuse(size_t bytecode, size_t next)
+	{
+#define FUSE(first, second, fused) \
+		if (bytecode == first && next == second) return fused;
+#include "threaded_fuse.inc"
+#undef FUSE
+		return bytecode;
+	}
+
+	template <int W>
+	size_t DecodedExecuteSegment<W>::threaded_unfuse(size_t bytecode)
+	{
+#define SUPERINSTRUCTION(first, second, fused) \
+		if (bytecode == fused) return first;
+#include "threaded_superinstructions.inc"
+#undef SUPERINSTRUCTION
+		return bytecode;
+	}
+
 } // riscv
@@ -72,8 +72,74 @@ static struct CallbackTable {
 	float  (*sqrtf32)(float);
 	double (*sqrtf64)(double);
 } api;
-static uint64_t* cur_insn;
-static uint64_t* max_insn;
+// The instruction counters of the Machine, which are at the same
+// offset from the CPU in every machine that shares this dylib
+static intptr_t cur_insn_offset;
+static intptr_t max_insn_offset;
+#define cur_insn ((uint64_t*)((char*)cpu + cur_insn_offset))
+#define max_insn ((uint64_t*)((char*)cpu + max_insn_offset))
+
+// Translated blocks return the next block to run, which lets
+// execution continue in native code from one block to another
+typedef struct Block Block;
+struct Block {
+	Block (*handler)(CPU*);
+};
+#define NO_BLOCK ((Block){0})
+static Block lookup_block(addr_t addr);
+
+static inline void run_blocks(CPU* cpu, Block (*handler)(CPU*))
+{
+	do {
+		handler = handler(cpu).handler;
+	} while (handler != 0);
+}
+
+// Loads and stores look up the page caches of Memory directly, which
+// are at fixed offsets from the CPU. Misses use the callbacks instead,
+// which also fill the caches.
+typedef struct {
+	addr_t   pageno;
+	uint8_t* data;
+} CachedPage;
+static intptr_t rd_cache_offset;
+static intptr_t wr_cache_offset;
+
+static inline CachedPage* page_cache_entry(const CPU* cpu, intptr_t offset, addr_t pageno) {
+	return (CachedPage*)((char*)cpu + offset) + (pageno & (RISCV_PAGE_CACHE_ENTRIES-1));
+}
+#ifdef RISCV_FORCE_ALIGN_MEMORY
+#  define PAGE_OFFSET(addr, T) ((addr) & (RISCV_PAGE_SIZE-1) & ~(addr_t)(sizeof(T)-1))
+#else
+#  define PAGE_OFFSET(addr, T) ((addr) & (RISCV_PAGE_SIZE-1))
+#endif
+#ifdef RISCV_UNALIGNED_SLOWPATHS
+#  define PAGE_CROSSING(addr, T) (PAGE_OFFSET(addr, T) + sizeof(T) > RISCV_PAGE_SIZE)
+#else
+#  define PAGE_CROSSING(addr, T) 0
+#endif
+
+#define MEMORY_ACCESSORS(T, bits) \
+static inline T rd##bits(const CPU* cpu, addr_t addr) { \
+	const addr_t pageno = addr / RISCV_PAGE_SIZE; \
+	const CachedPage* e = page_cache_entry(cpu, rd_cache_offset, pageno); \
+	if (LIKELY(e->pageno == pageno && !PAGE_CROSSING(addr, T))) \
+		return *(T*)&e->data[PAGE_OFFSET(addr, T)]; \
+	return api.mem_ld##bits(cpu, addr); \
+} \
+static inline void wr##bits(const CPU* cpu, addr_t addr, T value) { \
+	const addr_t pageno = addr / RISCV_PAGE_SIZE; \
+	const CachedPage* e = page_cache_entry(cpu, wr_cache_offset, pageno); \
+	if (LIKELY(e->pageno == pageno && !PAGE_CROSSING(addr, T))) { \
+		*(T*)&e->data[PAGE_OFFSET(addr, T)] = value; \
+		return; \
+	} \
+	api.mem_st##bits(cpu, addr, value); \
+}
+MEMORY_ACCESSORS(uint8_t,  8)
+MEMORY_ACCESSORS(uint16_t, 16)
+MEMORY_ACCESSORS(uint32_t, 32)
+MEMORY_ACCESSORS(uint64_t, 64)
 
 void* memcpy(void * restrict dst, const void * restrict src, unsigned len)
 {
@@ -108,10 +174,13 @@ static inline uint64_t MUL128(
 	return (middle << 32) | (uint32_t)p00;
 }
 
-extern void init(struct CallbackTable* table, uint64_t* cur_icount, uint64_t* max_icount) {
+extern void init(struct CallbackTable* table, intptr_t cur_icount, intptr_t max_icount,
+	intptr_t rd_cache, intptr_t wr_cache) {
 	api = *table;
-	cur_insn = cur_icount;
-	max_insn = max_icount;
+	cur_insn_offset = cur_icount;
+	max_insn_offset = max_icount;
+	rd_cache_offset = rd_cache;
+	wr_cache_offset = wr_cache;
 };
 )123";
 }
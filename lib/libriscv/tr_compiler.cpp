@@ -2,6 +2,7 @@
 #include <dlfcn.h>
 #include <string>
 #include <unistd.h>
+#include "common.hpp"
 
 static std::string compiler()
 {
@@ -31,6 +32,10 @@ namespace riscv
 		return compiler() + " -O2 -s -std=c99 -fPIC -shared -rdynamic -x c "
 		" -ffreestanding -fno-builtin -nostdlib -fexceptions "
 		 + "-DRISCV_TRANSLATION_DYLIB=" + std::to_string(arch)
+		 + " -DRISCV_PAGE_SIZE=" + std::to_string(PageSize)
+		 + " -DRISCV_PAGE_CACHE_ENTRIES=" + std::to_string(PageCacheEntries)
+		 + (force_align_memory ? " -DRISCV_FORCE_ALIGN_MEMORY" : "")
+		 + (unaligned_memory_slowpaths ? " -DRISCV_UNALIGNED_SLOWPATHS" : "")
 		 + " -pipe " + cflags();
 	}
 
@@ -4,13 +4,22 @@
 #include "rvfd.hpp"
 #include "tr_types.hpp"
 
-#define PCRELA(x) ((address_t) (tinfo.basepc + i * 4 + (x)))
+#define PCRELA(x) ((address_t) (current_pc + (x)))
 #define PCRELS(x) std::to_string(PCRELA(x)) + "UL"
 #define INSTRUCTION_COUNT(i) ("c + " + std::to_string(i))
-#define ILLEGAL_AND_EXIT() { code += "api.exception(cpu, ILLEGAL_OPCODE);\nreturn;\n"; }
+#define ILLEGAL_AND_EXIT() { code += "api.exception(cpu, ILLEGAL_OPCODE);\nreturn NO_BLOCK;\n"; }
 
 namespace riscv {
-static const std::string LOOP_EXPRESSION = "c < local_max_insn";
+// c + i counts the instructions executed before the one at index i.
+// The dispatch loop counts the last instruction of a translated block.
+// Jumping from index i to the label at index dst rebases c on dst.
+inline std::string jump_to_label(size_t i, int dst, const std::string& label)
+{
+	const int64_t rebase = int64_t(i) + 1 - dst;
+	return "if (" + INSTRUCTION_COUNT(i) + " < local_max_insn) { c "
+		+ (rebase < 0 ? "-= " + std::to_string(-rebase) : "+= " + std::to_string(rebase))
+		+ "; goto " + label + "; }\n";
+}
 
 template <typename ... Args>
 inline void add_code(std::string& code, Args&& ... addendum) {
@@ -43,24 +52,37 @@ struct BranchInfo {
 	int jump_label; // destination index, 0 when unused
 };
 #define FUNCLABEL(i)  (func + "_" + std::to_string(i))
+// Continue directly in the translated block at dst, if there is
+// one, and the instruction limit has not been reached
 template <int W>
-inline void add_branch(std::string& code, const BranchInfo& binfo, const std::string& op, const TransInfo<W>& tinfo, size_t i, rv32i_instruction instr, const std::string& func)
+inline void add_transfer(std::string& code, const TransInfo<W>& tinfo, size_t i, address_type<W> dst)
+{
+	if (tinfo.block_entries.count(dst)) {
+		code += "if (" + INSTRUCTION_COUNT(i) + " < local_max_insn) { "
+			"*cur_insn = " + INSTRUCTION_COUNT(i + 1) + "; cpu->pc = " + std::to_string(dst) + "UL; "
+			"return (Block){" + translated_function_name<W>(dst) + "}; }\n";
+	}
+}
+template <int W>
+inline void add_branch(std::string& code, const BranchInfo& binfo, const std::string& op, const TransInfo<W>& tinfo, size_t i, address_type<W> current_pc, rv32i_instruction instr, const std::string& func)
 {
 	using address_t = address_type<W>;
+	static constexpr address_t PCMASK = compressed_enabled ? 0x1 : 0x3;
 	if (binfo.sign == false)
 		code += "if (" + from_reg(tinfo, instr.Btype.rs1) + op + from_reg(tinfo, instr.Btype.rs2) + ") {\n";
 	else
 		code += "if ((saddr_t)" + from_reg(tinfo, instr.Btype.rs1) + op + " (saddr_t)" + from_reg(tinfo, instr.Btype.rs2) + ") {\n";
 	if (binfo.goto_enabled) {
 		// this is a jump back to the start of the function
-		code += "c += " + std::to_string(i) + "; if (" + LOOP_EXPRESSION + ") goto " + func + "_start;\n";
+		code += jump_to_label(i, 0, func + "_start");
 	} else if (binfo.jump_label > 0) {
 		// forward jump to label (from absolute index)
-		code += "c += " + std::to_string(i) + "; if (" + LOOP_EXPRESSION + ") ";
-		code += "goto " + FUNCLABEL(binfo.jump_label) + ";\n";
+		code += jump_to_label(i, binfo.jump_label, FUNCLABEL(binfo.jump_label));
 		// else, exit binary translation
+	} else {
+		add_transfer<W>(code, tinfo, i, PCRELA(instr.Btype.signed_imm()));
 	}
-	if (PCRELA(instr.Btype.signed_imm()) & 0x3)
+	if (PCRELA(instr.Btype.signed_imm()) & PCMASK)
 	{
 		code +=
 			"api.exception(cpu, " + std::to_string(MISALIGNED_INSTRUCTION) + ");\n";
@@ -69,9 +91,9 @@ inline void add_branch(std::string& code, const BranchInfo& binfo, const std::st
 	{
 		// The number of instructions to increment depends on if branch-instruction-counting is enabled
 		code += 
-			"*cur_insn = c; "
+			"*cur_insn = " + INSTRUCTION_COUNT(i) + "; "
 			"cpu->pc = " + PCRELS(instr.Btype.signed_imm() - 4) + ";\n"
-			"return;}\n";
+			"return NO_BLOCK;}\n";
 	}
 }
 template <int W>
@@ -94,12 +116,25 @@ void CPU<W>::emit(std::string& code, const std::string& func, TransInstr<W>* ip,
 	static constexpr unsigned XLEN = W * 8u;
 	static const std::string SIGNEXTW = "(saddr_t) (int32_t)";
 	std::set<unsigned> labels;
-	code += "extern void " + func + "(CPU* cpu) {\n"
+	code += "static Block " + func + "(CPU* cpu) {\n"
 		"uint64_t c = *cur_insn, local_max_insn = *max_insn; " + func + "_start:;\n";
 
+	// The address of each instruction, and the end of the block
+	std::vector<address_t> pcs(tinfo.len + 1);
+	pcs[0] = tinfo.basepc;
+	for (int i = 0; i < tinfo.len; i++)
+		pcs[i+1] = pcs[i] + ip[i].length;
+	// Index of the instruction at addr, or -1 if there is none
+	auto index_of = [&] (address_t addr) -> int {
+		const auto it = std::lower_bound(pcs.begin(), pcs.end() - 1, addr);
+		if (it == pcs.end() - 1 || *it != addr)
+			return -1;
+		return it - pcs.begin();
+	};
+
 	for (int i = 0; i < tinfo.len; i++) {
 		const auto instr = rv32i_instruction {ip[i].instr};
-		const auto current_pc = tinfo.basepc + i * 4;
+		const address_t current_pc = pcs[i];
 
 		// known jump locations
 		if (tinfo.jump_locations.count(current_pc)) {
@@ -116,52 +151,52 @@ void CPU<W>::emit(std::string& code, const std::string& func, TransInstr<W>* ip,
 			case 0x0: // I8
 				if (instr.Itype.rd == 0) {
 					add_code(code,
-					"api.mem_ld8(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
+					"rd8(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
 				} else {
 					add_code(code,
-					from_reg(instr.Itype.rd) + " = (saddr_t)(int8_t)api.mem_ld8(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
+					from_reg(instr.Itype.rd) + " = (saddr_t)(int8_t)rd8(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
 				} break;
 			case 0x1: // I16
 				if (instr.Itype.rd == 0) {
 					add_code(code,
-					"api.mem_ld16(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
+					"rd16(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
 				} else {
 					add_code(code,
-					from_reg(instr.Itype.rd) + " = (saddr_t)(int16_t)api.mem_ld16(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
+					from_reg(instr.Itype.rd) + " = (saddr_t)(int16_t)rd16(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
 				} break;
 			case 0x2: // I32
 				if (instr.Itype.rd == 0) {
 					add_code(code,
-					"api.mem_ld32(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
+					"rd32(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
 				} else {
 					if constexpr (W == 4) {
 						add_code(code,
-							from_reg(instr.Itype.rd) + " = api.mem_ld32(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
+							from_reg(instr.Itype.rd) + " = rd32(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
 					} else {
 						add_code(code,
-							from_reg(instr.Itype.rd) + " = (saddr_t)(int32_t)api.mem_ld32(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
+							from_reg(instr.Itype.rd) + " = (saddr_t)(int32_t)rd32(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
 					}
 				} break;
 			case 0x3: // I64
 				if (instr.Itype.rd == 0) {
 					add_code(code,
-					"api.mem_ld64(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
+					"rd64(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
 				} else {
 					add_code(code,
-					from_reg(instr.Itype.rd) + " = api.mem_ld64(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
+					from_reg(instr.Itype.rd) + " = rd64(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
 				}
 				break;
 			case 0x4: // U8
 				add_code(code,
-				from_reg(instr.Itype.rd) + " = api.mem_ld8(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
+				from_reg(instr.Itype.rd) + " = rd8(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
 				break;
 			case 0x5: // U16
 				add_code(code,
-				from_reg(instr.Itype.rd) + " = api.mem_ld16(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
+				from_reg(instr.Itype.rd) + " = rd16(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
 				break;
 			case 0x6: // U32
 				add_code(code,
-				from_reg(instr.Itype.rd) + " = api.mem_ld32(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
+				from_reg(instr.Itype.rd) + " = rd32(cpu, " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ");");
 				break;
 			default:
 				ILLEGAL_AND_EXIT();
@@ -170,101 +205,105 @@ void CPU<W>::emit(std::string& code, const std::string& func, TransInstr<W>* ip,
 			switch (instr.Stype.funct3) {
 			case 0x0: // I8
 				add_code(code,
-					"api.mem_st8(cpu, " + from_reg(tinfo, instr.Stype.rs1) + " + " + from_imm(instr.Stype.signed_imm()) + ", " + from_reg(tinfo, instr.Stype.rs2) + ");");
+					"wr8(cpu, " + from_reg(tinfo, instr.Stype.rs1) + " + " + from_imm(instr.Stype.signed_imm()) + ", " + from_reg(tinfo, instr.Stype.rs2) + ");");
 				break;
 			case 0x1: // I16
 				add_code(code,
-					"api.mem_st16(cpu, " + from_reg(tinfo, instr.Stype.rs1) + " + " + from_imm(instr.Stype.signed_imm()) + ", " + from_reg(tinfo, instr.Stype.rs2) + ");");
+					"wr16(cpu, " + from_reg(tinfo, instr.Stype.rs1) + " + " + from_imm(instr.Stype.signed_imm()) + ", " + from_reg(tinfo, instr.Stype.rs2) + ");");
 				break;
 			case 0x2: // I32
 				add_code(code,
-					"api.mem_st32(cpu, " + from_reg(tinfo, instr.Stype.rs1) + " + " + from_imm(instr.Stype.signed_imm()) + ", " + from_reg(tinfo, instr.Stype.rs2) + ");");
+					"wr32(cpu, " + from_reg(tinfo, instr.Stype.rs1) + " + " + from_imm(instr.Stype.signed_imm()) + ", " + from_reg(tinfo, instr.Stype.rs2) + ");");
 				break;
 			case 0x3: // I64
 				add_code(code,
-					"api.mem_st64(cpu, " + from_reg(tinfo, instr.Stype.rs1) + " + " + from_imm(instr.Stype.signed_imm()) + ", " + from_reg(tinfo, instr.Stype.rs2) + ");");
+					"wr64(cpu, " + from_reg(tinfo, instr.Stype.rs1) + " + " + from_imm(instr.Stype.signed_imm()) + ", " + from_reg(tinfo, instr.Stype.rs2) + ");");
 				break;
 			default:
 				ILLEGAL_AND_EXIT();
 			}
 			break;
 		case RV32I_BRANCH: {
-			const auto offset = instr.Btype.signed_imm() / 4;
+			const int dstidx = index_of(PCRELA(instr.Btype.signed_imm()));
 			// goto branch: restarts function
-			bool ge = tinfo.has_branch && (offset == -(long) i);
+			bool ge = tinfo.has_branch && dstidx == 0;
 			// forward label: branch inside code block
 			int fl = 0;
-			if (offset > 0 && i+offset < tinfo.len) {
+			if (dstidx > i) {
 				// forward label: future address
-				fl = i+offset;
+				fl = dstidx;
 				labels.insert(fl);
-			} else if (tinfo.jump_locations.count(PCRELA(offset * 4))) {
+			} else if (dstidx > 0 && tinfo.jump_locations.count(pcs[dstidx])) {
 				// forward label: existing jump location
-				const int dstidx = i + offset;
-				if (dstidx > 0 && dstidx < tinfo.len) {
-					fl = dstidx;
-				}
+				fl = dstidx;
 			}
 			switch (instr.Btype.funct3) {
 			case 0x0: // EQ
-				add_branch<W>(code, { false, ge, fl }, " == ", tinfo, i, instr, func);
+				add_branch<W>(code, { false, ge, fl }, " == ", tinfo, i, current_pc, instr, func);
 				break;
 			case 0x1: // NE
-				add_branch<W>(code, { false, ge, fl }, " != ", tinfo, i, instr, func);
+				add_branch<W>(code, { false, ge, fl }, " != ", tinfo, i, current_pc, instr, func);
 				break;
 			case 0x2:
 			case 0x3:
 				ILLEGAL_AND_EXIT();
 				break;
 			case 0x4: // LT
-				add_branch<W>(code, { true, ge, fl }, " < ", tinfo, i, instr, func);
+				add_branch<W>(code, { true, ge, fl }, " < ", tinfo, i, current_pc, instr, func);
 				break;
 			case 0x5: // GE
-				add_branch<W>(code, { true, ge, fl }, " >= ", tinfo, i, instr, func);
+				add_branch<W>(code, { true, ge, fl }, " >= ", tinfo, i, current_pc, instr, func);
 				break;
 			case 0x6: // LTU
-				add_branch<W>(code, { false, ge, fl }, " < ", tinfo, i, instr, func);
+				add_branch<W>(code, { false, ge, fl }, " < ", tinfo, i, current_pc, instr, func);
 				break;
 			case 0x7: // GEU
-				add_branch<W>(code, { false, ge, fl }, " >= ", tinfo, i, instr, func);
+				add_branch<W>(code, { false, ge, fl }, " >= ", tinfo, i, current_pc, instr, func);
 				break;
 			} } break;
 		case RV32I_JALR: {
 			// jump to register + immediate
 			// NOTE: We need to remember RS1 because it can be clobbered by RD
-			add_code(code, "{addr_t jrs1 = " + from_reg(tinfo, instr.Itype.rs1) + ";");
+			add_code(code, "{addr_t jrs1 = " + from_reg(tinfo, instr.Itype.rs1) + " + " + from_imm(instr.Itype.signed_imm()) + ";");
 			if (instr.Itype.rd != 0) {
-				add_code(code, from_reg(instr.Itype.rd) + " = " + PCRELS(4) + ";");
+				add_code(code, from_reg(instr.Itype.rd) + " = " + PCRELS(ip[i].length) + ";");
 			}
-			add_code(code, 
-				"*cur_insn = c + " + std::to_string(i) + ";\n"
-				"api.jump(cpu, jrs1 + " + from_imm(instr.Itype.signed_imm()) + " - 4); }",
+			// Calls and returns into other translated blocks stay in
+			// native code, unless the instruction limit is reached
+			add_code(code,
+				"if (" + INSTRUCTION_COUNT(i) + " < local_max_insn) {\n"
+				"  Block next = lookup_block(jrs1);\n"
+				"  if (next.handler) { *cur_insn = " + INSTRUCTION_COUNT(i + 1) + "; cpu->pc = jrs1; return next; }\n"
+				"}\n"
+				"*cur_insn = " + INSTRUCTION_COUNT(i) + ";\n"
+				"api.jump(cpu, jrs1 - 4); }",
+				"return NO_BLOCK;",
 				"}");
 			} return;
 		case RV32I_JAL: {
 			if (instr.Jtype.rd != 0) {
-				add_code(code, from_reg(instr.Jtype.rd) + " = " + PCRELS(4) + ";\n");
+				add_code(code, from_reg(instr.Jtype.rd) + " = " + PCRELS(ip[i].length) + ";\n");
 			}
 			// forward label: jump inside code block
-			const auto offset = instr.Jtype.jump_offset() / 4;
-			int fl = i+offset;
-			if (fl > 0 && fl < tinfo.len) {
+			const int fl = index_of(PCRELA(instr.Jtype.jump_offset()));
+			if (fl > 0) {
 				// forward labels require creating future labels
 				if (fl > i)
 					labels.insert(fl);
 				// this is a jump back to the start of the function
-				add_code(code, "c += " + std::to_string(i) + "; if (" + LOOP_EXPRESSION + ") goto " + FUNCLABEL(fl) + ";");
+				code += jump_to_label(i, fl, FUNCLABEL(fl));
 				// if we run out of instructions, we must exit:
 				add_code(code,
-					"*cur_insn = c;\n"
+					"*cur_insn = " + INSTRUCTION_COUNT(i) + ";\n"
 					"api.jump(cpu, " + PCRELS(instr.Jtype.jump_offset() - 4) + ");\n"
-					"return;");
+					"return NO_BLOCK;");
 			} else {
 				// Because of forward jumps we can't end the function here
+				add_transfer<W>(code, tinfo, i, PCRELA(instr.Jtype.jump_offset()));
 				add_code(code,
-					"*cur_insn = c + " + std::to_string(i) + ";\n"
+					"*cur_insn = " + INSTRUCTION_COUNT(i) + ";\n"
 					"api.jump(cpu, " + PCRELS(instr.Jtype.jump_offset() - 4) + ");\n"
-					"return;");
+					"return NO_BLOCK;");
 			} } break;
 		case RV32I_OP_IMM: {
 			// NOP
@@ -495,9 +534,9 @@ void CPU<W>::emit(std::string& code, const std::string& func, TransInstr<W>* ip,
 				);
 				break;
 			default:
-				ILLEGAL_AND_EXIT();
-				//fprintf(stderr, "RV32I_OP: Unhandled function 0x%X\n",
-				//		instr.Rtype.jumptable_friendly_op());
+				// Blocks can be entered after any call, so leave
+				// the rest of the extensions to the emulator
+				code += "api.execute(cpu, " + std::to_string(instr.whole) + ");\n";
 			}
 			break;
 		case RV32I_LUI:
@@ -518,20 +557,20 @@ void CPU<W>::emit(std::string& code, const std::string& func, TransInstr<W>* ip,
 			if (instr.Itype.funct3 == 0x0) {
 				if (instr.Itype.imm == 0) {
 					code += "cpu->pc = " + PCRELS(0) + "; "
-							"*cur_insn = c;\n";
+							"*cur_insn = " + INSTRUCTION_COUNT(i) + ";\n";
 					code += "if (UNLIKELY(api.syscall(cpu, " + from_reg(17) + ")))\n"
-					       "  return;\n";
+					       "  return NO_BLOCK;\n";
 					code += "local_max_insn = *max_insn;\n";
 					break;
 				} if (instr.Itype.imm == 1) {
 					code += "cpu->pc = " + PCRELS(0) + "; "
-							"*cur_insn = c;\n";
-					code += "api.ebreak(cpu);\nreturn;\n";
+							"*cur_insn = " + INSTRUCTION_COUNT(i) + ";\n";
+					code += "api.ebreak(cpu);\nreturn NO_BLOCK;\n";
 					break;
 				} if (instr.Itype.imm == 261) {
 					code += "cpu->pc = " + PCRELS(0) + "; "
-							"*cur_insn = c;\n";
-					code += "api.stop(cpu);\nreturn;\n";
+							"*cur_insn = " + INSTRUCTION_COUNT(i) + ";\n";
+					code += "api.stop(cpu);\nreturn NO_BLOCK;\n";
 					break;
 				} else {
 					code += "api.system(cpu, " + std::to_string(instr.whole) +");\n";
@@ -562,7 +601,7 @@ void CPU<W>::emit(std::string& code, const std::string& func, TransInstr<W>* ip,
 				}
 				break;
 			default:
-				ILLEGAL_AND_EXIT();
+				code += "api.execute(cpu, " + std::to_string(instr.whole) + ");\n";
 			}
 			} break;
 		case RV64I_OP32: {
@@ -618,6 +657,9 @@ void CPU<W>::emit(std::string& code, const std::string& func, TransInstr<W>* ip,
 			case 0x40: // ADDUW
 				add_code(code, dst + " = " + from_reg(tinfo, instr.Rtype.rs2) + " + " + src1 + ";");
 				break;
+			case 0x44: // ZEXT.H
+				add_code(code, dst + " = (uint16_t)" + src1 + ";");
+				break;
 			case 0x102: // SH1ADD.UW
 				add_code(code, dst + " = " + from_reg(tinfo, instr.Rtype.rs2) + " + (" + src1 + " << 1);");
 				break;
@@ -628,7 +670,7 @@ void CPU<W>::emit(std::string& code, const std::string& func, TransInstr<W>* ip,
 				add_code(code, dst + " = " + from_reg(tinfo, instr.Rtype.rs2) + " + (" + src1 + " << 3);");
 				break;
 			default:
-				ILLEGAL_AND_EXIT();
+				code += "api.execute(cpu, " + std::to_string(instr.whole) + ");\n";
 			}
 			} break;
 		case RV32F_LOAD: {
@@ -636,10 +678,10 @@ void CPU<W>::emit(std::string& code, const std::string& func, TransInstr<W>* ip,
 			const auto addr = from_reg(tinfo, fi.Itype.rs1) + " + " + from_imm(fi.Itype.signed_imm());
 			switch (fi.Itype.funct3) {
 			case 0x2: // FLW
-				code += "load_fl(&" + from_fpreg(fi.Itype.rd) + ", api.mem_ld32(cpu, " + addr + "));\n";
+				code += "load_fl(&" + from_fpreg(fi.Itype.rd) + ", rd32(cpu, " + addr + "));\n";
 				break;
 			case 0x3: // FLD
-				code += "load_dbl(&" + from_fpreg(fi.Itype.rd) + ", api.mem_ld64(cpu, " + addr + "));\n";
+				code += "load_dbl(&" + from_fpreg(fi.Itype.rd) + ", rd64(cpu, " + addr + "));\n";
 				break;
 			default:
 				code += "api.execute(cpu, " + std::to_string(instr.whole) + ");\n";
@@ -651,10 +693,10 @@ void CPU<W>::emit(std::string& code, const std::string& func, TransInstr<W>* ip,
 			const auto addr = from_reg(tinfo, fi.Stype.rs1) + " + " + from_imm(fi.Stype.signed_imm());
 			switch (fi.Itype.funct3) {
 			case 0x2: // FSW
-				code += "api.mem_st32(cpu, " + addr + ", " + from_fpreg(fi.Stype.rs2) + ".i32[0]);\n";
+				code += "wr32(cpu, " + addr + ", " + from_fpreg(fi.Stype.rs2) + ".i32[0]);\n";
 				break;
 			case 0x3: // FSD
-				code += "api.mem_st64(cpu, " + addr + ", " + from_fpreg(fi.Stype.rs2) + ".i64);\n";
+				code += "wr64(cpu, " + addr + ", " + from_fpreg(fi.Stype.rs2) + ".i64);\n";
 				break;
 			default:
 				code += "api.execute(cpu, " + std::to_string(instr.whole) + ");\n";
@@ -840,8 +882,9 @@ void CPU<W>::emit(std::string& code, const std::string& func, TransInstr<W>* ip,
 	}
 	// If the function ends with an unimplemented instruction,
 	// we must gracefully finish, setting new PC and incrementing IC
-	code += "cpu->pc += " + std::to_string((tinfo.len-1) * 4) + ";\n"
-			"*cur_insn = c + " + std::to_string(tinfo.len-1) + ";\n"
+	code += "cpu->pc = " + std::to_string(pcs[tinfo.len] - 4) + "UL;\n"
+			"*cur_insn = " + INSTRUCTION_COUNT(tinfo.len-1) + ";\n"
+			"return NO_BLOCK;\n"
 			"}\n";
 }
 
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cmath>
 #include <dlfcn.h>
 #include <unistd.h>
@@ -5,9 +6,11 @@
 #include "decoder_cache.hpp"
 #include "instruction_list.hpp"
 #include "rv32i_instr.hpp"
+#include "rvc.hpp"
 #include "tr_api.hpp"
 #include "tr_types.hpp"
 #include "util/crc32.hpp"
+#include <thread>
 #include <unordered_set>
 //#define BINTR_TIMING
 
@@ -64,15 +67,185 @@ inline DecoderData<W>& decoder_entry_at(const DecodedExecuteSegment<W>& exec, ad
 	return exec.decoder_cache()[addr / DecoderCache<W>::DIVISOR];
 }
 
+#ifdef RISCV_EXT_COMPRESSED
+// Encodings of 32-bit instructions, for expanding compressed instructions
+static constexpr uint32_t encode_itype(uint32_t opcode, uint32_t rd, uint32_t funct3, uint32_t rs1, int32_t imm) {
+	return opcode | (rd << 7) | (funct3 << 12) | (rs1 << 15) | (uint32_t(imm) << 20);
+}
+static constexpr uint32_t encode_stype(uint32_t opcode, uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+	return opcode | ((imm & 0x1F) << 7) | (funct3 << 12) | (rs1 << 15) | (rs2 << 20) | (((imm >> 5) & 0x7F) << 25);
+}
+static constexpr uint32_t encode_rtype(uint32_t opcode, uint32_t rd, uint32_t funct3, uint32_t rs1, uint32_t rs2, uint32_t funct7) {
+	return opcode | (rd << 7) | (funct3 << 12) | (rs1 << 15) | (rs2 << 20) | (funct7 << 25);
+}
+static constexpr uint32_t encode_btype(uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+	return RV32I_BRANCH | (((imm >> 11) & 0x1) << 7) | (((imm >> 1) & 0xF) << 8) | (funct3 << 12)
+		| (rs1 << 15) | (rs2 << 20) | (((imm >> 5) & 0x3F) << 25) | (((imm >> 12) & 0x1) << 31);
+}
+static constexpr uint32_t encode_jtype(uint32_t rd, int32_t imm) {
+	return RV32I_JAL | (rd << 7) | (imm & 0xFF000) | (((imm >> 11) & 0x1) << 20)
+		| (((imm >> 1) & 0x3FF) << 21) | (((imm >> 20) & 0x1) << 31);
+}
+static constexpr uint32_t RV32I_NOP = encode_itype(RV32I_OP_IMM, 0, 0, 0, 0);
+
+// Follows the decoding of the interpreter, see instr_decoding.inc
+template <int W>
+uint32_t expand_compressed(const uint16_t bits)
+{
+	static constexpr bool is64 = (W == 8);
+	const rv32c_instruction ci {bits};
+	switch (ci.opcode())
+	{
+	// Quadrant 0
+	case RISCV_CI_CODE(0b000, 0b00): // C.ADDI4SPN
+		if (ci.whole == 0x0)
+			return 0;
+		return encode_itype(RV32I_OP_IMM, ci.CIW.srd + 8, 0x0, REG_SP, ci.CIW.offset());
+	case RISCV_CI_CODE(0b001, 0b00): // C.FLD
+		return encode_itype(RV32F_LOAD, ci.CL.srd + 8, 0x3, ci.CL.srs1 + 8, ci.CSD.offset8());
+	case RISCV_CI_CODE(0b010, 0b00): // C.LW
+		return encode_itype(RV32I_LOAD, ci.CL.srd + 8, 0x2, ci.CL.srs1 + 8, ci.CL.offset());
+	case RISCV_CI_CODE(0b011, 0b00): // C.LD / C.FLW
+		if constexpr (is64)
+			return encode_itype(RV32I_LOAD, ci.CSD.srs2 + 8, 0x3, ci.CSD.srs1 + 8, ci.CSD.offset8());
+		else
+			return encode_itype(RV32F_LOAD, ci.CL.srd + 8, 0x2, ci.CL.srs1 + 8, ci.CL.offset());
+	case RISCV_CI_CODE(0b101, 0b00): // C.FSD
+		return encode_stype(RV32F_STORE, 0x3, ci.CSD.srs1 + 8, ci.CSD.srs2 + 8, ci.CSD.offset8());
+	case RISCV_CI_CODE(0b110, 0b00): // C.SW
+		return encode_stype(RV32I_STORE, 0x2, ci.CS.srs1 + 8, ci.CS.srs2 + 8, ci.CS.offset4());
+	case RISCV_CI_CODE(0b111, 0b00): // C.SD / C.FSW
+		if constexpr (is64)
+			return encode_stype(RV32I_STORE, 0x3, ci.CSD.srs1 + 8, ci.CSD.srs2 + 8, ci.CSD.offset8());
+		else
+			return encode_stype(RV32F_STORE, 0x2, ci.CS.srs1 + 8, ci.CS.srs2 + 8, ci.CS.offset4());
+	// Quadrant 1
+	case RISCV_CI_CODE(0b000, 0b01): // C.ADDI
+		if (ci.CI.rd == 0)
+			return RV32I_NOP;
+		return encode_itype(RV32I_OP_IMM, ci.CI.rd, 0x0, ci.CI.rd, ci.CI.signed_imm());
+	case RISCV_CI_CODE(0b001, 0b01): // C.ADDIW / C.JAL
+		if constexpr (is64) {
+			if (ci.CI.rd == 0)
+				return RV32I_NOP;
+			return encode_itype(RV64I_OP_IMM32, ci.CI.rd, 0x0, ci.CI.rd, ci.CI.signed_imm());
+		} else
+			return encode_jtype(REG_RA, ci.CJ.signed_imm());
+	case RISCV_CI_CODE(0b010, 0b01): // C.LI
+		if (ci.CI.rd == 0)
+			return RV32I_NOP;
+		return encode_itype(RV32I_OP_IMM, ci.CI.rd, 0x0, 0, ci.CI.signed_imm());
+	case RISCV_CI_CODE(0b011, 0b01): // C.ADDI16SP / C.LUI
+		if (ci.CI.rd == REG_SP)
+			return encode_itype(RV32I_OP_IMM, REG_SP, 0x0, REG_SP, ci.CI16.signed_imm());
+		if (ci.CI.rd == 0)
+			return 0;
+		return RV32I_LUI | (ci.CI.rd << 7) | (ci.CI.upper_imm() & 0xFFFFF000);
+	case RISCV_CI_CODE(0b100, 0b01): { // C.SRLI, C.SRAI, C.ANDI and C.SUB etc.
+		const uint32_t rd = ci.CA.srd + 8;
+		const uint32_t shift = is64 ? ci.CAB.shift64_imm() : ci.CAB.shift_imm();
+		switch (ci.CA.funct6 & 0x3) {
+		case 0: // C.SRLI
+			return encode_itype(RV32I_OP_IMM, rd, 0x5, rd, shift);
+		case 1: // C.SRAI
+			return encode_itype(RV32I_OP_IMM, rd, 0x5, rd, 0x400 | (ci.CAB.shift64_imm() & (W * 8 - 1)));
+		case 2: // C.ANDI
+			return encode_itype(RV32I_OP_IMM, rd, 0x7, rd, ci.CAB.signed_imm());
+		}
+		const uint32_t rs2 = ci.CA.srs2 + 8;
+		switch (ci.CA.funct2 | (ci.CA.funct6 & 0x4)) {
+		case 0: // C.SUB
+			return encode_rtype(RV32I_OP, rd, 0x0, rd, rs2, 0x20);
+		case 1: // C.XOR
+			return encode_rtype(RV32I_OP, rd, 0x4, rd, rs2, 0x0);
+		case 2: // C.OR
+			return encode_rtype(RV32I_OP, rd, 0x6, rd, rs2, 0x0);
+		case 3: // C.AND
+			return encode_rtype(RV32I_OP, rd, 0x7, rd, rs2, 0x0);
+		case 4: // C.SUBW
+			if constexpr (is64)
+				return encode_rtype(RV64I_OP32, rd, 0x0, rd, rs2, 0x20);
+			return 0;
+		case 5: // C.ADDW
+			if constexpr (is64)
+				return encode_rtype(RV64I_OP32, rd, 0x0, rd, rs2, 0x0);
+			return 0;
+		}
+		return 0;
+	}
+	case RISCV_CI_CODE(0b101, 0b01): // C.J
+		return encode_jtype(0, ci.CJ.signed_imm());
+	case RISCV_CI_CODE(0b110, 0b01): // C.BEQZ
+		return encode_btype(0x0, ci.CB.srs1 + 8, 0, ci.CB.signed_imm());
+	case RISCV_CI_CODE(0b111, 0b01): // C.BNEZ
+		return encode_btype(0x1, ci.CB.srs1 + 8, 0, ci.CB.signed_imm());
+	// Quadrant 2
+	case RISCV_CI_CODE(0b000, 0b10): // C.SLLI
+		if (ci.CI.rd == 0)
+			return RV32I_NOP;
+		return encode_itype(RV32I_OP_IMM, ci.CI.rd, 0x1, ci.CI.rd,
+			is64 ? ci.CI.shift64_imm() : ci.CI.shift_imm());
+	case RISCV_CI_CODE(0b001, 0b10): // C.FLDSP
+		return encode_itype(RV32F_LOAD, ci.CIFLD.rd, 0x3, REG_SP, ci.CIFLD.offset());
+	case RISCV_CI_CODE(0b010, 0b10): // C.LWSP
+		if (ci.CI2.rd == 0)
+			return RV32I_NOP;
+		return encode_itype(RV32I_LOAD, ci.CI2.rd, 0x2, REG_SP, ci.CI2.offset());
+	case RISCV_CI_CODE(0b011, 0b10): // C.LDSP / C.FLWSP
+		if constexpr (is64) {
+			if (ci.CIFLD.rd == 0) // Reserved
+				return 0;
+			return encode_itype(RV32I_LOAD, ci.CIFLD.rd, 0x3, REG_SP, ci.CIFLD.offset());
+		}
+		else
+			return encode_itype(RV32F_LOAD, ci.CI2.rd, 0x2, REG_SP, ci.CI2.offset());
+	case RISCV_CI_CODE(0b100, 0b10): { // C.JR, C.JALR, C.MV and C.ADD
+		const bool topbit = ci.whole & (1 << 12);
+		if (ci.CR.rd == 0) // C.EBREAK and hints
+			return 0;
+		if (ci.CR.rs2 == 0) // C.JR / C.JALR
+			return encode_itype(RV32I_JALR, topbit ? REG_RA : 0, 0x0, ci.CR.rd, 0);
+		return encode_rtype(RV32I_OP, ci.CR.rd, 0x0, topbit ? ci.CR.rd : 0, ci.CR.rs2, 0x0);
+	}
+	case RISCV_CI_CODE(0b101, 0b10): // C.FSDSP
+		return encode_stype(RV32F_STORE, 0x3, REG_SP, ci.CSFSD.rs2, ci.CSFSD.offset());
+	case RISCV_CI_CODE(0b110, 0b10): // C.SWSP
+		return encode_stype(RV32I_STORE, 0x2, REG_SP, ci.CSS.rs2, ci.CSS.offset(4));
+	case RISCV_CI_CODE(0b111, 0b10): // C.SDSP / C.FSWSP
+		if constexpr (is64)
+			return encode_stype(RV32I_STORE, 0x3, REG_SP, ci.CSFSD.rs2, ci.CSFSD.offset());
+		else
+			return encode_stype(RV32F_STORE, 0x2, REG_SP, ci.CSS.rs2, ci.CSS.offset(4));
+	}
+	return 0;
+}
+#endif
+
 template <int W>
 struct NamedIPair {
 	address_type<W> addr;
 	std::string symbol;
 };
 
+static std::vector<ProfileEntry> load_translation_profile(std::string_view filename)
+{
+	std::vector<ProfileEntry> entries;
+	if (filename.empty())
+		return entries;
+	FILE* f = fopen(std::string(filename).c_str(), "rb");
+	if (f == nullptr)
+		return entries;
+	ProfileEntry entry;
+	while (fread(&entry, sizeof(entry), 1, f) == 1)
+		entries.push_back(entry);
+	fclose(f);
+	return entries;
+}
+
 template <int W>
 int CPU<W>::load_translation(const MachineOptions<W>& options,
-	std::string* filename) const
+	std::string* filename, std::vector<ProfileEntry>* profile,
+	const DecodedExecuteSegment<W>& exec) const
 {
 	// Disable translator with NO_TRANSLATE=1
 	// or by setting max blocks to zero.
@@ -87,16 +260,22 @@ int CPU<W>::load_translation(const MachineOptions<W>& options,
 		throw MachineException(ILLEGAL_OPERATION, "Machine already reports binary translation");
 	}
 
-	const auto& exec = this->machine().memory.main_execute_segment();
 	auto* exec_data = exec.exec_data(exec.exec_begin());
 
-	// Checksum the execute segment + compiler flags
+	// Checksum the execute segment + compiler flags + the API
+	// that the dylib is built against
 	TIME_POINT(t5);
 	extern std::string compile_command(int arch);
+	extern const std::string bintr_code;
 	const auto cc = compile_command(W);
-	const uint32_t checksum =
+	uint32_t checksum =
 		crc32c(exec_data, exec.exec_end() - exec.exec_begin())
-		^ crc32c(cc.c_str(), cc.size());
+		^ crc32c(cc.c_str(), cc.size())
+		^ crc32c(bintr_code.c_str(), bintr_code.size());
+	// Different profiles produce different translations
+	auto entries = load_translation_profile(options.translate_profile);
+	if (!entries.empty())
+		checksum ^= crc32c(entries.data(), entries.size() * sizeof(ProfileEntry));
 
 	char filebuffer[256];
 	int len = snprintf(filebuffer, sizeof(filebuffer),
@@ -120,14 +299,17 @@ int CPU<W>::load_translation(const MachineOptions<W>& options,
 	#endif
 	}
 
+	// An unusable file is compiled again (activate_dylib closes it)
+	if (dylib != nullptr && !this->activate_dylib(exec, dylib))
+		dylib = nullptr;
+
 	// We must compile ourselves
 	if (dylib == nullptr) {
 		if (filename) *filename = std::string(filebuffer);
+		if (profile) *profile = std::move(entries);
 		return 1;
 	}
 
-	this->activate_dylib(dylib);
-
 	// close dylib when machine is destructed
 	machine().memory.set_binary_translated(dylib);
 #ifdef BINTR_TIMING
@@ -139,23 +321,32 @@ int CPU<W>::load_translation(const MachineOptions<W>& options,
 
 template <int W>
 void CPU<W>::try_translate(const MachineOptions<W>& options,
-	const std::string& filename, address_t basepc, std::vector<TransInstr<W>> ipairs) const
+	const std::string& filename, const std::vector<ProfileEntry>& profile_entries,
+	const DecodedExecuteSegment<W>& exec,
+	address_t basepc, std::vector<TransInstr<W>> ipairs) const
 {
 	// Run with VERBOSE=1 to see command and output
 	const bool verbose = (getenv("VERBOSE") != nullptr);
 
+#ifdef RISCV_EXT_COMPRESSED
+	// Compressed instructions are translated as their 32-bit equivalents
+	for (auto& ti : ipairs) {
+		if (ti.length == 2)
+			ti.instr = expand_compressed<W>(uint16_t(ti.instr));
+	}
+#endif
+
 	address_t gp = 0;
 	TIME_POINT(t0);
 if constexpr (SCAN_FOR_GP) {
 	// We assume that GP is initialized with AUIPC,
 	// followed by OP_IMM (and maybe OP_IMM32)
-	for (auto it = ipairs.begin(); it != ipairs.end(); ++it) {
+	address_t pc = basepc;
+	for (auto it = ipairs.begin(); it + 1 < ipairs.end(); pc += it->length, ++it) {
 		const rv32i_instruction instruction {it->instr};
 		if (instruction.opcode() == RV32I_AUIPC) {
 			const auto auipc = instruction;
 			if (auipc.Utype.rd == 3) { // GP
-				// calculate current PC for AUIPC
-				const address_t pc = basepc + 4 * (it - ipairs.begin());
 				const auto addi = rv32i_instruction {(it+1)->instr};
 				if (addi.opcode() == RV32I_OP_IMM && addi.Itype.funct3 == 0x0) {
 					//printf("Found OP_IMM: ADDI  rd=%d, rs1=%d\n", addi.Itype.rd, addi.Itype.rs1);
@@ -179,19 +370,30 @@ if constexpr (SCAN_FOR_GP) {
 	auto it = ipairs.begin();
 	std::vector<std::pair<decltype(it), address_t>> loops;
 	struct CodeBlock {
-		TransInstr<W>& instr;
+		TransInstr<W>* instr;
 		size_t      length;
 		address_t   addr;
 		bool        has_branch;
 		std::set<address_t> jump_locations;
+		uint64_t    executed;
 	};
 	std::vector<CodeBlock> blocks;
 	std::set<address_t> jump_locations;
 
-	while (it != ipairs.end() && icounter < options.translate_instr_max)
+	// With a profile every block is considered, and the
+	// most executed ones are picked after the scan
+	std::unordered_map<address_t, uint64_t> profile;
+	for (const auto& entry : profile_entries)
+		profile[entry.addr] += entry.count;
+	const bool profiled = !profile.empty();
+	uint64_t profile_total = 0;
+
+	while (it != ipairs.end() && (profiled || icounter < options.translate_instr_max))
 	{
 		const auto block = it;
 		bool has_branch = false;
+		bool untranslatable = false;
+		uint64_t executed = 0;
 		// Measure length of instructions that belong
 		// together sequentially (a code block).
 		auto current_pc = basepc;
@@ -200,10 +402,22 @@ if constexpr (SCAN_FOR_GP) {
 			const rv32i_instruction instruction{it->instr};
 			const auto opcode = instruction.opcode();
 
+			// Compressed instructions without a 32-bit equivalent
+			// end the block, and are left to the interpreter
+			if (it->length == 2 && it->instr == 0) {
+				untranslatable = true;
+				break;
+			}
+			if (profiled) {
+				auto pit = profile.find(current_pc);
+				if (pit != profile.end())
+					executed += pit->second;
+			}
+
 			// JALR is a show-stopper / code-blocker
 			if (opcode == RV32I_JALR)
 			{
-				current_pc += 4;
+				current_pc += it->length;
 				++it; break;
 			}
 			// loop detection (negative branch offsets)
@@ -217,31 +431,66 @@ if constexpr (SCAN_FOR_GP) {
 				has_branch = true;
 				const auto offset = instruction.Jtype.jump_offset();
 				jump_locations.insert(current_pc + offset);
+				// Calls end the block, so that the return address
+				// begins a block that translated returns can continue in
+				if (instruction.Jtype.rd != 0) {
+					current_pc += it->length;
+					++it; break;
+				}
 			}
 
-			current_pc += 4;
+			current_pc += it->length;
 		} // find block
 
 		// Process block and add it for emission
 		const size_t length = it - block;
+		profile_total += executed;
 		if (length >= options.block_size_treshold
-			&& icounter + length < options.translate_instr_max)
+			&& (profiled || icounter + length < options.translate_instr_max))
 		{
 			if constexpr (VERBOSE_BLOCKS) {
 				printf("Block found at %#lX. Length: %zu\n", (long) basepc, length);
 			}
 			blocks.push_back({
-				*block, length, basepc, has_branch,
-				std::move(jump_locations)
+				&*block, length, basepc, has_branch,
+				std::move(jump_locations), executed
 			});
 			icounter += length;
 			// we can't translate beyond this estimate, otherwise
 			// the compiler will never finish code generation
-			if (blocks.size() >= options.translate_blocks_max)
+			if (!profiled && blocks.size() >= options.translate_blocks_max)
 				break;
 		}
+		if (untranslatable) {
+			current_pc += it->length;
+			++it;
+		}
 		basepc = current_pc;
 	}
+
+	if (profiled) {
+		// Pick the most executed blocks within the same limits,
+		// and leave out blocks that were never executed
+		std::stable_sort(blocks.begin(), blocks.end(),
+			[] (const CodeBlock& a, const CodeBlock& b) { return a.executed > b.executed; });
+		std::vector<CodeBlock> hot_blocks;
+		icounter = 0;
+		uint64_t covered = 0;
+		for (auto& block : blocks) {
+			if (block.executed == 0 || hot_blocks.size() >= options.translate_blocks_max)
+				break;
+			if (icounter + block.length >= options.translate_instr_max)
+				continue;
+			icounter += block.length;
+			covered += block.executed;
+			hot_blocks.push_back(std::move(block));
+		}
+		blocks = std::move(hot_blocks);
+		if (verbose) {
+			printf("Translated blocks cover %.1f%% of the profiled instructions\n",
+				profile_total ? 100.0 * covered / profile_total : 0.0);
+		}
+	}
 #ifdef BINTR_TIMING
 	TIME_POINT(t3);
 	printf(">> Code block detection %ld ns\n", nanodiff(t2, t3));
@@ -252,18 +501,67 @@ if constexpr (SCAN_FOR_GP) {
 	extern const std::string bintr_code;
 	std::string code = bintr_code;
 
+	std::set<address_t> block_entries;
 	for (const auto& block : blocks)
 	{
-		std::string func =
-			"f" + std::to_string(block.addr);
-		emit(code, func, &block.instr, {
+		block_entries.insert(block.addr);
+		code += "static Block " + translated_function_name<W>(block.addr) + "(CPU*);\n";
+	}
+
+	for (auto& block : blocks)
+	{
+		const std::string func = translated_function_name<W>(block.addr);
+		emit(code, func, block.instr, {
 			block.addr, gp, (int)block.length,
 			block.has_branch,
 			true, // forward jumps
-			std::move(block.jump_locations)
+			std::move(block.jump_locations),
+			block_entries
 		});
-		dlmappings.push_back({block.addr, std::move(func)});
+		// The entry point from the emulator runs blocks until one
+		// of them returns to the emulator
+		code += "extern void " + func + "_entry(CPU* cpu) {\n"
+			"run_blocks(cpu, " + func + ");\n}\n";
+		dlmappings.push_back({block.addr, func + "_entry"});
+	}
+
+	// Open addressing hash table of all blocks, for indirect jumps
+	size_t jump_table_size = 1;
+	while (jump_table_size < 2 * blocks.size())
+		jump_table_size <<= 1;
+	std::vector<const CodeBlock*> jump_table(jump_table_size);
+	for (const auto& block : blocks)
+	{
+		size_t h = (block.addr >> 1) & (jump_table_size - 1);
+		while (jump_table[h] != nullptr)
+			h = (h + 1) & (jump_table_size - 1);
+		jump_table[h] = &block;
 	}
+	code += "#define JUMP_TABLE_MASK " + std::to_string(jump_table_size - 1) + "\n";
+	code += R"V0G0N(
+static const struct JumpTarget {
+	addr_t addr;
+	Block (*handler)(CPU*);
+} jump_table[JUMP_TABLE_MASK + 1] = {
+)V0G0N";
+	for (size_t h = 0; h < jump_table_size; h++)
+	{
+		if (jump_table[h] != nullptr)
+			code += "[" + std::to_string(h) + "] = {" + std::to_string(jump_table[h]->addr) + "UL, "
+				+ translated_function_name<W>(jump_table[h]->addr) + "},\n";
+	}
+	code += R"V0G0N(};
+static Block lookup_block(addr_t addr)
+{
+	unsigned h = (addr >> 1) & JUMP_TABLE_MASK;
+	while (jump_table[h].handler) {
+		if (jump_table[h].addr == addr)
+			return (Block){jump_table[h].handler};
+		h = (h + 1) & JUMP_TABLE_MASK;
+	}
+	return NO_BLOCK;
+}
+)V0G0N";
 	// Append all instruction handler -> dl function mappings
 	code += "const uint32_t no_mappings = "
 		+ std::to_string(dlmappings.size()) + ";\n";
@@ -301,8 +599,22 @@ const struct Mapping mappings[] = {
 		return;
 	}
 
-	TIME_POINT(t9);
 	extern void* compile(const std::string& code, int arch, const char*);
+	if (options.translate_background) {
+		// The translation is activated by the machine once it is
+		// ready, see Memory::activate_background_translation()
+		auto bt = std::make_shared<BackgroundTranslation>();
+		bt->filename = filename;
+		bt->exec_begin = exec.exec_begin();
+		bt->thread = std::thread([bt = bt.get(), code = std::move(code)] {
+			bt->dylib = compile(code, W, bt->filename.c_str());
+			bt->done.store(true, std::memory_order_release);
+		});
+		machine().memory.set_background_translation(std::move(bt));
+		return;
+	}
+
+	TIME_POINT(t9);
 	void* dylib = compile(code, W, filename.c_str());
 #ifdef BINTR_TIMING
 	TIME_POINT(t10);
@@ -313,7 +625,7 @@ const struct Mapping mappings[] = {
 		return;
 	}
 
-	this->activate_dylib(dylib);
+	this->activate_dylib(exec, dylib);
 
 #ifndef RISCV_TRANSLATION_CACHE
 	// Delete the program if the shared ELF is unwanted
@@ -329,7 +641,7 @@ const struct Mapping mappings[] = {
 }
 
 template <int W>
-void CPU<W>::activate_dylib(void* dylib) const
+bool CPU<W>::activate_dylib(const DecodedExecuteSegment<W>& exec, void* dylib) const
 {
 	TIME_POINT(t11);
 	// map the API callback table
@@ -340,10 +652,20 @@ void CPU<W>::activate_dylib(void* dylib) const
 			fprintf(stderr, "libriscv: Could not find dylib init function\n");
 		}
 		dlclose(dylib);
-		return;
+		return false;
 	}
 
-	auto func = (void (*)(const CallbackTable<W>&, uint64_t*, uint64_t*)) ptr;
+	// The dylib may be shared by several machines, but the instruction
+	// counters and the page caches are always at the same offset from
+	// their CPU
+	const auto& memory = machine().memory;
+	const auto counters = m_machine.get_counters();
+	const intptr_t cur_icount = (const char*)&counters.first - (const char*)this;
+	const intptr_t max_icount = (const char*)&counters.second - (const char*)this;
+	const intptr_t rd_cache = (const char*)memory.read_page_cache() - (const char*)this;
+	const intptr_t wr_cache = (const char*)memory.write_page_cache() - (const char*)this;
+
+	auto func = (void (*)(const CallbackTable<W>&, intptr_t, intptr_t, intptr_t, intptr_t)) ptr;
 	func(CallbackTable<W>{
 		.mem_read8 = [] (CPU<W>& cpu, address_type<W> addr) -> uint8_t {
 			return cpu.machine().memory.template read<uint8_t> (addr);
@@ -406,8 +728,7 @@ void CPU<W>::activate_dylib(void* dylib) const
 			return std::sqrt(d);
 		},
 	},
-	&m_machine.get_counters().first,
-	&m_machine.get_counters().second);
+	cur_icount, max_icount, rd_cache, wr_cache);
 
 	// Map all the functions to instruction handlers
 	uint32_t* no_mappings = (uint32_t *)dlsym(dylib, "no_mappings");
@@ -422,11 +743,10 @@ void CPU<W>::activate_dylib(void* dylib) const
 	}
 
 	// Apply mappings to decoder cache
-	auto& main_exec = machine().memory.main_execute_segment();
 	const auto nmappings = *no_mappings;
 	for (size_t i = 0; i < nmappings; i++) {
 		if (mappings[i].handler != nullptr) {
-			auto& entry = decoder_entry_at(main_exec, mappings[i].addr);
+			auto& entry = decoder_entry_at(exec, mappings[i].addr);
 			entry.set_insn_handler((instruction_handler<W>) mappings[i].handler);
 		}
 	}
@@ -435,17 +755,69 @@ void CPU<W>::activate_dylib(void* dylib) const
 	TIME_POINT(t12);
 	printf(">> Binary translation activation %ld ns\n", nanodiff(t11, t12));
 #endif
+	return true;
 }
 
-	template void CPU<4>::try_translate(const MachineOptions<4>&, const std::string&, address_t, std::vector<TransInstr<4>>) const;
-	template void CPU<8>::try_translate(const MachineOptions<8>&, const std::string&, address_t, std::vector<TransInstr<8>>) const;
-	template int CPU<4>::load_translation(const MachineOptions<4>&, std::string*) const;
-	template int CPU<8>::load_translation(const MachineOptions<8>&, std::string*) const;
-	template void CPU<4>::activate_dylib(void*) const;
-	template void CPU<8>::activate_dylib(void*) const;
+template <int W>
+void CPU<W>::simulate_profiling(uint64_t max)
+{
+	// Calculate the instruction limit
+	if (max != UINT64_MAX)
+		machine().set_max_instructions(machine().instruction_counter() + max);
+	else
+		machine().set_max_instructions(UINT64_MAX);
+
+	while (machine().instruction_counter() < machine().max_instructions()) {
+		this->m_profile[this->pc()] ++;
+		this->step_one();
+	}
+}
+
+template <int W>
+void CPU<W>::store_translation_profile(const std::string& filename) const
+{
+	std::vector<ProfileEntry> entries;
+	entries.reserve(m_profile.size());
+	for (const auto& it : m_profile)
+		entries.push_back({uint64_t(it.first), it.second});
+	std::sort(entries.begin(), entries.end(),
+		[] (const ProfileEntry& a, const ProfileEntry& b) { return a.addr < b.addr; });
+
+	FILE* f = fopen(filename.c_str(), "wb");
+	if (f == nullptr)
+		throw MachineException(ILLEGAL_OPERATION, "Unable to store translation profile");
+	const bool success =
+		fwrite(entries.data(), sizeof(ProfileEntry), entries.size(), f) == entries.size();
+	if (fclose(f) != 0 || !success)
+		throw MachineException(ILLEGAL_OPERATION, "Unable to store translation profile");
+}
 
-	static_assert(!compressed_enabled,
-		"C-extension incompatible with binary translation");
+	template void CPU<4>::try_translate(const MachineOptions<4>&, const std::string&, const std::vector<ProfileEntry>&, const DecodedExecuteSegment<4>&, address_t, std::vector<TransInstr<4>>) const;
+	template void CPU<8>::try_translate(const MachineOptions<8>&, const std::string&, const std::vector<ProfileEntry>&, const DecodedExecuteSegment<8>&, address_t, std::vector<TransInstr<8>>) const;
+	template int CPU<4>::load_translation(const MachineOptions<4>&, std::string*, std::vector<ProfileEntry>*, const DecodedExecuteSegment<4>&) const;
+	template int CPU<8>::load_translation(const MachineOptions<8>&, std::string*, std::vector<ProfileEntry>*, const DecodedExecuteSegment<8>&) const;
+	template bool CPU<4>::activate_dylib(const DecodedExecuteSegment<4>&, void*) const;
+	template bool CPU<8>::activate_dylib(const DecodedExecuteSegment<8>&, void*) const;
+	template void CPU<4>::simulate_profiling(uint64_t);
+	template void CPU<8>::simulate_profiling(uint64_t);
+	template void CPU<4>::store_translation_profile(const std::string&) const;
+	template void CPU<8>::store_translation_profile(const std::string&) const;
+#ifdef RISCV_EXT_COMPRESSED
+	template uint32_t expand_compressed<4>(uint16_t);
+	template uint32_t expand_compressed<8>(uint16_t);
+#endif
+
+	BackgroundTranslation::~BackgroundTranslation()
+	{
+		if (thread.joinable())
+			thread.join();
+		// Only set when the translation was never activated
+		if (dylib != nullptr)
+			dlclose(dylib);
+		// Kept for later runs only when it was activated
+		if (!filename.empty())
+			unlink(filename.c_str());
+	}
 
 	timespec time_now()
 	{
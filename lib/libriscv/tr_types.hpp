@@ -1,5 +1,9 @@
+#pragma once
 #include "types.hpp"
+#include <atomic>
 #include <set>
+#include <string>
+#include <thread>
 
 namespace riscv
 {
@@ -12,8 +16,40 @@ namespace riscv
 		bool has_branch;
 		bool forward_jumps;
 		std::set<address_type<W>> jump_locations;
+		// The start of every translated block, which translated
+		// code can continue in directly
+		const std::set<address_type<W>>& block_entries;
 	};
 
+	// Name of the translated function for the block at addr
+	template <int W>
+	inline std::string translated_function_name(address_type<W> addr) {
+		return "f" + std::to_string(addr);
+	}
+
 	template <int W>
 	struct TransInstr;
+
+#ifdef RISCV_EXT_COMPRESSED
+	// Returns the 32-bit instruction that does the same as a compressed
+	// instruction in the interpreter, or zero when the instruction
+	// should be left to the interpreter.
+	template <int W>
+	uint32_t expand_compressed(uint16_t);
+#endif
+
+	// A translation that is compiled on a background thread. The
+	// thread sets done once the compiler has finished, and dylib
+	// is nullptr if compilation failed. Destroying an unfinished
+	// translation waits for the compiler, and removes its output.
+	struct BackgroundTranslation
+	{
+		std::string filename;
+		uint64_t exec_begin = 0;
+		void* dylib = nullptr;
+		std::atomic<bool> done = false;
+		std::thread thread;
+
+		~BackgroundTranslation();
+	};
 }
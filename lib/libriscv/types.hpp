@@ -92,5 +92,13 @@ namespace riscv
 	struct TransInstr
 	{
 		uint32_t instr;
+		uint32_t length = 4;
+	};
+
+	// Translation profiles are arrays of instruction addresses
+	// and how many times they were executed, sorted by address
+	struct ProfileEntry {
+		uint64_t addr;
+		uint64_t count;
 	};
 }
@@ -41,3 +41,7 @@ build_libriscv -DRISCV_EXPERIMENTAL=ON -DRISCV_THREADED=ON -DRISCV_DEBUG=ON
 build_libriscv -DRISCV_MULTIPROCESS=OFF
 # 11. Multiprocessing disabled debug build
 build_libriscv -DRISCV_MULTIPROCESS=OFF -DRISCV_DEBUG=ON
+# 12. Asynchronous snapshots build
+build_libriscv -DRISCV_ASYNC_SNAPSHOTS=ON
+# 13. Flat memory with guarded arena build
+build_libriscv -DRISCV_FLAT_MEMORY=ON -DRISCV_GUARDED_ARENA=ON
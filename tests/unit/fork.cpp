@@ -0,0 +1,466 @@
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+
+#include <libriscv/machine.hpp>
+#include <atomic>
+#include <string>
+#include <thread>
+extern std::vector<uint8_t> load_file(const std::string& filename);
+static const std::vector<uint8_t> empty;
+static const std::string cwd {SRCDIR};
+using namespace riscv;
+
+static constexpr uint32_t ADDR = 0x10000;
+static constexpr unsigned PAGES = 16;
+
+TEST_CASE("Shared forks keep their snapshot", "[Fork]")
+{
+	Machine<RISCV32> machine { empty, {
+		.use_memory_arena = !flat_memory_enabled
+	}};
+	for (unsigned i = 0; i < PAGES; i++)
+		machine.memory.write<uint32_t> (ADDR + i * Page::size(), i);
+	// Shared forks are created from a published master
+	REQUIRE_THROWS(Machine<RISCV32> { machine, { .shared_fork = true } });
+	machine.publish_for_forks();
+
+	Machine<RISCV32> fork { machine, { .shared_fork = true } };
+	for (unsigned i = 0; i < PAGES; i++) {
+		const auto pageno = Memory<RISCV32>::page_number(ADDR + i * Page::size());
+		REQUIRE(machine.memory.get_pageno(pageno).is_shared());
+		REQUIRE(fork.memory.get_pageno(pageno).is_shared());
+	}
+
+	// The master copies pages away from the fork on write
+	machine.memory.write<uint32_t> (ADDR, 1234);
+	REQUIRE(machine.memory.read<uint32_t> (ADDR) == 1234);
+	REQUIRE(fork.memory.read<uint32_t> (ADDR) == 0);
+	REQUIRE(!machine.memory.get_page(ADDR).is_shared());
+
+	// Making a shared page writable must keep it copy-on-write
+	machine.memory.set_page_attr(ADDR + Page::size(), Page::size(), {
+		.read = true, .write = true
+	});
+	machine.memory.write<uint32_t> (ADDR + Page::size(), 5678);
+	REQUIRE(fork.memory.read<uint32_t> (ADDR + Page::size()) == 1);
+
+	// Freed master pages stay alive in the fork
+	machine.memory.free_pages(ADDR + 2 * Page::size(), Page::size());
+	REQUIRE(machine.memory.read<uint32_t> (ADDR + 2 * Page::size()) == 0);
+	REQUIRE(fork.memory.read<uint32_t> (ADDR + 2 * Page::size()) == 2);
+
+	// The fork copies pages away from the master on write
+	fork.memory.write<uint32_t> (ADDR + 3 * Page::size(), 999);
+	REQUIRE(machine.memory.read<uint32_t> (ADDR + 3 * Page::size()) == 3);
+
+	// New forks see the state the master has published last
+	Machine<RISCV32> fork2 { machine, { .shared_fork = true } };
+	REQUIRE(fork2.memory.read<uint32_t> (ADDR) == 0);
+	REQUIRE(fork2.memory.read<uint32_t> (ADDR + 2 * Page::size()) == 2);
+	machine.publish_for_forks();
+	REQUIRE(machine.memory.get_page(ADDR).is_shared());
+	Machine<RISCV32> fork3 { machine, { .shared_fork = true } };
+	REQUIRE(fork3.memory.read<uint32_t> (ADDR) == 1234);
+	REQUIRE(fork3.memory.read<uint32_t> (ADDR + Page::size()) == 5678);
+	REQUIRE(fork3.memory.read<uint32_t> (ADDR + 2 * Page::size()) == 0);
+	REQUIRE(fork3.memory.read<uint32_t> (ADDR + 3 * Page::size()) == 3);
+	REQUIRE(fork2.memory.read<uint32_t> (ADDR) == 0);
+}
+
+TEST_CASE("Shared forks outlive their master", "[Fork]")
+{
+	// The read-only segment of this program is kept out of the pages
+	const auto binary = load_file(cwd + "/elf/zig-riscv64-hello-world");
+	static constexpr uint64_t RODATA = 0x12000;
+	auto machine = std::make_unique<Machine<RISCV64>> (binary, MachineOptions<RISCV64> {
+		.use_memory_arena = !flat_memory_enabled
+	});
+	const auto value = machine->memory.read<uint64_t> (RODATA);
+	machine->publish_for_forks();
+
+	Machine<RISCV64> fork { *machine, { .shared_fork = true } };
+	machine.reset();
+	// Reuse the memory of the master
+	Machine<RISCV64> other { binary };
+	REQUIRE(fork.memory.read<uint64_t> (RODATA) == value);
+}
+
+TEST_CASE("Modify master while shared forks are running", "[Fork]")
+{
+	Machine<RISCV64> machine { empty, {
+		.use_memory_arena = !flat_memory_enabled
+	}};
+	for (unsigned i = 0; i < PAGES; i++)
+		machine.memory.write<uint64_t> (ADDR + i * Page::size(), 1);
+	machine.publish_for_forks();
+
+	std::vector<std::unique_ptr<Machine<RISCV64>>> forks;
+	for (int i = 0; i < 4; i++)
+		forks.emplace_back(new Machine<RISCV64> { machine, { .shared_fork = true } });
+
+	std::vector<std::thread> threads;
+	std::vector<uint64_t> sums(forks.size());
+	for (size_t f = 0; f < forks.size(); f++) {
+		threads.emplace_back([&, f] {
+			auto& fork = *forks[f];
+			for (int n = 0; n < 1000; n++)
+			for (unsigned i = 0; i < PAGES; i++)
+				sums[f] += fork.memory.read<uint64_t> (ADDR + i * Page::size());
+		});
+	}
+	// Keep rewriting (and freeing) master memory while the forks read
+	for (uint64_t n = 2; n < 1000; n++) {
+		for (unsigned i = 0; i < PAGES; i++)
+			machine.memory.write<uint64_t> (ADDR + i * Page::size(), n);
+		machine.memory.free_pages(ADDR, Page::size());
+	}
+	for (auto& t : threads)
+		t.join();
+
+	for (const auto sum : sums)
+		REQUIRE(sum == 1000 * PAGES);
+}
+
+TEST_CASE("Create shared forks while the master is running", "[Fork]")
+{
+	Machine<RISCV64> machine { empty, {
+		.use_memory_arena = !flat_memory_enabled
+	}};
+	for (unsigned i = 0; i < PAGES; i++)
+		machine.memory.write<uint64_t> (ADDR + i * Page::size(), 1);
+	machine.cpu.reg(REG_ARG0) = 1;
+	machine.publish_for_forks();
+
+	// Forks are created and reset from other threads, and must always
+	// see one whole published state of the master
+	std::atomic<bool> done = false;
+	std::vector<std::thread> threads;
+	std::vector<unsigned> failures(4);
+	for (size_t t = 0; t < failures.size(); t++) {
+		threads.emplace_back([&, t] {
+			auto consistent = [&] (Machine<RISCV64>& fork) {
+				const uint64_t value = fork.cpu.reg(REG_ARG0);
+				bool ok = fork.memory.pages_active() >= PAGES;
+				for (unsigned i = 0; i < PAGES; i++)
+					ok = ok && fork.memory.read<uint64_t> (ADDR + i * Page::size()) == value;
+				return ok;
+			};
+			Machine<RISCV64> reused { machine, { .shared_fork = true } };
+			while (!done.load()) {
+				Machine<RISCV64> fork { machine, { .shared_fork = true } };
+				fork.memory.write<uint64_t> (ADDR, 0);
+				reused.memory.write<uint64_t> (ADDR + Page::size(), 0);
+				reused.reset_to(machine, { .shared_fork = true });
+				if (!consistent(reused)) failures[t]++;
+				fork.memory.write<uint64_t> (ADDR, fork.cpu.reg(REG_ARG0));
+				if (!consistent(fork)) failures[t]++;
+			}
+		});
+	}
+	// Keep changing and publishing the master while forks are created
+	for (uint64_t n = 2; n < 2000; n++) {
+		for (unsigned i = 0; i < PAGES; i++)
+			machine.memory.write<uint64_t> (ADDR + i * Page::size(), n);
+		machine.memory.free_pages(ADDR + PAGES * Page::size(), Page::size());
+		machine.memory.write<uint64_t> (ADDR + PAGES * Page::size(), n);
+		machine.cpu.reg(REG_ARG0) = n;
+		if (n % 4 == 0)
+			machine.publish_for_forks();
+	}
+	done = true;
+	for (auto& t : threads)
+		t.join();
+
+	for (const auto count : failures)
+		REQUIRE(count == 0);
+}
+
+TEST_CASE("Fork a lazily decoded machine from many threads", "[Fork]")
+{
+	static const std::array<uint32_t, 6> program {
+		0x00000513, //        li      a0,0
+		0x00150513, // loop:  addi    a0,a0,1
+		0x06400313, //        li      t1,100
+		0xfe651ce3, //        bne     a0,t1,loop
+		0x05d00893, //        li      a7,93
+		0x00000073, //        ecall
+	};
+	Machine<RISCV64> machine { empty };
+	machine.setup_minimal_syscalls();
+	auto& exec = machine.memory.create_execute_segment(
+		{ .lazy_decoding = true }, program.data(), ADDR, sizeof(program));
+	machine.cpu.set_execute_segment(&exec);
+	machine.cpu.jump(ADDR);
+	// Lazy decoding is ignored with binary translation
+	REQUIRE(exec.is_lazy() == !binary_translation_enabled);
+
+	// Each fork decodes the whole segment before running it
+	std::vector<std::thread> threads;
+	std::vector<int> results(8);
+	for (size_t i = 0; i < results.size(); i++) {
+		threads.emplace_back([&, i] {
+			Machine<RISCV64> fork { machine };
+			fork.simulate(10'000ul);
+			results[i] = fork.return_value<int>();
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+
+	REQUIRE(!exec.is_lazy());
+	for (const int result : results)
+		REQUIRE(result == 100);
+}
+
+TEST_CASE("Reset a fork to a lazily decoded master", "[Fork]")
+{
+	static const std::array<uint32_t, 2> program {
+		0x02a00513, //        li      a0,42
+		0x0000006f, //        j       .
+	};
+	Machine<RISCV64> machine { empty };
+	Machine<RISCV64> fork { machine };
+	fork.setup_native_heap(1, 0x40000000, 0x100000);
+
+	// The master changes execute segment after the fork was made
+	auto& exec = machine.memory.create_execute_segment(
+		{ .lazy_decoding = true }, program.data(), ADDR, sizeof(program));
+	machine.cpu.set_execute_segment(&exec);
+	machine.cpu.jump(ADDR);
+	// Lazy decoding is ignored with binary translation
+	REQUIRE(exec.is_lazy() == !binary_translation_enabled);
+
+	fork.reset_to(machine);
+	REQUIRE(!exec.is_lazy());
+	fork.simulate<false>(10);
+	REQUIRE(fork.cpu.reg(REG_ARG0) == 42);
+	// The master has no native heap
+	REQUIRE_THROWS(fork.arena());
+}
+
+TEST_CASE("Reset fork to master", "[Fork]")
+{
+	Machine<RISCV64> machine { empty, {
+		.use_memory_arena = !flat_memory_enabled
+	}};
+	for (unsigned i = 0; i < PAGES; i++)
+		machine.memory.write<uint64_t> (ADDR + i * Page::size(), i);
+	machine.cpu.reg(REG_ARG0) = 1;
+	machine.set_instruction_counter(100);
+
+	Machine<RISCV64> fork { machine };
+	const size_t fork_pages = fork.memory.pages_active();
+
+	for (int round = 0; round < 3; round++)
+	{
+		fork.memory.write<uint64_t> (ADDR, 1234);
+		fork.memory.write<uint64_t> (0x7F000000, 5678);
+		fork.memory.free_pages(ADDR + Page::size(), Page::size());
+		fork.memory.set_page_attr(ADDR + 2 * Page::size(), Page::size(), {
+			.read = false, .write = false
+		});
+		fork.cpu.reg(REG_ARG0) = 2;
+		fork.set_instruction_counter(200);
+		REQUIRE(fork.memory.read<uint64_t> (ADDR + Page::size()) == 0);
+
+		fork.reset_to(machine);
+
+		REQUIRE(fork.memory.pages_active() == fork_pages);
+		for (unsigned i = 0; i < PAGES; i++)
+			REQUIRE(fork.memory.read<uint64_t> (ADDR + i * Page::size()) == i);
+		REQUIRE(fork.memory.get_page(0x7F000000).is_cow_page());
+		REQUIRE(fork.cpu.reg(REG_ARG0) == 1);
+		REQUIRE(fork.instruction_counter() == 100);
+	}
+	// The master can not be reset
+	REQUIRE_THROWS(machine.reset_to(fork));
+}
+
+template <int W>
+static void fork_flat_arena_master()
+{
+	Machine<W> machine { empty, {
+		.memory_max = 64ull << 20,
+		.use_memory_arena = true
+	}};
+	// With flat memory, these are written to the arena without pages
+	machine.memory.template write<uint32_t> (ADDR, 42);
+	machine.memory.template write<uint32_t> (ADDR + 3 * Page::size(), 43);
+
+	Machine<W> fork { machine };
+	REQUIRE(fork.memory.template read<uint32_t> (ADDR) == 42);
+	REQUIRE(fork.memory.template read<uint32_t> (ADDR + 3 * Page::size()) == 43);
+
+	fork.memory.template write<uint32_t> (ADDR, 1234);
+	REQUIRE(machine.memory.template read<uint32_t> (ADDR) == 42);
+	fork.reset_to(machine);
+	REQUIRE(fork.memory.template read<uint32_t> (ADDR) == 42);
+}
+
+TEST_CASE("Fork a master with a memory arena", "[Fork]")
+{
+	fork_flat_arena_master<RISCV32>();
+	fork_flat_arena_master<RISCV64>();
+}
+
+TEST_CASE("Reset shared fork to modified master", "[Fork]")
+{
+	Machine<RISCV64> machine { empty, {
+		.use_memory_arena = !flat_memory_enabled
+	}};
+	for (unsigned i = 0; i < PAGES; i++)
+		machine.memory.write<uint64_t> (ADDR + i * Page::size(), i);
+	machine.publish_for_forks();
+
+	Machine<RISCV64> fork { machine, { .shared_fork = true } };
+	fork.memory.write<uint64_t> (ADDR, 1234);
+	machine.memory.write<uint64_t> (ADDR, 5678);
+	REQUIRE(fork.memory.read<uint64_t> (ADDR) == 1234);
+	machine.publish_for_forks();
+
+	// Pages changed by the fork are shared again from the master
+	fork.reset_to(machine, { .shared_fork = true });
+	REQUIRE(fork.memory.read<uint64_t> (ADDR) == 5678);
+	REQUIRE(fork.memory.get_page(ADDR).is_shared());
+	machine.memory.write<uint64_t> (ADDR, 1);
+	REQUIRE(fork.memory.read<uint64_t> (ADDR) == 5678);
+}
+
+TEST_CASE("Reset shared fork after master changes", "[Fork]")
+{
+	Machine<RISCV64> machine { empty, {
+		.use_memory_arena = !flat_memory_enabled
+	}};
+	for (unsigned i = 0; i < 4; i++)
+		machine.memory.write<uint64_t> (ADDR + i * Page::size(), 1);
+	machine.publish_for_forks();
+
+	Machine<RISCV64> fork { machine, { .shared_fork = true } };
+	fork.memory.write<uint64_t> (ADDR, 2);
+	// The master changes pages the fork never touched
+	for (unsigned i = 0; i < 2; i++)
+		machine.memory.write<uint64_t> (ADDR + i * Page::size(), 2);
+	machine.memory.set_page_attr(ADDR + 2 * Page::size(), Page::size(), {
+		.read = false, .write = false
+	});
+	machine.memory.free_pages(ADDR + 3 * Page::size(), Page::size());
+	machine.memory.write<uint64_t> (ADDR + 4 * Page::size(), 2);
+	// Execute segments created by the fork are dropped on reset
+	const std::array<uint32_t, 2> code { 0x00000013, 0x00000013 };
+	fork.cpu.init_execute_area(code.data(), 0x7F000000, sizeof(code));
+	REQUIRE(fork.memory.cached_execute_segments() == 1);
+
+	machine.publish_for_forks();
+	fork.reset_to(machine, { .shared_fork = true });
+
+	Machine<RISCV64> fresh { machine, { .shared_fork = true } };
+	REQUIRE(fork.memory.pages_active() == fresh.memory.pages_active());
+	for (unsigned i = 0; i < 5; i++) {
+		const auto addr = ADDR + i * Page::size();
+		if (i == 2) {
+			REQUIRE(!fork.memory.get_page(addr).attr.read);
+			continue;
+		}
+		REQUIRE(fork.memory.read<uint64_t> (addr) == fresh.memory.read<uint64_t> (addr));
+	}
+	REQUIRE(fork.memory.read<uint64_t> (ADDR + Page::size()) == 2);
+	REQUIRE(fork.memory.read<uint64_t> (ADDR + 3 * Page::size()) == 0);
+	REQUIRE(fork.memory.cached_execute_segments() == 0);
+}
+
+TEST_CASE("Reset shared fork across several publications", "[Fork]")
+{
+	static constexpr unsigned IMAGE_PAGES = 32;
+	Machine<RISCV64> machine { empty, {
+		.use_memory_arena = !flat_memory_enabled
+	}};
+	for (unsigned i = 0; i < IMAGE_PAGES; i++)
+		machine.memory.write<uint64_t> (ADDR + i * Page::size(), i);
+	machine.publish_for_forks();
+	Machine<RISCV64> fork { machine, { .shared_fork = true } };
+
+	auto verify = [&] {
+		Machine<RISCV64> fresh { machine, { .shared_fork = true } };
+		REQUIRE(fork.memory.pages_active() == fresh.memory.pages_active());
+		for (unsigned i = 0; i < IMAGE_PAGES + 1; i++) {
+			const auto addr = ADDR + i * Page::size();
+			REQUIRE(fork.memory.get_page(addr).attr.read == fresh.memory.get_page(addr).attr.read);
+			if (fresh.memory.get_page(addr).attr.read)
+				REQUIRE(fork.memory.read<uint64_t> (addr) == fresh.memory.read<uint64_t> (addr));
+		}
+	};
+	// The fork falls behind by a few publications each round, and in
+	// the last rounds by more changes than the master has pages
+	for (unsigned round = 1; round < 8; round++)
+	{
+		const unsigned publications = (round < 6) ? round : 2 * IMAGE_PAGES;
+		for (unsigned n = 0; n < publications; n++) {
+			const unsigned page = (round * 7 + n * 3) % 16;
+			machine.memory.write<uint64_t> (ADDR + page * Page::size(), round * 100 + n);
+			machine.publish_for_forks();
+		}
+		machine.memory.free_pages(ADDR + (round + 16) * Page::size(), Page::size());
+		machine.memory.set_page_attr(ADDR + (round + 24) * Page::size(), Page::size(), {
+			.read = (round % 2) == 0, .write = false
+		});
+		machine.memory.write<uint64_t> (ADDR + IMAGE_PAGES * Page::size(), round);
+		// Changes after the last publication are not seen by forks
+		machine.publish_for_forks();
+		machine.memory.write<uint64_t> (ADDR, 9999);
+
+		fork.memory.write<uint64_t> (ADDR + round * 2 * Page::size(), 1234);
+		fork.reset_to(machine, { .shared_fork = true });
+		verify();
+	}
+	REQUIRE(fork.memory.read<uint64_t> (ADDR) != 9999);
+}
+
+TEST_CASE("Benchmark fork against reset_to", "[.benchmark][Fork]")
+{
+	static constexpr unsigned IMAGE_PAGES = 4096; /* 16MB */
+	static constexpr unsigned DIRTY_PAGES = 8;
+	Machine<RISCV64> machine { empty, { .memory_max = 64ull << 20 } };
+	for (unsigned i = 0; i < IMAGE_PAGES; i++)
+		machine.memory.write<uint64_t> (ADDR + i * Page::size(), i);
+
+	auto request = [] (Machine<RISCV64>& fork) {
+		for (unsigned i = 0; i < DIRTY_PAGES; i++)
+			fork.memory.write<uint64_t> (ADDR + i * 97 * Page::size(), i);
+		return fork.memory.read<uint64_t> (ADDR);
+	};
+
+	BENCHMARK("New fork per request") {
+		Machine<RISCV64> fork { machine };
+		return request(fork);
+	};
+	Machine<RISCV64> fork { machine };
+	BENCHMARK("Reset fork per request") {
+		fork.reset_to(machine);
+		return request(fork);
+	};
+
+	// Resetting a shared fork only restores the pages the fork and
+	// the master have changed, and should not depend on the image size
+	for (const unsigned image_pages : { 1024u, 4096u, 16384u })
+	{
+		Machine<RISCV64> master { empty, { .memory_max = 128ull << 20 } };
+		for (unsigned i = 0; i < image_pages; i++)
+			master.memory.write<uint64_t> (ADDR + i * Page::size(), i);
+		master.publish_for_forks();
+		Machine<RISCV64> shared { master, { .shared_fork = true } };
+		const std::string pages = std::to_string(image_pages) + " pages";
+
+		BENCHMARK("Reset shared fork per request, " + pages) {
+			shared.reset_to(master, { .shared_fork = true });
+			return request(shared);
+		};
+		uint64_t n = 0;
+		BENCHMARK("Publish and reset shared fork per request, " + pages) {
+			n++;
+			master.memory.write<uint64_t> (ADDR + (n % DIRTY_PAGES) * Page::size(), n);
+			master.publish_for_forks();
+			shared.reset_to(master, { .shared_fork = true });
+			return request(shared);
+		};
+	}
+}
@@ -1,6 +1,9 @@
 #include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
 #include <libriscv/common.hpp>
 #include <libriscv/native_heap.hpp>
+#include <list>
+#include <string>
 #include <vector>
 static const uintptr_t BEGIN = 0x1000000;
 static const uintptr_t END   = 0x2000000;
@@ -136,3 +139,192 @@ TEST_CASE("Basic heap usage", "[Heap]")
 	REQUIRE(arena.bytes_free() == END - BEGIN);
 	allocs.clear();
 }
+
+TEST_CASE("Heap transfer keeps allocations", "[Heap]")
+{
+	riscv::Arena arena {BEGIN, END};
+	std::vector<Allocation> allocs;
+	for (int i = 0; i < 1000; i++)
+		allocs.push_back(alloc_random(arena));
+	for (size_t i = 0; i < allocs.size(); i += 2)
+		REQUIRE(arena.free(allocs[i].addr) == 0);
+
+	riscv::Arena copy {arena};
+	REQUIRE(copy.bytes_used() == arena.bytes_used());
+	for (size_t i = 0; i < allocs.size(); i++) {
+		if (i % 2 == 0) {
+			REQUIRE(copy.size(allocs[i].addr) == 0);
+		} else {
+			REQUIRE(copy.size(allocs[i].addr) == allocs[i].size);
+			REQUIRE(copy.free(allocs[i].addr) == 0);
+		}
+	}
+	// The freed holes are reusable in the copy
+	REQUIRE(copy.bytes_used() == 0);
+	REQUIRE(copy.bytes_free() == END - BEGIN);
+	REQUIRE(copy.malloc(END - BEGIN) == BEGIN);
+}
+
+TEST_CASE("Sequential allocation from a small free chunk", "[Heap]")
+{
+	riscv::Arena arena {BEGIN, END};
+	// A small free chunk that straddles a page boundary,
+	// and another free chunk in the same bin as its tail
+	const auto a = arena.malloc(RISCV_PAGE_SIZE - 0x40);
+	const auto b = arena.malloc(0x100);
+	REQUIRE(b == BEGIN + RISCV_PAGE_SIZE - 0x40);
+	arena.malloc(8);
+	const auto d = arena.malloc(0xC0);
+	arena.malloc(8);
+	REQUIRE(arena.free(d) == 0);
+	REQUIRE(arena.free(b) == 0);
+
+	// The sequential allocation must start after the page boundary
+	const auto seq = arena.seq_alloc_aligned(0x80, 8);
+	REQUIRE(seq == BEGIN + RISCV_PAGE_SIZE);
+	// The head before the boundary stays free
+	REQUIRE(arena.size(b) == 0);
+	REQUIRE(arena.size(b, true) == 0x40);
+	// The other chunk in the same bin is still found
+	REQUIRE(arena.malloc(0xC0) == d);
+
+	// Freeing an already free chunk reports it to the callback
+	const riscv::ArenaChunk* unknown = nullptr;
+	arena.on_unknown_free([&] (auto, auto* ch) { unknown = ch; return -1; });
+	REQUIRE(arena.free(b) == -1);
+	REQUIRE(unknown != nullptr);
+	REQUIRE(unknown->free);
+	REQUIRE(unknown->data == b);
+
+	REQUIRE(arena.free(seq) == 0);
+	REQUIRE(arena.free(a) == 0);
+	REQUIRE(arena.bytes_used() == 8 + 0xC0 + 8);
+}
+
+// The first-fit allocator that Arena used before it had size-class bins
+// and a best-fit tree, as a baseline for the benchmark. Every lookup
+// walks the address-ordered chunks from the start.
+struct FirstFitArena
+{
+	struct Chunk {
+		uint64_t data;
+		size_t   size;
+		bool     free;
+	};
+	using Iterator = std::list<Chunk>::iterator;
+
+	FirstFitArena(uint64_t base, uint64_t end) : m_chunks{{base, size_t(end - base), true}} {}
+
+	uint64_t malloc(size_t size) {
+		const size_t length = riscv::Arena::fixup_size(size);
+		for (auto it = m_chunks.begin(); it != m_chunks.end(); ++it) {
+			if (it->free && it->size >= length) {
+				this->split(it, length);
+				it->free = false;
+				return it->data;
+			}
+		}
+		return 0;
+	}
+	std::tuple<uint64_t, size_t> realloc(uint64_t ptr, size_t newsize) {
+		auto it = this->find(ptr);
+		if (it == m_chunks.end())
+			return {0, 0};
+		newsize = riscv::Arena::fixup_size(newsize);
+		if (it->size >= newsize)
+			return {ptr, 0};
+		// Eat from the next chunk, when it is free and large enough
+		auto next = std::next(it);
+		if (next != m_chunks.end() && next->free && it->size + next->size >= newsize) {
+			next->data += newsize - it->size;
+			next->size -= newsize - it->size;
+			it->size = newsize;
+			if (next->size == 0)
+				m_chunks.erase(next);
+			return {ptr, 0};
+		}
+		const size_t old_len = it->size;
+		const uint64_t data = this->malloc(newsize);
+		if (data != 0)
+			this->release(it);
+		return {data, old_len};
+	}
+	int free(uint64_t ptr) {
+		auto it = this->find(ptr);
+		if (it == m_chunks.end())
+			return -1;
+		this->release(it);
+		return 0;
+	}
+	size_t chunks_used() const noexcept { return m_chunks.size(); }
+
+private:
+	Iterator find(uint64_t ptr) {
+		for (auto it = m_chunks.begin(); it != m_chunks.end(); ++it)
+			if (!it->free && it->data == ptr) return it;
+		return m_chunks.end();
+	}
+	void split(Iterator it, size_t size) {
+		m_chunks.insert(std::next(it), {it->data + size, it->size - size, true});
+		it->size = size;
+	}
+	void release(Iterator it) {
+		it->free = true;
+		if (auto next = std::next(it); next != m_chunks.end() && next->free) {
+			it->size += next->size;
+			m_chunks.erase(next);
+		}
+		if (it != m_chunks.begin()) {
+			if (auto prev = std::prev(it); prev->free) {
+				prev->size += it->size;
+				m_chunks.erase(it);
+			}
+		}
+	}
+
+	std::list<Chunk> m_chunks;
+};
+
+template <typename ArenaType>
+static void benchmark_live_allocations(const std::string& name)
+{
+	static const uintptr_t BENCH_END = 0x20000000;
+	static const size_t OPS = 2000;
+
+	for (const size_t live : {100u, 10000u})
+	{
+		srand(live);
+		ArenaType arena {BEGIN, BENCH_END};
+		std::vector<uint64_t> allocs;
+		// Mostly small allocations, with the occasional large one
+		auto random_size = [] (unsigned i) -> size_t {
+			return (i % 16 == 0) ? randInt(512, 8000) : randInt(8, 256);
+		};
+		for (size_t i = 0; i < live; i++) {
+			allocs.push_back(arena.malloc(random_size(i)));
+			REQUIRE(allocs.back() != 0);
+		}
+
+		BENCHMARK(name + ": Free and malloc, " + std::to_string(live) + " live allocations") {
+			for (unsigned i = 0; i < OPS; i++) {
+				auto& addr = allocs[randUpto(allocs.size())];
+				arena.free(addr);
+				addr = arena.malloc(random_size(i));
+			}
+			return arena.chunks_used();
+		};
+		BENCHMARK(name + ": Realloc, " + std::to_string(live) + " live allocations") {
+			for (unsigned i = 0; i < OPS; i++) {
+				auto& addr = allocs[randUpto(allocs.size())];
+				addr = std::get<0>(arena.realloc(addr, random_size(i)));
+			}
+			return arena.chunks_used();
+		};
+	}
+}
+
+TEST_CASE("Benchmark heap with many live allocations", "[.benchmark][Heap]")
+{
+	benchmark_live_allocations<riscv::Arena>("Arena");
+	benchmark_live_allocations<FirstFitArena>("First-fit baseline");
+}
@@ -235,3 +235,39 @@ TEST_CASE("Override execute space protection fault", "[Memory Traps]")
 		REQUIRE(state.trapped_fault == true);
 	}
 }
+
+TEST_CASE("Traps see the registers of the running program", "[Memory Traps]")
+{
+	// Stores into a flat arena bypass traps
+	Machine<RISCV32> machine { std::string_view{}, {
+		.use_memory_arena = !flat_memory_enabled
+	}};
+	static const std::array<uint32_t, 5> my_program {
+		0x07b00513, //        li      a0,123
+		0x000205b7, //        lui     a1,0x20
+		0x00a5a023, //        sw      a0,0(a1)
+		0x00160513, //        addi    a0,a2,1
+		0x0000006f, //        j       .
+	};
+	const uint32_t dst = 0x1000;
+	machine.copy_to_guest(dst, my_program.data(), sizeof(my_program));
+	machine.memory.set_page_attr(dst, Page::size(), {
+		.read = false,
+		.write = false,
+		.exec = true
+	});
+
+	int64_t trapped_a0 = 0;
+	machine.memory.trap(0x20000,
+	[&] (Page&, uint32_t, int mode, int64_t) {
+		REQUIRE(mode == (4 | TRAP_WRITE));
+		trapped_a0 = machine.cpu.reg(REG_ARG0);
+		// Registers written by the trap are seen by the program
+		machine.cpu.reg(REG_ARG2) = 41;
+	});
+
+	machine.cpu.jump(dst);
+	machine.simulate<false>(5);
+	REQUIRE(trapped_a0 == 123);
+	REQUIRE(machine.cpu.reg(REG_ARG0) == 42);
+}
@@ -1,8 +1,18 @@
 #include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
 #include <catch2/matchers/catch_matchers_string.hpp>
 
 #include <libriscv/machine.hpp>
 #include <libriscv/debug.hpp>
+#include <libriscv/decoder_cache.hpp>
+#include <libriscv/threaded_bytecodes.hpp>
+#include <libriscv/instruction_list.hpp>
+#include <libriscv/rv32i_instr.hpp>
+#include <libriscv/tr_types.hpp>
+#include <chrono>
+#include <set>
+#include <thread>
+#include <unistd.h>
 extern std::vector<uint8_t> build_and_load(const std::string& code,
 	const std::string& args = "-O2 -static", bool cpp = false);
 using namespace riscv;
@@ -58,3 +68,733 @@ TEST_CASE("Run exactly X instructions", "[Micro]")
 	REQUIRE(machine.instruction_counter() == 5);
 	REQUIRE(machine.cpu.reg(REG_ARG7) == 93);
 }
+
+TEST_CASE("Superinstructions match single-stepping", "[Micro]")
+{
+	// Pairs that have a superinstruction: LUI+ADDI, SD+SD, LD+LD,
+	// LI+BNE and LI+BEQ. SW+SW and LW+LW are never fused. Which of
+	// them are fused is decided by the generated threaded_fuse.inc.
+	static const std::array<uint32_t, 20> my_program{
+		0x123452b7, //        lui     t0,0x12345
+		0x67828293, //        addi    t0,t0,0x678
+		0x00003437, //        lui     s0,0x3
+		0x00543023, //        sd      t0,0(s0)
+		0x00543423, //        sd      t0,8(s0)
+		0x00043583, //        ld      a1,0(s0)
+		0x00843603, //        ld      a2,8(s0)
+		0x00542823, //        sw      t0,16(s0)
+		0x00542a23, //        sw      t0,20(s0)
+		0x01042683, //        lw      a3,16(s0)
+		0x01442703, //        lw      a4,20(s0)
+		0x00000513, //        li      a0,0
+		0x00150513, // loop:  addi    a0,a0,1
+		0x06400313, //        li      t1,100
+		0xfe651ce3, //        bne     a0,t1,loop
+		0x06400393, //        li      t2,100
+		0x00750463, //        beq     a0,t2,exit
+		0x00000513, //        li      a0,0
+		0x05d00893, // exit:  li      a7,93
+		0x00000073, //        ecall
+	};
+	const uint32_t dst = 0x1000;
+
+	Machine<RISCV64> machine;
+	machine.setup_minimal_syscalls();
+	machine.cpu.init_execute_area(my_program.data(), dst, sizeof(my_program));
+	machine.cpu.jump(dst);
+	machine.simulate(10'000ul);
+
+	REQUIRE(machine.return_value() == 100);
+	REQUIRE(machine.cpu.reg(REG_ARG1) == 0x12345678);
+	REQUIRE(machine.cpu.reg(REG_ARG2) == 0x12345678);
+	REQUIRE(machine.cpu.reg(REG_ARG3) == 0x12345678);
+	REQUIRE(machine.cpu.reg(REG_ARG4) == 0x12345678);
+
+	// Fused instructions still count as two
+	Machine<RISCV64> stepped;
+	stepped.setup_minimal_syscalls();
+	stepped.cpu.init_execute_area(my_program.data(), dst, sizeof(my_program));
+	stepped.cpu.jump(dst);
+	riscv::DebugMachine debugger{stepped};
+	debugger.simulate(10'000ul);
+
+	REQUIRE(stepped.return_value() == 100);
+	REQUIRE(machine.instruction_counter() == stepped.instruction_counter());
+}
+
+TEST_CASE("Calls count every instruction like single-stepping", "[Micro]")
+{
+	// With binary translation, the call and the return continue
+	// directly in the translated block at their destination
+	static const std::array<uint32_t, 19> my_program{
+		0x00150513, // func:  addi    a0,a0,1
+		0x00128293, //        addi    t0,t0,1
+		0x00130313, //        addi    t1,t1,1
+		0x00138393, //        addi    t2,t2,1
+		0x001e0e13, //        addi    t3,t3,1
+		0x001e8e93, //        addi    t4,t4,1
+		0x00008067, //        ret
+		0x00000513, // main:  li      a0,0
+		0x06400593, //        li      a1,100
+		0x00190913, // loop:  addi    s2,s2,1
+		0x00198993, //        addi    s3,s3,1
+		0x001a0a13, //        addi    s4,s4,1
+		0xfd1ff0ef, //        jal     ra,func
+		0xfeb518e3, //        bne     a0,a1,loop
+		0x001a8a93, //        addi    s5,s5,1
+		0x001b0b13, //        addi    s6,s6,1
+		0x001b8b93, //        addi    s7,s7,1
+		0x05d00893, //        li      a7,93
+		0x00000073, //        ecall
+	};
+	const uint32_t dst = 0x1000;
+	const uint32_t main = dst + 7 * 4;
+
+	Machine<RISCV64> machine;
+	machine.setup_minimal_syscalls();
+	machine.cpu.init_execute_area(my_program.data(), dst, sizeof(my_program));
+	machine.cpu.jump(main);
+	machine.simulate(10'000ul);
+	REQUIRE(machine.return_value() == 100);
+
+	Machine<RISCV64> stepped;
+	stepped.setup_minimal_syscalls();
+	stepped.cpu.init_execute_area(my_program.data(), dst, sizeof(my_program));
+	stepped.cpu.jump(main);
+	riscv::DebugMachine debugger{stepped};
+	debugger.simulate(10'000ul);
+
+	REQUIRE(stepped.return_value() == 100);
+	REQUIRE(stepped.instruction_counter() == 2 + 100 * 12 + 5);
+	REQUIRE(machine.instruction_counter() == stepped.instruction_counter());
+}
+
+TEST_CASE("C.JALR jumps to the old value of RA", "[Micro]")
+{
+	if constexpr (!compressed_enabled)
+		return;
+	static const std::array<uint32_t, 6> my_program{
+		0x00000513, //        li      a0,0
+		0x00000097, //        auipc   ra,0
+		0x00c08093, //        addi    ra,ra,12
+		0x45059082, //        c.jalr  ra
+		            //        c.li    a0,1
+		0x05d00893, //        li      a7,93
+		0x00000073, //        ecall
+	};
+	const uint32_t dst = 0x1000;
+
+	Machine<RISCV64> machine;
+	machine.setup_minimal_syscalls();
+	machine.cpu.init_execute_area(my_program.data(), dst, sizeof(my_program));
+	machine.cpu.jump(dst);
+	machine.simulate(100);
+
+	// The jump skips c.li, and links to it
+	REQUIRE(machine.return_value() == 0);
+	REQUIRE(machine.cpu.reg(REG_RA) == dst + 14);
+	REQUIRE(machine.instruction_counter() == 6);
+
+	// The instruction handler, without dispatch
+	Machine<RISCV64> stepped;
+	stepped.setup_minimal_syscalls();
+	stepped.cpu.init_execute_area(my_program.data(), dst, sizeof(my_program));
+	stepped.cpu.jump(dst);
+	riscv::DebugMachine debugger{stepped};
+	debugger.simulate(100);
+
+	REQUIRE(stepped.return_value() == 0);
+	REQUIRE(stepped.cpu.reg(REG_RA) == dst + 14);
+	REQUIRE(stepped.instruction_counter() == 6);
+}
+
+TEST_CASE("Stopping the machine from C.EBREAK", "[Micro]")
+{
+	if constexpr (!compressed_enabled)
+		return;
+	static const std::array<uint32_t, 4> my_program{
+		0x00019002, //        c.ebreak
+		            //        c.nop
+		0x00158593, // loop:  addi    a1,a1,1
+		0x00150513, //        addi    a0,a0,1
+		0xfe051ce3, //        bnez    a0,loop
+	};
+	const uint32_t dst = 0x1000;
+
+	Machine<RISCV64> machine;
+	machine.install_syscall_handler(SYSCALL_EBREAK, [] (Machine<RISCV64>& machine) {
+		machine.stop();
+	});
+	machine.cpu.init_execute_area(my_program.data(), dst, sizeof(my_program));
+	machine.cpu.reg(REG_ARG0) = 1;
+	machine.cpu.jump(dst);
+	machine.simulate<false>(1000);
+
+	// Dispatch modes may notice the stop late, but the
+	// instruction counter must match what was executed
+	REQUIRE(machine.stopped());
+	REQUIRE(machine.cpu.reg(REG_ARG1) > 0);
+	REQUIRE(machine.instruction_counter() == 2 + 3 * machine.cpu.reg(REG_ARG1));
+	REQUIRE(machine.instruction_counter() < 1000 + 3);
+}
+
+// Calls one function in each of the given number of execute segments,
+// in a loop. The functions are on pages of their own, between pages
+// that are not executable, so that each becomes a separate segment.
+static constexpr uint64_t LOOP_ADDR = 0x1000;
+static uint64_t segment_function(unsigned i) {
+	return LOOP_ADDR + (2 + 2 * i) * Page::size();
+}
+static void setup_segment_calls(Machine<RISCV64>& machine, unsigned segments)
+{
+	std::vector<uint32_t> program;
+	for (unsigned i = 0; i < segments; i++) {
+		// Function addresses in registers x2 to x31
+		const unsigned reg = 2 + i;
+		const uint32_t ret = 0x00008067; // ret
+		machine.copy_to_guest(segment_function(i), &ret, sizeof(ret));
+		machine.memory.set_page_attr(segment_function(i), Page::size(), {
+			.read = false, .write = false, .exec = true
+		});
+		machine.cpu.reg(reg) = segment_function(i);
+		program.push_back((reg << 15) | 0x000000e7); // jalr ra, 0(reg)
+	}
+	// j loop
+	const uint32_t imm = -4 * int32_t(segments);
+	program.push_back(((imm >> 20) & 0x1) << 31 | ((imm >> 1) & 0x3FF) << 21
+		| ((imm >> 11) & 0x1) << 20 | ((imm >> 12) & 0xFF) << 12 | 0x6F);
+
+	machine.copy_to_guest(LOOP_ADDR, program.data(), program.size() * 4);
+	machine.memory.set_page_attr(LOOP_ADDR, Page::size(), {
+		.read = false, .write = false, .exec = true
+	});
+	machine.cpu.jump(LOOP_ADDR);
+}
+
+// The same loop body, with the instructions either in pairs that are
+// fused into superinstructions, or ordered so that none of them are.
+// LI+BNE is only fused with a forward branch.
+static const std::array<uint32_t, 9> fused_loop {
+	0x123452b7, // loop:  lui     t0,0x12345
+	0x67828293, //        addi    t0,t0,0x678
+	0x00543023, //        sd      t0,0(s0)
+	0x00543423, //        sd      t0,8(s0)
+	0x00043583, //        ld      a1,0(s0)
+	0x00843603, //        ld      a2,8(s0)
+	0x00150513, //        addi    a0,a0,1
+	0xfff00313, //        li      t1,-1
+	0xfe6510e3, //        bne     a0,t1,loop
+};
+static const std::array<uint32_t, 9> unfused_loop {
+	0x123452b7, // loop:  lui     t0,0x12345
+	0x00543023, //        sd      t0,0(s0)
+	0x67828293, //        addi    t0,t0,0x678
+	0x00043583, //        ld      a1,0(s0)
+	0x00543423, //        sd      t0,8(s0)
+	0x00843603, //        ld      a2,8(s0)
+	0xfff00313, //        li      t1,-1
+	0x00150513, //        addi    a0,a0,1
+	0xfe6510e3, //        bne     a0,t1,loop
+};
+static void setup_loop(Machine<RISCV64>& machine, const std::array<uint32_t, 9>& loop)
+{
+	machine.cpu.init_execute_area(loop.data(), LOOP_ADDR, sizeof(loop));
+	machine.cpu.reg(8) = 0x3000; // s0
+	machine.cpu.jump(LOOP_ADDR);
+}
+// Dispatches per loop iteration, where the first instruction
+// of a fused pair dispatches for both of them
+static unsigned loop_dispatches(Machine<RISCV64>& machine)
+{
+	auto* exec = machine.memory.exec_segment_for(LOOP_ADDR);
+	REQUIRE(exec != nullptr);
+	unsigned dispatches = 0;
+	for (uint64_t pc = LOOP_ADDR; pc < LOOP_ADDR + 4 * fused_loop.size(); pc += 4) {
+		const auto bytecode =
+			exec->decoder_cache()[pc / DecoderCache<RISCV64>::DIVISOR].get_bytecode();
+		if (bytecode >= RV32I_BC_LUI_ADDI && bytecode <= RV32I_BC_STD_STD)
+			pc += 4;
+		dispatches++;
+	}
+	return dispatches;
+}
+
+TEST_CASE("Benchmark superinstruction dispatches", "[.benchmark][Micro]")
+{
+	Machine<RISCV64> fused;
+	setup_loop(fused, fused_loop);
+	fused.simulate<false>(1000);
+	// Translated code has no dispatches
+	if (fused.memory.is_binary_translated())
+		return;
+	REQUIRE(loop_dispatches(fused) == 6);
+	BENCHMARK("Loop with fused pairs (6 dispatches for 9 instructions)") {
+		fused.simulate<false>(900'000);
+		return fused.instruction_counter();
+	};
+
+	Machine<RISCV64> unfused;
+	setup_loop(unfused, unfused_loop);
+	unfused.simulate<false>(1000);
+	REQUIRE(loop_dispatches(unfused) == 9);
+	BENCHMARK("Loop without fused pairs (9 dispatches for 9 instructions)") {
+		unfused.simulate<false>(900'000);
+		return unfused.instruction_counter();
+	};
+}
+
+// A loop that calls one function with JAL and one with JALR (or
+// C.JALR), which both return with RET (or C.JR)
+static void setup_calls(Machine<RISCV64>& machine, bool compressed)
+{
+	static const std::array<uint32_t, 10> calls {
+		0x020000ef, // loop:  jal     ra,f1
+		0x000280e7, //        jalr    t0
+		0x00150513, //        addi    a0,a0,1
+		0xff5ff06f, //        j       loop
+		0x00000013, 0x00000013, 0x00000013, 0x00000013,
+		0x00008067, // f1:    ret
+		0x00008067, // f2:    ret
+	};
+	static const std::array<uint32_t, 9> compressed_calls {
+		0x020000ef, // loop:  jal     ra,f1
+		0x00019282, //        c.jalr  t0
+		            //        c.nop
+		0x00150513, //        addi    a0,a0,1
+		0xff5ff06f, //        j       loop
+		0x00000013, 0x00000013, 0x00000013, 0x00000013,
+		0x80828082, // f1:    c.jr    ra
+		            // f2:    c.jr    ra
+	};
+	if (compressed) {
+		machine.cpu.init_execute_area(compressed_calls.data(), LOOP_ADDR, sizeof(compressed_calls));
+		machine.cpu.reg(REG_T0) = LOOP_ADDR + 0x22;
+	} else {
+		machine.cpu.init_execute_area(calls.data(), LOOP_ADDR, sizeof(calls));
+		machine.cpu.reg(REG_T0) = LOOP_ADDR + 0x24;
+	}
+	machine.cpu.jump(LOOP_ADDR);
+}
+
+TEST_CASE("Benchmark indirect jumps", "[.benchmark][Micro]")
+{
+	Machine<RISCV64> machine;
+	setup_calls(machine, false);
+	machine.simulate<false>(1000);
+	// 6 instructions per iteration
+	REQUIRE(machine.cpu.reg(REG_ARG0) >= 1000 / 6);
+	BENCHMARK("Calls and returns with JAL and JALR") {
+		machine.simulate<false>(600'000);
+		return machine.instruction_counter();
+	};
+
+	if constexpr (compressed_enabled) {
+		Machine<RISCV64> compressed;
+		setup_calls(compressed, true);
+		compressed.simulate<false>(1000);
+		// 7 instructions per iteration, with the C.NOP
+		REQUIRE(compressed.cpu.reg(REG_ARG0) >= 1000 / 7);
+		BENCHMARK("Calls and returns with C.JALR and C.JR") {
+			compressed.simulate<false>(600'000);
+			return compressed.instruction_counter();
+		};
+	}
+}
+
+TEST_CASE("Benchmark taken backward branches", "[.benchmark][Micro]")
+{
+	// Every third instruction is a taken branch that checks
+	// the instruction limit
+	static const std::array<uint32_t, 3> branches {
+		0x00158593, // loop:  addi    a1,a1,1
+		0x00150513, //        addi    a0,a0,1
+		0xfe051ce3, //        bnez    a0,loop
+	};
+	Machine<RISCV64> machine;
+	machine.cpu.init_execute_area(branches.data(), LOOP_ADDR, sizeof(branches));
+	machine.cpu.reg(REG_ARG0) = 1;
+	machine.cpu.jump(LOOP_ADDR);
+	machine.simulate<false>(900);
+	REQUIRE(machine.cpu.reg(REG_ARG1) == 300);
+	BENCHMARK("Loop with a taken branch every 3 instructions") {
+		machine.simulate<false>(900'000);
+		return machine.instruction_counter();
+	};
+}
+
+TEST_CASE("Least recently used execute segments are evicted", "[Micro]")
+{
+	Machine<RISCV64> machine;
+	setup_segment_calls(machine, 2);
+	machine.simulate<false>(1000);
+	REQUIRE(machine.memory.cached_execute_segments() == 3);
+
+	// Look up the first function, leaving the second one unused the longest
+	REQUIRE(machine.memory.exec_segment_for(segment_function(0)) != nullptr);
+	machine.memory.evict_execute_segments(2);
+	REQUIRE(machine.memory.cached_execute_segments() == 2);
+	REQUIRE(machine.memory.exec_segment_for(LOOP_ADDR) != nullptr);
+	REQUIRE(machine.memory.exec_segment_for(segment_function(0)) != nullptr);
+	REQUIRE(machine.memory.exec_segment_for(segment_function(1)) == nullptr);
+
+	// Evicted segments are created again when needed
+	machine.simulate<false>(1000);
+	REQUIRE(machine.memory.cached_execute_segments() == 3);
+
+	// Limit the number of execute segments
+	Machine<RISCV64> limited { MachineOptions<RISCV64>{ .max_execute_segments = 3 } };
+	setup_segment_calls(limited, 8);
+	limited.simulate<false>(10'000);
+	REQUIRE(limited.instruction_counter() >= 10'000);
+	REQUIRE(limited.memory.cached_execute_segments() == 3);
+	REQUIRE(limited.memory.main_execute_segment().is_within(LOOP_ADDR));
+}
+
+TEST_CASE("Evicting a segment that is paused in a nested call", "[Micro]")
+{
+	// A segment can be evicted while it is paused in a system call,
+	// with dispatch resuming in it after the call returns
+	static constexpr uint64_t OUTER_ADDR = LOOP_ADDR + 2 * Page::size();
+	static constexpr uint64_t NESTED_ADDR = LOOP_ADDR + 4 * Page::size();
+	static const std::array<uint32_t, 3> main_program {
+		0x000280e7, //        jalr    t0
+		0x05d00893, // exit:  li      a7,93
+		0x00000073, //        ecall
+	};
+	static const std::array<uint32_t, 4> outer_function {
+		0x1f400893, //        li      a7,500
+		0x00000073, //        ecall
+		0x00150513, //        addi    a0,a0,1
+		0x00008067, //        ret
+	};
+	static const std::array<uint32_t, 2> nested_function {
+		0x02a00513, //        li      a0,42
+		0x00008067, //        ret
+	};
+	auto add_code = [] (Machine<RISCV64>& machine, uint64_t addr, const auto& code) {
+		machine.copy_to_guest(addr, code.data(), sizeof(code));
+		machine.memory.set_page_attr(addr, Page::size(), {
+			.read = false, .write = false, .exec = true
+		});
+	};
+
+	Machine<RISCV64> machine { MachineOptions<RISCV64>{ .max_execute_segments = 2 } };
+	machine.setup_minimal_syscalls();
+	add_code(machine, LOOP_ADDR, main_program);
+	add_code(machine, OUTER_ADDR, outer_function);
+	add_code(machine, NESTED_ADDR, nested_function);
+	machine.memory.set_exit_address(LOOP_ADDR + 4);
+
+	static uint64_t nested_result = 0;
+	machine.install_syscall_handler(500, [] (Machine<RISCV64>& machine) {
+		// Creating the segment of the nested function evicts the
+		// segment of the outer function, which is paused here
+		nested_result = machine.preempt(NESTED_ADDR);
+		REQUIRE(machine.memory.cached_execute_segments() == 2);
+		REQUIRE(machine.memory.exec_segment_for(OUTER_ADDR) == nullptr);
+	});
+
+	machine.cpu.reg(REG_T0) = OUTER_ADDR;
+	machine.cpu.jump(LOOP_ADDR);
+	machine.simulate(1000);
+
+	REQUIRE(nested_result == 42);
+	// The outer function resumed after the system call
+	REQUIRE(machine.return_value() == 1);
+	REQUIRE(machine.memory.cached_execute_segments() == 2);
+
+	// The main execute segment is always kept
+	REQUIRE_THROWS(Machine<RISCV64>{ MachineOptions<RISCV64>{ .max_execute_segments = 1 } });
+}
+
+TEST_CASE("Benchmark calls between execute segments", "[.benchmark][Micro]")
+{
+	Machine<RISCV64> two;
+	setup_segment_calls(two, 1);
+	BENCHMARK("Two execute segments") {
+		two.simulate<false>(100'000);
+		return two.instruction_counter();
+	};
+
+	Machine<RISCV64> many;
+	setup_segment_calls(many, 30);
+	BENCHMARK("31 execute segments") {
+		many.simulate<false>(100'000);
+		return many.instruction_counter();
+	};
+}
+
+#ifdef RISCV_BINARY_TRANSLATION
+TEST_CASE("Background translations are activated", "[Micro]")
+{
+	// A loop that is unique to this process, so that there is
+	// no translation of it from an earlier run, followed by a
+	// function that is never executed
+	std::array<uint32_t, 19> program;
+	std::copy(fused_loop.begin(), fused_loop.end(), program.begin());
+	const uint32_t unique = getpid() & 0x7FF;
+	program[1] = (unique << 20) | 0x00028293; // addi t0,t0,unique
+	program[fused_loop.size()] = 0x00008067; // ret
+	static constexpr uint64_t DEAD_ADDR = LOOP_ADDR + 4 * (fused_loop.size() + 1);
+	std::fill(program.begin() + fused_loop.size() + 1, program.end() - 1,
+		0x00168693); // addi a3,a3,1
+	program.back() = 0x00008067; // ret
+	auto setup = [&] (Machine<RISCV64>& machine, const MachineOptions<RISCV64>& options) {
+		machine.cpu.set_execute_segment(&machine.memory.create_execute_segment(
+			options, program.data(), LOOP_ADDR, sizeof(program)));
+		machine.cpu.reg(8) = 0x3000; // s0
+		machine.cpu.jump(LOOP_ADDR);
+	};
+
+	// The translation is compiled with the options of the segment,
+	// which must not be lost when it is activated later
+	const std::string profile = "/tmp/rvprofile-" + std::to_string(getpid());
+	{
+		Machine<RISCV64> machine;
+		setup(machine, { .translate_blocks_max = 0 });
+		machine.cpu.simulate_profiling(10'000);
+		machine.cpu.store_translation_profile(profile);
+	}
+	const MachineOptions<RISCV64> options {
+		.translate_background = true,
+		.translate_profile = profile,
+	};
+
+	{
+		// Destroying the machine waits for the compiler,
+		// and removes the unused translation
+		Machine<RISCV64> machine;
+		setup(machine, options);
+		REQUIRE(machine.memory.has_background_translation());
+	}
+
+	Machine<RISCV64> machine;
+	setup(machine, options);
+	REQUIRE(machine.memory.has_background_translation());
+	REQUIRE(!machine.is_binary_translated());
+
+	// Interpret until the translation is activated
+	for (int i = 0; i < 3000 && !machine.is_binary_translated(); i++) {
+		machine.simulate<false>(10'000);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	unlink(profile.c_str());
+	REQUIRE(machine.is_binary_translated());
+	REQUIRE(!machine.memory.has_background_translation());
+	// Only the blocks in the profile were translated
+	auto* exec = machine.memory.exec_segment_for(LOOP_ADDR);
+	auto translated = [&] (uint64_t addr) {
+		return exec->decoder_cache()[addr / DecoderCache<RISCV64>::DIVISOR].get_bytecode()
+			== RV32I_BC_TRANSLATOR;
+	};
+	REQUIRE(translated(LOOP_ADDR));
+	REQUIRE(!translated(DEAD_ADDR));
+
+	const auto iterations = machine.cpu.reg(REG_ARG0);
+	machine.simulate<false>(9'000);
+	REQUIRE(machine.cpu.reg(REG_ARG0) > iterations);
+	REQUIRE(machine.cpu.reg(REG_ARG1) == 0x12345000 + unique);
+	REQUIRE(machine.cpu.reg(REG_ARG2) == 0x12345000 + unique);
+}
+
+TEST_CASE("Translation profiles select the translated blocks", "[Micro]")
+{
+	for (const bool background : {false, true})
+	{
+		// A function that is never called, followed by a loop that
+		// is unique to this process and run. Without a profile, the
+		// first function would be translated as well.
+		std::array<uint32_t, 18> program;
+		std::fill(program.begin(), program.begin() + 8, 0x00168693); // addi a3,a3,1
+		program[8] = 0x00008067; // ret
+		static constexpr uint64_t HOT_ADDR = LOOP_ADDR + 4 * 9;
+		std::copy(fused_loop.begin(), fused_loop.end(), program.begin() + 9);
+		const uint32_t unique = (getpid() & 0x3FF) << 1 | background;
+		program[10] = (unique << 20) | 0x00028293; // addi t0,t0,unique
+		auto setup = [&] (Machine<RISCV64>& machine, const MachineOptions<RISCV64>& options) {
+			machine.cpu.set_execute_segment(&machine.memory.create_execute_segment(
+				options, program.data(), LOOP_ADDR, sizeof(program)));
+			machine.cpu.reg(8) = 0x3000; // s0
+			machine.cpu.jump(HOT_ADDR);
+		};
+
+		const std::string profile = "/tmp/rvprofile-" + std::to_string(getpid());
+		{
+			Machine<RISCV64> machine;
+			setup(machine, { .translate_blocks_max = 0 });
+			machine.cpu.simulate_profiling(10'000);
+			REQUIRE(!machine.is_binary_translated());
+			machine.cpu.store_translation_profile(profile);
+		}
+
+		Machine<RISCV64> machine;
+		setup(machine, {
+			.translate_background = background,
+			.translate_profile = profile,
+		});
+		for (int i = 0; i < 3000 && !machine.is_binary_translated(); i++) {
+			machine.simulate<false>(10'000);
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		unlink(profile.c_str());
+		REQUIRE(machine.is_binary_translated());
+
+		auto* exec = machine.memory.exec_segment_for(HOT_ADDR);
+		auto translated = [&] (uint64_t addr) {
+			return exec->decoder_cache()[addr / DecoderCache<RISCV64>::DIVISOR].get_bytecode()
+				== RV32I_BC_TRANSLATOR;
+		};
+		REQUIRE(!translated(LOOP_ADDR));
+		REQUIRE(translated(HOT_ADDR));
+
+		machine.simulate<false>(10'000);
+		REQUIRE(machine.cpu.reg(REG_ARG1) == 0x12345000 + unique);
+		REQUIRE(machine.cpu.reg(REG_ARG3) == 0);
+	}
+}
+
+#ifdef RISCV_EXT_COMPRESSED
+// Steps every compressed instruction that the translator expands, and
+// its 32-bit expansion, from the same state. Returns the encodings that
+// end in a different state, and counts the opcode classes covered.
+template <int W>
+static std::vector<uint16_t> mismatched_expansions(std::set<unsigned>& classes)
+{
+	using address_t = address_type<W>;
+	static constexpr address_t CODE_ADDR = 0x100000;
+	static constexpr address_t DATA_ADDR = 0x3000;
+	// Both segments have one instruction every 4 bytes,
+	// and compressed instructions are followed by C.NOP
+	std::vector<uint16_t> encodings;
+	std::vector<uint32_t> compressed;
+	std::vector<uint32_t> expanded;
+	for (uint32_t bits = 0; bits < 0x10000; bits++) {
+		if ((bits & 0x3) == 0x3)
+			continue;
+		const uint32_t instr = expand_compressed<W>(bits);
+		if (instr == 0)
+			continue;
+		encodings.push_back(bits);
+		compressed.push_back(0x00010000 | bits);
+		expanded.push_back(instr);
+		classes.insert(bits & 0xE003);
+	}
+	std::array<uint8_t, 1024> data;
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = i * 37 + 11;
+
+	const MachineOptions<W> options { .translate_blocks_max = 0 };
+	Machine<W> cmachine;
+	Machine<W> emachine;
+	cmachine.cpu.set_execute_segment(&cmachine.memory.create_execute_segment(
+		options, compressed.data(), CODE_ADDR, 4 * compressed.size()));
+	emachine.cpu.set_execute_segment(&emachine.memory.create_execute_segment(
+		options, expanded.data(), CODE_ADDR, 4 * expanded.size()));
+
+	// Registers point into the data, so that loads and stores work
+	auto step = [&] (Machine<W>& machine, address_t pc) -> int {
+		machine.copy_to_guest(DATA_ADDR, data.data(), data.size());
+		for (unsigned r = 0; r < 32; r++) {
+			if (r != 0)
+				machine.cpu.reg(r) = DATA_ADDR + 8 * r;
+			machine.cpu.registers().getfl(r).load_u64(0x4000000000000000 + r);
+		}
+		machine.cpu.jump(pc);
+		try {
+			machine.cpu.step_one();
+		} catch (const MachineException& e) {
+			return e.type();
+		}
+		return -1;
+	};
+
+	std::vector<uint16_t> mismatches;
+	for (size_t i = 0; i < encodings.size(); i++)
+	{
+		const address_t pc = CODE_ADDR + 4 * i;
+		bool same = step(cmachine, pc) == step(emachine, pc);
+		// Sequential instructions end at their own length
+		const bool sequential =
+			cmachine.cpu.pc() == pc + 2 && emachine.cpu.pc() == pc + 4;
+		same = same && (sequential || cmachine.cpu.pc() == emachine.cpu.pc());
+		// So do the return addresses of calls
+		const rv32i_instruction instr { expanded[i] };
+		if ((instr.opcode() == RV32I_JAL || instr.opcode() == RV32I_JALR) && instr.Itype.rd != 0) {
+			same = same && cmachine.cpu.reg(instr.Itype.rd) + 2 == emachine.cpu.reg(instr.Itype.rd);
+			cmachine.cpu.reg(instr.Itype.rd) = emachine.cpu.reg(instr.Itype.rd);
+		}
+		for (unsigned r = 0; r < 32; r++) {
+			same = same && cmachine.cpu.reg(r) == emachine.cpu.reg(r);
+			same = same && cmachine.cpu.registers().getfl(r).i64 == emachine.cpu.registers().getfl(r).i64;
+		}
+		std::array<uint8_t, data.size()> cdata, edata;
+		cmachine.copy_from_guest(cdata.data(), DATA_ADDR, cdata.size());
+		emachine.copy_from_guest(edata.data(), DATA_ADDR, edata.size());
+		if (!same || cdata != edata)
+			mismatches.push_back(encodings[i]);
+	}
+	return mismatches;
+}
+
+TEST_CASE("Compressed instructions expand to their 32-bit equivalents", "[Micro]")
+{
+	// Every opcode class except the reserved one in quadrant 0
+	std::set<unsigned> classes;
+	REQUIRE(mismatched_expansions<RISCV32>(classes).empty());
+	REQUIRE(classes.size() == 23);
+	classes.clear();
+	REQUIRE(mismatched_expansions<RISCV64>(classes).empty());
+	REQUIRE(classes.size() == 23);
+}
+
+TEST_CASE("Compressed instructions are translated", "[Micro]")
+{
+	static const std::array<uint16_t, 21> my_program{
+		0x45d1, //        c.li    a1,20
+		0x4501, //        c.li    a0,0
+		0x862e, // loop:  c.mv    a2,a1
+		0x060e, //        c.slli  a2,3
+		0x9532, //        c.add   a0,a2
+		0x156d, //        c.addi  a0,-5
+		0xe42a, //        c.sdsp  a0,8(sp)
+		0x66a2, //        c.ldsp  a3,8(sp)
+		0x8ead, //        c.xor   a3,a1
+		0x8285, //        c.srli  a3,1
+		0x9abd, //        c.andi  a3,-17
+		0xc054, //        c.sw    a3,4(s0)
+		0x4050, //        c.lw    a2,4(s0)
+		0x8d11, //        c.sub   a0,a2
+		0x2505, //        c.addiw a0,1
+		0x15fd, //        c.addi  a1,-1
+		0xf1f5, //        c.bnez  a1,loop
+		0x0893, 0x05d0, //  li      a7,93
+		0x0073, 0x0000, //  ecall
+	};
+	auto run = [] (Machine<RISCV64>& machine, const MachineOptions<RISCV64>& options) {
+		machine.setup_minimal_syscalls();
+		machine.cpu.set_execute_segment(&machine.memory.create_execute_segment(
+			options, my_program.data(), LOOP_ADDR, sizeof(my_program)));
+		machine.cpu.reg(REG_SP) = 0x3100;
+		machine.cpu.reg(8) = 0x3000; // s0
+		machine.cpu.jump(LOOP_ADDR);
+		machine.simulate(10'000ul);
+	};
+
+	Machine<RISCV64> translated;
+	run(translated, {});
+	REQUIRE(translated.is_binary_translated());
+	auto* exec = translated.memory.exec_segment_for(LOOP_ADDR);
+	REQUIRE(exec->decoder_cache()[LOOP_ADDR / DecoderCache<RISCV64>::DIVISOR].get_bytecode()
+		== RV32I_BC_TRANSLATOR);
+
+	Machine<RISCV64> interpreted;
+	run(interpreted, { .translate_blocks_max = 0 });
+	REQUIRE(!interpreted.is_binary_translated());
+
+	REQUIRE(interpreted.cpu.reg(REG_ARG1) == 0);
+	REQUIRE(translated.return_value() == interpreted.return_value());
+	for (unsigned r = 0; r < 32; r++)
+		REQUIRE(translated.cpu.reg(r) == interpreted.cpu.reg(r));
+}
+#endif
+#endif
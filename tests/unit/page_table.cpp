@@ -0,0 +1,134 @@
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+
+#include <libriscv/machine.hpp>
+extern std::vector<uint8_t> build_and_load(const std::string& code,
+	const std::string& args = "-O2 -static", bool cpp = false);
+static const uint64_t MAX_MEMORY = 256ul << 20; /* 256MB */
+static const uint64_t MAX_INSTRUCTIONS = 2'000'000'000ul;
+static const std::vector<uint8_t> empty;
+using namespace riscv;
+
+TEST_CASE("Flat page table lookups", "[PageTable]")
+{
+	Machine<RISCV32> machine { empty, {
+		.use_memory_arena = false,
+		.flat_page_table_bound = 1ull << 32
+	}};
+	REQUIRE(machine.memory.flat_page_table().enabled());
+
+	static constexpr uint32_t addresses[] = { 0x1000, 0x7FFFF000, 0xFFFFF000 };
+	for (const uint32_t addr : addresses)
+		machine.memory.write<uint32_t> (addr, addr);
+	machine.memory.invalidate_reset_cache();
+	for (const uint32_t addr : addresses) {
+		REQUIRE(machine.memory.read<uint32_t> (addr) == addr);
+		const auto pageno = Memory<RISCV32>::page_number(addr);
+		REQUIRE(&machine.memory.get_pageno(pageno) == &machine.memory.pages().at(pageno));
+	}
+
+	// Freed pages must also disappear from the flat page table
+	machine.memory.free_pages(0x7FFFF000, Page::size());
+	REQUIRE(machine.memory.get_page(0x7FFFF000).is_cow_page());
+	REQUIRE(machine.memory.read<uint32_t> (0x7FFFF000) == 0);
+
+	// Forks index the pages they loan from the main machine
+	Machine<RISCV32> fork { machine, { .flat_page_table_bound = 1ull << 32 } };
+	REQUIRE(fork.memory.read<uint32_t> (0xFFFFF000) == 0xFFFFF000);
+	fork.memory.write<uint32_t> (0xFFFFF000, 1234);
+	REQUIRE(fork.memory.read<uint32_t> (0xFFFFF000) == 1234);
+	REQUIRE(machine.memory.read<uint32_t> (0xFFFFF000) == 0xFFFFF000);
+}
+
+TEST_CASE("Bounded flat page table on 64-bit", "[PageTable]")
+{
+	static constexpr uint64_t BOUND = 1ull << 30;
+	Machine<RISCV64> machine { empty, { .flat_page_table_bound = BOUND } };
+
+	// Pages above the bound are still found in the page map
+	machine.memory.write<uint64_t> (BOUND - 8, 1);
+	machine.memory.write<uint64_t> (BOUND, 2);
+	machine.memory.write<uint64_t> (0x7FFF00000000, 3);
+	machine.memory.invalidate_reset_cache();
+	REQUIRE(machine.memory.read<uint64_t> (BOUND - 8) == 1);
+	REQUIRE(machine.memory.read<uint64_t> (BOUND) == 2);
+	REQUIRE(machine.memory.read<uint64_t> (0x7FFF00000000) == 3);
+	REQUIRE(machine.memory.flat_page_table().leaves() == 1);
+}
+
+static const char pointer_chase_program[] = R"M(
+#define N  (16u << 20) / sizeof(void*)
+#define STRIDE  (4096 / sizeof(void*) + 1)
+static void* chain[N];
+
+int main()
+{
+	// Build a single cycle visiting every element, with each
+	// step landing on a different page.
+	unsigned idx = 0;
+	for (unsigned i = 0; i < N; i++) {
+		const unsigned next = (idx + STRIDE * 7919) % N;
+		chain[idx] = &chain[next];
+		idx = next;
+	}
+	void** p = chain[0];
+	for (unsigned i = 0; i < 4 * N; i++)
+		p = *p;
+	return p != 0;
+})M";
+
+static const char stream_program[] = R"M(
+#define N  (2u << 20)
+static double a[N], b[N], c[N];
+
+int main()
+{
+	for (unsigned i = 0; i < N; i++) {
+		b[i] = 2.0; c[i] = 0.5;
+	}
+	const double s = 3.0;
+	for (int k = 0; k < 4; k++) {
+		for (unsigned i = 0; i < N; i++)
+			c[i] = a[i];
+		for (unsigned i = 0; i < N; i++)
+			b[i] = s * c[i];
+		for (unsigned i = 0; i < N; i++)
+			c[i] = a[i] + b[i];
+		for (unsigned i = 0; i < N; i++)
+			a[i] = b[i] + s * c[i];
+	}
+	return a[N-1] != 0.0;
+})M";
+
+static int run_program(const std::vector<uint8_t>& binary, uint64_t bound)
+{
+	Machine<RISCV64> machine { binary, {
+		.memory_max = MAX_MEMORY,
+		.flat_page_table_bound = bound
+	}};
+	machine.setup_linux_syscalls();
+	machine.setup_linux(
+		{"page_table"},
+		{"LC_TYPE=C", "LC_ALL=C", "USER=root"});
+	machine.simulate(MAX_INSTRUCTIONS);
+	return machine.return_value<int>();
+}
+
+TEST_CASE("Benchmark flat page table against page map", "[.benchmark][PageTable]")
+{
+	const auto chase = build_and_load(pointer_chase_program);
+	const auto stream = build_and_load(stream_program);
+
+	BENCHMARK("Pointer chasing, page map") {
+		return run_program(chase, 0);
+	};
+	BENCHMARK("Pointer chasing, flat page table") {
+		return run_program(chase, 1ull << 32);
+	};
+	BENCHMARK("STREAM, page map") {
+		return run_program(stream, 0);
+	};
+	BENCHMARK("STREAM, flat page table") {
+		return run_program(stream, 1ull << 32);
+	};
+}
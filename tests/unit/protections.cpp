@@ -2,6 +2,9 @@
 #include <catch2/matchers/catch_matchers_string.hpp>
 
 #include <libriscv/machine.hpp>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
 using namespace riscv;
 static const std::vector<uint8_t> empty;
 static constexpr uint32_t V = 0x1000;
@@ -61,23 +64,289 @@ TEST_CASE("Trigger guard pages", "[Memory]")
 
 TEST_CASE("Caches must be invalidated", "[Memory]")
 {
-	Machine<RISCV32> machine { empty };
+	// The flat memory arena ignores page attributes
+	Machine<RISCV32> machine { empty, { .use_memory_arena = false } };
 
 	// Force creation of writable pages
 	machine.memory.memset(V, 0, VLEN);
 	// Read data from page, causing cached read
 	REQUIRE(machine.memory.read<uint32_t> (V) == 0x0);
-	// Make page completely unpresented
+	// Make page completely unpresented, which also
+	// invalidates the cached page.
 	machine.memory.set_page_attr(V, Page::size(), {.read = false, .write = false, .exec = false});
-	// We can still read from the page, because
-	// it is in the read cache.
-	REQUIRE(machine.memory.read<uint32_t> (V) == 0x0);
 
-	// Invalidate the caches
-	machine.memory.invalidate_reset_cache();
+	// We can no longer read from or write to the page
+	REQUIRE_THROWS_WITH([&] {
+		machine.memory.read<uint32_t> (V);
+	}(), Catch::Matchers::ContainsSubstring("Protection fault"));
+	REQUIRE_THROWS_WITH([&] {
+		machine.memory.write<uint32_t> (V, 0x1);
+	}(), Catch::Matchers::ContainsSubstring("Protection fault"));
+
+	// Freed pages must not linger in the caches
+	machine.memory.write<uint32_t> (V + Page::size(), 0x1234);
+	REQUIRE(machine.memory.read<uint32_t> (V + Page::size()) == 0x1234);
+	machine.memory.free_pages(V + Page::size(), Page::size());
+	REQUIRE(machine.memory.read<uint32_t> (V + Page::size()) == 0x0);
+}
+
+TEST_CASE("Page caches with conflicting entries", "[Memory]")
+{
+	Machine<RISCV32> machine { empty };
+	static constexpr uint32_t PAGES = 4 * PageCacheEntries;
+
+	// Every page maps to the same cache entry as several others
+	for (uint32_t i = 0; i < PAGES; i++)
+		machine.memory.write<uint32_t> (V + i * Page::size(), i);
+	for (uint32_t i = 0; i < PAGES; i++)
+		REQUIRE(machine.memory.read<uint32_t> (V + i * Page::size()) == i);
+	// Interleaved accesses on pages with different cache entries
+	for (uint32_t i = 0; i < PAGES; i++) {
+		const uint32_t src = V + i * Page::size();
+		const uint32_t dst = V + (i ^ 1) * Page::size() + 4;
+		machine.memory.write<uint32_t> (dst, machine.memory.read<uint32_t> (src));
+	}
+	for (uint32_t i = 0; i < PAGES; i++)
+		REQUIRE(machine.memory.read<uint32_t> (V + i * Page::size() + 4) == (i ^ 1));
+
+	const auto& stats = machine.memory.page_cache_stats();
+	if constexpr (page_cache_stats_enabled) {
+		REQUIRE(stats.read_misses >= 3 * PAGES);
+		REQUIRE(stats.write_misses >= 2 * PAGES);
+		// The first read evicts a conflicting page, the second one hits
+		machine.memory.reset_page_cache_stats();
+		machine.memory.read<uint32_t> (V);
+		machine.memory.read<uint32_t> (V + 4);
+		REQUIRE(stats.read_misses == 1);
+		REQUIRE(stats.read_hits == 1);
+	} else {
+		REQUIRE(stats.read_misses == 0);
+		REQUIRE(stats.write_misses == 0);
+	}
+}
+
+TEST_CASE("Memory arena accesses are coherent", "[Memory]")
+{
+	Machine<RISCV32> machine { empty, { .use_memory_arena = true } };
+	if (machine.memory.memory_arena_size() == 0)
+		return; // Arena not available
+
+	// Values around a page boundary, written and read in different ways
+	static constexpr uint32_t ADDR = V + Page::size() - 2;
+	machine.memory.write<uint16_t> (ADDR, 0xCCDD);
+	machine.memory.write<uint16_t> (ADDR + 2, 0xAABB);
+	uint32_t value = 0;
+	machine.memory.memcpy_out(&value, ADDR, sizeof(value));
+	REQUIRE(value == 0xAABBCCDD);
+	REQUIRE(machine.memory.get_page(V).data()[Page::size() - 1] == 0xCC);
+
+	const uint32_t other = 0x11223344;
+	machine.memory.memcpy(ADDR, &other, sizeof(other));
+	REQUIRE(machine.memory.read<uint16_t> (ADDR) == 0x3344);
+	REQUIRE(machine.memory.read<uint16_t> (V + Page::size()) == 0x1122);
+
+	if constexpr (guarded_arena_enabled) {
+		// Host page protections mirror the page attributes
+		REQUIRE(machine.memory.is_guarded_arena());
+		REQUIRE(machine.memory.memory_arena_size() == (1ull << 32));
+		machine.memory.set_page_attr(V, Page::size(), {.read = true, .write = false});
+		REQUIRE(machine.memory.read<uint16_t> (ADDR) == 0x3344);
+		REQUIRE_THROWS_WITH([&] {
+			machine.memory.write<uint32_t> (V, 0x1234);
+		}(), Catch::Matchers::ContainsSubstring("Protection fault"));
+		machine.memory.set_page_attr(V, Page::size(), {.read = false, .write = false});
+		REQUIRE_THROWS_WITH([&] {
+			volatile uint32_t value = machine.memory.read<uint32_t> (V);
+			(void)value;
+		}(), Catch::Matchers::ContainsSubstring("Protection fault"));
+		// Freed pages become zeroed read-write memory again
+		machine.memory.free_pages(V, Page::size());
+		REQUIRE(machine.memory.read<uint32_t> (V) == 0x0);
+		machine.memory.write<uint32_t> (V, 0x1234);
+		REQUIRE(machine.memory.read<uint32_t> (V) == 0x1234);
+	} else if constexpr (flat_memory_enabled) {
+		// Page attributes are ignored inside the flat arena
+		REQUIRE(machine.memory.flat_memory_boundary() == machine.memory.memory_arena_size());
+		machine.memory.set_page_attr(V, Page::size(), {.read = false, .write = false});
+		machine.memory.write<uint32_t> (V, 0x1234);
+		REQUIRE(machine.memory.read<uint32_t> (V) == 0x1234);
+	}
+}
+
+TEST_CASE("Shared pages inside the memory arena", "[Memory]")
+{
+	Machine<RISCV32> machine { empty, { .use_memory_arena = true } };
+	if (machine.memory.flat_memory_boundary() == 0)
+		return; // Arena not available
+
+	// Flat loads read the arena, so the shared contents must be there
+	static const Page shared {
+		PageAttributes { .read = true, .write = false },
+		std::array<uint8_t, PageSize> { 0x44, 0x33, 0x22, 0x11 }
+	};
+	machine.memory.install_shared_page(V / Page::size(), shared);
+	REQUIRE(machine.memory.read<uint32_t> (V) == 0x11223344);
 
-	// We can no longer read from the page
+	static constexpr uint32_t CODE = V + 2 * Page::size();
+	static const std::array<uint32_t, 2> program {
+		0x00052503, // lw a0, 0(a0)
+		0x0000006f, // j 0
+	};
+	machine.copy_to_guest(CODE, program.data(), sizeof(program));
+	machine.memory.set_page_attr(CODE, Page::size(), {.read = false, .write = false, .exec = true});
+	machine.cpu.reg(REG_ARG0) = V;
+	machine.cpu.jump(CODE);
+	machine.simulate<false>(10);
+	REQUIRE(machine.cpu.reg(REG_ARG0) == 0x11223344);
+	// The shared page itself is never written to
+	REQUIRE(shared.data()[0] == 0x44);
+
+	// Non-owned memory can not be aliased by the arena
+	std::array<uint8_t, PageSize> buffer {};
+	REQUIRE_THROWS_WITH([&] {
+		machine.memory.insert_non_owned_memory(V + 4 * Page::size(), buffer.data(), buffer.size());
+	}(), Catch::Matchers::ContainsSubstring("flat arena"));
+}
+
+TEST_CASE("Guarded arena faults in guest code", "[Memory]")
+{
+	if constexpr (!guarded_arena_enabled)
+		return;
+	Machine<RISCV32> machine { empty, { .memory_max = 64 * Page::size() } };
+	REQUIRE(machine.memory.is_guarded_arena());
+
+	static const std::array<uint32_t, 5> program {
+		0x00000297, // auipc t0, 0
+		0x0002a503, // lw a0, 0(t0)
+		0xffe02503, // lw a0, -2(zero)
+		0x00052023, // sw zero, 0(a0)
+		0x00650533, // add a0, a0, t1
+	};
+	machine.copy_to_guest(V, program.data(), sizeof(program));
+	// The jump back to the store at V + 12
+	const uint32_t loop = 0xff9ff06f; // j -8
+	machine.copy_to_guest(V + 20, &loop, sizeof(loop));
+	machine.memory.set_page_attr(V, Page::size(), {.read = false, .write = false, .exec = true});
+
+	// Execute-only pages are not readable from the guest
+	machine.cpu.jump(V);
+	REQUIRE_THROWS_WITH([&] {
+		machine.simulate(100);
+	}(), Catch::Matchers::ContainsSubstring("Protection fault"));
+
+	// The guard page at the end of the address space, with
+	// the full offset of the faulting byte inside the arena
+	machine.cpu.jump(V + 8);
+	try {
+		machine.simulate(100);
+		FAIL("Reading the guard page should fail");
+	} catch (const MachineException& me) {
+		REQUIRE(me.type() == PROTECTION_FAULT);
+		REQUIRE(me.data() == (1ull << 32));
+	}
+
+	// Stores to new pages commit memory up to memory_max. The pages
+	// around V and the last page were committed in chunks of 16.
+	machine.cpu.reg(REG_ARG0) = 0x100000;
+	machine.cpu.reg(REG_T1) = Page::size();
+	machine.cpu.jump(V + 12);
+	REQUIRE_THROWS_WITH([&] {
+		machine.simulate(1000);
+	}(), Catch::Matchers::ContainsSubstring("Out of memory"));
+	REQUIRE(machine.cpu.reg(REG_ARG0) >= 0x100000 + 16 * Page::size());
+	REQUIRE(machine.cpu.reg(REG_ARG0) <= 0x100000 + 64 * Page::size());
+
+	// Host accesses outside of the guest use the pages
+	REQUIRE(machine.memory.read<uint32_t> (0x100000) == 0);
 	REQUIRE_THROWS_WITH([&] {
 		machine.memory.read<uint32_t> (V);
 	}(), Catch::Matchers::ContainsSubstring("Protection fault"));
 }
+
+TEST_CASE("Guarded arenas commit memory in chunks", "[Memory]")
+{
+	if constexpr (!guarded_arena_enabled)
+		return;
+	auto host_mappings = [] {
+		std::ifstream maps("/proc/self/maps");
+		return std::count(std::istreambuf_iterator<char>(maps), {}, '\n');
+	};
+	Machine<RISCV32> machine { empty, { .memory_max = 1024 * Page::size() } };
+	REQUIRE(machine.memory.is_guarded_arena());
+
+	// Touching every other page must not split the host mapping
+	// into one mapping per page
+	const auto mappings = host_mappings();
+	for (uint32_t i = 0; i < 256; i += 2)
+		machine.memory.write<uint32_t> (0x100000 + i * Page::size(), i);
+	REQUIRE(host_mappings() < mappings + 16);
+	for (uint32_t i = 0; i < 256; i += 2)
+		REQUIRE(machine.memory.read<uint32_t> (0x100000 + i * Page::size()) == i);
+}
+
+TEST_CASE("Guarded arena faults unwind the dispatch loop", "[Memory]")
+{
+	if constexpr (!guarded_arena_enabled)
+		return;
+	static constexpr uint32_t RO = V + Page::size();
+	static const std::array<uint32_t, 6> program {
+		0x00158593, // addi a1, a1, 1
+		0x00260613, // addi a2, a2, 2
+		0x00b52023, // sw a1, 0(a0)
+		0x00368693, // addi a3, a3, 3
+		0x00052703, // lw a4, 0(a0)
+		0x0000006f, // j 0
+	};
+	// A guarded arena, and a machine where the same fault comes from the pages
+	Machine<RISCV32> guarded { empty, { .memory_max = 64 * Page::size() } };
+	Machine<RISCV32> paged { empty, { .memory_max = 64 * Page::size(), .use_memory_arena = false } };
+	REQUIRE(guarded.memory.is_guarded_arena());
+	REQUIRE(!paged.memory.is_guarded_arena());
+
+	for (auto* machine : {&guarded, &paged}) {
+		machine->copy_to_guest(V, program.data(), sizeof(program));
+		machine->memory.set_page_attr(V, Page::size(), {.read = false, .write = false, .exec = true});
+		const uint32_t original = 0xDEADBEEF;
+		machine->copy_to_guest(RO, &original, sizeof(original));
+		machine->memory.set_page_attr(RO, Page::size(), {.read = true, .write = false});
+		machine->cpu.reg(REG_ARG0) = RO;
+		machine->cpu.jump(V);
+		try {
+			machine->simulate(100);
+			FAIL("Writing to a read-only page should fail");
+		} catch (const MachineException& me) {
+			REQUIRE(me.type() == PROTECTION_FAULT);
+			REQUIRE(me.data() == RO);
+		}
+		// The page is unchanged, and still read-only
+		REQUIRE(machine->memory.read<uint32_t> (RO) == original);
+		REQUIRE_THROWS_WITH([&] {
+			machine->memory.write<uint32_t> (RO, 0x1234);
+		}(), Catch::Matchers::ContainsSubstring("Protection fault"));
+	}
+
+	// Registers, PC and the instruction counter were written back
+	// by the dispatch loop, the same way for both machines
+	REQUIRE(guarded.cpu.reg(REG_ARG1) == 1);
+	REQUIRE(guarded.cpu.reg(REG_ARG2) == 2);
+	REQUIRE(guarded.cpu.reg(REG_ARG3) == 0);
+	for (int i = 0; i < 32; i++)
+		REQUIRE(guarded.cpu.reg(i) == paged.cpu.reg(i));
+	REQUIRE(guarded.cpu.pc() == paged.cpu.pc());
+	REQUIRE(guarded.instruction_counter() == paged.instruction_counter());
+	REQUIRE(guarded.instruction_counter() > 0);
+
+	// The simulation released its execute segments, so
+	// evicting them frees them right away
+	const size_t usage = guarded.memory.memory_usage_total();
+	const size_t segment = guarded.memory.exec_segment_for(V)->size_bytes();
+	guarded.memory.evict_execute_segments(0);
+	REQUIRE(guarded.memory.memory_usage_total() == usage - segment);
+
+	// The guest can continue after the fault
+	guarded.memory.set_page_attr(RO, Page::size(), {.read = true, .write = true});
+	guarded.cpu.jump(V);
+	guarded.simulate<false>(100);
+	REQUIRE(guarded.memory.read<uint32_t> (RO) == 2);
+	REQUIRE(guarded.cpu.reg(REG_ARG4) == 2);
+}
@@ -2,10 +2,13 @@
 #include <catch2/matchers/catch_matchers_string.hpp>
 
 #include <libriscv/machine.hpp>
+#include <fstream>
+#include <unistd.h>
 extern std::vector<uint8_t> build_and_load(const std::string& code,
 		   const std::string& args = "-O2 -static", bool cpp = false);
 static const uint64_t MAX_MEMORY = 8ul << 20; /* 8MB */
 static const uint64_t MAX_INSTRUCTIONS = 10'000'000ul;
+static const std::vector<uint8_t> empty;
 using namespace riscv;
 
 TEST_CASE("Catch output from write system call", "[Output]")
@@ -59,3 +62,289 @@ TEST_CASE("Catch output from write system call", "[Output]")
 
 	REQUIRE(restored_machine.return_value<int>() == 666);
 }
+
+TEST_CASE("Delta snapshots of changed pages", "[Serialize]")
+{
+	// Pages both inside and outside of the memory arena
+	static constexpr uint64_t addresses[] = {
+		0x10000, 0x11000, 0x12000, 0x40000000, 0x40001000
+	};
+	for (const bool use_arena : {false, true})
+	{
+		const MachineOptions<RISCV64> options {
+			.memory_max = MAX_MEMORY,
+			.use_memory_arena = use_arena
+		};
+		Machine<RISCV64> machine { empty, options };
+		for (const auto addr : addresses)
+			machine.memory.write<uint64_t> (addr, addr);
+
+		std::vector<uint8_t> full;
+		machine.serialize_to(full);
+		const uint32_t first = machine.snapshot_id();
+		REQUIRE(first != 0);
+
+		// Change, free and create some pages
+		machine.memory.write<uint64_t> (0x11000, 1);
+		machine.memory.write<uint64_t> (0x40001000, 2);
+		machine.memory.free_pages(0x12000, Page::size());
+		machine.memory.write<uint64_t> (0x13000, 3);
+
+		std::vector<uint8_t> delta1;
+		machine.serialize_delta_since(first, delta1);
+		REQUIRE(delta1.size() < full.size());
+		REQUIRE(delta1.size() < 4 * (Page::size() + 64) + 512);
+
+		machine.memory.write<uint64_t> (0x10000, 4);
+		std::vector<uint8_t> delta2;
+		machine.serialize_delta_since(machine.snapshot_id(), delta2);
+		REQUIRE(delta2.size() < 2 * (Page::size() + 64) + 512);
+		// A delta against the first snapshot has all the changes
+		std::vector<uint8_t> delta12;
+		machine.serialize_delta_since(first, delta12);
+		REQUIRE_THROWS(machine.serialize_delta_since(machine.snapshot_id() + 1, delta12));
+
+		auto verify = [] (Machine<RISCV64>& m) {
+			REQUIRE(m.memory.read<uint64_t> (0x10000) == 4);
+			REQUIRE(m.memory.read<uint64_t> (0x11000) == 1);
+			REQUIRE(m.memory.read<uint64_t> (0x12000) == 0);
+			REQUIRE(m.memory.read<uint64_t> (0x13000) == 3);
+			REQUIRE(m.memory.read<uint64_t> (0x40000000) == 0x40000000);
+			REQUIRE(m.memory.read<uint64_t> (0x40001000) == 2);
+		};
+
+		Machine<RISCV64> restored1 { empty, options };
+		REQUIRE(restored1.deserialize_from(full) == 0);
+		for (const auto addr : addresses)
+			REQUIRE(restored1.memory.read<uint64_t> (addr) == addr);
+		REQUIRE(restored1.deserialize_from(delta1) == 0);
+		REQUIRE(restored1.deserialize_from(delta2) == 0);
+		verify(restored1);
+
+		Machine<RISCV64> restored2 { empty, options };
+		REQUIRE(restored2.deserialize_from(full) == 0);
+		REQUIRE(restored2.deserialize_from(delta12) == 0);
+		verify(restored2);
+
+		// Deltas only apply to the snapshot they were made against
+		Machine<RISCV64> restored3 { empty, options };
+		REQUIRE(restored3.deserialize_from(delta1) == -8);
+		REQUIRE(restored3.deserialize_from(full) == 0);
+		REQUIRE(restored3.deserialize_from(delta2) == -8);
+		REQUIRE(restored3.memory.read<uint64_t> (0x10000) == 0x10000);
+	}
+}
+
+TEST_CASE("Delta snapshots of direct arena writes", "[Serialize]")
+{
+	if constexpr (!flat_memory_enabled)
+		return;
+	const MachineOptions<RISCV64> options {
+		.memory_max = MAX_MEMORY,
+		.use_memory_arena = true
+	};
+	Machine<RISCV64> machine { empty, options };
+	for (uint64_t addr = 0x10000; addr < 0x20000; addr += Page::size())
+		machine.memory.write<uint64_t> (addr, addr);
+	std::vector<uint8_t> full;
+	machine.serialize_to(full);
+
+	// Writes that bypass the memory API are found too
+	auto* arena = (uint8_t *)machine.memory.memory_arena_ptr();
+	arena[0x14008] = 1;
+	std::vector<uint8_t> delta1;
+	machine.serialize_delta_since(machine.snapshot_id(), delta1);
+	REQUIRE(delta1.size() < 2 * (Page::size() + 64) + 512);
+	REQUIRE(delta1.size() > Page::size());
+
+	// Nothing was written since the last snapshot
+	std::vector<uint8_t> delta2;
+	machine.serialize_delta_since(machine.snapshot_id(), delta2);
+	REQUIRE(delta2.size() < Page::size());
+
+	Machine<RISCV64> restored { empty, options };
+	REQUIRE(restored.deserialize_from(full) == 0);
+	REQUIRE(restored.deserialize_from(delta1) == 0);
+	REQUIRE(restored.memory.read<uint8_t> (0x14008) == 1);
+	REQUIRE(restored.memory.read<uint64_t> (0x1F000) == 0x1F000);
+}
+
+TEST_CASE("Snapshots of a guarded arena", "[Serialize]")
+{
+	if constexpr (!guarded_arena_enabled)
+		return;
+	const MachineOptions<RISCV32> options { .memory_max = MAX_MEMORY };
+	Machine<RISCV32> machine { empty, options };
+	REQUIRE(machine.memory.is_guarded_arena());
+	machine.memory.write<uint32_t> (0x10000, 1);
+	machine.memory.write<uint32_t> (0x11000, 2);
+	machine.memory.set_page_attr(0x11000, Page::size(), {
+		.read = false, .write = false
+	});
+
+	// Only pages in use are visited, and unreadable pages are read
+	std::vector<uint8_t> full;
+	machine.serialize_to(full);
+	REQUIRE(full.size() < 8 * (Page::size() + 64) + 512);
+	REQUIRE_THROWS_WITH(machine.memory.read<uint32_t> (0x11000), "Protection fault");
+
+	machine.memory.write<uint32_t> (0x10000, 3);
+	std::vector<uint8_t> delta;
+	machine.serialize_delta_since(machine.snapshot_id(), delta);
+	REQUIRE(delta.size() < 2 * (Page::size() + 64) + 512);
+
+	Machine<RISCV32> restored { empty, options };
+	REQUIRE(restored.deserialize_from(full) == 0);
+	REQUIRE(restored.deserialize_from(delta) == 0);
+	REQUIRE(restored.memory.read<uint32_t> (0x10000) == 3);
+	REQUIRE(!restored.memory.get_page(0x11000).attr.read);
+	restored.memory.set_page_attr(0x11000, Page::size(), {
+		.read = true, .write = true
+	});
+	REQUIRE(restored.memory.read<uint32_t> (0x11000) == 2);
+}
+
+TEST_CASE("Restore page aligned snapshot file by mapping it", "[Serialize]")
+{
+	static constexpr uint64_t addresses[] = {
+		0x10000, 0x11000, 0x40000000, 0x40001000
+	};
+	const std::string filename = "/tmp/libriscv_snapshot_" + std::to_string(getpid());
+	for (const bool use_arena : {false, true})
+	{
+		const MachineOptions<RISCV64> options {
+			.memory_max = MAX_MEMORY,
+			.use_memory_arena = use_arena
+		};
+		Machine<RISCV64> machine { empty, options };
+		for (const auto addr : addresses)
+			machine.memory.write<uint64_t> (addr, addr);
+		machine.cpu.reg(REG_ARG0) = 1234;
+
+		std::vector<uint8_t> data;
+		machine.serialize_aligned_to(data);
+		REQUIRE(data.size() % Page::size() == 0);
+		FILE* f = fopen(filename.c_str(), "wb");
+		REQUIRE(f != nullptr);
+		REQUIRE(fwrite(data.data(), 1, data.size(), f) == data.size());
+		fclose(f);
+
+		Machine<RISCV64> restored { empty, options };
+		restored.memory.write<uint64_t> (0x12000, 1);
+		REQUIRE(restored.deserialize_mapped(filename) == 0);
+		REQUIRE(restored.cpu.reg(REG_ARG0) == 1234);
+		for (const auto addr : addresses)
+			REQUIRE(restored.memory.read<uint64_t> (addr) == addr);
+		REQUIRE(restored.memory.read<uint64_t> (0x12000) == 0);
+
+		// Writes stay private to the restored machine
+		restored.memory.write<uint64_t> (0x40000000, 5);
+		Machine<RISCV64> restored2 { empty, options };
+		REQUIRE(restored2.deserialize_mapped(filename) == 0);
+		REQUIRE(restored2.memory.read<uint64_t> (0x40000000) == 0x40000000);
+		REQUIRE(restored.memory.read<uint64_t> (0x40000000) == 5);
+
+		// Mapped pages are serialized again, and the layout is also
+		// readable as a regular snapshot
+		std::vector<uint8_t> again;
+		restored.serialize_to(again);
+		Machine<RISCV64> restored3 { empty, options };
+		REQUIRE(restored3.deserialize_from(again) == 0);
+		REQUIRE(restored3.memory.read<uint64_t> (0x40000000) == 5);
+		REQUIRE(restored3.memory.read<uint64_t> (0x40001000) == 0x40001000);
+		REQUIRE(restored3.deserialize_from(data) == 0);
+		REQUIRE(restored3.memory.read<uint64_t> (0x40000000) == 0x40000000);
+
+		// Restoring again releases the mapping of the previous restore
+		auto mappings = [&] {
+			std::ifstream maps("/proc/self/maps");
+			size_t count = 0;
+			for (std::string line; std::getline(maps, line); )
+				count += line.find(filename) != std::string::npos;
+			return count;
+		};
+		const size_t mapped = mappings();
+		for (int i = 0; i < 4; i++)
+			REQUIRE(restored.deserialize_mapped(filename) == 0);
+		REQUIRE(mappings() == mapped);
+		REQUIRE(restored.memory.read<uint64_t> (0x40000000) == 0x40000000);
+
+		// Regular snapshots can not be mapped
+		f = fopen(filename.c_str(), "wb");
+		fwrite(again.data(), 1, again.size(), f);
+		fclose(f);
+		REQUIRE(restored3.deserialize_mapped(filename) == -7);
+		REQUIRE(restored3.deserialize_mapped(filename + ".missing") == -6);
+	}
+	unlink(filename.c_str());
+}
+
+#ifdef RISCV_ASYNC_SNAPSHOTS
+TEST_CASE("Asynchronous compressed snapshots", "[Serialize]")
+{
+	static constexpr uint64_t addresses[] = {
+		0x10000, 0x11000, 0x40000000, 0x40001000
+	};
+	for (const bool use_arena : {false, true})
+	{
+		const MachineOptions<RISCV64> options {
+			.memory_max = MAX_MEMORY,
+			.use_memory_arena = use_arena
+		};
+		Machine<RISCV64> machine { empty, options };
+		for (const auto addr : addresses)
+			machine.memory.write<uint64_t> (addr, addr);
+		// A page with non-zero words at both ends
+		machine.memory.write<uint64_t> (0x40002000, 1);
+		machine.memory.write<uint64_t> (0x40002ff8, 2);
+		machine.memory.memzero(0x40003000, 8);
+		machine.cpu.reg(REG_ARG0) = 1234;
+
+		auto future = machine.serialize_async();
+		const uint32_t snapshot_id = machine.snapshot_id();
+		REQUIRE(snapshot_id != 0);
+		// Writes after the snapshot are not part of it
+		for (const auto addr : addresses)
+			machine.memory.write<uint64_t> (addr, 5);
+		machine.cpu.reg(REG_ARG0) = 0;
+		const auto data = future.get();
+		// Once the snapshot is written, pages are written in place again
+		const auto* frozen = machine.memory.get_page(0x40002000).data();
+		machine.memory.write<uint64_t> (0x40002008, 3);
+		REQUIRE(machine.memory.get_page(0x40002000).data() == frozen);
+
+		std::vector<uint8_t> full;
+		machine.serialize_to(full);
+		REQUIRE(data.size() < full.size());
+
+		Machine<RISCV64> restored { empty, options };
+		REQUIRE(restored.deserialize_from(data) == 0);
+		REQUIRE(restored.cpu.reg(REG_ARG0) == 1234);
+		for (const auto addr : addresses)
+			REQUIRE(restored.memory.read<uint64_t> (addr) == addr);
+		REQUIRE(restored.memory.read<uint64_t> (0x40002000) == 1);
+		REQUIRE(restored.memory.read<uint64_t> (0x40002ff8) == 2);
+		REQUIRE(restored.memory.read<uint64_t> (0x40003000) == 0);
+		// Deltas can be made against it
+		std::vector<uint8_t> delta;
+		machine.serialize_delta_since(snapshot_id, delta);
+		REQUIRE(restored.deserialize_from(delta) == 0);
+		for (const auto addr : addresses)
+			REQUIRE(restored.memory.read<uint64_t> (addr) == 5);
+
+		// Truncated snapshots are rejected
+		REQUIRE(restored.deserialize_from({data.begin(), data.end() - 1}) == -5);
+
+		// Compressed snapshots can not be mapped, even when marked page aligned
+		const std::string filename = "/tmp/libriscv_snapshot_" + std::to_string(getpid());
+		auto aligned = data;
+		aligned[18] |= 0x1; // SerializedMachine::flags
+		FILE* f = fopen(filename.c_str(), "wb");
+		REQUIRE(f != nullptr);
+		REQUIRE(fwrite(aligned.data(), 1, aligned.size(), f) == aligned.size());
+		fclose(f);
+		REQUIRE(restored.deserialize_mapped(filename) == -7);
+		unlink(filename.c_str());
+	}
+}
+#endif
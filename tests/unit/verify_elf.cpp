@@ -1,5 +1,10 @@
 #include <catch2/catch_test_macros.hpp>
 #include <libriscv/machine.hpp>
+#include <libriscv/decoder_cache.hpp>
+#include <libriscv/util/crc32.hpp>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 extern std::vector<uint8_t> load_file(const std::string& filename);
 static const uint64_t MAX_MEMORY = 8ul << 20; /* 8MB */
 static const uint64_t MAX_INSTRUCTIONS = 10'000'000ul;
@@ -133,3 +138,218 @@ TEST_CASE("RV64 Newlib with B-ext Hello World", "[Verify]")
 	REQUIRE(state.text.find("[problems]") != std::string::npos);
 	REQUIRE(state.text.find("Caught exception: Hello Exceptions!") != std::string::npos);
 }
+
+TEST_CASE("Lazily decoded programs behave like fully decoded ones", "[Verify]")
+{
+	// The Go runtime is left out, as its instruction count
+	// varies from run to run
+	static const std::vector<std::string> programs {
+		"zig-riscv64-hello-world",
+		"rust-riscv64-hello-world",
+		"newlib-rv64g_zba_zbb-hello-world",
+	};
+	for (const auto& program : programs)
+	{
+		const auto binary = load_file(cwd + "/elf/" + program);
+
+		struct Result {
+			std::string text;
+			uint64_t instructions;
+			uint64_t return_value;
+		};
+		auto run = [&] (bool lazy) {
+			riscv::Machine<RISCV64> machine { binary, {
+				.memory_max = MAX_MEMORY,
+				.lazy_decoding = lazy
+			} };
+			machine.setup_linux_syscalls();
+			machine.setup_posix_threads();
+			machine.setup_linux(
+				{program},
+				{"LC_TYPE=C", "LC_ALL=C", "USER=root"});
+
+			Result result;
+			machine.set_userdata(&result);
+			machine.set_printer([] (const auto& m, const char* data, size_t size) {
+				m.template get_userdata<Result> ()->text.append(data, data + size);
+			});
+			machine.simulate(MAX_INSTRUCTIONS);
+
+			result.instructions = machine.instruction_counter();
+			result.return_value = machine.return_value();
+			return result;
+		};
+		const auto eager = run(false);
+		const auto lazy  = run(true);
+
+		REQUIRE(!lazy.text.empty());
+		REQUIRE(lazy.text == eager.text);
+		REQUIRE(lazy.return_value == eager.return_value);
+		// Instruction counting is exact
+		REQUIRE(lazy.instructions == eager.instructions);
+	}
+}
+
+TEST_CASE("Machines of the same program share their execute segment", "[Verify]")
+{
+	const auto binary = load_file(cwd + "/elf/newlib-rv64g_zba_zbb-hello-world");
+
+	auto run = [] (riscv::Machine<RISCV64>& machine) {
+		machine.setup_linux_syscalls();
+		machine.setup_linux(
+			{"newlib-rv64g_zba_zbb-hello-world"},
+			{"LC_TYPE=C", "LC_ALL=C", "USER=root"});
+		machine.simulate(MAX_INSTRUCTIONS);
+		return machine.instruction_counter();
+	};
+
+	const riscv::MachineOptions<RISCV64> options {
+		.memory_max = MAX_MEMORY,
+		.share_execute_segments = true
+	};
+	riscv::Machine<RISCV64> machine1 { binary, options };
+	riscv::Machine<RISCV64> machine2 { binary, options };
+	// Binary translation happens per machine
+	REQUIRE((&machine1.memory.main_execute_segment() == &machine2.memory.main_execute_segment())
+		== !riscv::binary_translation_enabled);
+
+	// Sharing is opt-in
+	riscv::Machine<RISCV64> machine3 { binary, { .memory_max = MAX_MEMORY } };
+	REQUIRE(&machine1.memory.main_execute_segment() != &machine3.memory.main_execute_segment());
+
+	// Executing one machine does not affect the other
+	const auto icount = run(machine1);
+	REQUIRE(run(machine2) == icount);
+	REQUIRE(run(machine3) == icount);
+}
+
+TEST_CASE("Decoder caches can be stored and loaded again", "[Verify]")
+{
+	// Decoder caches are ignored with binary translation
+	if constexpr (riscv::binary_translation_enabled)
+		return;
+	const auto binary = load_file(cwd + "/elf/zig-riscv64-hello-world");
+	const auto directory = std::filesystem::temp_directory_path() / "libriscv-decoder-test";
+	std::filesystem::remove_all(directory);
+	std::filesystem::create_directory(directory);
+	const std::string dirname = directory.string();
+
+	struct Result {
+		std::string text;
+		uint64_t instructions;
+	};
+	auto run = [&] (std::string_view cache_directory) {
+		riscv::Machine<RISCV64> machine { binary, {
+			.memory_max = MAX_MEMORY,
+			.decoder_cache_directory = cache_directory
+		} };
+		machine.setup_linux_syscalls();
+		machine.setup_linux(
+			{"zig-riscv64-hello-world"},
+			{"LC_TYPE=C", "LC_ALL=C", "USER=root"});
+
+		Result result;
+		machine.set_userdata(&result);
+		machine.set_printer([] (const auto& m, const char* data, size_t size) {
+			m.template get_userdata<Result> ()->text.append(data, data + size);
+		});
+		machine.simulate(MAX_INSTRUCTIONS);
+		result.instructions = machine.instruction_counter();
+		return result;
+	};
+	const auto uncached = run("");
+	const auto stored   = run(dirname);
+	REQUIRE(std::distance(std::filesystem::directory_iterator(directory),
+		std::filesystem::directory_iterator{}) == 1);
+	const auto loaded   = run(dirname);
+
+	REQUIRE(!uncached.text.empty());
+	REQUIRE(stored.text == uncached.text);
+	REQUIRE(loaded.text == uncached.text);
+	REQUIRE(stored.instructions == uncached.instructions);
+	REQUIRE(loaded.instructions == uncached.instructions);
+
+	std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Decoder cache files are validated before use", "[Verify]")
+{
+	// Decoder caches are ignored with binary translation
+	if constexpr (riscv::binary_translation_enabled)
+		return;
+	const auto binary = load_file(cwd + "/elf/zig-riscv64-hello-world");
+	const auto directory = std::filesystem::temp_directory_path() / "libriscv-decoder-validation";
+	std::filesystem::remove_all(directory);
+	std::filesystem::create_directory(directory);
+	const std::string dirname = directory.string();
+
+	auto run = [&] {
+		riscv::Machine<RISCV64> machine { binary, {
+			.memory_max = MAX_MEMORY,
+			.decoder_cache_directory = dirname
+		} };
+		machine.setup_linux_syscalls();
+		machine.setup_linux(
+			{"zig-riscv64-hello-world"},
+			{"LC_TYPE=C", "LC_ALL=C", "USER=root"});
+		machine.set_printer([] (const auto&, const char*, size_t) {});
+		machine.simulate(MAX_INSTRUCTIONS);
+		return machine.instruction_counter();
+	};
+	const auto instructions = run();
+	const auto filename = std::filesystem::directory_iterator(directory)->path();
+	const auto stored = load_file(filename.string());
+	auto write_file = [&] (const std::vector<uint8_t>& data) {
+		std::ofstream(filename, std::ios::binary).write((const char *)data.data(), data.size());
+	};
+
+	// A file that is intact is loaded, and not stored again
+	const auto stored_time = std::filesystem::last_write_time(filename);
+	REQUIRE(run() == instructions);
+	REQUIRE(std::filesystem::last_write_time(filename) == stored_time);
+
+	// The header (see DecoderCacheFileHeader) is followed by the
+	// handler table and the decoder cache, whose entries begin with
+	// the bytecode
+	auto read32 = [&] (size_t offset) {
+		uint32_t value;
+		std::memcpy(&value, &stored[offset], sizeof(value));
+		return value;
+	};
+	static constexpr size_t HEADER_SIZE = 64;
+	const size_t entry_size = read32(12);
+	const size_t cache_offset = HEADER_SIZE + 4 * read32(44);
+	REQUIRE(entry_size == sizeof(DecoderData<RISCV64>));
+	REQUIRE((stored.size() - cache_offset) % entry_size == 0);
+
+	// The checksum covers the whole file, with itself zeroed
+	auto checksum_of = [] (std::vector<uint8_t> data) {
+		std::memset(&data[56], 0, sizeof(uint32_t));
+		return crc32c(data.data(), data.size());
+	};
+	REQUIRE(checksum_of(stored) == read32(56));
+
+	// A different handler table, with the stored checksum
+	auto corrupted = stored;
+	corrupted[HEADER_SIZE + 4] ^= 0xFF;
+	write_file(corrupted);
+
+	// The file is decoded again, and replaced
+	REQUIRE(run() == instructions);
+	REQUIRE(load_file(filename.string()) == stored);
+
+	// An unknown bytecode, with a checksum that matches
+	corrupted = stored;
+	size_t entry = cache_offset;
+	while (corrupted[entry] == 0)
+		entry += entry_size;
+	corrupted[entry] = 0xFF;
+	const uint32_t checksum = checksum_of(corrupted);
+	std::memcpy(&corrupted[56], &checksum, sizeof(checksum));
+	write_file(corrupted);
+
+	REQUIRE(run() == instructions);
+	REQUIRE(load_file(filename.string()) == stored);
+
+	std::filesystem::remove_all(directory);
+}